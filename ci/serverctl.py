@@ -100,6 +100,9 @@ port=8082
             seafile_fileserver_conf = '''\
 [fileserver]
 port=8082
+
+[zip]
+windows_encoding = GBK
 '''
         with open(seafile_conf, 'a+') as fp:
             fp.write('\n')
@@ -107,6 +107,22 @@ block_backend_fs_read_block (BlockBackend *bend,
     return ret;
 }
 
+static int
+block_backend_fs_seek_block (BlockBackend *bend,
+                             BHandle *handle,
+                             gint64 offset)
+{
+    g_return_val_if_fail (handle->rw_type == BLOCK_READ, -1);
+
+    if (lseek (handle->fd, (off_t)offset, SEEK_SET) < 0) {
+        seaf_warning ("Failed to seek block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 block_backend_fs_write_block (BlockBackend *bend,
                                 BHandle *handle,
@@ -263,6 +279,37 @@ block_backend_fs_stat_block_by_handle (BlockBackend *bend,
     return block_md;
 }
 
+static int
+block_backend_fs_get_block_segment (BlockBackend *bend,
+                                    BHandle *handle,
+                                    int *fd, gint64 *offset, gint64 *len)
+{
+    SeafStat st;
+    int new_fd;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_READ, -1);
+
+    if (seaf_fstat (handle->fd, &st) < 0) {
+        seaf_warning ("[block bend] Failed to stat block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    /* The handle keeps its own fd, so that it can be closed as usual. */
+    new_fd = dup (handle->fd);
+    if (new_fd < 0) {
+        seaf_warning ("[block bend] Failed to dup fd for block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    *fd = new_fd;
+    *offset = 0;
+    *len = (gint64)st.st_size;
+
+    return 0;
+}
+
 static int
 block_backend_fs_foreach_block (BlockBackend *bend,
                                 const char *store_id,
@@ -493,6 +540,8 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     bend->remove_block = block_backend_fs_remove_block;
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
+    bend->get_block_segment = block_backend_fs_get_block_segment;
+    bend->seek_block = block_backend_fs_seek_block;
     bend->block_handle_free = block_backend_fs_block_handle_free;
     bend->foreach_block = block_backend_fs_foreach_block;
     bend->remove_store = block_backend_fs_remove_store;
@@ -0,0 +1,1563 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block backend that appends blocks into large per-store pack files,
+ * instead of storing every block in its own file.
+ *
+ * Files in a store directory (<seaf_dir>/storage/block-packs/<store_id>/):
+ *
+ *   pack-00000001, ...  Append-only block contents. New blocks are always
+ *                       appended to the pack with the largest number.
+ *   index               Array of PackEntry sorted by block id. It's memory
+ *                       mapped and searched with binary search.
+ *   journal             PackEntry records (including removals) appended since
+ *                       the index was last rebuilt. It's replayed into a hash
+ *                       table when the store is loaded, and merged into a new
+ *                       index when it grows large.
+ *
+ * Space taken by removed blocks is reclaimed by compact_store, which rewrites
+ * the live blocks of mostly garbage packs and deletes the old pack files.
+ * It's driven by GC.
+ *
+ * Each process keeps its own index mappings, journal fd and current pack
+ * size, so only one process may use the pack dir at a time. It's locked
+ * when the backend is created, so GC and fsck refuse to run while
+ * seaf-server is using the pack dir. Stores are loaded on demand and at
+ * most MAX_OPEN_STORES unused stores are kept open.
+ */
+
+#include "common.h"
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "block-backend.h"
+
+#define PACK_INDEX_MAGIC "SFPI"
+#define PACK_INDEX_VERSION 1
+
+#define DEFAULT_PACK_SIZE ((gint64)1 << 30) /* 1GB */
+
+/* The journal is merged into the index when it has more entries than this,
+ * or than 1/8 of the index, whichever is larger.
+ */
+#define JOURNAL_MERGE_MIN_ENTRIES 65536
+
+/* Packs with more garbage than this ratio are rewritten by compaction. */
+#define COMPACT_GARBAGE_RATIO 0.2
+
+/* Loaded stores, each with a mapped index and possibly a journal fd and
+ * a pack fd open.
+ */
+#define MAX_OPEN_STORES 256
+
+#define FOREACH_BATCH_SIZE 4096
+#define COPY_BUF_SIZE (1 << 16)
+
+#define ENTRY_REMOVED 1
+
+/* On-disk format of index and journal records. Integers are little-endian. */
+typedef struct PackEntry {
+    unsigned char id[20];
+    guint32 pack_id;
+    guint64 offset;
+    guint32 size;
+    guint32 flags;
+} __attribute__((__packed__)) PackEntry;
+
+typedef struct PackIndexHdr {
+    char magic[4];
+    guint32 version;
+    guint64 n_entries;
+} __attribute__((__packed__)) PackIndexHdr;
+
+typedef struct PackStore {
+    char *store_id;
+    char *dir;
+
+    /* Protected by stores_lock. A store is only closed when it's not used. */
+    int ref;
+    GList link;                 /* node in the LRU list */
+
+    /* Protects the index mapping and the journal table. Lookups hold it for
+     * read. Modifications hold it for write, together with write_lock.
+     */
+    pthread_rwlock_t index_lock;
+    void *index_map;
+    gsize index_map_len;
+    const PackEntry *index_entries;
+    guint64 n_index_entries;
+    GHashTable *journal;        /* raw id -> PackEntry in host byte order */
+
+    /* Serializes modifications: appending to the current pack and the
+     * journal, rebuilding the index and removing packs.
+     */
+    pthread_mutex_t write_lock;
+    int journal_fd;
+    guint32 cur_pack_id;
+    int cur_pack_fd;
+    gint64 cur_pack_size;
+} PackStore;
+
+typedef struct {
+    char          *pack_dir;
+    char          *tmp_dir;
+    gint64         pack_size;
+
+    int            lock_fd;
+
+    GHashTable    *stores;      /* store_id -> PackStore */
+    GQueue         stores_lru;  /* most recently used first */
+    pthread_mutex_t stores_lock;
+} PackPriv;
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     fd;
+    int     rw_type;
+    char    *tmp_file;
+    /* Location of the block in the pack, for read. */
+    guint64 offset;
+    guint32 size;
+    guint32 pos;
+};
+
+static void
+entry_from_disk (const PackEntry *disk, PackEntry *entry)
+{
+    memcpy (entry->id, disk->id, 20);
+    entry->pack_id = GUINT32_FROM_LE (disk->pack_id);
+    entry->offset = GUINT64_FROM_LE (disk->offset);
+    entry->size = GUINT32_FROM_LE (disk->size);
+    entry->flags = GUINT32_FROM_LE (disk->flags);
+}
+
+static void
+entry_to_disk (const PackEntry *entry, PackEntry *disk)
+{
+    memcpy (disk->id, entry->id, 20);
+    disk->pack_id = GUINT32_TO_LE (entry->pack_id);
+    disk->offset = GUINT64_TO_LE (entry->offset);
+    disk->size = GUINT32_TO_LE (entry->size);
+    disk->flags = GUINT32_TO_LE (entry->flags);
+}
+
+static guint
+entry_id_hash (gconstpointer key)
+{
+    guint32 h;
+
+    /* Block ids are sha1, so any 4 bytes are evenly distributed. */
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+entry_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, 20) == 0;
+}
+
+static int
+compare_entry_id (const void *a, const void *b)
+{
+    return memcmp (((const PackEntry *)a)->id, ((const PackEntry *)b)->id, 20);
+}
+
+static char *
+get_pack_path (PackStore *store, guint32 pack_id, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/pack-%08u", store->dir, pack_id);
+    return path;
+}
+
+static ssize_t
+pread_full (int fd, void *buf, size_t n, guint64 offset)
+{
+    size_t left = n;
+    ssize_t ret;
+    char *ptr = buf;
+
+    while (left > 0) {
+        ret = pread (fd, ptr, left, (off_t)offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        left -= ret;
+        ptr += ret;
+        offset += ret;
+    }
+
+    return n - left;
+}
+
+/* Index and journal loading. */
+
+static void
+unmap_index (PackStore *store)
+{
+    if (store->index_map)
+        munmap (store->index_map, store->index_map_len);
+    store->index_map = NULL;
+    store->index_map_len = 0;
+    store->index_entries = NULL;
+    store->n_index_entries = 0;
+}
+
+static int
+map_index (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, "index", NULL);
+    SeafStat st;
+    PackIndexHdr *hdr;
+    void *map;
+    int fd;
+    int ret = 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            seaf_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+            ret = -1;
+        }
+        goto out;
+    }
+
+    if (seaf_fstat (fd, &st) < 0 || st.st_size < sizeof(PackIndexHdr)) {
+        seaf_warning ("[pack bend] Invalid index file %s.\n", path);
+        ret = -1;
+        goto out;
+    }
+
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        seaf_warning ("[pack bend] Failed to map %s: %s.\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    hdr = map;
+    if (memcmp (hdr->magic, PACK_INDEX_MAGIC, 4) != 0 ||
+        GUINT32_FROM_LE (hdr->version) != PACK_INDEX_VERSION ||
+        st.st_size != sizeof(PackIndexHdr) +
+                      GUINT64_FROM_LE (hdr->n_entries) * sizeof(PackEntry)) {
+        seaf_warning ("[pack bend] Invalid index file %s.\n", path);
+        munmap (map, st.st_size);
+        ret = -1;
+        goto out;
+    }
+
+    store->index_map = map;
+    store->index_map_len = st.st_size;
+    store->index_entries = (const PackEntry *)(hdr + 1);
+    store->n_index_entries = GUINT64_FROM_LE (hdr->n_entries);
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (path);
+    return ret;
+}
+
+static int
+replay_journal (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, "journal", NULL);
+    PackEntry disk, *entry;
+    gint64 valid_len = 0;
+    int fd;
+    int n;
+
+    fd = g_open (path, O_RDWR | O_BINARY, 0);
+    if (fd < 0) {
+        g_free (path);
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    while ((n = readn (fd, &disk, sizeof(disk))) == sizeof(disk)) {
+        entry = g_new (PackEntry, 1);
+        entry_from_disk (&disk, entry);
+        g_hash_table_replace (store->journal, entry->id, entry);
+        valid_len += sizeof(disk);
+    }
+
+    /* Drop a partially written record from a crash. */
+    if (n > 0 && ftruncate (fd, valid_len) < 0) {
+        seaf_warning ("[pack bend] Failed to truncate %s: %s.\n", path, strerror(errno));
+        close (fd);
+        g_free (path);
+        return -1;
+    }
+
+    close (fd);
+    g_free (path);
+    return (n < 0) ? -1 : 0;
+}
+
+static void
+find_current_pack (PackStore *store)
+{
+    GDir *dir;
+    const char *dname;
+    guint32 pack_id;
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (sscanf (dname, "pack-%08u", &pack_id) == 1 && pack_id > store->cur_pack_id)
+            store->cur_pack_id = pack_id;
+    }
+    g_dir_close (dir);
+}
+
+static void
+pack_store_free (PackStore *store)
+{
+    unmap_index (store);
+    g_hash_table_destroy (store->journal);
+    if (store->journal_fd >= 0)
+        close (store->journal_fd);
+    if (store->cur_pack_fd >= 0)
+        close (store->cur_pack_fd);
+    pthread_rwlock_destroy (&store->index_lock);
+    pthread_mutex_destroy (&store->write_lock);
+    g_free (store->store_id);
+    g_free (store->dir);
+    g_free (store);
+}
+
+static PackStore *
+pack_store_load (PackPriv *priv, const char *store_id)
+{
+    PackStore *store = g_new0 (PackStore, 1);
+
+    store->store_id = g_strdup (store_id);
+    store->link.data = store;
+    store->dir = g_build_filename (priv->pack_dir, store_id, NULL);
+    pthread_rwlock_init (&store->index_lock, NULL);
+    pthread_mutex_init (&store->write_lock, NULL);
+    store->journal = g_hash_table_new_full (entry_id_hash, entry_id_equal,
+                                            NULL, g_free);
+    store->journal_fd = -1;
+    store->cur_pack_fd = -1;
+
+    if (map_index (store) < 0 || replay_journal (store) < 0) {
+        seaf_warning ("[pack bend] Failed to load block store %s.\n", store_id);
+        pack_store_free (store);
+        return NULL;
+    }
+
+    find_current_pack (store);
+
+    return store;
+}
+
+/* Close the least recently used stores that are not in use. Called with
+ * stores_lock held.
+ */
+static void
+evict_stores (PackPriv *priv)
+{
+    GList *ptr, *prev;
+    PackStore *store;
+
+    for (ptr = priv->stores_lru.tail;
+         ptr && g_hash_table_size (priv->stores) > MAX_OPEN_STORES;
+         ptr = prev) {
+        prev = ptr->prev;
+        store = ptr->data;
+        if (store->ref > 0)
+            continue;
+        g_queue_unlink (&priv->stores_lru, ptr);
+        g_hash_table_remove (priv->stores, store->store_id);
+    }
+}
+
+/* Returns a referenced store, release it with put_store(). */
+static PackStore *
+get_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+    PackStore *store;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (store) {
+        g_queue_unlink (&priv->stores_lru, &store->link);
+    } else {
+        store = pack_store_load (priv, store_id);
+        if (store)
+            g_hash_table_insert (priv->stores, store->store_id, store);
+    }
+    if (store) {
+        g_queue_push_head_link (&priv->stores_lru, &store->link);
+        ++store->ref;
+        evict_stores (priv);
+    }
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    return store;
+}
+
+static void
+put_store (BlockBackend *bend, PackStore *store)
+{
+    PackPriv *priv = bend->be_priv;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    --store->ref;
+    evict_stores (priv);
+    pthread_mutex_unlock (&priv->stores_lock);
+}
+
+/* Lookup a block. The caller must hold index_lock or write_lock. */
+static gboolean
+lookup_entry (PackStore *store, const unsigned char *id, PackEntry *entry)
+{
+    PackEntry *jentry;
+    guint64 lo = 0, hi = store->n_index_entries, mid;
+    int cmp;
+
+    jentry = g_hash_table_lookup (store->journal, id);
+    if (jentry) {
+        if (jentry->flags & ENTRY_REMOVED)
+            return FALSE;
+        *entry = *jentry;
+        return TRUE;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp (store->index_entries[mid].id, id, 20);
+        if (cmp == 0) {
+            entry_from_disk (&store->index_entries[mid], entry);
+            return TRUE;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Return the position of the first index entry larger than @id. */
+static guint64
+index_upper_bound (PackStore *store, const unsigned char *id)
+{
+    guint64 lo = 0, hi = store->n_index_entries, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (memcmp (store->index_entries[mid].id, id, 20) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Modifications. The caller must hold write_lock for all functions below. */
+
+static int
+sync_dir (const char *path)
+{
+    int fd = open (path, O_RDONLY);
+    int ret = 0;
+
+    if (fd < 0)
+        return -1;
+    if (fsync (fd) < 0 && errno != EINVAL)
+        ret = -1;
+    close (fd);
+    return ret;
+}
+
+static int
+rebuild_index (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, "index", NULL);
+    char *tmp_path = g_strconcat (path, ".tmp", NULL);
+    PackEntry *jentries = NULL, *out_buf = NULL;
+    guint n_jentries, n_out = 0;
+    guint64 i = 0, j = 0, n_total = 0;
+    PackIndexHdr hdr;
+    GHashTableIter iter;
+    gpointer value;
+    int fd = -1;
+    int ret = 0;
+
+    n_jentries = g_hash_table_size (store->journal);
+    jentries = g_new (PackEntry, n_jentries);
+    g_hash_table_iter_init (&iter, store->journal);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        memcpy (&jentries[j++], value, sizeof(PackEntry));
+    qsort (jentries, n_jentries, sizeof(PackEntry), compare_entry_id);
+
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to open %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    memset (&hdr, 0, sizeof(hdr));
+    if (writen (fd, &hdr, sizeof(hdr)) < 0)
+        goto write_error;
+
+    /* Merge the sorted index with the sorted journal. Journal entries
+     * override index entries with the same id, and removed ones are dropped.
+     */
+    out_buf = g_new (PackEntry, FOREACH_BATCH_SIZE);
+    j = 0;
+    while (i < store->n_index_entries || j < n_jentries) {
+        int cmp;
+
+        if (i == store->n_index_entries)
+            cmp = 1;
+        else if (j == n_jentries)
+            cmp = -1;
+        else
+            cmp = memcmp (store->index_entries[i].id, jentries[j].id, 20);
+
+        if (cmp < 0) {
+            memcpy (&out_buf[n_out++], &store->index_entries[i++], sizeof(PackEntry));
+        } else {
+            if (cmp == 0)
+                ++i;
+            if (!(jentries[j].flags & ENTRY_REMOVED))
+                entry_to_disk (&jentries[j], &out_buf[n_out++]);
+            ++j;
+        }
+
+        if (n_out == FOREACH_BATCH_SIZE) {
+            if (writen (fd, out_buf, n_out * sizeof(PackEntry)) < 0)
+                goto write_error;
+            n_total += n_out;
+            n_out = 0;
+        }
+    }
+    if (n_out > 0) {
+        if (writen (fd, out_buf, n_out * sizeof(PackEntry)) < 0)
+            goto write_error;
+        n_total += n_out;
+    }
+
+    memcpy (hdr.magic, PACK_INDEX_MAGIC, 4);
+    hdr.version = GUINT32_TO_LE (PACK_INDEX_VERSION);
+    hdr.n_entries = GUINT64_TO_LE (n_total);
+    if (pwrite (fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        goto write_error;
+
+    if (fsync (fd) < 0)
+        goto write_error;
+    close (fd);
+    fd = -1;
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[pack bend] Failed to rename %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    /* Replaying the journal over the new index is harmless, so it's safe
+     * to crash before the journal is truncated.
+     */
+    pthread_rwlock_wrlock (&store->index_lock);
+    unmap_index (store);
+    if (map_index (store) < 0)
+        ret = -1;
+    else
+        g_hash_table_remove_all (store->journal);
+    pthread_rwlock_unlock (&store->index_lock);
+
+    if (ret == 0) {
+        int tret;
+        if (store->journal_fd >= 0) {
+            tret = ftruncate (store->journal_fd, 0);
+        } else {
+            char *journal_path = g_build_filename (store->dir, "journal", NULL);
+            tret = truncate (journal_path, 0);
+            if (tret < 0 && errno == ENOENT)
+                tret = 0;
+            g_free (journal_path);
+        }
+        if (tret < 0) {
+            seaf_warning ("[pack bend] Failed to truncate journal in %s: %s.\n",
+                          store->dir, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    goto out;
+
+write_error:
+    seaf_warning ("[pack bend] Failed to write %s: %s.\n", tmp_path, strerror(errno));
+    ret = -1;
+out:
+    if (fd >= 0) {
+        close (fd);
+        g_unlink (tmp_path);
+    }
+    g_free (jentries);
+    g_free (out_buf);
+    g_free (path);
+    g_free (tmp_path);
+    return ret;
+}
+
+static void
+maybe_rebuild_index (PackStore *store)
+{
+    guint64 threshold = MAX (JOURNAL_MERGE_MIN_ENTRIES, store->n_index_entries / 8);
+
+    if (g_hash_table_size (store->journal) >= threshold)
+        rebuild_index (store);
+}
+
+static int
+append_journal (PackStore *store, const PackEntry *entry)
+{
+    PackEntry disk, *jentry;
+
+    entry_to_disk (entry, &disk);
+    if (writen (store->journal_fd, &disk, sizeof(disk)) < 0) {
+        seaf_warning ("[pack bend] Failed to write journal in %s: %s.\n",
+                      store->dir, strerror(errno));
+        return -1;
+    }
+
+    jentry = g_memdup (entry, sizeof(PackEntry));
+    pthread_rwlock_wrlock (&store->index_lock);
+    g_hash_table_replace (store->journal, jentry->id, jentry);
+    pthread_rwlock_unlock (&store->index_lock);
+
+    return 0;
+}
+
+static int
+prepare_current_pack (PackStore *store, gint64 pack_size)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+
+    if (store->journal_fd < 0) {
+        char *journal_path;
+
+        if (g_mkdir_with_parents (store->dir, 0777) < 0) {
+            seaf_warning ("[pack bend] Failed to create %s: %s.\n",
+                          store->dir, strerror(errno));
+            return -1;
+        }
+
+        journal_path = g_build_filename (store->dir, "journal", NULL);
+        store->journal_fd = g_open (journal_path,
+                                    O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0666);
+        g_free (journal_path);
+        if (store->journal_fd < 0) {
+            seaf_warning ("[pack bend] Failed to open journal in %s: %s.\n",
+                          store->dir, strerror(errno));
+            return -1;
+        }
+    }
+
+    while (1) {
+        if (store->cur_pack_fd < 0) {
+            if (store->cur_pack_id == 0)
+                store->cur_pack_id = 1;
+            get_pack_path (store, store->cur_pack_id, path);
+            store->cur_pack_fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0666);
+            if (store->cur_pack_fd < 0) {
+                seaf_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+                return -1;
+            }
+            if (seaf_fstat (store->cur_pack_fd, &st) < 0) {
+                close (store->cur_pack_fd);
+                store->cur_pack_fd = -1;
+                return -1;
+            }
+            store->cur_pack_size = st.st_size;
+        }
+
+        if (store->cur_pack_size < pack_size)
+            break;
+
+        /* Start a new pack when the current one is full. Blocks moved by
+         * compaction may be in it, so it's synced before it's closed.
+         */
+        if (fsync (store->cur_pack_fd) < 0)
+            seaf_warning ("[pack bend] Failed to sync pack %u in %s: %s.\n",
+                          store->cur_pack_id, store->dir, strerror(errno));
+        close (store->cur_pack_fd);
+        store->cur_pack_fd = -1;
+        ++store->cur_pack_id;
+    }
+
+    return 0;
+}
+
+/* Append @size bytes at @src_offset of @src_fd to the current pack,
+ * as the content of block @id.
+ */
+static int
+append_block (PackStore *store, gint64 pack_size,
+              const unsigned char *id,
+              int src_fd, guint64 src_offset, guint32 size)
+{
+    char *buf = NULL;
+    PackEntry entry;
+    guint32 done = 0;
+    ssize_t n;
+
+    if (prepare_current_pack (store, pack_size) < 0)
+        return -1;
+
+    buf = g_malloc (COPY_BUF_SIZE);
+    while (done < size) {
+        n = pread_full (src_fd, buf, MIN (COPY_BUF_SIZE, size - done),
+                        src_offset + done);
+        if (n <= 0) {
+            seaf_warning ("[pack bend] Failed to read block content: %s.\n",
+                          n < 0 ? strerror(errno) : "unexpected EOF");
+            goto error;
+        }
+        if (pwrite (store->cur_pack_fd, buf, n, store->cur_pack_size + done) != n) {
+            seaf_warning ("[pack bend] Failed to write pack %u in %s: %s.\n",
+                          store->cur_pack_id, store->dir, strerror(errno));
+            goto error;
+        }
+        done += n;
+    }
+    g_free (buf);
+
+    memcpy (entry.id, id, 20);
+    entry.pack_id = store->cur_pack_id;
+    entry.offset = store->cur_pack_size;
+    entry.size = size;
+    entry.flags = 0;
+
+    /* Block content must be in the pack before the journal refers to it. */
+    store->cur_pack_size += size;
+    if (append_journal (store, &entry) < 0)
+        return -1;
+
+    return 0;
+
+error:
+    g_free (buf);
+    /* Drop the partially written block. */
+    if (ftruncate (store->cur_pack_fd, store->cur_pack_size) < 0)
+        seaf_warning ("[pack bend] Failed to truncate pack %u in %s.\n",
+                      store->cur_pack_id, store->dir);
+    return -1;
+}
+
+/* BlockBackend operations. */
+
+static int
+open_tmp_file (BlockBackend *bend,
+               const char *basename,
+               char **path)
+{
+    PackPriv *priv = bend->be_priv;
+    int fd;
+
+    *path = g_strdup_printf ("%s/%s.XXXXXX", priv->tmp_dir, basename);
+    fd = g_mkstemp (*path);
+    if (fd < 0)
+        g_free (*path);
+
+    return fd;
+}
+
+static BHandle *
+block_backend_pack_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    BHandle *handle;
+    PackStore *store;
+    PackEntry entry;
+    unsigned char id[20];
+    char path[SEAF_PATH_MAX];
+    char *tmp_file = NULL;
+    int fd = -1;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    memset (&entry, 0, sizeof(entry));
+
+    if (rw_type == BLOCK_READ) {
+        store = get_store (bend, store_id);
+        if (!store)
+            return NULL;
+
+        hex_to_rawdata (block_id, id, 20);
+
+        /* Hold the lock until the pack is opened, so that it can't be
+         * removed by compaction in between.
+         */
+        pthread_rwlock_rdlock (&store->index_lock);
+        if (lookup_entry (store, id, &entry)) {
+            get_pack_path (store, entry.pack_id, path);
+            fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        } else {
+            errno = ENOENT;
+        }
+        pthread_rwlock_unlock (&store->index_lock);
+        put_store (bend, store);
+
+        if (fd < 0) {
+            ccnet_warning ("[pack bend] failed to open block %s for read: %s\n",
+                           block_id, strerror(errno));
+            return NULL;
+        }
+    } else {
+        fd = open_tmp_file (bend, block_id, &tmp_file);
+        if (fd < 0) {
+            ccnet_warning ("[pack bend] failed to open block %s for write: %s\n",
+                           block_id, strerror(errno));
+            return NULL;
+        }
+    }
+
+    handle = g_new0 (BHandle, 1);
+    handle->fd = fd;
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    if (rw_type == BLOCK_READ) {
+        handle->offset = entry.offset;
+        handle->size = entry.size;
+    } else {
+        handle->tmp_file = tmp_file;
+    }
+    if (store_id)
+        handle->store_id = g_strdup(store_id);
+    handle->version = version;
+
+    return handle;
+}
+
+static int
+block_backend_pack_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    ssize_t ret;
+    int n;
+
+    n = MIN ((guint32)len, handle->size - handle->pos);
+    if (n <= 0)
+        return 0;
+
+    ret = pread_full (handle->fd, buf, n, handle->offset + handle->pos);
+    if (ret < 0) {
+        seaf_warning ("Failed to read block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror (errno));
+        return -1;
+    }
+    handle->pos += ret;
+
+    return ret;
+}
+
+static int
+block_backend_pack_seek_block (BlockBackend *bend,
+                               BHandle *handle,
+                               gint64 offset)
+{
+    g_return_val_if_fail (handle->rw_type == BLOCK_READ, -1);
+
+    if (offset < 0 || offset > handle->size)
+        return -1;
+    handle->pos = (guint32)offset;
+
+    return 0;
+}
+
+static int
+block_backend_pack_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    int ret;
+
+    ret = writen (handle->fd, buf, len);
+    if (ret < 0)
+        seaf_warning ("Failed to write block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror (errno));
+
+    return ret;
+}
+
+static int
+block_backend_pack_close_block (BlockBackend *bend,
+                                BHandle *handle)
+{
+    return close (handle->fd);
+}
+
+static void
+block_backend_pack_block_handle_free (BlockBackend *bend,
+                                      BHandle *handle)
+{
+    if (handle->rw_type == BLOCK_WRITE) {
+        /* make sure the tmp file is removed even on failure. */
+        g_unlink (handle->tmp_file);
+        g_free (handle->tmp_file);
+    }
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_pack_commit_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    PackPriv *priv = bend->be_priv;
+    PackStore *store;
+    unsigned char id[20];
+    SeafStat st;
+    int fd;
+    int ret;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    store = get_store (bend, handle->store_id);
+    if (!store)
+        return -1;
+
+    /* The write fd is already closed, read the content from the tmp file. */
+    fd = g_open (handle->tmp_file, O_RDONLY | O_BINARY, 0);
+    if (fd < 0 || seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("[pack bend] failed to commit block %s:%s: %s\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        put_store (bend, store);
+        return -1;
+    }
+
+    hex_to_rawdata (handle->block_id, id, 20);
+
+    pthread_mutex_lock (&store->write_lock);
+    ret = append_block (store, priv->pack_size, id, fd, 0, (guint32)st.st_size);
+    if (ret == 0)
+        maybe_rebuild_index (store);
+    pthread_mutex_unlock (&store->write_lock);
+
+    close (fd);
+    put_store (bend, store);
+
+    if (ret < 0)
+        seaf_warning ("[pack bend] failed to commit block %s:%s\n",
+                      handle->store_id, handle->block_id);
+    return ret;
+}
+
+static gboolean
+block_backend_pack_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_sha1)
+{
+    PackStore *store;
+    PackEntry entry;
+    unsigned char id[20];
+    gboolean ret;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return FALSE;
+
+    hex_to_rawdata (block_sha1, id, 20);
+
+    pthread_rwlock_rdlock (&store->index_lock);
+    ret = lookup_entry (store, id, &entry);
+    pthread_rwlock_unlock (&store->index_lock);
+
+    put_store (bend, store);
+    return ret;
+}
+
+static int
+block_backend_pack_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    PackStore *store;
+    PackEntry entry;
+    unsigned char id[20];
+    int ret = -1;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return -1;
+
+    hex_to_rawdata (block_id, id, 20);
+
+    pthread_mutex_lock (&store->write_lock);
+    if (lookup_entry (store, id, &entry)) {
+        entry.flags |= ENTRY_REMOVED;
+        ret = append_journal (store, &entry);
+        if (ret == 0)
+            maybe_rebuild_index (store);
+    }
+    pthread_mutex_unlock (&store->write_lock);
+
+    put_store (bend, store);
+    return ret;
+}
+
+static BMetadata *
+block_backend_pack_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    PackStore *store;
+    PackEntry entry;
+    unsigned char id[20];
+    BMetadata *block_md;
+    gboolean found;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return NULL;
+
+    hex_to_rawdata (block_id, id, 20);
+
+    pthread_rwlock_rdlock (&store->index_lock);
+    found = lookup_entry (store, id, &entry);
+    pthread_rwlock_unlock (&store->index_lock);
+    put_store (bend, store);
+
+    if (!found) {
+        seaf_warning ("[pack bend] Failed to stat block %s:%s: not found.\n",
+                      store_id, block_id);
+        return NULL;
+    }
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = entry.size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_pack_stat_block_by_handle (BlockBackend *bend,
+                                         BHandle *handle)
+{
+    BMetadata *block_md;
+    SeafStat st;
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+
+    if (handle->rw_type == BLOCK_READ) {
+        block_md->size = handle->size;
+    } else {
+        if (seaf_fstat (handle->fd, &st) < 0) {
+            seaf_warning ("[pack bend] Failed to stat block %s:%s.\n",
+                          handle->store_id, handle->block_id);
+            g_free (block_md);
+            return NULL;
+        }
+        block_md->size = (uint32_t) st.st_size;
+    }
+
+    return block_md;
+}
+
+static int
+block_backend_pack_get_block_segment (BlockBackend *bend,
+                                      BHandle *handle,
+                                      int *fd, gint64 *offset, gint64 *len)
+{
+    int new_fd;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_READ, -1);
+
+    new_fd = dup (handle->fd);
+    if (new_fd < 0) {
+        seaf_warning ("[pack bend] Failed to dup fd for block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    *fd = new_fd;
+    *offset = (gint64)handle->offset;
+    *len = (gint64)handle->size;
+
+    return 0;
+}
+
+static int
+block_backend_pack_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    PackStore *store;
+    PackEntry *jentries = NULL, *jentry;
+    GHashTable *visited = NULL;
+    GHashTableIter iter;
+    gpointer value;
+    unsigned char (*batch)[20] = NULL;
+    unsigned char last_id[20];
+    gboolean has_last = FALSE;
+    char block_id[41];
+    guint n_jentries, i, n_batch;
+    guint64 pos;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return -1;
+
+    /* Snapshot the journal. Removals are visited as well, so that they
+     * are skipped in the index below.
+     */
+    pthread_rwlock_rdlock (&store->index_lock);
+    n_jentries = g_hash_table_size (store->journal);
+    jentries = g_new (PackEntry, n_jentries);
+    i = 0;
+    g_hash_table_iter_init (&iter, store->journal);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        memcpy (&jentries[i++], value, sizeof(PackEntry));
+    pthread_rwlock_unlock (&store->index_lock);
+
+    visited = g_hash_table_new (entry_id_hash, entry_id_equal);
+    for (i = 0; i < n_jentries; ++i) {
+        jentry = &jentries[i];
+        g_hash_table_add (visited, jentry->id);
+        if (jentry->flags & ENTRY_REMOVED)
+            continue;
+        rawdata_to_hex (jentry->id, block_id, 20);
+        if (!process (store_id, version, block_id, user_data))
+            goto out;
+    }
+
+    /* Walk the index in batches, without holding the lock while calling
+     * @process, so that it may modify the store (e.g. remove blocks in GC).
+     * The index may be rebuilt between batches, so resume from the last id.
+     */
+    batch = g_malloc (FOREACH_BATCH_SIZE * 20);
+    while (1) {
+        n_batch = 0;
+
+        pthread_rwlock_rdlock (&store->index_lock);
+        pos = has_last ? index_upper_bound (store, last_id) : 0;
+        for (; pos < store->n_index_entries && n_batch < FOREACH_BATCH_SIZE; ++pos) {
+            const unsigned char *id = store->index_entries[pos].id;
+            if (g_hash_table_contains (visited, id))
+                continue;
+            jentry = g_hash_table_lookup (store->journal, id);
+            if (jentry && (jentry->flags & ENTRY_REMOVED))
+                continue;
+            memcpy (batch[n_batch++], id, 20);
+        }
+        pthread_rwlock_unlock (&store->index_lock);
+
+        if (n_batch == 0)
+            break;
+
+        for (i = 0; i < n_batch; ++i) {
+            rawdata_to_hex (batch[i], block_id, 20);
+            if (!process (store_id, version, block_id, user_data))
+                goto out;
+        }
+
+        memcpy (last_id, batch[n_batch - 1], 20);
+        has_last = TRUE;
+    }
+
+out:
+    g_free (batch);
+    g_hash_table_destroy (visited);
+    g_free (jentries);
+    put_store (bend, store);
+    return 0;
+}
+
+static int
+block_backend_pack_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+    PackStore *dst_store;
+    BHandle *handle;
+    PackEntry entry;
+    unsigned char id[20];
+    int ret = 0;
+
+    dst_store = get_store (bend, dst_store_id);
+    if (!dst_store)
+        return -1;
+
+    handle = block_backend_pack_open_block (bend, src_store_id, src_version,
+                                            block_id, BLOCK_READ);
+    if (!handle) {
+        put_store (bend, dst_store);
+        return -1;
+    }
+
+    hex_to_rawdata (block_id, id, 20);
+
+    pthread_mutex_lock (&dst_store->write_lock);
+    if (!lookup_entry (dst_store, id, &entry)) {
+        ret = append_block (dst_store, priv->pack_size, id,
+                            handle->fd, handle->offset, handle->size);
+        if (ret == 0)
+            maybe_rebuild_index (dst_store);
+    }
+    pthread_mutex_unlock (&dst_store->write_lock);
+
+    block_backend_pack_close_block (bend, handle);
+    block_backend_pack_block_handle_free (bend, handle);
+    put_store (bend, dst_store);
+
+    return ret;
+}
+
+static int
+block_backend_pack_remove_store (BlockBackend *bend, const char *store_id)
+{
+    PackStore *store;
+    GDir *dir;
+    const char *dname;
+    char *path;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->write_lock);
+
+    pthread_rwlock_wrlock (&store->index_lock);
+    unmap_index (store);
+    g_hash_table_remove_all (store->journal);
+    pthread_rwlock_unlock (&store->index_lock);
+
+    if (store->journal_fd >= 0)
+        close (store->journal_fd);
+    store->journal_fd = -1;
+    if (store->cur_pack_fd >= 0)
+        close (store->cur_pack_fd);
+    store->cur_pack_fd = -1;
+    store->cur_pack_id = 0;
+    store->cur_pack_size = 0;
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            path = g_build_filename (store->dir, dname, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+        g_rmdir (store->dir);
+    }
+
+    pthread_mutex_unlock (&store->write_lock);
+    put_store (bend, store);
+
+    return 0;
+}
+
+static int
+compact_pack (BlockBackend *bend, PackStore *store,
+              guint32 pack_id, GArray *entries)
+{
+    PackPriv *priv = bend->be_priv;
+    char path[SEAF_PATH_MAX];
+    PackEntry *old, cur;
+    guint i;
+    int fd = -1;
+
+    get_pack_path (store, pack_id, path);
+
+    if (entries->len > 0) {
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        if (fd < 0) {
+            seaf_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Move live blocks to the current pack one by one, so that other
+     * writers are not blocked for too long. A block is skipped if it has
+     * been removed or rewritten in the mean time.
+     */
+    for (i = 0; i < entries->len; ++i) {
+        old = &g_array_index (entries, PackEntry, i);
+
+        pthread_mutex_lock (&store->write_lock);
+        if (lookup_entry (store, old->id, &cur) &&
+            cur.pack_id == pack_id && cur.offset == old->offset) {
+            if (append_block (store, priv->pack_size, cur.id,
+                              fd, cur.offset, cur.size) < 0) {
+                pthread_mutex_unlock (&store->write_lock);
+                close (fd);
+                return -1;
+            }
+            maybe_rebuild_index (store);
+        }
+        pthread_mutex_unlock (&store->write_lock);
+    }
+
+    if (fd >= 0)
+        close (fd);
+
+    pthread_mutex_lock (&store->write_lock);
+
+    /* The moved blocks, the journal entries and the index that refer to
+     * them must be on disk before the old copies are removed.
+     */
+    if ((store->cur_pack_fd >= 0 && fsync (store->cur_pack_fd) < 0) ||
+        (store->journal_fd >= 0 && fsync (store->journal_fd) < 0) ||
+        sync_dir (store->dir) < 0) {
+        seaf_warning ("[pack bend] Failed to sync %s: %s.\n",
+                      store->dir, strerror(errno));
+        pthread_mutex_unlock (&store->write_lock);
+        return -1;
+    }
+
+    /* New blocks are never added to an old pack, so nothing refers to it
+     * any more. Open read handles keep their own fd.
+     */
+    pthread_rwlock_wrlock (&store->index_lock);
+    g_unlink (path);
+    pthread_rwlock_unlock (&store->index_lock);
+    pthread_mutex_unlock (&store->write_lock);
+
+    return 0;
+}
+
+static int
+block_backend_pack_compact_store (BlockBackend *bend, const char *store_id)
+{
+    PackStore *store;
+    GHashTable *live_bytes = NULL;  /* pack id -> gint64 */
+    GHashTable *candidates = NULL;  /* pack id -> GArray of PackEntry */
+    GHashTableIter iter;
+    gpointer key, value;
+    GDir *dir;
+    const char *dname;
+    char path[SEAF_PATH_MAX];
+    PackEntry entry;
+    SeafStat st;
+    guint32 pack_id;
+    guint64 i;
+    gint64 reclaimed = 0;
+    int n_packs = 0;
+    int ret = 0;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return -1;
+
+    live_bytes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    candidates = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                        (GDestroyNotify)g_array_unref);
+
+    pthread_mutex_lock (&store->write_lock);
+
+    /* Merge the journal first, so that all live blocks are in the index. */
+    if (g_hash_table_size (store->journal) > 0 && rebuild_index (store) < 0) {
+        pthread_mutex_unlock (&store->write_lock);
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < store->n_index_entries; ++i) {
+        gint64 *bytes;
+
+        entry_from_disk (&store->index_entries[i], &entry);
+        bytes = g_hash_table_lookup (live_bytes, GUINT_TO_POINTER(entry.pack_id));
+        if (!bytes) {
+            bytes = g_new0 (gint64, 1);
+            g_hash_table_insert (live_bytes, GUINT_TO_POINTER(entry.pack_id), bytes);
+        }
+        *bytes += entry.size;
+    }
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            gint64 *bytes;
+            gint64 garbage;
+
+            if (sscanf (dname, "pack-%08u", &pack_id) != 1 ||
+                pack_id == store->cur_pack_id)
+                continue;
+            if (seaf_stat (get_pack_path (store, pack_id, path), &st) < 0)
+                continue;
+
+            bytes = g_hash_table_lookup (live_bytes, GUINT_TO_POINTER(pack_id));
+            garbage = st.st_size - (bytes ? *bytes : 0);
+            if (garbage > 0 && garbage >= st.st_size * COMPACT_GARBAGE_RATIO) {
+                g_hash_table_insert (candidates, GUINT_TO_POINTER(pack_id),
+                                     g_array_new (FALSE, FALSE, sizeof(PackEntry)));
+                reclaimed += garbage;
+            }
+        }
+        g_dir_close (dir);
+    }
+
+    for (i = 0; i < store->n_index_entries; ++i) {
+        GArray *entries;
+
+        entry_from_disk (&store->index_entries[i], &entry);
+        entries = g_hash_table_lookup (candidates, GUINT_TO_POINTER(entry.pack_id));
+        if (entries)
+            g_array_append_val (entries, entry);
+    }
+
+    pthread_mutex_unlock (&store->write_lock);
+
+    g_hash_table_iter_init (&iter, candidates);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (compact_pack (bend, store, GPOINTER_TO_UINT(key), value) < 0) {
+            seaf_warning ("[pack bend] Failed to compact pack %u of store %s.\n",
+                          GPOINTER_TO_UINT(key), store_id);
+            ret = -1;
+            goto out;
+        }
+        ++n_packs;
+    }
+
+    if (n_packs > 0)
+        seaf_message ("Compacted %d packs of block store %s, "
+                      "about %"G_GINT64_FORMAT" bytes are reclaimed.\n",
+                      n_packs, store_id, reclaimed);
+
+out:
+    g_hash_table_destroy (live_bytes);
+    g_hash_table_destroy (candidates);
+    put_store (bend, store);
+    return ret;
+}
+
+/* The lock is released when the process exits. */
+static int
+lock_pack_dir (const char *pack_dir)
+{
+    char *path = g_build_filename (pack_dir, "lock", NULL);
+    int fd;
+
+    fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+    g_free (path);
+
+    /* Don't let child processes keep the lock. */
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+    if (flock (fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            seaf_warning ("Block pack dir %s is used by another process. "
+                          "Stop seaf-server before running GC or fsck.\n", pack_dir);
+        else
+            seaf_warning ("[pack bend] Failed to lock %s: %s.\n",
+                          pack_dir, strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir, gint64 pack_size)
+{
+    BlockBackend *bend;
+    PackPriv *priv;
+
+    bend = g_new0 (BlockBackend, 1);
+    priv = g_new0 (PackPriv, 1);
+    bend->be_priv = priv;
+
+    priv->pack_dir = g_build_filename (seaf_dir, "storage", "block-packs", NULL);
+    priv->tmp_dir = g_strdup (tmp_dir);
+    priv->pack_size = pack_size > 0 ? pack_size : DEFAULT_PACK_SIZE;
+    priv->lock_fd = -1;
+    /* Keys are owned by the stores. */
+    priv->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, (GDestroyNotify)pack_store_free);
+    g_queue_init (&priv->stores_lru);
+    pthread_mutex_init (&priv->stores_lock, NULL);
+
+    if (g_mkdir_with_parents (priv->pack_dir, 0777) < 0) {
+        seaf_warning ("Block pack dir %s does not exist and"
+                      " is unable to create\n", priv->pack_dir);
+        goto onerror;
+    }
+
+    if (g_mkdir_with_parents (tmp_dir, 0777) < 0) {
+        seaf_warning ("Blocks tmp dir %s does not exist and"
+                      " is unable to create\n", tmp_dir);
+        goto onerror;
+    }
+
+    priv->lock_fd = lock_pack_dir (priv->pack_dir);
+    if (priv->lock_fd < 0)
+        goto onerror;
+
+    bend->open_block = block_backend_pack_open_block;
+    bend->read_block = block_backend_pack_read_block;
+    bend->write_block = block_backend_pack_write_block;
+    bend->commit_block = block_backend_pack_commit_block;
+    bend->close_block = block_backend_pack_close_block;
+    bend->exists = block_backend_pack_block_exists;
+    bend->remove_block = block_backend_pack_remove_block;
+    bend->stat_block = block_backend_pack_stat_block;
+    bend->stat_block_by_handle = block_backend_pack_stat_block_by_handle;
+    bend->get_block_segment = block_backend_pack_get_block_segment;
+    bend->seek_block = block_backend_pack_seek_block;
+    bend->block_handle_free = block_backend_pack_block_handle_free;
+    bend->foreach_block = block_backend_pack_foreach_block;
+    bend->remove_store = block_backend_pack_remove_store;
+    bend->copy = block_backend_pack_copy;
+    bend->compact_store = block_backend_pack_compact_store;
+
+    return bend;
+
+onerror:
+    g_hash_table_destroy (priv->stores);
+    g_free (priv->pack_dir);
+    g_free (priv->tmp_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
@@ -8,22 +8,33 @@
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+extern BlockBackend *
+block_backend_pack_new (const char *block_dir, const char *tmp_dir,
+                        gint64 pack_size);
+
 BlockBackend*
-load_filesystem_block_backend(GKeyFile *config)
+load_filesystem_block_backend(GKeyFile *config,
+                              const char *seaf_dir,
+                              const char *default_tmp_dir)
 {
     BlockBackend *bend;
     char *tmp_dir;
     char *block_dir;
     
     block_dir = g_key_file_get_string (config, "block_backend", "block_dir", NULL);
+    if (!block_dir)
+        block_dir = g_strdup (seaf_dir);
     if (!block_dir) {
         seaf_warning ("Block dir not set in config.\n");
         return NULL;
     }
 
     tmp_dir = g_key_file_get_string (config, "block_backend", "tmp_dir", NULL);
+    if (!tmp_dir)
+        tmp_dir = g_strdup (default_tmp_dir);
     if (!tmp_dir) {
         seaf_warning ("Block tmp dir not set in config.\n");
+        g_free (block_dir);
         return NULL;
     }
 
@@ -35,7 +46,51 @@ load_filesystem_block_backend(GKeyFile *config)
 }
 
 BlockBackend*
-load_block_backend (GKeyFile *config)
+load_pack_block_backend(GKeyFile *config,
+                        const char *seaf_dir,
+                        const char *default_tmp_dir)
+{
+    BlockBackend *bend;
+    char *tmp_dir;
+    char *block_dir;
+    int pack_size_mb;
+
+    /* The Go fileserver reads blocks from the filesystem layout only. */
+    if (g_key_file_get_boolean (config, "fileserver", "use_go_fileserver", NULL)) {
+        seaf_warning ("The pack block backend can't be used with the Go fileserver.\n");
+        return NULL;
+    }
+    
+    block_dir = g_key_file_get_string (config, "block_backend", "block_dir", NULL);
+    if (!block_dir)
+        block_dir = g_strdup (seaf_dir);
+    if (!block_dir) {
+        seaf_warning ("Block dir not set in config.\n");
+        return NULL;
+    }
+
+    tmp_dir = g_key_file_get_string (config, "block_backend", "tmp_dir", NULL);
+    if (!tmp_dir)
+        tmp_dir = g_strdup (default_tmp_dir);
+    if (!tmp_dir) {
+        seaf_warning ("Block tmp dir not set in config.\n");
+        g_free (block_dir);
+        return NULL;
+    }
+
+    /* Size of a pack file in MB. Uses the default if not set. */
+    pack_size_mb = g_key_file_get_integer (config, "block_backend", "pack_size", NULL);
+
+    bend = block_backend_pack_new (block_dir, tmp_dir,
+                                   (gint64)pack_size_mb * ((gint64)1 << 20));
+
+    g_free (block_dir);
+    g_free (tmp_dir);
+    return bend;
+}
+
+BlockBackend*
+load_block_backend (GKeyFile *config, const char *seaf_dir, const char *tmp_dir)
 {
     char *backend;
     BlockBackend *bend;
@@ -46,11 +101,18 @@ load_block_backend (GKeyFile *config)
     }
 
     if (strcmp(backend, "filesystem") == 0) {
-        bend = load_filesystem_block_backend(config);
+        bend = load_filesystem_block_backend(config, seaf_dir, tmp_dir);
+        g_free (backend);
+        return bend;
+    }
+
+    if (strcmp(backend, "pack") == 0) {
+        bend = load_pack_block_backend(config, seaf_dir, tmp_dir);
         g_free (backend);
         return bend;
     }
 
     seaf_warning ("Unknown backend\n");
+    g_free (backend);
     return NULL;
 }
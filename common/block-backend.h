@@ -14,6 +14,12 @@ struct BlockBackend {
                             const char *block_id, int rw_type);
 
     int      (*read_block) (BlockBackend *bend, BHandle *handle, void *buf, int len);
+
+    /* Move the read position of a block opened for read to @offset, so
+     * that reading from an offset doesn't read the content before it.
+     * Backends that can't support this leave the field NULL.
+     */
+    int      (*seek_block) (BlockBackend *bend, BHandle *handle, gint64 offset);
     
     int      (*write_block) (BlockBackend *bend, BHandle *handle, const void *buf, int len);
     
@@ -35,6 +41,14 @@ struct BlockBackend {
     
     BMetadata* (*stat_block_by_handle) (BlockBackend *bend, BHandle *handle);
 
+    /* Expose the content of a block opened for read as a segment of a file,
+     * so that it can be sent without copying through user space.
+     * On success, @fd is a new descriptor owned by the caller.
+     * Backends that can't support this leave the field NULL.
+     */
+    int      (*get_block_segment) (BlockBackend *bend, BHandle *handle,
+                                   int *fd, gint64 *offset, gint64 *len);
+
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
     int      (*foreach_block) (BlockBackend *bend,
@@ -54,11 +68,19 @@ struct BlockBackend {
     int      (*remove_store) (BlockBackend *bend,
                               const char *store_id);
 
+    /* Reclaim space of removed blocks. Called by GC after removing blocks.
+     * Backends that free space on removal leave the field NULL.
+     */
+    int      (*compact_store) (BlockBackend *bend,
+                               const char *store_id);
+
     void*    be_priv;           /* backend private field */
 
 };
 
 
-BlockBackend* load_block_backend (GKeyFile *config);
+BlockBackend* load_block_backend (GKeyFile *config,
+                                  const char *seaf_dir,
+                                  const char *tmp_dir);
 
 #endif
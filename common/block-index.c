@@ -0,0 +1,442 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "log.h"
+#include "block-mgr.h"
+#include "block-index.h"
+
+/* Default memory limit of all store indexes, in MB. */
+#define DEFAULT_MEMORY_LIMIT 256
+/* Rebuild an index this often, to pick up blocks written by other processes. */
+#define DEFAULT_REFRESH_INTERVAL 3600
+/* Wait this long before retrying a failed build. */
+#define RETRY_INTERVAL 60
+
+#define BUILD_THREADS 2
+
+/* 10 bits and 7 hashes per block give about 1% false positives
+ * when the filter is full.
+ */
+#define BITS_PER_BLOCK 10
+#define N_HASHES 7
+#define MIN_CAPACITY 65536
+
+enum {
+    STORE_INDEX_BUILDING,
+    STORE_INDEX_READY,
+    STORE_INDEX_FAILED,
+};
+
+typedef struct StoreIndex {
+    char store_id[37];
+    int version;
+    int state;
+
+    guint64 *bits;
+    guint64 n_bits;
+    guint64 n_items;
+    guint64 capacity;
+
+    gint64 build_time;          /* when the last build started */
+    gboolean rebuilding;        /* a build is running for a ready index */
+    GArray *pending;            /* blocks added while a build is running */
+    gboolean dropped;           /* removed while a build is running */
+
+    GList link;                 /* node in the LRU list */
+} StoreIndex;
+
+struct BlockIndex {
+    SeafBlockManager *mgr;
+
+    pthread_mutex_t lock;
+    GHashTable *stores;
+    GQueue lru;                 /* most recently used first */
+    gint64 mem_size;
+    gint64 mem_limit;
+    int refresh_interval;
+    GThreadPool *builders;
+
+    pthread_mutex_t handles_lock;
+    GHashTable *handles;        /* BlockHandle -> store id + block id */
+};
+
+static void build_store_index (gpointer data, gpointer user_data);
+
+BlockIndex *
+block_index_new (SeafBlockManager *mgr, GKeyFile *config)
+{
+    BlockIndex *index;
+    GError *error = NULL;
+    gboolean enabled;
+    int mem_limit, refresh_interval;
+
+    enabled = g_key_file_get_boolean (config, "block_index", "enabled", &error);
+    if (error) {
+        enabled = TRUE;
+        g_clear_error (&error);
+    }
+    if (!enabled)
+        return NULL;
+
+    mem_limit = g_key_file_get_integer (config, "block_index", "memory_limit", &error);
+    if (error) {
+        mem_limit = DEFAULT_MEMORY_LIMIT;
+        g_clear_error (&error);
+    }
+    if (mem_limit <= 0)
+        return NULL;
+
+    refresh_interval = g_key_file_get_integer (config, "block_index",
+                                               "refresh_interval", &error);
+    if (error) {
+        refresh_interval = DEFAULT_REFRESH_INTERVAL;
+        g_clear_error (&error);
+    }
+
+    index = g_new0 (BlockIndex, 1);
+    index->mgr = mgr;
+    index->mem_limit = (gint64)mem_limit << 20;
+    index->refresh_interval = refresh_interval;
+    pthread_mutex_init (&index->lock, NULL);
+    index->stores = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&index->lru);
+    pthread_mutex_init (&index->handles_lock, NULL);
+    index->handles = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+
+    index->builders = g_thread_pool_new (build_store_index, index,
+                                         BUILD_THREADS, FALSE, NULL);
+    if (!index->builders) {
+        seaf_warning ("Failed to create block index build threads.\n");
+        g_hash_table_destroy (index->stores);
+        g_hash_table_destroy (index->handles);
+        g_free (index);
+        return NULL;
+    }
+
+    return index;
+}
+
+/* Block ids are sha1 hashes, so their first 8 bytes are already well
+ * distributed.
+ */
+static guint64
+block_fingerprint (const char *block_id)
+{
+    guint8 raw[8];
+    guint64 fp;
+
+    hex_to_rawdata (block_id, raw, 8);
+    memcpy (&fp, raw, 8);
+    return fp;
+}
+
+static inline guint64
+mix64 (guint64 x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void
+bloom_set (guint64 *bits, guint64 n_bits, guint64 fp)
+{
+    guint64 h2 = mix64 (fp) | 1;
+    guint64 bit;
+    int i;
+
+    for (i = 0; i < N_HASHES; ++i) {
+        bit = (fp + i * h2) % n_bits;
+        bits[bit >> 6] |= (1ULL << (bit & 63));
+    }
+}
+
+static gboolean
+bloom_test (guint64 *bits, guint64 n_bits, guint64 fp)
+{
+    guint64 h2 = mix64 (fp) | 1;
+    guint64 bit;
+    int i;
+
+    for (i = 0; i < N_HASHES; ++i) {
+        bit = (fp + i * h2) % n_bits;
+        if (!(bits[bit >> 6] & (1ULL << (bit & 63))))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+store_index_free (StoreIndex *s)
+{
+    g_free (s->bits);
+    g_array_free (s->pending, TRUE);
+    g_free (s);
+}
+
+static gint64
+store_index_mem_size (StoreIndex *s)
+{
+    return s->n_bits / 8;
+}
+
+/* Drop the least recently used indexes until the memory limit is met.
+ * Must be called with the lock held.
+ */
+static void
+evict_stores (BlockIndex *index)
+{
+    GList *ptr, *prev;
+    StoreIndex *s;
+
+    ptr = index->lru.tail;
+    while (ptr && index->mem_size > index->mem_limit) {
+        prev = ptr->prev;
+        s = ptr->data;
+        if (s->state == STORE_INDEX_READY && !s->rebuilding) {
+            g_queue_unlink (&index->lru, ptr);
+            g_hash_table_remove (index->stores, s->store_id);
+            index->mem_size -= store_index_mem_size (s);
+            store_index_free (s);
+        }
+        ptr = prev;
+    }
+}
+
+static void
+start_build (BlockIndex *index, StoreIndex *s)
+{
+    s->build_time = (gint64)time(NULL);
+    if (s->state == STORE_INDEX_READY)
+        s->rebuilding = TRUE;
+    else
+        s->state = STORE_INDEX_BUILDING;
+    g_thread_pool_push (index->builders, s, NULL);
+}
+
+static gboolean
+collect_block (const char *store_id, int version,
+               const char *block_id, void *user_data)
+{
+    GArray *fps = user_data;
+    guint64 fp;
+
+    if (!is_object_id_valid (block_id))
+        return TRUE;
+
+    fp = block_fingerprint (block_id);
+    g_array_append_val (fps, fp);
+    return TRUE;
+}
+
+static void
+build_store_index (gpointer data, gpointer user_data)
+{
+    StoreIndex *s = data;
+    BlockIndex *index = user_data;
+    GArray *fps;
+    guint64 capacity = 0, n_bits = 0, *bits = NULL;
+    guint i;
+    int rc;
+
+    fps = g_array_new (FALSE, FALSE, sizeof(guint64));
+    rc = seaf_block_manager_foreach_block (index->mgr, s->store_id, s->version,
+                                           collect_block, fps);
+    if (rc == 0) {
+        /* Leave room for the store to grow before it needs a rebuild. */
+        capacity = MAX ((guint64)fps->len * 2, MIN_CAPACITY);
+        n_bits = (capacity * BITS_PER_BLOCK + 63) & ~63ULL;
+        bits = g_try_new0 (guint64, n_bits / 64);
+        if (bits) {
+            for (i = 0; i < fps->len; ++i)
+                bloom_set (bits, n_bits, g_array_index (fps, guint64, i));
+        }
+    }
+
+    pthread_mutex_lock (&index->lock);
+
+    if (s->dropped) {
+        pthread_mutex_unlock (&index->lock);
+        store_index_free (s);
+        g_free (bits);
+        g_array_free (fps, TRUE);
+        return;
+    }
+
+    if (!bits) {
+        seaf_warning ("Failed to build block index for store %s.\n", s->store_id);
+        if (s->state != STORE_INDEX_READY)
+            s->state = STORE_INDEX_FAILED;
+        s->rebuilding = FALSE;
+        g_array_set_size (s->pending, 0);
+        pthread_mutex_unlock (&index->lock);
+        g_array_free (fps, TRUE);
+        return;
+    }
+
+    for (i = 0; i < s->pending->len; ++i)
+        bloom_set (bits, n_bits, g_array_index (s->pending, guint64, i));
+
+    index->mem_size -= store_index_mem_size (s);
+    g_free (s->bits);
+    s->bits = bits;
+    s->n_bits = n_bits;
+    s->capacity = capacity;
+    s->n_items = fps->len + s->pending->len;
+    index->mem_size += store_index_mem_size (s);
+    g_array_set_size (s->pending, 0);
+    s->state = STORE_INDEX_READY;
+    s->rebuilding = FALSE;
+
+    evict_stores (index);
+
+    pthread_mutex_unlock (&index->lock);
+
+    seaf_debug ("Built block index for store %s, %u blocks.\n",
+                s->store_id, fps->len);
+    g_array_free (fps, TRUE);
+}
+
+int
+block_index_check (BlockIndex *index,
+                   const char *store_id,
+                   int version,
+                   const char *block_id)
+{
+    StoreIndex *s;
+    guint64 fp = block_fingerprint (block_id);
+    gint64 now = (gint64)time(NULL);
+    int ret = BLOCK_INDEX_UNKNOWN;
+
+    pthread_mutex_lock (&index->lock);
+
+    s = g_hash_table_lookup (index->stores, store_id);
+    if (!s) {
+        s = g_new0 (StoreIndex, 1);
+        memcpy (s->store_id, store_id, 36);
+        s->version = version;
+        s->pending = g_array_new (FALSE, FALSE, sizeof(guint64));
+        s->link.data = s;
+        g_hash_table_insert (index->stores, s->store_id, s);
+        g_queue_push_head_link (&index->lru, &s->link);
+        start_build (index, s);
+        goto out;
+    }
+
+    g_queue_unlink (&index->lru, &s->link);
+    g_queue_push_head_link (&index->lru, &s->link);
+
+    switch (s->state) {
+    case STORE_INDEX_FAILED:
+        if (now - s->build_time >= RETRY_INTERVAL)
+            start_build (index, s);
+        break;
+    case STORE_INDEX_READY:
+        if (!bloom_test (s->bits, s->n_bits, fp))
+            ret = BLOCK_INDEX_MISSING;
+        if (!s->rebuilding &&
+            (s->n_items > s->capacity ||
+             (index->refresh_interval > 0 &&
+              now - s->build_time >= index->refresh_interval)))
+            start_build (index, s);
+        break;
+    default:
+        break;
+    }
+
+out:
+    pthread_mutex_unlock (&index->lock);
+    return ret;
+}
+
+void
+block_index_add (BlockIndex *index,
+                 const char *store_id,
+                 const char *block_id)
+{
+    StoreIndex *s;
+    guint64 fp = block_fingerprint (block_id);
+
+    pthread_mutex_lock (&index->lock);
+
+    s = g_hash_table_lookup (index->stores, store_id);
+    if (s) {
+        if (s->state == STORE_INDEX_BUILDING || s->rebuilding)
+            g_array_append_val (s->pending, fp);
+        if (s->bits) {
+            bloom_set (s->bits, s->n_bits, fp);
+            ++(s->n_items);
+        }
+    }
+
+    pthread_mutex_unlock (&index->lock);
+}
+
+void
+block_index_track_handle (BlockIndex *index,
+                          BlockHandle *handle,
+                          const char *store_id,
+                          const char *block_id)
+{
+    char *key = g_strconcat (store_id, "/", block_id, NULL);
+
+    pthread_mutex_lock (&index->handles_lock);
+    g_hash_table_replace (index->handles, handle, key);
+    pthread_mutex_unlock (&index->handles_lock);
+}
+
+void
+block_index_commit_handle (BlockIndex *index, BlockHandle *handle)
+{
+    char *key;
+
+    pthread_mutex_lock (&index->handles_lock);
+    key = g_hash_table_lookup (index->handles, handle);
+    if (key)
+        g_hash_table_steal (index->handles, handle);
+    pthread_mutex_unlock (&index->handles_lock);
+
+    if (!key)
+        return;
+
+    key[36] = '\0';
+    block_index_add (index, key, key + 37);
+    g_free (key);
+}
+
+void
+block_index_untrack_handle (BlockIndex *index, BlockHandle *handle)
+{
+    pthread_mutex_lock (&index->handles_lock);
+    g_hash_table_remove (index->handles, handle);
+    pthread_mutex_unlock (&index->handles_lock);
+}
+
+void
+block_index_remove_store (BlockIndex *index, const char *store_id)
+{
+    StoreIndex *s;
+
+    pthread_mutex_lock (&index->lock);
+
+    s = g_hash_table_lookup (index->stores, store_id);
+    if (s) {
+        g_hash_table_remove (index->stores, s->store_id);
+        g_queue_unlink (&index->lru, &s->link);
+        index->mem_size -= store_index_mem_size (s);
+        if (s->state == STORE_INDEX_BUILDING || s->rebuilding)
+            s->dropped = TRUE;
+        else
+            store_index_free (s);
+    }
+
+    pthread_mutex_unlock (&index->lock);
+}
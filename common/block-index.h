@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_INDEX_H
+#define BLOCK_INDEX_H
+
+#include <glib.h>
+
+#include "block.h"
+
+struct _SeafBlockManager;
+
+/*
+ * In-memory index of the blocks in each store, to answer "block doesn't
+ * exist" without touching the backend.
+ *
+ * The index of a store is a Bloom filter, built in the background from
+ * foreach_block the first time the store is checked, and updated when
+ * blocks are committed or copied in this process. A Bloom filter has no
+ * false negatives, so removed blocks (e.g. by GC) never make the index
+ * lie about a block that exists. A "maybe" answer must still be confirmed
+ * with the backend.
+ *
+ * Blocks written by other processes are not seen until the index is
+ * rebuilt, so a block can be reported missing when it exists.
+ */
+typedef struct BlockIndex BlockIndex;
+
+enum {
+    BLOCK_INDEX_MISSING,        /* the block doesn't exist */
+    BLOCK_INDEX_UNKNOWN,        /* may exist, or the index is not ready */
+};
+
+/* Returns NULL if the index is disabled in config. */
+BlockIndex *
+block_index_new (struct _SeafBlockManager *mgr, GKeyFile *config);
+
+int
+block_index_check (BlockIndex *index,
+                   const char *store_id,
+                   int version,
+                   const char *block_id);
+
+void
+block_index_add (BlockIndex *index,
+                 const char *store_id,
+                 const char *block_id);
+
+/* Remember the block a write handle is for, so that it can be added
+ * when the handle is committed.
+ */
+void
+block_index_track_handle (BlockIndex *index,
+                          BlockHandle *handle,
+                          const char *store_id,
+                          const char *block_id);
+
+void
+block_index_commit_handle (BlockIndex *index, BlockHandle *handle);
+
+void
+block_index_untrack_handle (BlockIndex *index, BlockHandle *handle);
+
+void
+block_index_remove_store (BlockIndex *index, const char *store_id);
+
+#endif
@@ -18,6 +18,8 @@
 #include <glib/gstdio.h>
 
 #include "block-backend.h"
+#include "block-index.h"
+#include "metrics.h"
 
 #define SEAF_BLOCK_DIR "blocks"
 
@@ -25,22 +27,66 @@
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+static SeafMetric *
+new_op_metric (const char *op)
+{
+    SeafMetric *metric;
+    char *labels;
+
+    labels = g_strdup_printf ("op=\"%s\"", op);
+    metric = seaf_metric_histogram_new ("seafile_block_op_duration_seconds", labels,
+                                        "Latency of block store operations.");
+    g_free (labels);
+
+    return metric;
+}
+
+static void
+init_metrics (SeafBlockManager *mgr)
+{
+    mgr->open_metric = new_op_metric ("open");
+    mgr->read_metric = new_op_metric ("read");
+    mgr->write_metric = new_op_metric ("write");
+    mgr->commit_metric = new_op_metric ("commit");
+    mgr->exists_metric = new_op_metric ("exists");
+    mgr->read_bytes_metric = seaf_metric_counter_new ("seafile_block_read_bytes_total", NULL,
+                                                      "Bytes read from the block store.");
+    mgr->write_bytes_metric = seaf_metric_counter_new ("seafile_block_written_bytes_total", NULL,
+                                                       "Bytes written to the block store.");
+}
 
 SeafBlockManager *
 seaf_block_manager_new (struct _SeafileSession *seaf,
                         const char *seaf_dir)
 {
     SeafBlockManager *mgr;
+    char *backend_name = NULL;
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
 
-    mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    if (seaf->config)
+        backend_name = g_key_file_get_string (seaf->config,
+                                              "block_backend", "name", NULL);
+
+    /* Use the filesystem backend for any other name, as before. */
+    if (g_strcmp0 (backend_name, "pack") == 0)
+        mgr->backend = load_block_backend (seaf->config, seaf_dir,
+                                           seaf->tmp_file_dir);
+    else
+        mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    g_free (backend_name);
+
     if (!mgr->backend) {
         seaf_warning ("[Block mgr] Failed to load backend.\n");
         goto onerror;
     }
 
+    if (seaf->config)
+        mgr->index = block_index_new (mgr, seaf->config);
+
+    init_metrics (mgr);
+
     return mgr;
 
 onerror:
@@ -63,13 +109,22 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
                                const char *block_id,
                                int rw_type)
 {
+    BlockHandle *handle;
+    gint64 start;
+
     if (!store_id || !is_uuid_valid(store_id) ||
         !block_id || !is_object_id_valid(block_id))
         return NULL;
 
-    return mgr->backend->open_block (mgr->backend,
-                                     store_id, version,
-                                     block_id, rw_type);
+    start = g_get_monotonic_time ();
+    handle = mgr->backend->open_block (mgr->backend,
+                                       store_id, version,
+                                       block_id, rw_type);
+    seaf_metric_observe (mgr->open_metric, g_get_monotonic_time () - start);
+    if (handle && rw_type == BLOCK_WRITE && mgr->index)
+        block_index_track_handle (mgr->index, handle, store_id, block_id);
+
+    return handle;
 }
 
 int
@@ -77,7 +132,26 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len)
 {
-    return mgr->backend->read_block (mgr->backend, handle, buf, len);
+    gint64 start = g_get_monotonic_time ();
+    int n;
+
+    n = mgr->backend->read_block (mgr->backend, handle, buf, len);
+    seaf_metric_observe (mgr->read_metric, g_get_monotonic_time () - start);
+    if (n > 0)
+        seaf_metric_add (mgr->read_bytes_metric, n);
+
+    return n;
+}
+
+int
+seaf_block_manager_seek_block (SeafBlockManager *mgr,
+                               BlockHandle *handle,
+                               gint64 offset)
+{
+    if (!mgr->backend->seek_block)
+        return -1;
+
+    return mgr->backend->seek_block (mgr->backend, handle, offset);
 }
 
 int
@@ -85,7 +159,15 @@ seaf_block_manager_write_block (SeafBlockManager *mgr,
                                 BlockHandle *handle,
                                 const void *buf, int len)
 {
-    return mgr->backend->write_block (mgr->backend, handle, buf, len);
+    gint64 start = g_get_monotonic_time ();
+    int n;
+
+    n = mgr->backend->write_block (mgr->backend, handle, buf, len);
+    seaf_metric_observe (mgr->write_metric, g_get_monotonic_time () - start);
+    if (n > 0)
+        seaf_metric_add (mgr->write_bytes_metric, n);
+
+    return n;
 }
 
 int
@@ -99,6 +181,9 @@ void
 seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
                                       BlockHandle *handle)
 {
+    if (mgr->index)
+        block_index_untrack_handle (mgr->index, handle);
+
     return mgr->backend->block_handle_free (mgr->backend, handle);
 }
 
@@ -106,7 +191,15 @@ int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    gint64 start = g_get_monotonic_time ();
+    int ret;
+
+    ret = mgr->backend->commit_block (mgr->backend, handle);
+    seaf_metric_observe (mgr->commit_metric, g_get_monotonic_time () - start);
+    if (ret == 0 && mgr->index)
+        block_index_commit_handle (mgr->index, handle);
+
+    return ret;
 }
     
 gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
@@ -118,6 +211,30 @@ gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
         !block_id || !is_object_id_valid(block_id))
         return FALSE;
 
+    gint64 start = g_get_monotonic_time ();
+    gboolean ret;
+
+    ret = mgr->backend->exists (mgr->backend, store_id, version, block_id);
+    seaf_metric_observe (mgr->exists_metric, g_get_monotonic_time () - start);
+
+    return ret;
+}
+
+gboolean
+seaf_block_manager_block_exists_indexed (SeafBlockManager *mgr,
+                                         const char *store_id,
+                                         int version,
+                                         const char *block_id)
+{
+    if (!store_id || !is_uuid_valid(store_id) ||
+        !block_id || !is_object_id_valid(block_id))
+        return FALSE;
+
+    if (mgr->index &&
+        block_index_check (mgr->index, store_id, version,
+                           block_id) == BLOCK_INDEX_MISSING)
+        return FALSE;
+
     return mgr->backend->exists (mgr->backend, store_id, version, block_id);
 }
 
@@ -154,6 +271,18 @@ seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
     return mgr->backend->stat_block_by_handle (mgr->backend, handle);
 }
 
+int
+seaf_block_manager_get_block_segment (SeafBlockManager *mgr,
+                                      BlockHandle *handle,
+                                      int *fd, gint64 *offset, gint64 *len)
+{
+    if (!mgr->backend->get_block_segment)
+        return -1;
+
+    return mgr->backend->get_block_segment (mgr->backend, handle,
+                                            fd, offset, len);
+}
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   const char *store_id,
@@ -174,18 +303,24 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                int dst_version,
                                const char *block_id)
 {
+    int ret;
+
     if (strcmp (block_id, EMPTY_SHA1) == 0)
         return 0;
     if (seaf_block_manager_block_exists (mgr, dst_store_id, dst_version, block_id)) {
         return 0;
     }
 
-    return mgr->backend->copy (mgr->backend,
-                               src_store_id,
-                               src_version,
-                               dst_store_id,
-                               dst_version,
-                               block_id);
+    ret = mgr->backend->copy (mgr->backend,
+                              src_store_id,
+                              src_version,
+                              dst_store_id,
+                              dst_version,
+                              block_id);
+    if (ret == 0 && mgr->index)
+        block_index_add (mgr->index, dst_store_id, block_id);
+
+    return ret;
 }
 
 static gboolean
@@ -267,5 +402,18 @@ int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id)
 {
+    if (mgr->index)
+        block_index_remove_store (mgr->index, store_id);
+
     return mgr->backend->remove_store (mgr->backend, store_id);
 }
+
+int
+seaf_block_manager_compact_store (SeafBlockManager *mgr,
+                                  const char *store_id)
+{
+    if (!mgr->backend->compact_store)
+        return 0;
+
+    return mgr->backend->compact_store (mgr->backend, store_id);
+}
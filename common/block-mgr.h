@@ -17,6 +17,17 @@ struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    /* In-memory index of existing blocks, NULL if disabled. */
+    struct BlockIndex *index;
+
+    struct SeafMetric *open_metric;
+    struct SeafMetric *read_metric;
+    struct SeafMetric *write_metric;
+    struct SeafMetric *commit_metric;
+    struct SeafMetric *exists_metric;
+    struct SeafMetric *read_bytes_metric;
+    struct SeafMetric *write_bytes_metric;
 };
 
 
@@ -55,6 +66,18 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len);
 
+/*
+ * Move the read position of a block to @offset.
+ *
+ * @handle: Hanlde returned by seaf_block_manager_open_block() for read.
+ *
+ * Returns: 0 on success, -1 if not supported by the backend or on error.
+ */
+int
+seaf_block_manager_seek_block (SeafBlockManager *mgr,
+                               BlockHandle *handle,
+                               gint64 offset);
+
 /*
  * Write data to a block.
  * The semantics is similar to writen.
@@ -103,6 +126,18 @@ seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  int version,
                                  const char *block_id);
 
+/*
+ * Like seaf_block_manager_block_exists(), but answers from an in-memory
+ * index when the block is known not to exist. It may return FALSE for a
+ * block written by another process since the index was built, so only use
+ * it where that is harmless, e.g. to ask clients which blocks to upload.
+ */
+gboolean
+seaf_block_manager_block_exists_indexed (SeafBlockManager *mgr,
+                                         const char *store_id,
+                                         int version,
+                                         const char *block_id);
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *store_id,
@@ -119,6 +154,21 @@ BlockMetadata *
 seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
                                          BlockHandle *handle);
 
+/*
+ * Get the file segment holding the content of a block.
+ *
+ * @handle: Handle returned by seaf_block_manager_open_block() for read.
+ * @fd: Set to a new file descriptor, which should be closed by the caller.
+ * @offset: Offset of block content in @fd.
+ * @len: Length of block content.
+ *
+ * Returns: 0 on success, -1 if not supported by the backend or on error.
+ */
+int
+seaf_block_manager_get_block_segment (SeafBlockManager *mgr,
+                                      BlockHandle *handle,
+                                      int *fd, gint64 *offset, gint64 *len);
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   const char *store_id,
@@ -139,6 +189,11 @@ int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id);
 
+/* Reclaim space of removed blocks, if the backend needs it. Called by GC. */
+int
+seaf_block_manager_compact_store (SeafBlockManager *mgr,
+                                  const char *store_id);
+
 guint64
 seaf_block_manager_get_block_number (SeafBlockManager *mgr,
                                      const char *store_id,
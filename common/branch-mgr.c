@@ -75,15 +75,254 @@ seaf_branch_unref (SeafBranch *branch)
         seaf_branch_free (branch);
 }
 
+#if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
+
+/*
+ * Cache of branch heads.
+ *
+ * Heads updated in this process are written through the cache. Heads
+ * updated by other processes (the Go file server) are invalidated with
+ * the invalidate_branch_cache RPC. Heads updated directly in the database
+ * by anything else, such as another seaf-server sharing the database,
+ * are only seen when the entry expires. So the cache is only safe when
+ * this process is the single writer of the branch table, and it is off
+ * by default. It's enabled with "enabled = true" in the [branch_cache]
+ * section; "ttl" bounds how long a stale head can be served.
+ *
+ * The cache is split into shards with a read-write lock each, so that
+ * lookups of different repos don't contend. Every shard has a generation
+ * number that is bumped when a head is invalidated. A head read from the
+ * database is only cached if the generation didn't change meanwhile, so
+ * that an old head can't overwrite a newer one.
+ */
+
+#define BRANCH_CACHE_SHARDS 64
+#define DEFAULT_BRANCH_CACHE_TTL 5
+#define DEFAULT_BRANCH_CACHE_MAX_ENTRIES 1000000
+
+typedef struct CachedHead {
+    char commit_id[41];
+    gint64 expire_time;
+} CachedHead;
+
+typedef struct BranchCacheShard {
+    pthread_rwlock_t lock;
+    GHashTable *heads;          /* repo_id/name -> CachedHead */
+    guint gen;
+} BranchCacheShard;
+
+#endif
+
 struct _SeafBranchManagerPriv {
     sqlite3 *db;
 #ifndef SEAFILE_SERVER
     pthread_mutex_t db_lock;
 #endif
+#if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
+    /* NULL if the cache is disabled. */
+    BranchCacheShard *cache_shards;
+    int cache_ttl;
+    int cache_shard_size;
+#endif
 };
 
 static int open_db (SeafBranchManager *mgr);
 
+#if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
+
+static void
+init_head_cache (SeafBranchManager *mgr)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+    GKeyFile *config = mgr->seaf->config;
+    GError *error = NULL;
+    gboolean enabled;
+    int max_entries;
+    int i;
+
+    enabled = g_key_file_get_boolean (config, "branch_cache", "enabled", &error);
+    if (error) {
+        enabled = FALSE;
+        g_clear_error (&error);
+    }
+    if (!enabled)
+        return;
+
+    priv->cache_ttl = g_key_file_get_integer (config, "branch_cache", "ttl", &error);
+    if (error) {
+        priv->cache_ttl = DEFAULT_BRANCH_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    if (priv->cache_ttl <= 0)
+        return;
+
+    max_entries = g_key_file_get_integer (config, "branch_cache", "max_entries",
+                                          &error);
+    if (error) {
+        max_entries = DEFAULT_BRANCH_CACHE_MAX_ENTRIES;
+        g_clear_error (&error);
+    }
+    if (max_entries <= 0)
+        return;
+    priv->cache_shard_size = MAX (max_entries / BRANCH_CACHE_SHARDS, 1);
+
+    priv->cache_shards = g_new0 (BranchCacheShard, BRANCH_CACHE_SHARDS);
+    for (i = 0; i < BRANCH_CACHE_SHARDS; ++i) {
+        pthread_rwlock_init (&priv->cache_shards[i].lock, NULL);
+        priv->cache_shards[i].heads = g_hash_table_new_full (g_str_hash,
+                                                             g_str_equal,
+                                                             g_free, g_free);
+    }
+}
+
+/* All branches of a repo are in the same shard. */
+static BranchCacheShard *
+get_cache_shard (SeafBranchManager *mgr, const char *repo_id)
+{
+    return &mgr->priv->cache_shards[g_str_hash (repo_id) % BRANCH_CACHE_SHARDS];
+}
+
+/*
+ * Returns TRUE and sets @commit_id if the head is cached. Otherwise sets
+ * @gen to pass to head_cache_set() after reading the head from db.
+ */
+static gboolean
+head_cache_lookup (SeafBranchManager *mgr,
+                   const char *repo_id,
+                   const char *name,
+                   char *commit_id,
+                   guint *gen)
+{
+    BranchCacheShard *shard;
+    CachedHead *head;
+    char *key;
+    gboolean ret = FALSE;
+
+    if (!mgr->priv->cache_shards)
+        return FALSE;
+
+    shard = get_cache_shard (mgr, repo_id);
+    key = g_strconcat (repo_id, "/", name, NULL);
+
+    pthread_rwlock_rdlock (&shard->lock);
+    head = g_hash_table_lookup (shard->heads, key);
+    if (head && head->expire_time > (gint64)time(NULL)) {
+        memcpy (commit_id, head->commit_id, 41);
+        ret = TRUE;
+    } else {
+        *gen = shard->gen;
+    }
+    pthread_rwlock_unlock (&shard->lock);
+
+    g_free (key);
+    return ret;
+}
+
+static gboolean
+is_cached_head_expired (gpointer key, gpointer value, gpointer data)
+{
+    CachedHead *head = value;
+    gint64 *now = data;
+
+    return head->expire_time <= *now;
+}
+
+/*
+ * Cache a head if no head in the shard was invalidated since @gen was
+ * taken. Set @bump when the head was just updated, so that heads read
+ * from db before the update are not cached.
+ */
+static void
+head_cache_set (SeafBranchManager *mgr,
+                const char *repo_id,
+                const char *name,
+                const char *commit_id,
+                guint gen,
+                gboolean bump)
+{
+    BranchCacheShard *shard;
+    CachedHead *head;
+    gint64 now;
+
+    if (!mgr->priv->cache_shards)
+        return;
+
+    shard = get_cache_shard (mgr, repo_id);
+
+    pthread_rwlock_wrlock (&shard->lock);
+
+    if (shard->gen != gen)
+        goto out;
+    if (bump)
+        ++shard->gen;
+
+    now = (gint64)time(NULL);
+    if (g_hash_table_size (shard->heads) >= mgr->priv->cache_shard_size) {
+        g_hash_table_foreach_remove (shard->heads, is_cached_head_expired, &now);
+        if (g_hash_table_size (shard->heads) >= mgr->priv->cache_shard_size)
+            g_hash_table_remove_all (shard->heads);
+    }
+
+    head = g_new0 (CachedHead, 1);
+    memcpy (head->commit_id, commit_id, 40);
+    head->expire_time = now + mgr->priv->cache_ttl;
+    g_hash_table_replace (shard->heads,
+                          g_strconcat (repo_id, "/", name, NULL), head);
+
+out:
+    pthread_rwlock_unlock (&shard->lock);
+}
+
+/* Returns the new generation of the shard. */
+static guint
+head_cache_invalidate (SeafBranchManager *mgr,
+                       const char *repo_id,
+                       const char *name)
+{
+    BranchCacheShard *shard;
+    char *key;
+    guint gen;
+
+    if (!mgr->priv->cache_shards)
+        return 0;
+
+    shard = get_cache_shard (mgr, repo_id);
+    key = g_strconcat (repo_id, "/", name, NULL);
+
+    pthread_rwlock_wrlock (&shard->lock);
+    g_hash_table_remove (shard->heads, key);
+    gen = ++shard->gen;
+    pthread_rwlock_unlock (&shard->lock);
+
+    g_free (key);
+    return gen;
+}
+
+static gboolean
+is_head_of_repo (gpointer key, gpointer value, gpointer data)
+{
+    return strncmp ((const char *)key, (const char *)data, 36) == 0;
+}
+
+void
+seaf_branch_manager_invalidate_cache (SeafBranchManager *mgr,
+                                      const char *repo_id)
+{
+    BranchCacheShard *shard;
+
+    if (!mgr->priv->cache_shards)
+        return;
+
+    shard = get_cache_shard (mgr, repo_id);
+
+    pthread_rwlock_wrlock (&shard->lock);
+    g_hash_table_foreach_remove (shard->heads, is_head_of_repo, (gpointer)repo_id);
+    ++shard->gen;
+    pthread_rwlock_unlock (&shard->lock);
+}
+
+#endif  /* defined( SEAFILE_SERVER ) && defined( FULL_FEATURE ) */
+
 SeafBranchManager *
 seaf_branch_manager_new (struct _SeafileSession *seaf)
 {
@@ -97,6 +336,10 @@ seaf_branch_manager_new (struct _SeafileSession *seaf)
     pthread_mutex_init (&mgr->priv->db_lock, NULL);
 #endif
 
+#if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
+    init_head_cache (mgr);
+#endif
+
     return mgr;
 }
 
@@ -231,6 +474,10 @@ seaf_branch_manager_add_branch (SeafBranchManager *mgr, SeafBranch *branch)
         if (rc < 0)
             return -1;
     }
+
+#ifdef FULL_FEATURE
+    head_cache_invalidate (mgr, branch->repo_id, branch->name);
+#endif
     return 0;
 #endif
 }
@@ -260,6 +507,10 @@ seaf_branch_manager_del_branch (SeafBranchManager *mgr,
                                       2, "string", name, "string", repo_id);
     if (rc < 0)
         return -1;
+
+#ifdef FULL_FEATURE
+    head_cache_invalidate (mgr, repo_id, name);
+#endif
     return 0;
 #endif
 }
@@ -292,6 +543,10 @@ seaf_branch_manager_update_branch (SeafBranchManager *mgr, SeafBranch *branch)
                                       "string", branch->repo_id);
     if (rc < 0)
         return -1;
+
+#ifdef FULL_FEATURE
+    head_cache_invalidate (mgr, branch->repo_id, branch->name);
+#endif
     return 0;
 #endif
 }
@@ -314,13 +569,23 @@ get_commit_id (SeafDBRow *row, void *data)
 }
 
 static void
-publish_repo_update_event (const char *repo_id, const char *commit_id)
+publish_repo_update_event (const char *repo_id, const char *commit_id,
+                           gboolean is_virtual)
 {
     char buf[128];
     snprintf (buf, sizeof(buf), "repo-update\t%s\t%s",
               repo_id, commit_id);
 
-    seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_EVENT, buf);
+    /* Consumers of the event queue handle virtual repos through their
+     * origin repo. In-process listeners, like the head commit table used
+     * by head-commits-watch, still need to see the new head.
+     */
+    if (is_virtual)
+        seaf_mq_manager_notify_listeners (seaf->mq_mgr,
+                                          SEAFILE_SERVER_CHANNEL_EVENT, buf);
+    else
+        seaf_mq_manager_publish_event (seaf->mq_mgr,
+                                       SEAFILE_SERVER_CHANNEL_EVENT, buf);
 }
 
  static void
@@ -328,10 +593,9 @@ publish_repo_update_event (const char *repo_id, const char *commit_id)
  {
      seaf_repo_manager_update_repo_info (seaf->repo_mgr, branch->repo_id, branch->commit_id);
  
-     if (seaf_repo_manager_is_virtual_repo (seaf->repo_mgr, branch->repo_id))
-         return;
-
-     publish_repo_update_event (branch->repo_id, branch->commit_id);
+     publish_repo_update_event (branch->repo_id, branch->commit_id,
+                                seaf_repo_manager_is_virtual_repo (seaf->repo_mgr,
+                                                                   branch->repo_id));
  }
 
 int
@@ -342,6 +606,7 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
     SeafDBTrans *trans;
     char *sql;
     char commit_id[41] = { 0 };
+    guint gen;
 
     trans = seaf_db_begin_transaction (mgr->seaf->db);
     if (!trans)
@@ -364,14 +629,13 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
                                             get_commit_id, commit_id,
                                             2, "string", branch->name,
                                             "string", branch->repo_id) < 0) {
-        seaf_db_rollback (trans);
-        seaf_db_trans_close (trans);
-        return -1;
+        goto error;
     }
+    /* The caller may have read a stale cached head, e.g. one updated by
+     * another process.
+     */
     if (strcmp (old_commit_id, commit_id) != 0) {
-        seaf_db_rollback (trans);
-        seaf_db_trans_close (trans);
-        return -1;
+        goto error;
     }
 
     sql = "UPDATE Branch SET commit_id = ? "
@@ -379,22 +643,33 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
     if (seaf_db_trans_query (trans, sql, 3, "string", branch->commit_id,
                              "string", branch->name,
                              "string", branch->repo_id) < 0) {
-        seaf_db_rollback (trans);
-        seaf_db_trans_close (trans);
-        return -1;
+        goto error;
     }
 
+    /* Readers go to db until the new head is committed. The row is locked
+     * until then, so concurrent updates of the branch are cached in order.
+     */
+    gen = head_cache_invalidate (mgr, branch->repo_id, branch->name);
+
     if (seaf_db_commit (trans) < 0) {
-        seaf_db_rollback (trans);
-        seaf_db_trans_close (trans);
-        return -1;
+        goto error;
     }
 
     seaf_db_trans_close (trans);
 
+    head_cache_set (mgr, branch->repo_id, branch->name, branch->commit_id,
+                    gen, TRUE);
+
     on_branch_updated (mgr, branch);
 
     return 0;
+
+error:
+    seaf_db_rollback (trans);
+    seaf_db_trans_close (trans);
+    /* Don't keep serving a head that doesn't match the db. */
+    head_cache_invalidate (mgr, branch->repo_id, branch->name);
+    return -1;
 }
 
 #endif
@@ -484,6 +759,12 @@ real_get_branch (SeafBranchManager *mgr,
 {
     char commit_id[41];
     char *sql;
+#ifdef FULL_FEATURE
+    guint gen = 0;
+
+    if (head_cache_lookup (mgr, repo_id, name, commit_id, &gen))
+        return seaf_branch_new (name, repo_id, commit_id);
+#endif
 
     commit_id[0] = 0;
     sql = "SELECT commit_id FROM Branch WHERE name=? AND repo_id=?";
@@ -497,6 +778,10 @@ real_get_branch (SeafBranchManager *mgr,
     if (commit_id[0] == 0)
         return NULL;
 
+#ifdef FULL_FEATURE
+    head_cache_set (mgr, repo_id, name, commit_id, gen, FALSE);
+#endif
+
     return seaf_branch_new (name, repo_id, commit_id);
 }
 
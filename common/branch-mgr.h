@@ -60,6 +60,14 @@ int
 seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
                                             SeafBranch *branch,
                                             const char *old_commit_id);
+
+/**
+ * Drop the cached heads of @repo_id, after its branches are changed
+ * by another process.
+ */
+void
+seaf_branch_manager_invalidate_cache (SeafBranchManager *mgr,
+                                      const char *repo_id);
 #endif
 
 SeafBranch *
@@ -4,6 +4,7 @@
 
 #include "log.h"
 
+#include <pthread.h>
 #include <jansson.h>
 #include <openssl/sha.h>
 
@@ -17,8 +18,27 @@
 
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+#define DEFAULT_MAX_CACHED_COMMITS 10000
+
+/*
+ * Loaded commits are kept in an LRU cache. Commit objects are immutable
+ * once added, so cached commits are shared with callers: the cache holds
+ * one reference, and each lookup returns a new one.
+ */
+typedef struct CachedCommit {
+    char key[78];               /* repo id + commit id + version */
+    SeafCommit *commit;
+    GList link;                 /* node in the LRU list */
+} CachedCommit;
+
 struct _SeafCommitManagerPriv {
-    int dummy;
+    pthread_mutex_t cache_lock;
+    GHashTable *commit_cache;
+    GQueue cache_lru;           /* most recently used first */
+    int max_cached;
+    guint64 cache_hits;
+    guint64 cache_misses;
+    guint64 cache_evictions;
 };
 
 static SeafCommit *
@@ -176,7 +196,8 @@ seaf_commit_free (SeafCommit *commit)
 void
 seaf_commit_ref (SeafCommit *commit)
 {
-    commit->ref++;
+    /* Cached commits are shared between threads. */
+    g_atomic_int_inc (&commit->ref);
 }
 
 void
@@ -185,7 +206,7 @@ seaf_commit_unref (SeafCommit *commit)
     if (!commit)
         return;
 
-    if (--commit->ref <= 0)
+    if (g_atomic_int_dec_and_test (&commit->ref))
         seaf_commit_free (commit);
 }
 
@@ -193,11 +214,26 @@ SeafCommitManager*
 seaf_commit_manager_new (SeafileSession *seaf)
 {
     SeafCommitManager *mgr = g_new0 (SeafCommitManager, 1);
+    GError *error = NULL;
 
     mgr->priv = g_new0 (SeafCommitManagerPriv, 1);
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
+    pthread_mutex_init (&mgr->priv->cache_lock, NULL);
+    mgr->priv->commit_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&mgr->priv->cache_lru);
+
+    mgr->priv->max_cached = g_key_file_get_integer (seaf->config,
+                                                    "commit_cache", "max_commits",
+                                                    &error);
+    if (error) {
+        mgr->priv->max_cached = DEFAULT_MAX_CACHED_COMMITS;
+        g_clear_error (&error);
+    }
+    if (mgr->priv->max_cached < 0)
+        mgr->priv->max_cached = 0;
+
     return mgr;
 }
 
@@ -211,23 +247,126 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     return 0;
 }
 
-#if 0
-inline static void
-add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
+static void
+cache_key (char key[], int version, const char *repo_id, const char *id)
 {
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
+    snprintf (key, 78, "%.36s%.40s%d", repo_id, id, version);
+}
+
+static SeafCommit *
+lookup_cache (SeafCommitManager *mgr, int version,
+              const char *repo_id, const char *id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CachedCommit *cached;
+    SeafCommit *commit = NULL;
+    char key[78];
+
+    if (priv->max_cached == 0)
+        return NULL;
+
+    cache_key (key, version, repo_id, id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    cached = g_hash_table_lookup (priv->commit_cache, key);
+    if (cached) {
+        g_queue_unlink (&priv->cache_lru, &cached->link);
+        g_queue_push_head_link (&priv->cache_lru, &cached->link);
+        commit = cached->commit;
+        seaf_commit_ref (commit);
+        ++priv->cache_hits;
+    } else {
+        ++priv->cache_misses;
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return commit;
+}
+
+/* Called with cache_lock held. */
+static void
+drop_cached_commit (SeafCommitManagerPriv *priv, CachedCommit *cached)
+{
+    g_hash_table_remove (priv->commit_cache, cached->key);
+    g_queue_unlink (&priv->cache_lru, &cached->link);
+    seaf_commit_unref (cached->commit);
+    g_free (cached);
+}
+
+static void
+add_commit_to_cache (SeafCommitManager *mgr, int version,
+                     const char *repo_id, SeafCommit *commit)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CachedCommit *cached;
+
+    if (priv->max_cached == 0)
+        return;
+
+    cached = g_new0 (CachedCommit, 1);
+    cache_key (cached->key, version, repo_id, commit->commit_id);
+    cached->link.data = cached;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    /* Another thread may have loaded the same commit. */
+    if (g_hash_table_lookup (priv->commit_cache, cached->key)) {
+        pthread_mutex_unlock (&priv->cache_lock);
+        g_free (cached);
+        return;
+    }
+
     seaf_commit_ref (commit);
+    cached->commit = commit;
+    g_hash_table_insert (priv->commit_cache, cached->key, cached);
+    g_queue_push_head_link (&priv->cache_lru, &cached->link);
+
+    while (g_queue_get_length (&priv->cache_lru) > priv->max_cached) {
+        drop_cached_commit (priv, g_queue_peek_tail (&priv->cache_lru));
+        ++priv->cache_evictions;
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static void
+remove_commit_from_cache (SeafCommitManager *mgr, int version,
+                          const char *repo_id, const char *id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CachedCommit *cached;
+    char key[78];
+
+    cache_key (key, version, repo_id, id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    cached = g_hash_table_lookup (priv->commit_cache, key);
+    if (cached)
+        drop_cached_commit (priv, cached);
+    pthread_mutex_unlock (&priv->cache_lock);
 }
 
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
+void
+seaf_commit_manager_get_cache_stats (SeafCommitManager *mgr,
+                                     CommitCacheStats *stats)
 {
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CachedCommit *cached;
+    GList *ptr;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    stats->hits = priv->cache_hits;
+    stats->misses = priv->cache_misses;
+    stats->evictions = priv->cache_evictions;
+    stats->n_cached = g_queue_get_length (&priv->cache_lru);
+    stats->borrowed = 0;
+    for (ptr = priv->cache_lru.head; ptr; ptr = ptr->next) {
+        cached = ptr->data;
+        /* The cache holds one reference. */
+        stats->borrowed += g_atomic_int_get (&cached->commit->ref) - 1;
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
 }
-#endif
 
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr,
@@ -235,7 +374,9 @@ seaf_commit_manager_add_commit (SeafCommitManager *mgr,
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
+    /* The commit is not cached here, since the caller still owns it and
+     * may not be done with it. It's cached when it's loaded.
+     */
     if ((ret = save_commit (mgr, commit->repo_id, commit->version, commit)) < 0)
         return -1;
     
@@ -250,20 +391,8 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 {
     g_return_if_fail (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    /* Other holders of the commit keep their references. */
+    remove_commit_from_cache (mgr, version, repo_id, id);
 
     delete_commit (mgr, repo_id, version, id);
 }
@@ -276,19 +405,18 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr,
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
+    if (!id)
+        return NULL;
+
+    commit = lookup_cache (mgr, version, repo_id, id);
+    if (commit)
         return commit;
-    }
-#endif
 
     commit = load_commit (mgr, repo_id, version, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    add_commit_to_cache (mgr, version, repo_id, commit);
 
     return commit;
 }
@@ -587,12 +715,6 @@ seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    int version,
                                    const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
-        return TRUE;
-#endif
-
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
@@ -919,5 +1041,18 @@ int
 seaf_commit_manager_remove_store (SeafCommitManager *mgr,
                                   const char *store_id)
 {
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CachedCommit *cached;
+    GList *ptr, *next;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    for (ptr = priv->cache_lru.head; ptr; ptr = next) {
+        next = ptr->next;
+        cached = ptr->data;
+        if (strncmp (cached->key, store_id, 36) == 0)
+            drop_cached_commit (priv, cached);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
     return seaf_obj_store_remove_store (mgr->obj_store, store_id);
 }
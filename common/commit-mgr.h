@@ -120,8 +120,8 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 
 /**
  * Find a commit object.
- * This function increments ref count of returned object.
- * Not MT safe.
+ * This function increments ref count of returned object. The returned
+ * object may be shared with other threads, so it must not be modified.
  */
 SeafCommit* 
 seaf_commit_manager_get_commit (SeafCommitManager *mgr,
@@ -194,4 +194,21 @@ int
 seaf_commit_manager_remove_store (SeafCommitManager *mgr,
                                   const char *store_id);
 
+/* Counters of the commit cache. @borrowed is the number of references
+ * to cached commits held outside the cache. It goes back to its previous
+ * value once the callers are done, unless a reference is leaked, or
+ * dropped twice.
+ */
+typedef struct CommitCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint n_cached;
+    gint64 borrowed;
+} CommitCacheStats;
+
+void
+seaf_commit_manager_get_cache_stats (SeafCommitManager *mgr,
+                                     CommitCacheStats *stats);
+
 #endif
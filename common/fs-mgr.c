@@ -10,6 +10,7 @@ char *strcasestr (const char *haystack, const char *needle);
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #ifndef WIN32
     #include <arpa/inet.h>
@@ -37,9 +38,36 @@ char *strcasestr (const char *haystack, const char *needle);
 
 #define SEAF_TMP_EXT "~"
 
+/* Default memory limit of the fs object cache, in MB. */
+#define DEFAULT_OBJ_CACHE_SIZE 128
+
+/*
+ * Parsed dir and file objects are cached in an LRU list, bounded by the
+ * estimated memory used by the objects. Fs objects are immutable, so a
+ * cached object never becomes stale. Objects are cached per repo, so that
+ * an object is only found in the repos it was read from.
+ */
+typedef struct FsCacheEntry {
+    char key[77];               /* repo id + object id */
+    int type;                   /* SEAF_METADATA_TYPE_DIR or _FILE */
+    void *obj;
+    gint64 size;
+    int ref_count;              /* protected by cache_lock */
+    GList link;                 /* node in the LRU list */
+} FsCacheEntry;
+
 struct _SeafFSManagerPriv {
     /* GHashTable      *seafile_cache; */
     GHashTable      *bl_cache;
+
+    pthread_mutex_t cache_lock;
+    GHashTable      *obj_cache;
+    GQueue          cache_lru;      /* most recently used first */
+    gint64          cache_size;
+    gint64          cache_max_size;
+    guint64         cache_hits;
+    guint64         cache_misses;
+    guint64         cache_evictions;
 };
 
 typedef struct SeafileOndisk {
@@ -60,6 +88,33 @@ typedef struct SeafdirOndisk {
     char    dirents[0];
 } __attribute__((__packed__)) SeafdirOndisk;
 
+/*
+ * Fs objects of version >= SEAF_BINARY_OBJ_VERSION are stored in a binary
+ * format. Integers are little-endian. Every object starts with a header:
+ *
+ *   magic "SFO2" | type u8 | version u8 | flags u8 | compression u8 | count u32
+ *
+ * A file object is followed by the file size (u64) and count raw block ids.
+ * A dir object is followed by count BinaryDirent records and a string table,
+ * which holds the name and then the modifier of each dirent. The object id
+ * is the sha1 of the whole object.
+ *
+ * Objects are not compressed, the compression byte is reserved.
+ */
+#define BINARY_OBJ_MAGIC "SFO2"
+#define BINARY_OBJ_HDR_SIZE 12
+#define BINARY_FLAG_SORTED 1
+
+typedef struct BinaryDirent {
+    guint8  id[20];
+    guint32 mode;
+    gint64  mtime;
+    gint64  size;
+    guint32 name_off;
+    guint16 name_len;
+    guint16 modifier_len;
+} __attribute__((__packed__)) BinaryDirent;
+
 #ifndef SEAFILE_SERVER
 uint32_t
 calculate_chunk_size (uint64_t total_size);
@@ -70,6 +125,160 @@ write_seafile (SeafFSManager *fs_mgr,
                unsigned char *obj_sha1);
 #endif  /* SEAFILE_SERVER */
 
+static void
+obj_cache_init (SeafFSManager *mgr, GKeyFile *config)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    GError *error = NULL;
+    int max_size;
+
+    max_size = g_key_file_get_integer (config, "fs_cache", "memory_limit", &error);
+    if (error) {
+        max_size = DEFAULT_OBJ_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+    if (max_size < 0)
+        max_size = 0;
+
+    priv->cache_max_size = (gint64)max_size << 20;
+    pthread_mutex_init (&priv->cache_lock, NULL);
+    priv->obj_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&priv->cache_lru);
+}
+
+static gint64
+estimate_dir_size (SeafDir *dir)
+{
+    /* The serialized object is kept along with the parsed entries. */
+    gint64 size = sizeof(SeafDir) + MAX (dir->ondisk_size, 0);
+    SeafDirent *dent;
+    GList *ptr;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        size += sizeof(GList) + sizeof(SeafDirent) + dent->name_len + 1;
+        if (dent->modifier)
+            size += strlen(dent->modifier) + 1;
+    }
+
+    return size;
+}
+
+static gint64
+estimate_seafile_size (Seafile *file)
+{
+    /* Including block offsets, which may be added later. */
+    return sizeof(Seafile) +
+        (gint64)file->n_blocks * (sizeof(char *) + 41 + sizeof(guint64));
+}
+
+static void
+cache_entry_unref (FsCacheEntry *entry)
+{
+    /* Called with cache_lock held. */
+    if (--entry->ref_count > 0)
+        return;
+
+    if (entry->type == SEAF_METADATA_TYPE_DIR)
+        seaf_dir_free (entry->obj);
+    else
+        seafile_unref (entry->obj);
+    g_free (entry);
+}
+
+/* Returns a referenced entry, or NULL. */
+static FsCacheEntry *
+obj_cache_lookup (SeafFSManager *mgr, const char *repo_id, const char *obj_id)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    FsCacheEntry *entry;
+    char key[77];
+
+    if (priv->cache_max_size == 0)
+        return NULL;
+
+    snprintf (key, sizeof(key), "%.36s%.40s", repo_id, obj_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->obj_cache, key);
+    if (entry) {
+        g_queue_unlink (&priv->cache_lru, &entry->link);
+        g_queue_push_head_link (&priv->cache_lru, &entry->link);
+        ++entry->ref_count;
+        ++priv->cache_hits;
+    } else {
+        ++priv->cache_misses;
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return entry;
+}
+
+static void
+obj_cache_release (SeafFSManager *mgr, FsCacheEntry *entry)
+{
+    pthread_mutex_lock (&mgr->priv->cache_lock);
+    cache_entry_unref (entry);
+    pthread_mutex_unlock (&mgr->priv->cache_lock);
+}
+
+/* Add @obj to the cache. The cache takes ownership of @obj. */
+static void
+obj_cache_add (SeafFSManager *mgr, const char *repo_id, const char *obj_id,
+               int type, void *obj, gint64 size)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    FsCacheEntry *entry, *old;
+    GList *tail;
+
+    entry = g_new0 (FsCacheEntry, 1);
+    snprintf (entry->key, sizeof(entry->key), "%.36s%.40s", repo_id, obj_id);
+    entry->type = type;
+    entry->obj = obj;
+    entry->size = size;
+    entry->ref_count = 1;
+    entry->link.data = entry;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    /* Don't let a single huge object flush the whole cache. */
+    if (size > priv->cache_max_size / 4 ||
+        g_hash_table_lookup (priv->obj_cache, entry->key) != NULL) {
+        cache_entry_unref (entry);
+        goto out;
+    }
+
+    g_hash_table_insert (priv->obj_cache, entry->key, entry);
+    g_queue_push_head_link (&priv->cache_lru, &entry->link);
+    priv->cache_size += size;
+
+    while (priv->cache_size > priv->cache_max_size) {
+        tail = g_queue_pop_tail_link (&priv->cache_lru);
+        old = tail->data;
+        g_hash_table_remove (priv->obj_cache, old->key);
+        priv->cache_size -= old->size;
+        ++priv->cache_evictions;
+        cache_entry_unref (old);
+    }
+
+out:
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, FsCacheStats *stats)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    stats->hits = priv->cache_hits;
+    stats->misses = priv->cache_misses;
+    stats->evictions = priv->cache_evictions;
+    stats->n_cached = g_queue_get_length (&priv->cache_lru);
+    stats->size = priv->cache_size;
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
 SeafFSManager *
 seaf_fs_manager_new (SeafileSession *seaf,
                      const char *seaf_dir)
@@ -86,6 +295,8 @@ seaf_fs_manager_new (SeafileSession *seaf,
 
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
 
+    obj_cache_init (mgr, seaf->config);
+
     return mgr;
 }
 
@@ -356,6 +567,84 @@ create_seafile_v0 (CDCFileDescriptor *cdc, int *ondisk_size, char *seafile_id)
     return ondisk;
 }
 
+static gboolean
+is_binary_fs_object (const uint8_t *data, int len)
+{
+    return (len >= BINARY_OBJ_HDR_SIZE &&
+            memcmp (data, BINARY_OBJ_MAGIC, 4) == 0);
+}
+
+static void
+put_binary_hdr (guint8 *buf, int type, int version, int flags, guint32 count)
+{
+    memcpy (buf, BINARY_OBJ_MAGIC, 4);
+    buf[4] = (guint8)type;
+    buf[5] = (guint8)version;
+    buf[6] = (guint8)flags;
+    buf[7] = 0;
+    count = GUINT32_TO_LE (count);
+    memcpy (buf + 8, &count, 4);
+}
+
+static int
+parse_binary_hdr (const char *obj_id, const uint8_t *data, int len,
+                  int type, int *version, int *flags, guint32 *count)
+{
+    guint32 n;
+
+    if (!is_binary_fs_object (data, len)) {
+        seaf_warning ("Object %s is not a binary fs object.\n", obj_id);
+        return -1;
+    }
+    if (data[4] != type) {
+        seaf_debug ("Object %s has type %d, expected %d.\n",
+                    obj_id, data[4], type);
+        return -1;
+    }
+    if (data[5] < 1) {
+        seaf_debug ("Fs object %s version should be > 0, version is %d.\n",
+                    obj_id, data[5]);
+        return -1;
+    }
+    if (data[7] != 0) {
+        seaf_warning ("Unsupported compression %d for fs object %s.\n",
+                      data[7], obj_id);
+        return -1;
+    }
+
+    memcpy (&n, data + 8, 4);
+    *version = data[5];
+    *flags = data[6];
+    *count = GUINT32_FROM_LE (n);
+    return 0;
+}
+
+static void *
+create_seafile_binary (int repo_version,
+                       CDCFileDescriptor *cdc,
+                       int *ondisk_size,
+                       char *seafile_id)
+{
+    guint8 *buf;
+    guint64 file_size;
+
+    *ondisk_size = BINARY_OBJ_HDR_SIZE + 8 + cdc->block_nr * 20;
+    buf = g_new0 (guint8, *ondisk_size);
+
+    put_binary_hdr (buf, SEAF_METADATA_TYPE_FILE,
+                    seafile_version_from_repo_version(repo_version),
+                    0, cdc->block_nr);
+    file_size = GUINT64_TO_LE ((guint64)cdc->file_size);
+    memcpy (buf + BINARY_OBJ_HDR_SIZE, &file_size, 8);
+    memcpy (buf + BINARY_OBJ_HDR_SIZE + 8, cdc->blk_sha1s, cdc->block_nr * 20);
+
+    unsigned char sha1[20];
+    calculate_sha1 (sha1, (const char *)buf, *ondisk_size);
+    rawdata_to_hex (sha1, seafile_id, 20);
+
+    return buf;
+}
+
 static void *
 create_seafile_json (int repo_version,
                      CDCFileDescriptor *cdc,
@@ -402,6 +691,14 @@ seaf_fs_manager_calculate_seafile_id_json (int repo_version,
 {
     json_t *object, *block_id_array;
 
+    if (seafile_version_from_repo_version(repo_version) >= SEAF_BINARY_OBJ_VERSION) {
+        char seafile_id[41];
+        int len;
+        g_free (create_seafile_binary (repo_version, cdc, &len, seafile_id));
+        hex_to_rawdata (seafile_id, file_id_sha1, 20);
+        return;
+    }
+
     object = json_object ();
 
     json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
@@ -443,7 +740,20 @@ write_seafile (SeafFSManager *fs_mgr,
     void *ondisk;
     int ondisk_size;
 
-    if (version > 0) {
+    if (seafile_version_from_repo_version(version) >= SEAF_BINARY_OBJ_VERSION) {
+        ondisk = create_seafile_binary (version, cdc, &ondisk_size, seafile_id);
+
+        if (seaf_obj_store_obj_exists (fs_mgr->obj_store, repo_id, version, seafile_id)) {
+            ret = 0;
+            g_free (ondisk);
+            goto out;
+        }
+
+        if (seaf_obj_store_write_obj (fs_mgr->obj_store, repo_id, version, seafile_id,
+                                      ondisk, ondisk_size, FALSE) < 0)
+            ret = -1;
+        g_free (ondisk);
+    } else if (version > 0) {
         ondisk = create_seafile_json (version, cdc, &ondisk_size, seafile_id);
 
         guint8 *compressed;
@@ -1087,7 +1397,8 @@ out:
 void
 seafile_ref (Seafile *seafile)
 {
-    ++seafile->ref_count;
+    /* Seafile objects in the cache are shared between threads. */
+    g_atomic_int_inc (&seafile->ref_count);
 }
 
 static void
@@ -1100,6 +1411,7 @@ seafile_free (Seafile *seafile)
             g_free (seafile->blk_sha1s[i]);
         g_free (seafile->blk_sha1s);
     }
+    g_free (seafile->blk_offsets);
 
     g_free (seafile);
 }
@@ -1110,7 +1422,7 @@ seafile_unref (Seafile *seafile)
     if (!seafile)
         return;
 
-    if (--seafile->ref_count <= 0)
+    if (g_atomic_int_dec_and_test (&seafile->ref_count))
         seafile_free (seafile);
 }
 
@@ -1249,10 +1561,55 @@ seafile_from_json (const char *id, void *data, int len)
     return seafile;
 }
 
+static Seafile *
+seafile_from_binary (const char *id, const uint8_t *data, int len)
+{
+    int version, flags;
+    guint32 count;
+    guint64 file_size;
+    Seafile *seafile;
+    const uint8_t *ptr;
+    int i;
+
+    if (parse_binary_hdr (id, data, len, SEAF_METADATA_TYPE_FILE,
+                          &version, &flags, &count) < 0)
+        return NULL;
+
+    if ((gint64)len != BINARY_OBJ_HDR_SIZE + 8 + (gint64)count * 20) {
+        seaf_warning ("[fs mgr] Corrupt seafile object %s.\n", id);
+        return NULL;
+    }
+
+    memcpy (&file_size, data + BINARY_OBJ_HDR_SIZE, 8);
+
+    seafile = g_new0 (Seafile, 1);
+
+    seafile->object.type = SEAF_METADATA_TYPE_FILE;
+
+    memcpy (seafile->file_id, id, 40);
+    seafile->version = version;
+    seafile->file_size = GUINT64_FROM_LE (file_size);
+    seafile->n_blocks = count;
+    seafile->blk_sha1s = g_new0 (char *, seafile->n_blocks);
+
+    ptr = data + BINARY_OBJ_HDR_SIZE + 8;
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        seafile->blk_sha1s[i] = g_new0 (char, 41);
+        rawdata_to_hex (ptr, seafile->blk_sha1s[i], 20);
+        ptr += 20;
+    }
+
+    seafile->ref_count = 1;
+
+    return seafile;
+}
+
 static Seafile *
 seafile_from_data (const char *id, void *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_binary_fs_object (data, len))
+        return seafile_from_binary (id, data, len);
+    else if (is_json)
         return seafile_from_json (id, data, len);
     else
         return seafile_from_v0_data (id, data, len);
@@ -1267,14 +1624,7 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     void *data;
     int len;
     Seafile *seafile;
-
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
-#endif
+    FsCacheEntry *entry;
 
     if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
         seafile = g_new0 (Seafile, 1);
@@ -1283,6 +1633,14 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
         return seafile;
     }
 
+    entry = obj_cache_lookup (mgr, repo_id, file_id);
+    if (entry) {
+        seafile = entry->obj;
+        seafile_ref (seafile);
+        obj_cache_release (mgr, entry);
+        return seafile;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  file_id, &data, &len) < 0) {
         seaf_warning ("[fs mgr] Failed to read file %s.\n", file_id);
@@ -1292,13 +1650,14 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     seafile = seafile_from_data (file_id, data, len, (version > 0));
     g_free (data);
 
-#if 0
     /*
      * Add to cache. Also increase ref count.
      */
-    seafile_ref (seafile);
-    g_hash_table_insert (mgr->priv->seafile_cache, g_strdup(file_id), seafile);
-#endif
+    if (seafile && mgr->priv->cache_max_size > 0) {
+        seafile_ref (seafile);
+        obj_cache_add (mgr, repo_id, file_id, SEAF_METADATA_TYPE_FILE,
+                       seafile, estimate_seafile_size (seafile));
+    }
 
     return seafile;
 }
@@ -1354,10 +1713,39 @@ seafile_to_json (Seafile *file, int *len)
     return (guint8 *)data;
 }
 
+static guint8 *
+seafile_to_binary (Seafile *file, int *len)
+{
+    guint8 *buf, *ptr;
+    guint64 file_size;
+    int i;
+
+    *len = BINARY_OBJ_HDR_SIZE + 8 + file->n_blocks * 20;
+    buf = g_new0 (guint8, *len);
+
+    put_binary_hdr (buf, SEAF_METADATA_TYPE_FILE, file->version, 0, file->n_blocks);
+    file_size = GUINT64_TO_LE (file->file_size);
+    memcpy (buf + BINARY_OBJ_HDR_SIZE, &file_size, 8);
+
+    ptr = buf + BINARY_OBJ_HDR_SIZE + 8;
+    for (i = 0; i < file->n_blocks; ++i) {
+        hex_to_rawdata (file->blk_sha1s[i], ptr, 20);
+        ptr += 20;
+    }
+
+    unsigned char sha1[20];
+    calculate_sha1 (sha1, (const char *)buf, *len);
+    rawdata_to_hex (sha1, file->file_id, 20);
+
+    return buf;
+}
+
 static guint8 *
 seafile_to_data (Seafile *file, int *len)
 {
-    if (file->version > 0) {
+    if (file->version >= SEAF_BINARY_OBJ_VERSION)
+        return seafile_to_binary (file, len);
+    else if (file->version > 0) {
         guint8 *data;
         int orig_len;
         guint8 *compressed;
@@ -1402,6 +1790,44 @@ seafile_save (SeafFSManager *fs_mgr,
     return ret;
 }
 
+int
+seaf_fs_manager_convert_seafile_to_binary (SeafFSManager *mgr,
+                                           const char *repo_id,
+                                           int version,
+                                           const char *file_id,
+                                           char *new_id)
+{
+    Seafile *file, tmp;
+    guint8 *data;
+    int len;
+    int ret = 0;
+
+    if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
+        memcpy (new_id, EMPTY_SHA1, 41);
+        return 0;
+    }
+
+    file = seaf_fs_manager_get_seafile (mgr, repo_id, version, file_id);
+    if (!file)
+        return -1;
+
+    /* The file may be shared with the object cache, convert a copy. */
+    tmp = *file;
+    tmp.version = SEAF_BINARY_OBJ_VERSION;
+    data = seafile_to_binary (&tmp, &len);
+    memcpy (new_id, tmp.file_id, 41);
+    seafile_unref (file);
+
+    if (!seaf_obj_store_obj_exists (mgr->obj_store, repo_id,
+                                    SEAF_BINARY_OBJ_VERSION, new_id) &&
+        seaf_obj_store_write_obj (mgr->obj_store, repo_id, SEAF_BINARY_OBJ_VERSION,
+                                  new_id, data, len, FALSE) < 0)
+        ret = -1;
+
+    g_free (data);
+    return ret;
+}
+
 static void compute_dir_id_v0 (SeafDir *dir, GList *entries)
 {
     SHA_CTX ctx;
@@ -1527,6 +1953,30 @@ seaf_dirent_dup (SeafDirent *dent)
     return new_dent;
 }
 
+SeafDir *
+seaf_dir_dup (SeafDir *dir)
+{
+    SeafDir *new_dir;
+    GList *ptr;
+
+    new_dir = g_new0 (SeafDir, 1);
+    new_dir->object.type = dir->object.type;
+    new_dir->version = dir->version;
+    memcpy (new_dir->dir_id, dir->dir_id, 41);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        new_dir->entries = g_list_prepend (new_dir->entries,
+                                           seaf_dirent_dup (ptr->data));
+    new_dir->entries = g_list_reverse (new_dir->entries);
+
+    if (dir->ondisk) {
+        new_dir->ondisk = g_memdup (dir->ondisk, dir->ondisk_size);
+        new_dir->ondisk_size = dir->ondisk_size;
+    }
+
+    return new_dir;
+}
+
 static SeafDir *
 seaf_dir_from_v0_data (const char *dir_id, const uint8_t *data, int len)
 {
@@ -1724,11 +2174,74 @@ seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
     return dir;
 }
 
+static SeafDir *
+seaf_dir_from_binary (const char *dir_id, const uint8_t *data, int len)
+{
+    int version, flags;
+    guint32 count;
+    const BinaryDirent *rec;
+    const char *strs;
+    gint64 str_len;
+    guint32 name_off, name_len, modifier_len;
+    SeafDirent *dirent;
+    SeafDir *dir;
+    guint32 i;
+
+    if (parse_binary_hdr (dir_id, data, len, SEAF_METADATA_TYPE_DIR,
+                          &version, &flags, &count) < 0)
+        return NULL;
+
+    str_len = (gint64)len - BINARY_OBJ_HDR_SIZE - (gint64)count * sizeof(BinaryDirent);
+    if (str_len < 0) {
+        seaf_warning ("[fs mgr] Corrupt seafdir object %s.\n", dir_id);
+        return NULL;
+    }
+    rec = (const BinaryDirent *)(data + BINARY_OBJ_HDR_SIZE);
+    strs = (const char *)(rec + count);
+
+    dir = g_new0 (SeafDir, 1);
+
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->version = version;
+
+    for (i = 0; i < count; ++i, ++rec) {
+        name_off = GUINT32_FROM_LE (rec->name_off);
+        name_len = GUINT16_FROM_LE (rec->name_len);
+        modifier_len = GUINT16_FROM_LE (rec->modifier_len);
+        if ((gint64)name_off + name_len + modifier_len > str_len) {
+            seaf_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            seaf_dir_free (dir);
+            return NULL;
+        }
+
+        dirent = g_new0 (SeafDirent, 1);
+        dirent->version = version;
+        dirent->mode = GUINT32_FROM_LE (rec->mode);
+        rawdata_to_hex (rec->id, dirent->id, 20);
+        dirent->name_len = name_len;
+        dirent->name = g_strndup (strs + name_off, name_len);
+        dirent->mtime = GINT64_FROM_LE (rec->mtime);
+        if (S_ISREG(dirent->mode)) {
+            dirent->modifier = g_strndup (strs + name_off + name_len, modifier_len);
+            dirent->size = GINT64_FROM_LE (rec->size);
+        }
+
+        dir->entries = g_list_prepend (dir->entries, dirent);
+    }
+    dir->entries = g_list_reverse (dir->entries);
+
+    return dir;
+}
+
 SeafDir *
 seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
                     gboolean is_json)
 {
-    if (is_json)
+    if (is_binary_fs_object (data, len))
+        return seaf_dir_from_binary (dir_id, data, len);
+    else if (is_json)
         return seaf_dir_from_json (dir_id, data, len);
     else
         return seaf_dir_from_v0_data (dir_id, data, len);
@@ -1825,10 +2338,81 @@ seaf_dir_to_json (SeafDir *dir, int *len)
     return data;
 }
 
+static void *
+seaf_dir_to_binary (SeafDir *dir, int *len)
+{
+    GList *ptr;
+    SeafDirent *dirent, *prev = NULL;
+    guint32 count = 0;
+    int str_len = 0;
+    int flags = BINARY_FLAG_SORTED;
+    int modifier_len;
+    guint8 *buf;
+    BinaryDirent *rec;
+    char *strs;
+    guint32 str_off = 0;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dirent = ptr->data;
+        modifier_len = 0;
+        if (S_ISREG(dirent->mode) && dirent->modifier)
+            modifier_len = strlen(dirent->modifier);
+        if (dirent->name_len > G_MAXUINT16 || modifier_len > G_MAXUINT16) {
+            seaf_warning ("Dirent name or modifier too long in dir %s.\n",
+                          dir->dir_id);
+            return NULL;
+        }
+        str_len += dirent->name_len + modifier_len;
+        /* Dirents are sorted by name in descending order. */
+        if (prev && strcmp (prev->name, dirent->name) < 0)
+            flags = 0;
+        prev = dirent;
+        ++count;
+    }
+
+    *len = BINARY_OBJ_HDR_SIZE + count * sizeof(BinaryDirent) + str_len;
+    buf = g_new0 (guint8, *len);
+    put_binary_hdr (buf, SEAF_METADATA_TYPE_DIR, dir->version, flags, count);
+
+    rec = (BinaryDirent *)(buf + BINARY_OBJ_HDR_SIZE);
+    strs = (char *)(rec + count);
+    for (ptr = dir->entries; ptr; ptr = ptr->next, ++rec) {
+        dirent = ptr->data;
+        modifier_len = 0;
+        if (S_ISREG(dirent->mode) && dirent->modifier)
+            modifier_len = strlen(dirent->modifier);
+
+        hex_to_rawdata (dirent->id, rec->id, 20);
+        rec->mode = GUINT32_TO_LE (dirent->mode);
+        rec->mtime = GINT64_TO_LE (dirent->mtime);
+        if (S_ISREG(dirent->mode))
+            rec->size = GINT64_TO_LE (dirent->size);
+        rec->name_off = GUINT32_TO_LE (str_off);
+        rec->name_len = GUINT16_TO_LE ((guint16)dirent->name_len);
+        rec->modifier_len = GUINT16_TO_LE ((guint16)modifier_len);
+
+        memcpy (strs + str_off, dirent->name, dirent->name_len);
+        str_off += dirent->name_len;
+        if (modifier_len > 0) {
+            memcpy (strs + str_off, dirent->modifier, modifier_len);
+            str_off += modifier_len;
+        }
+    }
+
+    /* The dir object id is sha1 hash of the binary object. */
+    unsigned char sha1[20];
+    calculate_sha1 (sha1, (const char *)buf, *len);
+    rawdata_to_hex (sha1, dir->dir_id, 20);
+
+    return buf;
+}
+
 void *
 seaf_dir_to_data (SeafDir *dir, int *len)
 {
-    if (dir->version > 0) {
+    if (dir->version >= SEAF_BINARY_OBJ_VERSION)
+        return seaf_dir_to_binary (dir, len);
+    else if (dir->version > 0) {
         guint8 *data;
         int orig_len;
         guint8 *compressed;
@@ -1871,6 +2455,79 @@ seaf_dir_save (SeafFSManager *fs_mgr,
     return ret;
 }
 
+int
+seaf_fs_manager_find_block (SeafFSManager *mgr,
+                            const char *repo_id,
+                            int version,
+                            Seafile *file,
+                            guint64 offset,
+                            guint64 *blk_start)
+{
+    guint64 *offsets;
+    BlockMetadata *bmd;
+    int known, old;
+    int lo, hi, mid;
+
+    if (offset >= file->file_size)
+        return -1;
+
+    /* The file may be shared between threads through the object cache.
+     * Threads that look up the same block sizes set the same offsets.
+     */
+    offsets = g_atomic_pointer_get (&file->blk_offsets);
+    if (!offsets) {
+        offsets = g_new0 (guint64, file->n_blocks + 1);
+        if (!g_atomic_pointer_compare_and_exchange (&file->blk_offsets,
+                                                    NULL, offsets)) {
+            g_free (offsets);
+            offsets = g_atomic_pointer_get (&file->blk_offsets);
+        }
+    }
+
+    known = g_atomic_int_get (&file->blk_offsets_known);
+    old = known;
+    while (known < file->n_blocks && offsets[known] <= offset) {
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr, repo_id, version,
+                                             file->blk_sha1s[known]);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s:%s.\n",
+                          repo_id, file->blk_sha1s[known]);
+            return -1;
+        }
+        offsets[known + 1] = offsets[known] + bmd->size;
+        g_free (bmd);
+        ++known;
+    }
+
+    if (known > old) {
+        while (old < known &&
+               !g_atomic_int_compare_and_exchange (&file->blk_offsets_known,
+                                                   old, known))
+            old = g_atomic_int_get (&file->blk_offsets_known);
+    }
+
+    if (offsets[known] <= offset) {
+        seaf_warning ("File %s is shorter than its size.\n", file->file_id);
+        return -1;
+    }
+
+    /* Find the last block starting at or before @offset. Empty blocks
+     * are skipped, since the next block starts at the same offset.
+     */
+    lo = 0;
+    hi = known;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    *blk_start = offsets[lo];
+    return lo;
+}
+
 SeafDir *
 seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
                              const char *repo_id,
@@ -1880,8 +2537,7 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     void *data;
     int len;
     SeafDir *dir;
-
-    /* TODO: add hash cache */
+    FsCacheEntry *entry;
 
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
@@ -1890,6 +2546,16 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
         return dir;
     }
 
+    /* Callers may modify the returned dir, so they get a copy of the
+     * cached one. Copying is still much cheaper than parsing.
+     */
+    entry = obj_cache_lookup (mgr, repo_id, dir_id);
+    if (entry) {
+        dir = seaf_dir_dup (entry->obj);
+        obj_cache_release (mgr, entry);
+        return dir;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  dir_id, &data, &len) < 0) {
         seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
@@ -1899,6 +2565,10 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
     g_free (data);
 
+    if (dir && mgr->priv->cache_max_size > 0)
+        obj_cache_add (mgr, repo_id, dir_id, SEAF_METADATA_TYPE_DIR,
+                       seaf_dir_dup (dir), estimate_dir_size (dir));
+
     return dir;
 }
 
@@ -2023,7 +2693,9 @@ int
 seaf_metadata_type_from_data (const char *obj_id,
                               uint8_t *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_binary_fs_object (data, len))
+        return data[4];
+    else if (is_json)
         return parse_metadata_type_json (obj_id, data, len);
     else
         return parse_metadata_type_v0 (data, len);
@@ -2091,7 +2763,14 @@ seaf_fs_object_from_data (const char *obj_id,
                           uint8_t *data, int len,
                           gboolean is_json)
 {
-    if (is_json)
+    if (is_binary_fs_object (data, len)) {
+        if (data[4] == SEAF_METADATA_TYPE_FILE)
+            return (SeafFSObject *)seafile_from_binary (obj_id, data, len);
+        else if (data[4] == SEAF_METADATA_TYPE_DIR)
+            return (SeafFSObject *)seaf_dir_from_binary (obj_id, data, len);
+        seaf_warning ("Invalid fs type %d.\n", data[4]);
+        return NULL;
+    } else if (is_json)
         return fs_object_from_json (obj_id, data, len);
     else
         return fs_object_from_v0_data (obj_id, data, len);
@@ -2885,11 +3564,25 @@ verify_fs_object_json (const char *obj_id, uint8_t *data, int len)
     return (strcmp(hex, obj_id) == 0);
 }
 
+static gboolean
+verify_fs_object_binary (const char *obj_id, uint8_t *data, int len)
+{
+    unsigned char sha1[20];
+    char hex[41];
+
+    calculate_sha1 (sha1, (const char *)data, len);
+    rawdata_to_hex (sha1, hex, 20);
+
+    return (strcmp(hex, obj_id) == 0);
+}
+
 static gboolean
 verify_seafdir (const char *dir_id, uint8_t *data, int len,
                 gboolean verify_id, gboolean is_json)
 {
-    if (is_json)
+    if (is_binary_fs_object (data, len))
+        return verify_fs_object_binary (dir_id, data, len);
+    else if (is_json)
         return verify_fs_object_json (dir_id, data, len);
     else
         return verify_seafdir_v0 (dir_id, data, len, verify_id);
@@ -2966,7 +3659,9 @@ static gboolean
 verify_seafile (const char *id, void *data, int len,
                 gboolean verify_id, gboolean is_json)
 {
-    if (is_json)
+    if (is_binary_fs_object (data, len))
+        return verify_fs_object_binary (id, data, len);
+    else if (is_json)
         return verify_fs_object_json (id, data, len);
     else
         return verify_seafile_v0 (id, data, len, verify_id);
@@ -3047,7 +3742,9 @@ seaf_fs_manager_verify_object (SeafFSManager *mgr,
         return FALSE;
     }
 
-    if (version == 0)
+    if (is_binary_fs_object (data, len))
+        ret = verify_fs_object_binary (obj_id, data, len);
+    else if (version == 0)
         ret = verify_fs_object_v0 (obj_id, data, len, verify_id);
     else
         ret = verify_fs_object_json (obj_id, data, len);
@@ -3061,6 +3758,8 @@ dir_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= SEAF_BINARY_OBJ_VERSION)
+        return SEAF_BINARY_OBJ_VERSION;
     else
         return CURRENT_DIR_OBJ_VERSION;
 }
@@ -3070,6 +3769,8 @@ seafile_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= SEAF_BINARY_OBJ_VERSION)
+        return SEAF_BINARY_OBJ_VERSION;
     else
         return CURRENT_SEAFILE_OBJ_VERSION;
 }
@@ -15,6 +15,9 @@
 #define CURRENT_DIR_OBJ_VERSION 1
 #define CURRENT_SEAFILE_OBJ_VERSION 1
 
+/* Repos of this version or higher store fs objects in a binary format. */
+#define SEAF_BINARY_OBJ_VERSION 2
+
 typedef struct _SeafFSManager SeafFSManager;
 typedef struct _SeafFSObject SeafFSObject;
 typedef struct _Seafile Seafile;
@@ -40,6 +43,11 @@ struct _Seafile {
     guint64     file_size;
     guint32     n_blocks;
     char        **blk_sha1s;
+    /* Set by seaf_fs_manager_find_block(). Only the first
+     * blk_offsets_known + 1 offsets are set.
+     */
+    guint64     *blk_offsets;
+    gint        blk_offsets_known;
     int         ref_count;
 };
 
@@ -62,6 +70,16 @@ seafile_save (SeafFSManager *fs_mgr,
               int version,
               Seafile *file);
 
+/* Save a copy of a file object in the binary format, and return its id
+ * in @new_id.
+ */
+int
+seaf_fs_manager_convert_seafile_to_binary (SeafFSManager *mgr,
+                                           const char *repo_id,
+                                           int version,
+                                           const char *file_id,
+                                           char *new_id);
+
 #define SEAF_DIR_NAME_LEN 256
 
 struct _SeafDirent {
@@ -94,6 +112,9 @@ seaf_dir_new (const char *id, GList *entries, int version);
 void 
 seaf_dir_free (SeafDir *dir);
 
+SeafDir *
+seaf_dir_dup (SeafDir *dir);
+
 SeafDir *
 seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
                     gboolean is_json);
@@ -172,6 +193,20 @@ seaf_fs_manager_new (struct _SeafileSession *seaf,
 int
 seaf_fs_manager_init (SeafFSManager *mgr);
 
+/* Counters of the parsed fs object cache. @size is the estimated memory
+ * used by cached objects, in bytes.
+ */
+typedef struct FsCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint n_cached;
+    gint64 size;
+} FsCacheStats;
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, FsCacheStats *stats);
+
 #ifndef SEAFILE_SERVER
 
 int 
@@ -236,6 +271,20 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
                              int version,
                              const char *file_id);
 
+/* Returns the index of the block of @file containing @offset, and sets
+ * @blk_start to the offset of the block in the file. Sizes of the blocks
+ * up to that one are looked up the first time they are needed; they are
+ * kept with @file and shared through the fs object cache.
+ * Returns -1 if @offset is beyond the end of the file or on error.
+ */
+int
+seaf_fs_manager_find_block (SeafFSManager *mgr,
+                            const char *repo_id,
+                            int version,
+                            Seafile *file,
+                            guint64 offset,
+                            guint64 *blk_start);
+
 SeafDir *
 seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
                              const char *repo_id,
@@ -0,0 +1,313 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define MAX_METRICS 512
+
+/* Bucket i counts values below 2^i microseconds; the last one is +Inf. */
+#define N_BUCKETS 38
+/* Smaller buckets are merged into the first exposed one. */
+#define FIRST_EXPOSED_BUCKET 6
+#define HISTOGRAM_SUM (N_BUCKETS)
+#define HISTOGRAM_COUNT (N_BUCKETS + 1)
+#define HISTOGRAM_SLOTS (N_BUCKETS + 2)
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} MetricType;
+
+struct SeafMetric {
+    int index;
+    MetricType type;
+    char *name;
+    char *labels;
+    char *help;
+};
+
+typedef struct ThreadValues {
+    /* Allocated when a thread first records to a metric. */
+    gint64 *values[MAX_METRICS];
+} ThreadValues;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static SeafMetric *metrics[MAX_METRICS];
+static int n_metrics;
+
+static pthread_once_t values_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t values_key;
+static GList *threads;          /* ThreadValues of running threads */
+static ThreadValues retired;    /* sum of the values of exited threads */
+
+static int
+metric_slots (SeafMetric *metric)
+{
+    return metric->type == METRIC_HISTOGRAM ? HISTOGRAM_SLOTS : 1;
+}
+
+static SeafMetric *
+metric_new (MetricType type, const char *name, const char *labels, const char *help)
+{
+    SeafMetric *metric = NULL;
+    int i;
+
+    pthread_mutex_lock (&metrics_lock);
+
+    for (i = 0; i < n_metrics; ++i) {
+        if (strcmp (metrics[i]->name, name) == 0 &&
+            g_strcmp0 (metrics[i]->labels, labels) == 0) {
+            metric = metrics[i];
+            goto out;
+        }
+    }
+
+    if (n_metrics == MAX_METRICS) {
+        seaf_warning ("Too many metrics, %s is not recorded.\n", name);
+        goto out;
+    }
+
+    metric = g_new0 (SeafMetric, 1);
+    metric->index = n_metrics;
+    metric->type = type;
+    metric->name = g_strdup (name);
+    metric->labels = g_strdup (labels);
+    metric->help = g_strdup (help);
+    metrics[n_metrics++] = metric;
+
+out:
+    pthread_mutex_unlock (&metrics_lock);
+    return metric;
+}
+
+SeafMetric *
+seaf_metric_counter_new (const char *name, const char *labels, const char *help)
+{
+    return metric_new (METRIC_COUNTER, name, labels, help);
+}
+
+SeafMetric *
+seaf_metric_gauge_new (const char *name, const char *labels, const char *help)
+{
+    return metric_new (METRIC_GAUGE, name, labels, help);
+}
+
+SeafMetric *
+seaf_metric_histogram_new (const char *name, const char *labels, const char *help)
+{
+    return metric_new (METRIC_HISTOGRAM, name, labels, help);
+}
+
+static void
+add_values (ThreadValues *dst, ThreadValues *src)
+{
+    int i, j, n;
+
+    for (i = 0; i < n_metrics; ++i) {
+        if (!src->values[i])
+            continue;
+        n = metric_slots (metrics[i]);
+        if (!dst->values[i])
+            dst->values[i] = g_new0 (gint64, n);
+        for (j = 0; j < n; ++j)
+            dst->values[i][j] += src->values[i][j];
+    }
+}
+
+/* Keep the values of a thread when it exits. */
+static void
+thread_values_free (void *data)
+{
+    ThreadValues *tv = data;
+    int i;
+
+    pthread_mutex_lock (&metrics_lock);
+    add_values (&retired, tv);
+    threads = g_list_remove (threads, tv);
+    pthread_mutex_unlock (&metrics_lock);
+
+    for (i = 0; i < MAX_METRICS; ++i)
+        g_free (tv->values[i]);
+    g_free (tv);
+}
+
+static void
+create_values_key ()
+{
+    pthread_key_create (&values_key, thread_values_free);
+}
+
+static gint64 *
+get_thread_slots (SeafMetric *metric)
+{
+    ThreadValues *tv;
+    gint64 *slots;
+
+    pthread_once (&values_key_once, create_values_key);
+
+    tv = pthread_getspecific (values_key);
+    if (!tv) {
+        tv = g_new0 (ThreadValues, 1);
+        pthread_mutex_lock (&metrics_lock);
+        threads = g_list_prepend (threads, tv);
+        pthread_mutex_unlock (&metrics_lock);
+        pthread_setspecific (values_key, tv);
+    }
+
+    slots = tv->values[metric->index];
+    if (!slots) {
+        slots = g_new0 (gint64, metric_slots (metric));
+        /* Formatting reads the pointer from another thread. */
+        __atomic_store_n (&tv->values[metric->index], slots, __ATOMIC_RELEASE);
+    }
+
+    return slots;
+}
+
+/* Only the owner thread writes its slots, so relaxed atomics are enough
+ * to let the formatting thread read them.
+ */
+static inline void
+slot_add (gint64 *slot, gint64 n)
+{
+    __atomic_store_n (slot, __atomic_load_n (slot, __ATOMIC_RELAXED) + n,
+                      __ATOMIC_RELAXED);
+}
+
+void
+seaf_metric_add (SeafMetric *metric, gint64 n)
+{
+    if (!metric)
+        return;
+
+    slot_add (get_thread_slots (metric), n);
+}
+
+void
+seaf_metric_observe (SeafMetric *metric, gint64 usec)
+{
+    gint64 *slots;
+    int bucket;
+
+    if (!metric)
+        return;
+
+    if (usec <= 0)
+        bucket = 0;
+    else
+        bucket = MIN (64 - __builtin_clzll ((guint64)usec), N_BUCKETS - 1);
+
+    slots = get_thread_slots (metric);
+    slot_add (&slots[bucket], 1);
+    slot_add (&slots[HISTOGRAM_SUM], MAX (usec, 0));
+    slot_add (&slots[HISTOGRAM_COUNT], 1);
+}
+
+/* Called with metrics_lock held. */
+static void
+sum_metric (SeafMetric *metric, gint64 *sum)
+{
+    int n = metric_slots (metric);
+    ThreadValues *tv;
+    gint64 *slots;
+    GList *ptr;
+    int j;
+
+    memset (sum, 0, sizeof(gint64) * n);
+
+    if (retired.values[metric->index]) {
+        for (j = 0; j < n; ++j)
+            sum[j] += retired.values[metric->index][j];
+    }
+
+    for (ptr = threads; ptr; ptr = ptr->next) {
+        tv = ptr->data;
+        slots = __atomic_load_n (&tv->values[metric->index], __ATOMIC_ACQUIRE);
+        if (!slots)
+            continue;
+        for (j = 0; j < n; ++j)
+            sum[j] += __atomic_load_n (&slots[j], __ATOMIC_RELAXED);
+    }
+}
+
+static void
+format_series (GString *buf, const char *name, const char *suffix,
+               const char *labels, const char *le)
+{
+    g_string_append_printf (buf, "%s%s", name, suffix);
+    if (labels && le)
+        g_string_append_printf (buf, "{%s,le=\"%s\"}", labels, le);
+    else if (labels)
+        g_string_append_printf (buf, "{%s}", labels);
+    else if (le)
+        g_string_append_printf (buf, "{le=\"%s\"}", le);
+}
+
+static void
+format_metric (GString *buf, SeafMetric *metric, gint64 *sum)
+{
+    gint64 cumulative = 0;
+    char le[32];
+    int i;
+
+    if (metric->type != METRIC_HISTOGRAM) {
+        format_series (buf, metric->name, "", metric->labels, NULL);
+        g_string_append_printf (buf, " %"G_GINT64_FORMAT"\n", sum[0]);
+        return;
+    }
+
+    for (i = 0; i < N_BUCKETS - 1; ++i) {
+        cumulative += sum[i];
+        if (i < FIRST_EXPOSED_BUCKET)
+            continue;
+        snprintf (le, sizeof(le), "%g", (double)((guint64)1 << i) / 1000000);
+        format_series (buf, metric->name, "_bucket", metric->labels, le);
+        g_string_append_printf (buf, " %"G_GINT64_FORMAT"\n", cumulative);
+    }
+    format_series (buf, metric->name, "_bucket", metric->labels, "+Inf");
+    g_string_append_printf (buf, " %"G_GINT64_FORMAT"\n", sum[HISTOGRAM_COUNT]);
+
+    format_series (buf, metric->name, "_sum", metric->labels, NULL);
+    g_string_append_printf (buf, " %.6f\n", (double)sum[HISTOGRAM_SUM] / 1000000);
+    format_series (buf, metric->name, "_count", metric->labels, NULL);
+    g_string_append_printf (buf, " %"G_GINT64_FORMAT"\n", sum[HISTOGRAM_COUNT]);
+}
+
+static const char *type_names[] = { "counter", "gauge", "histogram" };
+
+void
+seaf_metrics_format (GString *buf)
+{
+    gboolean formatted[MAX_METRICS] = { 0 };
+    gint64 sum[HISTOGRAM_SLOTS];
+    SeafMetric *metric;
+    int i, j;
+
+    pthread_mutex_lock (&metrics_lock);
+
+    /* Series of the same name must be grouped under one TYPE line. */
+    for (i = 0; i < n_metrics; ++i) {
+        if (formatted[i])
+            continue;
+        metric = metrics[i];
+        if (metric->help)
+            g_string_append_printf (buf, "# HELP %s %s\n", metric->name, metric->help);
+        g_string_append_printf (buf, "# TYPE %s %s\n",
+                                metric->name, type_names[metric->type]);
+
+        for (j = i; j < n_metrics; ++j) {
+            if (formatted[j] || strcmp (metrics[j]->name, metric->name) != 0)
+                continue;
+            sum_metric (metrics[j], sum);
+            format_metric (buf, metrics[j], sum);
+            formatted[j] = TRUE;
+        }
+    }
+
+    pthread_mutex_unlock (&metrics_lock);
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_METRICS_H
+#define SEAF_METRICS_H
+
+#include <glib.h>
+
+/*
+ * Process-wide counters, gauges and latency histograms, exposed in the
+ * Prometheus text format.
+ *
+ * Every thread updates its own copy of the values, so recording never
+ * takes a lock. The copies are summed when the metrics are formatted.
+ * Values of exited threads are kept.
+ *
+ * Histograms have one bucket per power of two microseconds.
+ *
+ * Metrics are registered once at startup. @labels is the Prometheus
+ * label list without braces (e.g. "route=\"get_block\""), or NULL.
+ * Registering the same name and labels again returns the same metric.
+ * The functions return NULL when too many metrics are registered.
+ * Recording to a NULL metric does nothing.
+ */
+
+typedef struct SeafMetric SeafMetric;
+
+SeafMetric *
+seaf_metric_counter_new (const char *name, const char *labels, const char *help);
+
+SeafMetric *
+seaf_metric_gauge_new (const char *name, const char *labels, const char *help);
+
+/* Observed values are in microseconds, and are exposed in seconds. */
+SeafMetric *
+seaf_metric_histogram_new (const char *name, const char *labels, const char *help);
+
+/* Add @n to a counter or a gauge. */
+void
+seaf_metric_add (SeafMetric *metric, gint64 n);
+
+void
+seaf_metric_observe (SeafMetric *metric, gint64 usec);
+
+/* Append all metrics to @buf in the Prometheus text format. */
+void
+seaf_metrics_format (GString *buf);
+
+#endif
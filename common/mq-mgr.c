@@ -3,9 +3,15 @@
 #include "utils.h"
 #include "mq-mgr.h"
 
+typedef struct MqListener {
+    SeafMqListener func;
+    void *data;
+} MqListener;
+
 typedef struct SeafMqManagerPriv {
     // chan <-> async_queue
     GHashTable *chans;
+    GList *listeners;
 } SeafMqManagerPriv;
 
 SeafMqManager *
@@ -20,6 +26,16 @@ seaf_mq_manager_new ()
     return mgr;
 }
 
+void
+seaf_mq_manager_add_listener (SeafMqManager *mgr, SeafMqListener listener, void *data)
+{
+    MqListener *l = g_new0 (MqListener, 1);
+
+    l->func = listener;
+    l->data = data;
+    mgr->priv->listeners = g_list_append (mgr->priv->listeners, l);
+}
+
 static GAsyncQueue *
 seaf_mq_manager_channel_new (SeafMqManager *mgr, const char *channel)
 {
@@ -31,6 +47,18 @@ seaf_mq_manager_channel_new (SeafMqManager *mgr, const char *channel)
     return async_queue;
 }
 
+void
+seaf_mq_manager_notify_listeners (SeafMqManager *mgr, const char *channel, const char *content)
+{
+    GList *ptr;
+    MqListener *l;
+
+    for (ptr = mgr->priv->listeners; ptr; ptr = ptr->next) {
+        l = ptr->data;
+        l->func (channel, content, l->data);
+    }
+}
+
 int
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *channel, const char *content)
 {
@@ -41,6 +69,8 @@ seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *channel, const ch
         return -1;
     }
 
+    seaf_mq_manager_notify_listeners (mgr, channel, content);
+
     GAsyncQueue *async_queue = g_hash_table_lookup (mgr->priv->chans, channel);
     if (!async_queue) {
         async_queue = seaf_mq_manager_channel_new(mgr, channel);
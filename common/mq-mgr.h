@@ -15,6 +15,18 @@ typedef struct SeafMqManager {
 SeafMqManager *
 seaf_mq_manager_new ();
 
+typedef void (*SeafMqListener) (const char *channel, const char *content, void *data);
+
+/* Listeners are called in the publishing thread for every event, before
+ * it's queued. They must be added before events are published.
+ */
+void
+seaf_mq_manager_add_listener (SeafMqManager *mgr, SeafMqListener listener, void *data);
+
+/* Only call the listeners, the event is not queued for other consumers. */
+void
+seaf_mq_manager_notify_listeners (SeafMqManager *mgr, const char *channel, const char *content);
+
 int
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *channel, const char *content);
 
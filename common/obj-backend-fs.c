@@ -2,6 +2,11 @@
 #define _WIN32_WINNT 0x500
 #endif
 
+#ifdef __linux__
+/* For syncfs(). */
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 #include "utils.h"
 #include "obj-backend.h"
@@ -494,6 +499,127 @@ obj_backend_fs_remove_store (ObjBackend *bend, const char *store_id)
     return 0;
 }
 
+static int
+sync_path (const char *path)
+{
+    int fd;
+    int ret;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    ret = fsync_obj_contents (fd);
+    close (fd);
+
+    return ret;
+}
+
+static int
+datasync_path (const char *path)
+{
+#ifdef __linux__
+    int fd;
+    int ret = 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    if (fdatasync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("Failed to fdatasync %s: %s.\n", path, strerror(errno));
+        ret = -1;
+    }
+    close (fd);
+
+    return ret;
+#else
+    return sync_path (path);
+#endif
+}
+
+/* Sets of at least this many objects are synced with one syncfs(). */
+#define SYNCFS_MIN_OBJS 1024
+
+#ifdef __linux__
+static int
+syncfs_path (const char *path)
+{
+    int fd;
+    int ret = 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    if (syncfs (fd) < 0) {
+        seaf_warning ("Failed to syncfs %s: %s.\n", path, strerror(errno));
+        ret = -1;
+    }
+    close (fd);
+
+    return ret;
+}
+#endif
+
+/*
+ * Sync each object, and each object dir and repo dir once, since they may
+ * have been created for the objects. Only the files of the batch are
+ * flushed, other writes to the same file system are not waited for.
+ *
+ * Large sets, like the objects of a new library uploaded with recv-fs,
+ * are synced with one syncfs() instead, which is much faster than one
+ * fdatasync() per object.
+ */
+static int
+obj_backend_fs_sync_objs (ObjBackend *bend,
+                          const char *repo_id,
+                          int version,
+                          GList *obj_ids)
+{
+    char path[SEAF_PATH_MAX];
+    GHashTable *dirs;
+    GHashTableIter iter;
+    gpointer key;
+    GList *ptr;
+    char *dir;
+    int ret = 0;
+
+    if (!obj_ids)
+        return 0;
+
+#ifdef __linux__
+    if (g_list_nth (obj_ids, SYNCFS_MIN_OBJS - 1) != NULL)
+        return syncfs_path (((FsPriv *)bend->priv)->obj_dir);
+#endif
+
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (ptr = obj_ids; ptr; ptr = ptr->next) {
+        id_to_path (bend->priv, ptr->data, path, repo_id, version);
+        if (datasync_path (path) < 0)
+            ret = -1;
+
+        dir = g_path_get_dirname (path);
+        g_hash_table_replace (dirs, g_path_get_dirname (dir), NULL);
+        g_hash_table_replace (dirs, dir, NULL);
+    }
+
+#ifndef WIN32
+    g_hash_table_iter_init (&iter, dirs);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        if (sync_path (key) < 0)
+            ret = -1;
+    }
+#endif
+
+    g_hash_table_destroy (dirs);
+    return ret;
+}
+
 ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
 {
@@ -520,6 +646,7 @@ obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
     bend->foreach_obj = obj_backend_fs_foreach_obj;
     bend->copy = obj_backend_fs_copy;
     bend->remove_store = obj_backend_fs_remove_store;
+    bend->sync_objs = obj_backend_fs_sync_objs;
 
     return bend;
 
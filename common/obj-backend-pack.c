@@ -0,0 +1,1360 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Object backend that groups objects of a store into append-only segment
+ * files, instead of writing every object to its own file.
+ *
+ * Files in a store directory (<seaf_dir>/storage/<obj_type>-packs/<store_id>/):
+ *
+ *   seg-00000001, ...  Sequence of records: RecordHdr followed by the object
+ *                      content. Removing an object appends a record with
+ *                      OBJ_REMOVED set. Segments are the source of truth,
+ *                      everything else can be rebuilt from them.
+ *   index              Open addressing hash table of IndexSlot, memory mapped.
+ *                      It covers the segments up to the position recorded in
+ *                      its header.
+ *
+ * Records appended after the index was built are replayed into a hash table
+ * when the store is loaded. When the table grows large, a new index is built.
+ * Segments are memory mapped, so reading an object is a lookup and a memcpy.
+ *
+ * The loaded state is per process and segments are mapped past their end,
+ * so only one process may use the objects dir at a time. It's locked when
+ * the backend is created, like the block pack dir. Stores are loaded on
+ * demand and at most MAX_OPEN_STORES unused stores are kept open, like in
+ * the block pack backend.
+ *
+ * Deleting an object only appends a removal record. Unlike the block pack
+ * backend, segments are never compacted, so the space of deleted objects
+ * is only reclaimed when the whole store is removed.
+ */
+
+#include "common.h"
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "obj-backend.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define RECORD_MAGIC 0x4f534653     /* "SFSO" */
+#define INDEX_MAGIC "SFOI"
+#define INDEX_VERSION 1
+
+/* A new segment is started when the current one would exceed this size. */
+#define SEGMENT_MAX_SIZE ((gint64)1 << 26) /* 64MB */
+
+#define INDEX_MIN_SLOTS 1024
+
+/* Build a new index when more objects than this, or than 1/4 of the index,
+ * are not in the index.
+ */
+#define REBUILD_MIN_RECENT 65536
+
+/* Above this number of mapped segments, objects are read with pread(). */
+#define MAX_MAPPED_SEGMENTS 16384
+
+/* Loaded stores, each with a mapped index, mapped segments and possibly
+ * the current segment fd open.
+ */
+#define MAX_OPEN_STORES 256
+
+#define FOREACH_BUF_SIZE (1 << 22) /* 4MB */
+#define FOREACH_BATCH_SIZE 4096
+
+#define OBJ_REMOVED 1
+
+/* On-disk formats. Integers are little-endian. */
+
+typedef struct RecordHdr {
+    guint32 magic;
+    unsigned char id[20];
+    guint32 len;
+    guint32 flags;
+} __attribute__((__packed__)) RecordHdr;
+
+typedef struct IndexSlot {
+    unsigned char id[20];
+    guint32 seg_id;             /* 0 for an empty slot */
+    guint64 offset;             /* offset of object content in the segment */
+    guint32 len;
+} __attribute__((__packed__)) IndexSlot;
+
+typedef struct IndexHdr {
+    char magic[4];
+    guint32 version;
+    guint64 n_slots;
+    guint64 n_entries;
+    /* Records before this position are in the index. */
+    guint32 end_seg_id;
+    guint64 end_offset;
+} __attribute__((__packed__)) IndexHdr;
+
+typedef struct ObjLoc {
+    unsigned char id[20];
+    guint32 seg_id;
+    guint64 offset;
+    guint32 len;
+    gboolean removed;
+} ObjLoc;
+
+typedef struct Segment {
+    void *map;
+    gsize map_len;
+} Segment;
+
+typedef struct PackStore {
+    char *store_id;
+    char *dir;
+
+    /* Protected by stores_lock. A store is only closed when it's not used. */
+    int ref;
+    GList link;                 /* node in the LRU list */
+
+    /* Protects the index mapping, the recent table and segment mappings.
+     * Modifications hold it for write, together with write_lock.
+     */
+    pthread_rwlock_t lock;
+    void *index_map;
+    gsize index_map_len;
+    const IndexSlot *slots;
+    guint64 n_slots;
+    guint64 n_index_entries;
+    GHashTable *recent;         /* raw id -> ObjLoc, not in the index */
+    GHashTable *segments;       /* seg id -> Segment */
+
+    /* Serializes appending and index building. */
+    pthread_mutex_t write_lock;
+    guint32 cur_seg_id;
+    int cur_seg_fd;
+    gint64 cur_seg_size;
+} PackStore;
+
+typedef struct PackPriv {
+    char *obj_dir;
+    int lock_fd;
+    GHashTable *stores;         /* store_id -> PackStore */
+    GQueue stores_lru;          /* most recently used first */
+    pthread_mutex_t stores_lock;
+} PackPriv;
+
+static gint n_mapped_segments = 0;
+
+static guint
+obj_id_hash (gconstpointer key)
+{
+    guint32 h;
+
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+obj_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, 20) == 0;
+}
+
+static guint64
+slot_hash (const unsigned char *id)
+{
+    guint64 h;
+
+    memcpy (&h, id + 4, sizeof(h));
+    return GUINT64_FROM_LE (h);
+}
+
+static char *
+get_seg_path (PackStore *store, guint32 seg_id, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/seg-%08u", store->dir, seg_id);
+    return path;
+}
+
+static ssize_t
+pread_full (int fd, void *buf, size_t n, guint64 offset)
+{
+    size_t left = n;
+    ssize_t ret;
+    char *ptr = buf;
+
+    while (left > 0) {
+        ret = pread (fd, ptr, left, (off_t)offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        left -= ret;
+        ptr += ret;
+        offset += ret;
+    }
+
+    return n - left;
+}
+
+static void
+segment_free (gpointer data)
+{
+    Segment *seg = data;
+
+    if (seg->map) {
+        munmap (seg->map, seg->map_len);
+        g_atomic_int_add (&n_mapped_segments, -1);
+    }
+    g_free (seg);
+}
+
+/* Index. */
+
+static void
+unmap_index (PackStore *store)
+{
+    if (store->index_map)
+        munmap (store->index_map, store->index_map_len);
+    store->index_map = NULL;
+    store->index_map_len = 0;
+    store->slots = NULL;
+    store->n_slots = 0;
+    store->n_index_entries = 0;
+}
+
+static int
+map_index (PackStore *store, guint32 *end_seg_id, guint64 *end_offset)
+{
+    char *path = g_build_filename (store->dir, "index", NULL);
+    IndexHdr *hdr;
+    SeafStat st;
+    void *map;
+    int fd;
+    int ret = 0;
+
+    *end_seg_id = 0;
+    *end_offset = 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            seaf_warning ("[obj pack] Failed to open %s: %s.\n", path, strerror(errno));
+            ret = -1;
+        }
+        goto out;
+    }
+
+    if (seaf_fstat (fd, &st) < 0 || st.st_size < sizeof(IndexHdr)) {
+        seaf_warning ("[obj pack] Invalid index %s, rebuilding it.\n", path);
+        goto out;
+    }
+
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        seaf_warning ("[obj pack] Failed to map %s: %s.\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    hdr = map;
+    if (memcmp (hdr->magic, INDEX_MAGIC, 4) != 0 ||
+        GUINT32_FROM_LE (hdr->version) != INDEX_VERSION ||
+        st.st_size != sizeof(IndexHdr) +
+                      GUINT64_FROM_LE (hdr->n_slots) * sizeof(IndexSlot)) {
+        /* The index can always be rebuilt from the segments. */
+        seaf_warning ("[obj pack] Invalid index %s, rebuilding it.\n", path);
+        munmap (map, st.st_size);
+        goto out;
+    }
+
+    store->index_map = map;
+    store->index_map_len = st.st_size;
+    store->slots = (const IndexSlot *)(hdr + 1);
+    store->n_slots = GUINT64_FROM_LE (hdr->n_slots);
+    store->n_index_entries = GUINT64_FROM_LE (hdr->n_entries);
+    *end_seg_id = GUINT32_FROM_LE (hdr->end_seg_id);
+    *end_offset = GUINT64_FROM_LE (hdr->end_offset);
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (path);
+    return ret;
+}
+
+/* Lookup an object. The caller must hold lock or write_lock. */
+static gboolean
+lookup_obj (PackStore *store, const unsigned char *id, ObjLoc *loc)
+{
+    ObjLoc *recent;
+    const IndexSlot *slot;
+    guint64 i;
+
+    recent = g_hash_table_lookup (store->recent, id);
+    if (recent) {
+        if (recent->removed)
+            return FALSE;
+        *loc = *recent;
+        return TRUE;
+    }
+
+    if (store->n_slots == 0)
+        return FALSE;
+
+    /* n_slots is a power of 2 and the table is at most half full. */
+    i = slot_hash (id) & (store->n_slots - 1);
+    while (1) {
+        slot = &store->slots[i];
+        if (slot->seg_id == 0)
+            return FALSE;
+        if (memcmp (slot->id, id, 20) == 0) {
+            memcpy (loc->id, id, 20);
+            loc->seg_id = GUINT32_FROM_LE (slot->seg_id);
+            loc->offset = GUINT64_FROM_LE (slot->offset);
+            loc->len = GUINT32_FROM_LE (slot->len);
+            loc->removed = FALSE;
+            return TRUE;
+        }
+        i = (i + 1) & (store->n_slots - 1);
+    }
+}
+
+static void
+insert_slot (IndexSlot *slots, guint64 n_slots, const ObjLoc *loc)
+{
+    guint64 i = slot_hash (loc->id) & (n_slots - 1);
+
+    while (slots[i].seg_id != 0 && memcmp (slots[i].id, loc->id, 20) != 0)
+        i = (i + 1) & (n_slots - 1);
+
+    memcpy (slots[i].id, loc->id, 20);
+    slots[i].seg_id = GUINT32_TO_LE (loc->seg_id);
+    slots[i].offset = GUINT64_TO_LE (loc->offset);
+    slots[i].len = GUINT32_TO_LE (loc->len);
+}
+
+/* Build a new index from the current index and the recent table.
+ * The caller must hold write_lock.
+ */
+static int
+rebuild_index (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, "index", NULL);
+    char *tmp_path = g_strconcat (path, ".tmp", NULL);
+    GHashTableIter iter;
+    gpointer value;
+    ObjLoc loc, *recent;
+    IndexHdr *hdr;
+    IndexSlot *slots;
+    guint64 n_entries = 0, n_slots = INDEX_MIN_SLOTS, i;
+    gsize map_len;
+    void *map = NULL;
+    int fd;
+    int ret = 0;
+
+    while (n_slots < 2 * (store->n_index_entries + g_hash_table_size (store->recent)))
+        n_slots *= 2;
+    map_len = sizeof(IndexHdr) + n_slots * sizeof(IndexSlot);
+
+    fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+    if (ftruncate (fd, map_len) < 0) {
+        seaf_warning ("[obj pack] Failed to resize %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+    map = mmap (NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        seaf_warning ("[obj pack] Failed to map %s: %s.\n", tmp_path, strerror(errno));
+        map = NULL;
+        ret = -1;
+        goto out;
+    }
+
+    hdr = map;
+    slots = (IndexSlot *)(hdr + 1);
+
+    for (i = 0; i < store->n_slots; ++i) {
+        const IndexSlot *slot = &store->slots[i];
+        if (slot->seg_id == 0 || g_hash_table_lookup (store->recent, slot->id))
+            continue;
+        memcpy (loc.id, slot->id, 20);
+        loc.seg_id = GUINT32_FROM_LE (slot->seg_id);
+        loc.offset = GUINT64_FROM_LE (slot->offset);
+        loc.len = GUINT32_FROM_LE (slot->len);
+        insert_slot (slots, n_slots, &loc);
+        ++n_entries;
+    }
+
+    g_hash_table_iter_init (&iter, store->recent);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        recent = value;
+        if (recent->removed)
+            continue;
+        insert_slot (slots, n_slots, recent);
+        ++n_entries;
+    }
+
+    memcpy (hdr->magic, INDEX_MAGIC, 4);
+    hdr->version = GUINT32_TO_LE (INDEX_VERSION);
+    hdr->n_slots = GUINT64_TO_LE (n_slots);
+    hdr->n_entries = GUINT64_TO_LE (n_entries);
+    hdr->end_seg_id = GUINT32_TO_LE (store->cur_seg_id);
+    hdr->end_offset = GUINT64_TO_LE (store->cur_seg_size);
+
+    if (msync (map, map_len, MS_SYNC) < 0) {
+        seaf_warning ("[obj pack] Failed to sync %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[obj pack] Failed to rename %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    pthread_rwlock_wrlock (&store->lock);
+    unmap_index (store);
+    store->index_map = map;
+    store->index_map_len = map_len;
+    store->slots = slots;
+    store->n_slots = n_slots;
+    store->n_index_entries = n_entries;
+    g_hash_table_remove_all (store->recent);
+    pthread_rwlock_unlock (&store->lock);
+    map = NULL;
+
+out:
+    if (map)
+        munmap (map, map_len);
+    if (fd >= 0)
+        close (fd);
+    if (ret < 0)
+        g_unlink (tmp_path);
+    g_free (path);
+    g_free (tmp_path);
+    return ret;
+}
+
+static void
+maybe_rebuild_index (PackStore *store)
+{
+    guint64 threshold = MAX (REBUILD_MIN_RECENT, store->n_index_entries / 4);
+
+    if (g_hash_table_size (store->recent) >= threshold)
+        rebuild_index (store);
+}
+
+/* Loading. */
+
+static void
+add_recent (PackStore *store, const RecordHdr *hdr, guint32 seg_id, guint64 offset)
+{
+    ObjLoc *loc = g_new0 (ObjLoc, 1);
+
+    memcpy (loc->id, hdr->id, 20);
+    loc->seg_id = seg_id;
+    loc->offset = offset + sizeof(RecordHdr);
+    loc->len = GUINT32_FROM_LE (hdr->len);
+    loc->removed = (GUINT32_FROM_LE (hdr->flags) & OBJ_REMOVED) != 0;
+    g_hash_table_replace (store->recent, loc->id, loc);
+}
+
+/* Add records after @offset in a segment to the recent table.
+ * A partially written record at the end (from a crash) is truncated.
+ */
+static int
+replay_segment (PackStore *store, guint32 seg_id, guint64 offset)
+{
+    char path[SEAF_PATH_MAX];
+    RecordHdr hdr;
+    SeafStat st;
+    int fd;
+
+    get_seg_path (store, seg_id, path);
+    fd = g_open (path, O_RDWR | O_BINARY, 0);
+    if (fd < 0 || seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n", path, strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        return -1;
+    }
+
+    while (offset < st.st_size) {
+        if (offset + sizeof(hdr) > st.st_size ||
+            pread_full (fd, &hdr, sizeof(hdr), offset) != sizeof(hdr) ||
+            GUINT32_FROM_LE (hdr.magic) != RECORD_MAGIC ||
+            offset + sizeof(hdr) + GUINT32_FROM_LE (hdr.len) > st.st_size) {
+            seaf_warning ("[obj pack] Truncating broken record at %s:%"G_GUINT64_FORMAT".\n",
+                          path, offset);
+            if (ftruncate (fd, offset) < 0) {
+                close (fd);
+                return -1;
+            }
+            break;
+        }
+
+        add_recent (store, &hdr, seg_id, offset);
+        offset += sizeof(hdr) + GUINT32_FROM_LE (hdr.len);
+    }
+
+    close (fd);
+    return 0;
+}
+
+static gint
+compare_seg_ids (gconstpointer a, gconstpointer b)
+{
+    guint32 id_a = GPOINTER_TO_UINT(a), id_b = GPOINTER_TO_UINT(b);
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+static GList *
+list_segments (PackStore *store)
+{
+    GList *ids = NULL;
+    GDir *dir;
+    const char *dname;
+    guint32 seg_id;
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (!dir)
+        return NULL;
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (sscanf (dname, "seg-%08u", &seg_id) == 1 && seg_id > 0)
+            ids = g_list_prepend (ids, GUINT_TO_POINTER(seg_id));
+    }
+    g_dir_close (dir);
+
+    return g_list_sort (ids, compare_seg_ids);
+}
+
+static void
+pack_store_free (PackStore *store)
+{
+    unmap_index (store);
+    g_hash_table_destroy (store->recent);
+    g_hash_table_destroy (store->segments);
+    if (store->cur_seg_fd >= 0)
+        close (store->cur_seg_fd);
+    pthread_rwlock_destroy (&store->lock);
+    pthread_mutex_destroy (&store->write_lock);
+    g_free (store->store_id);
+    g_free (store->dir);
+    g_free (store);
+}
+
+static PackStore *
+pack_store_load (PackPriv *priv, const char *store_id)
+{
+    PackStore *store = g_new0 (PackStore, 1);
+    guint32 end_seg_id, seg_id;
+    guint64 end_offset;
+    GList *seg_ids, *ptr;
+    int ret = 0;
+
+    store->store_id = g_strdup (store_id);
+    store->link.data = store;
+    store->dir = g_build_filename (priv->obj_dir, store_id, NULL);
+    pthread_rwlock_init (&store->lock, NULL);
+    pthread_mutex_init (&store->write_lock, NULL);
+    store->recent = g_hash_table_new_full (obj_id_hash, obj_id_equal, NULL, g_free);
+    store->segments = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, segment_free);
+    store->cur_seg_fd = -1;
+
+    if (map_index (store, &end_seg_id, &end_offset) < 0) {
+        pack_store_free (store);
+        return NULL;
+    }
+
+    seg_ids = list_segments (store);
+    for (ptr = seg_ids; ptr; ptr = ptr->next) {
+        seg_id = GPOINTER_TO_UINT(ptr->data);
+        if (seg_id < end_seg_id)
+            continue;
+        ret = replay_segment (store, seg_id, seg_id == end_seg_id ? end_offset : 0);
+        if (ret < 0)
+            break;
+        store->cur_seg_id = seg_id;
+    }
+    g_list_free (seg_ids);
+
+    if (ret < 0) {
+        seaf_warning ("[obj pack] Failed to load object store %s.\n", store->dir);
+        pack_store_free (store);
+        return NULL;
+    }
+
+    return store;
+}
+
+/* Close the least recently used stores that are not in use. Called with
+ * stores_lock held.
+ */
+static void
+evict_stores (PackPriv *priv)
+{
+    GList *ptr, *prev;
+    PackStore *store;
+
+    for (ptr = priv->stores_lru.tail;
+         ptr && g_hash_table_size (priv->stores) > MAX_OPEN_STORES;
+         ptr = prev) {
+        prev = ptr->prev;
+        store = ptr->data;
+        if (store->ref > 0)
+            continue;
+        g_queue_unlink (&priv->stores_lru, ptr);
+        g_hash_table_remove (priv->stores, store->store_id);
+    }
+}
+
+/* Returns a referenced store, release it with put_store(). */
+static PackStore *
+get_store (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+    PackStore *store;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (store) {
+        g_queue_unlink (&priv->stores_lru, &store->link);
+    } else {
+        store = pack_store_load (priv, store_id);
+        if (store)
+            g_hash_table_insert (priv->stores, store->store_id, store);
+    }
+    if (store) {
+        g_queue_push_head_link (&priv->stores_lru, &store->link);
+        ++store->ref;
+        evict_stores (priv);
+    }
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    return store;
+}
+
+static void
+put_store (ObjBackend *bend, PackStore *store)
+{
+    PackPriv *priv = bend->priv;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    --store->ref;
+    evict_stores (priv);
+    pthread_mutex_unlock (&priv->stores_lock);
+}
+
+/* Appending. The caller must hold write_lock. */
+
+static int
+sync_fd (int fd)
+{
+    /* Some file systems may not support fsync().
+     * In this case, just skip the error.
+     */
+    if (fdatasync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("Failed to fsync: %s.\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sync_dir (const char *path)
+{
+    int fd = open (path, O_RDONLY);
+    int ret = 0;
+
+    if (fd < 0)
+        return -1;
+    if (fsync (fd) < 0 && errno != EINVAL)
+        ret = -1;
+    close (fd);
+    return ret;
+}
+
+static int
+prepare_current_segment (PackStore *store, guint32 record_len)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+
+    if (store->cur_seg_fd >= 0 && store->cur_seg_size > 0 &&
+        store->cur_seg_size + record_len > SEGMENT_MAX_SIZE) {
+        close (store->cur_seg_fd);
+        store->cur_seg_fd = -1;
+        ++store->cur_seg_id;
+        store->cur_seg_size = 0;
+    }
+
+    if (store->cur_seg_fd >= 0)
+        return 0;
+
+    if (g_mkdir_with_parents (store->dir, 0777) < 0) {
+        seaf_warning ("[obj pack] Failed to create %s: %s.\n", store->dir, strerror(errno));
+        return -1;
+    }
+
+    if (store->cur_seg_id == 0)
+        store->cur_seg_id = 1;
+    get_seg_path (store, store->cur_seg_id, path);
+    store->cur_seg_fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0666);
+    if (store->cur_seg_fd < 0 || seaf_fstat (store->cur_seg_fd, &st) < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n", path, strerror(errno));
+        if (store->cur_seg_fd >= 0)
+            close (store->cur_seg_fd);
+        store->cur_seg_fd = -1;
+        return -1;
+    }
+    store->cur_seg_size = st.st_size;
+
+    /* Make sure the new segment file itself survives a crash. */
+    if (st.st_size == 0 && sync_dir (store->dir) < 0)
+        seaf_warning ("[obj pack] Failed to sync dir %s.\n", store->dir);
+
+    return 0;
+}
+
+static int
+append_record (PackStore *store, const unsigned char *id,
+               const void *data, guint32 len, guint32 flags,
+               gboolean need_sync)
+{
+    RecordHdr hdr;
+    ObjLoc *loc;
+    guint64 offset;
+
+    if (prepare_current_segment (store, sizeof(hdr) + len) < 0)
+        return -1;
+
+    hdr.magic = GUINT32_TO_LE (RECORD_MAGIC);
+    memcpy (hdr.id, id, 20);
+    hdr.len = GUINT32_TO_LE (len);
+    hdr.flags = GUINT32_TO_LE (flags);
+
+    offset = store->cur_seg_size;
+    if (pwrite (store->cur_seg_fd, &hdr, sizeof(hdr), offset) != sizeof(hdr) ||
+        (len > 0 &&
+         pwrite (store->cur_seg_fd, data, len, offset + sizeof(hdr)) != len)) {
+        seaf_warning ("[obj pack] Failed to write segment %u in %s: %s.\n",
+                      store->cur_seg_id, store->dir, strerror(errno));
+        if (ftruncate (store->cur_seg_fd, offset) < 0)
+            seaf_warning ("[obj pack] Failed to truncate segment %u in %s.\n",
+                          store->cur_seg_id, store->dir);
+        return -1;
+    }
+
+    if (need_sync && sync_fd (store->cur_seg_fd) < 0)
+        return -1;
+
+    store->cur_seg_size += sizeof(hdr) + len;
+
+    loc = g_new0 (ObjLoc, 1);
+    memcpy (loc->id, id, 20);
+    loc->seg_id = store->cur_seg_id;
+    loc->offset = offset + sizeof(hdr);
+    loc->len = len;
+    loc->removed = (flags & OBJ_REMOVED) != 0;
+
+    pthread_rwlock_wrlock (&store->lock);
+    g_hash_table_replace (store->recent, loc->id, loc);
+    pthread_rwlock_unlock (&store->lock);
+
+    return 0;
+}
+
+/* Reading. */
+
+static Segment *
+map_segment (PackStore *store, guint32 seg_id, guint64 end)
+{
+    char path[SEAF_PATH_MAX];
+    Segment *seg;
+    SeafStat st;
+    gsize map_len;
+    void *map;
+    int fd;
+
+    if (g_atomic_int_get (&n_mapped_segments) >= MAX_MAPPED_SEGMENTS)
+        return NULL;
+
+    get_seg_path (store, seg_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0 || seaf_fstat (fd, &st) < 0) {
+        if (fd >= 0)
+            close (fd);
+        return NULL;
+    }
+
+    /* Map the full segment size, so that the current segment doesn't need
+     * to be remapped as it grows. Only written ranges are accessed.
+     */
+    map_len = MAX (MAX (SEGMENT_MAX_SIZE, st.st_size), end);
+    map = mmap (NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        seaf_warning ("[obj pack] Failed to map %s: %s.\n", path, strerror(errno));
+        return NULL;
+    }
+
+    seg = g_hash_table_lookup (store->segments, GUINT_TO_POINTER(seg_id));
+    if (seg) {
+        munmap (seg->map, seg->map_len);
+    } else {
+        seg = g_new0 (Segment, 1);
+        g_hash_table_insert (store->segments, GUINT_TO_POINTER(seg_id), seg);
+        g_atomic_int_inc (&n_mapped_segments);
+    }
+    seg->map = map;
+    seg->map_len = map_len;
+
+    return seg;
+}
+
+static int
+read_with_pread (PackStore *store, const ObjLoc *loc, void *buf)
+{
+    char path[SEAF_PATH_MAX];
+    int fd;
+    ssize_t n;
+
+    get_seg_path (store, loc->seg_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        return -1;
+    n = pread_full (fd, buf, loc->len, loc->offset);
+    close (fd);
+
+    return (n == loc->len) ? 0 : -1;
+}
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackStore *store;
+    Segment *seg;
+    ObjLoc loc;
+    unsigned char id[20];
+    void *buf;
+    int ret = 0;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_rwlock_rdlock (&store->lock);
+    if (!lookup_obj (store, id, &loc)) {
+        pthread_rwlock_unlock (&store->lock);
+        put_store (bend, store);
+        seaf_debug ("[obj pack] Object %s:%s not found.\n", repo_id, obj_id);
+        return -1;
+    }
+
+    /* Keep the same interface as the fs backend: a nul-terminated buffer. */
+    buf = g_malloc (loc.len + 1);
+    ((char *)buf)[loc.len] = 0;
+
+    seg = g_hash_table_lookup (store->segments, GUINT_TO_POINTER(loc.seg_id));
+    if (seg && loc.offset + loc.len <= seg->map_len) {
+        memcpy (buf, (char *)seg->map + loc.offset, loc.len);
+        pthread_rwlock_unlock (&store->lock);
+        goto out;
+    }
+    pthread_rwlock_unlock (&store->lock);
+
+    pthread_rwlock_wrlock (&store->lock);
+    seg = map_segment (store, loc.seg_id, loc.offset + loc.len);
+    if (seg) {
+        memcpy (buf, (char *)seg->map + loc.offset, loc.len);
+        pthread_rwlock_unlock (&store->lock);
+    } else {
+        pthread_rwlock_unlock (&store->lock);
+        ret = read_with_pread (store, &loc, buf);
+    }
+
+out:
+    put_store (bend, store);
+    if (ret < 0) {
+        seaf_warning ("[obj pack] Failed to read object %s:%s.\n", repo_id, obj_id);
+        g_free (buf);
+        return -1;
+    }
+
+    *data = buf;
+    *len = (int)loc.len;
+    return 0;
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
+                        const char *obj_id,
+                        void *data,
+                        int len,
+                        gboolean need_sync)
+{
+    PackStore *store;
+    ObjLoc loc;
+    unsigned char id[20];
+    int ret = 0;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_mutex_lock (&store->write_lock);
+    /* Objects are immutable, no need to write an existing one again. */
+    if (!lookup_obj (store, id, &loc)) {
+        ret = append_record (store, id, data, len, 0, need_sync);
+        if (ret == 0)
+            maybe_rebuild_index (store);
+    }
+    pthread_mutex_unlock (&store->write_lock);
+    put_store (bend, store);
+
+    if (ret < 0)
+        seaf_warning ("[obj pack] Failed to write obj %s:%s.\n", repo_id, obj_id);
+    return ret;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackStore *store;
+    ObjLoc loc;
+    unsigned char id[20];
+    gboolean ret;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return FALSE;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_rwlock_rdlock (&store->lock);
+    ret = lookup_obj (store, id, &loc);
+    pthread_rwlock_unlock (&store->lock);
+    put_store (bend, store);
+
+    return ret;
+}
+
+static int
+obj_backend_pack_get_location (ObjBackend *bend,
+                               const char *repo_id,
+                               int version,
+                               const char *obj_id,
+                               guint64 *location)
+{
+    PackStore *store;
+    ObjLoc loc;
+    unsigned char id[20];
+    gboolean found;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_rwlock_rdlock (&store->lock);
+    found = lookup_obj (store, id, &loc);
+    pthread_rwlock_unlock (&store->lock);
+    put_store (bend, store);
+
+    if (!found)
+        return -1;
+
+    /* Segments are much smaller than 4GB. */
+    *location = ((guint64)loc.seg_id << 32) | loc.offset;
+    return 0;
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackStore *store;
+    ObjLoc loc;
+    unsigned char id[20];
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_mutex_lock (&store->write_lock);
+    if (lookup_obj (store, id, &loc) &&
+        append_record (store, id, NULL, 0, OBJ_REMOVED, FALSE) == 0)
+        maybe_rebuild_index (store);
+    pthread_mutex_unlock (&store->write_lock);
+    put_store (bend, store);
+}
+
+typedef struct ForeachCandidate {
+    unsigned char id[20];
+    guint64 offset;             /* offset of object content */
+} ForeachCandidate;
+
+/* Call @process for the candidates that are still the live copy of their
+ * object. The lock is not held while calling @process.
+ */
+static gboolean
+process_candidates (PackStore *store, const char *repo_id, int version,
+                    guint32 seg_id, ForeachCandidate *cands, int n_cands,
+                    SeafObjFunc process, void *user_data)
+{
+    gboolean *live = g_new0 (gboolean, n_cands);
+    char obj_id[41];
+    ObjLoc loc;
+    gboolean ret = TRUE;
+    int i;
+
+    pthread_rwlock_rdlock (&store->lock);
+    for (i = 0; i < n_cands; ++i) {
+        live[i] = lookup_obj (store, cands[i].id, &loc) &&
+                  loc.seg_id == seg_id && loc.offset == cands[i].offset;
+    }
+    pthread_rwlock_unlock (&store->lock);
+
+    for (i = 0; i < n_cands; ++i) {
+        if (!live[i])
+            continue;
+        rawdata_to_hex (cands[i].id, obj_id, 20);
+        if (!process (repo_id, version, obj_id, user_data)) {
+            ret = FALSE;
+            break;
+        }
+    }
+
+    g_free (live);
+    return ret;
+}
+
+/* Read a segment sequentially in large chunks, and visit the live objects. */
+static gboolean
+foreach_obj_in_segment (PackStore *store, const char *repo_id, int version,
+                        guint32 seg_id, char *buf,
+                        ForeachCandidate *cands,
+                        SeafObjFunc process, void *user_data)
+{
+    char path[SEAF_PATH_MAX];
+    RecordHdr hdr;
+    SeafStat st;
+    guint64 offset = 0, buf_start = 0, buf_len = 0;
+    ssize_t n;
+    int n_cands = 0;
+    int fd;
+    gboolean ret = TRUE;
+
+    get_seg_path (store, seg_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0 || seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n", path, strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        return TRUE;
+    }
+
+    while (offset + sizeof(hdr) <= st.st_size) {
+        if (offset < buf_start || offset + sizeof(hdr) > buf_start + buf_len) {
+            n = pread_full (fd, buf, FOREACH_BUF_SIZE, offset);
+            if (n < (ssize_t)sizeof(hdr))
+                break;
+            buf_start = offset;
+            buf_len = n;
+        }
+
+        memcpy (&hdr, buf + (offset - buf_start), sizeof(hdr));
+        if (GUINT32_FROM_LE (hdr.magic) != RECORD_MAGIC)
+            break;
+
+        if (!(GUINT32_FROM_LE (hdr.flags) & OBJ_REMOVED)) {
+            memcpy (cands[n_cands].id, hdr.id, 20);
+            cands[n_cands].offset = offset + sizeof(hdr);
+            if (++n_cands == FOREACH_BATCH_SIZE) {
+                ret = process_candidates (store, repo_id, version, seg_id,
+                                          cands, n_cands, process, user_data);
+                n_cands = 0;
+                if (!ret)
+                    break;
+            }
+        }
+
+        offset += sizeof(hdr) + GUINT32_FROM_LE (hdr.len);
+    }
+
+    if (ret && n_cands > 0)
+        ret = process_candidates (store, repo_id, version, seg_id,
+                                  cands, n_cands, process, user_data);
+
+    close (fd);
+    return ret;
+}
+
+static int
+obj_backend_pack_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    PackStore *store;
+    GList *seg_ids, *ptr;
+    ForeachCandidate *cands;
+    char *buf;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    buf = g_malloc (FOREACH_BUF_SIZE);
+    cands = g_new (ForeachCandidate, FOREACH_BATCH_SIZE);
+
+    seg_ids = list_segments (store);
+    for (ptr = seg_ids; ptr; ptr = ptr->next) {
+        if (!foreach_obj_in_segment (store, repo_id, version,
+                                     GPOINTER_TO_UINT(ptr->data), buf, cands,
+                                     process, user_data))
+            break;
+    }
+    g_list_free (seg_ids);
+    put_store (bend, store);
+
+    g_free (cands);
+    g_free (buf);
+    return 0;
+}
+
+static int
+obj_backend_pack_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    void *data = NULL;
+    int len;
+    int ret;
+
+    if (obj_backend_pack_exists (bend, dst_repo_id, dst_version, obj_id))
+        return 0;
+
+    if (obj_backend_pack_read (bend, src_repo_id, src_version, obj_id, &data, &len) < 0)
+        return -1;
+
+    ret = obj_backend_pack_write (bend, dst_repo_id, dst_version, obj_id,
+                                  data, len, FALSE);
+    g_free (data);
+
+    return ret;
+}
+
+static int
+obj_backend_pack_remove_store (ObjBackend *bend, const char *store_id)
+{
+    PackStore *store;
+    GDir *dir;
+    const char *dname;
+    char *path;
+
+    store = get_store (bend, store_id);
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->write_lock);
+
+    pthread_rwlock_wrlock (&store->lock);
+    unmap_index (store);
+    g_hash_table_remove_all (store->recent);
+    g_hash_table_remove_all (store->segments);
+    pthread_rwlock_unlock (&store->lock);
+
+    if (store->cur_seg_fd >= 0)
+        close (store->cur_seg_fd);
+    store->cur_seg_fd = -1;
+    store->cur_seg_id = 0;
+    store->cur_seg_size = 0;
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            path = g_build_filename (store->dir, dname, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+        g_rmdir (store->dir);
+    }
+
+    pthread_mutex_unlock (&store->write_lock);
+    put_store (bend, store);
+
+    return 0;
+}
+
+static int
+obj_backend_pack_sync_objs (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            GList *obj_ids)
+{
+    PackStore *store;
+    GHashTable *seg_ids;
+    GHashTableIter iter;
+    gpointer key;
+    char path[SEAF_PATH_MAX];
+    unsigned char id[20];
+    ObjLoc loc;
+    GList *ptr;
+    int fd;
+    int ret = 0;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    /* Objects in a batch are usually in one or two segments. */
+    seg_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    pthread_rwlock_rdlock (&store->lock);
+    for (ptr = obj_ids; ptr; ptr = ptr->next) {
+        hex_to_rawdata (ptr->data, id, 20);
+        if (lookup_obj (store, id, &loc))
+            g_hash_table_add (seg_ids, GUINT_TO_POINTER(loc.seg_id));
+    }
+    pthread_rwlock_unlock (&store->lock);
+
+    g_hash_table_iter_init (&iter, seg_ids);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        get_seg_path (store, GPOINTER_TO_UINT(key), path);
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        if (fd < 0 || sync_fd (fd) < 0) {
+            seaf_warning ("[obj pack] Failed to sync %s.\n", path);
+            ret = -1;
+        }
+        if (fd >= 0)
+            close (fd);
+    }
+    g_hash_table_destroy (seg_ids);
+
+    if (sync_dir (store->dir) < 0)
+        ret = -1;
+    put_store (bend, store);
+
+    return ret;
+}
+
+/* The lock is released when the process exits. */
+static int
+lock_obj_dir (const char *obj_dir)
+{
+    char *path = g_build_filename (obj_dir, "lock", NULL);
+    int fd;
+
+    fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n", path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+    g_free (path);
+
+    /* Don't let child processes keep the lock. */
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+    if (flock (fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            seaf_warning ("Objects dir %s is used by another process. "
+                          "Stop seaf-server before running GC or fsck.\n", obj_dir);
+        else
+            seaf_warning ("[obj pack] Failed to lock %s: %s.\n",
+                          obj_dir, strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+    char *dir_name;
+
+    bend = g_new0 (ObjBackend, 1);
+    priv = g_new0 (PackPriv, 1);
+    bend->priv = priv;
+
+    dir_name = g_strconcat (obj_type, "-packs", NULL);
+    priv->obj_dir = g_build_filename (seaf_dir, "storage", dir_name, NULL);
+    g_free (dir_name);
+    priv->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, (GDestroyNotify)pack_store_free);
+    g_queue_init (&priv->stores_lru);
+    pthread_mutex_init (&priv->stores_lock, NULL);
+
+    if (g_mkdir_with_parents (priv->obj_dir, 0777) < 0) {
+        seaf_warning ("[Obj Backend] Objects dir %s does not exist and"
+                      " is unable to create\n", priv->obj_dir);
+        goto onerror;
+    }
+
+    priv->lock_fd = lock_obj_dir (priv->obj_dir);
+    if (priv->lock_fd < 0)
+        goto onerror;
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->delete = obj_backend_pack_delete;
+    bend->foreach_obj = obj_backend_pack_foreach_obj;
+    bend->copy = obj_backend_pack_copy;
+    bend->remove_store = obj_backend_pack_remove_store;
+    bend->sync_objs = obj_backend_pack_sync_objs;
+    bend->get_location = obj_backend_pack_get_location;
+
+    return bend;
+
+onerror:
+    g_hash_table_destroy (priv->stores);
+    g_free (priv->obj_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
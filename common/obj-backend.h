@@ -48,6 +48,24 @@ struct ObjBackend {
     int        (*remove_store) (ObjBackend *bend,
                                 const char *store_id);
 
+    /* Make objects written without syncing durable.
+     * @obj_ids is a list of object ids in the repo.
+     */
+    int        (*sync_objs) (ObjBackend *bend,
+                             const char *repo_id,
+                             int version,
+                             GList *obj_ids);
+
+    /* Optional. Set @location to a value that orders objects by their
+     * position on disk, so that callers reading many objects can read them
+     * in this order.
+     */
+    int        (*get_location) (ObjBackend *bend,
+                                const char *repo_id,
+                                int version,
+                                const char *obj_id,
+                                guint64 *location);
+
     void *priv;
 };
 
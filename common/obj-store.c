@@ -1,5 +1,7 @@
 #include "common.h"
 
+#include <pthread.h>
+
 #include "log.h"
 
 #include "seafile-session.h"
@@ -8,15 +10,94 @@
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "metrics.h"
 
 struct SeafObjStore {
     ObjBackend   *bend;
+    /* Per-thread WriteBatch. */
+    pthread_key_t batch_key;
+
+    SeafMetric *read_metric;
+    SeafMetric *write_metric;
+    SeafMetric *exists_metric;
 };
 typedef struct SeafObjStore SeafObjStore;
 
+typedef struct WriteBatch {
+    int depth;
+    /* "<version>/<repo_id>" -> list of object ids */
+    GHashTable *objs;
+} WriteBatch;
+
+static void
+free_obj_id_list (gpointer data)
+{
+    g_list_free_full ((GList *)data, g_free);
+}
+
+static void
+write_batch_free (gpointer data)
+{
+    WriteBatch *batch = data;
+
+    g_hash_table_destroy (batch->objs);
+    g_free (batch);
+}
+
 extern ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
 
+extern ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type);
+
+static ObjBackend *
+load_obj_backend (SeafileSession *seaf, const char *obj_type)
+{
+    const char *group = NULL;
+    char *name = NULL;
+    ObjBackend *bend;
+
+    if (g_strcmp0 (obj_type, "fs") == 0)
+        group = "fs_object_backend";
+    else if (g_strcmp0 (obj_type, "commits") == 0)
+        group = "commit_object_backend";
+
+    if (group && seaf->config)
+        name = g_key_file_get_string (seaf->config, group, "name", NULL);
+
+    if (g_strcmp0 (name, "pack") == 0) {
+        /* The Go fileserver reads objects from the filesystem layout only. */
+        if (g_key_file_get_boolean (seaf->config, "fileserver",
+                                    "use_go_fileserver", NULL)) {
+            seaf_warning ("The pack backend for %s objects can't be used with "
+                          "the Go fileserver.\n", obj_type);
+            g_free (name);
+            return NULL;
+        }
+        seaf_message ("Using pack backend for %s objects.\n", obj_type);
+        bend = obj_backend_pack_new (seaf->seaf_dir, obj_type);
+    } else {
+        bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    }
+
+    g_free (name);
+    return bend;
+}
+
+static SeafMetric *
+new_op_metric (const char *obj_type, const char *op)
+{
+    SeafMetric *metric;
+    char *labels;
+
+    labels = g_strdup_printf ("type=\"%s\",op=\"%s\"", obj_type, op);
+    metric = seaf_metric_histogram_new ("seafile_obj_op_duration_seconds", labels,
+                                        "Latency of object store operations.");
+    g_free (labels);
+
+    return metric;
+}
+
 struct SeafObjStore *
 seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
 {
@@ -25,13 +106,19 @@ seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
     if (!store)
         return NULL;
 
-    store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    store->bend = load_obj_backend (seaf, obj_type);
     if (!store->bend) {
         seaf_warning ("[Object store] Failed to load backend.\n");
         g_free (store);
         return NULL;
     }
 
+    pthread_key_create (&store->batch_key, write_batch_free);
+
+    store->read_metric = new_op_metric (obj_type, "read");
+    store->write_metric = new_op_metric (obj_type, "write");
+    store->exists_metric = new_op_metric (obj_type, "exists");
+
     return store;
 }
 
@@ -50,12 +137,60 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          int *len)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    int ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->read (bend, repo_id, version, obj_id, data, len);
+    start = g_get_monotonic_time ();
+    ret = bend->read (bend, repo_id, version, obj_id, data, len);
+    seaf_metric_observe (obj_store->read_metric, g_get_monotonic_time () - start);
+
+    return ret;
+}
+
+static int
+write_obj (struct SeafObjStore *obj_store,
+           const char *repo_id,
+           int version,
+           const char *obj_id,
+           void *data,
+           int len,
+           gboolean need_sync)
+{
+    ObjBackend *bend = obj_store->bend;
+    WriteBatch *batch;
+    gpointer orig_key, value = NULL;
+    GList *ids;
+    char *key;
+
+    if (!repo_id || !is_uuid_valid(repo_id) ||
+        !obj_id || !is_object_id_valid(obj_id))
+        return -1;
+
+    /* Every object written in a batch is synced when the batch is
+     * committed, including fs objects, which are written without need_sync.
+     */
+    batch = pthread_getspecific (obj_store->batch_key);
+    if (!batch || batch->depth == 0 || !bend->sync_objs)
+        return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+
+    /* Synced when the batch is committed. */
+    if (bend->write (bend, repo_id, version, obj_id, data, len, FALSE) < 0)
+        return -1;
+
+    key = g_strdup_printf ("%d/%s", version, repo_id);
+    if (g_hash_table_lookup_extended (batch->objs, key, &orig_key, &value)) {
+        g_hash_table_steal (batch->objs, key);
+        g_free (key);
+        key = orig_key;
+    }
+    ids = g_list_prepend (value, g_strdup(obj_id));
+    g_hash_table_insert (batch->objs, key, ids);
+
+    return 0;
 }
 
 int
@@ -67,13 +202,13 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           int len,
                           gboolean need_sync)
 {
-    ObjBackend *bend = obj_store->bend;
+    gint64 start = g_get_monotonic_time ();
+    int ret;
 
-    if (!repo_id || !is_uuid_valid(repo_id) ||
-        !obj_id || !is_object_id_valid(obj_id))
-        return -1;
+    ret = write_obj (obj_store, repo_id, version, obj_id, data, len, need_sync);
+    seaf_metric_observe (obj_store->write_metric, g_get_monotonic_time () - start);
 
-    return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    return ret;
 }
 
 gboolean
@@ -83,12 +218,37 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    gboolean ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return FALSE;
 
-    return bend->exists (bend, repo_id, version, obj_id);
+    start = g_get_monotonic_time ();
+    ret = bend->exists (bend, repo_id, version, obj_id);
+    seaf_metric_observe (obj_store->exists_metric, g_get_monotonic_time () - start);
+
+    return ret;
+}
+
+int
+seaf_obj_store_get_obj_location (struct SeafObjStore *obj_store,
+                                 const char *repo_id,
+                                 int version,
+                                 const char *obj_id,
+                                 guint64 *location)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->get_location)
+        return -1;
+
+    if (!repo_id || !is_uuid_valid(repo_id) ||
+        !obj_id || !is_object_id_valid(obj_id))
+        return -1;
+
+    return bend->get_location (bend, repo_id, version, obj_id, location);
 }
 
 void
@@ -142,3 +302,100 @@ seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
 
     return bend->remove_store (bend, store_id);
 }
+
+void
+seaf_obj_store_begin_write_batch (struct SeafObjStore *obj_store)
+{
+    WriteBatch *batch = pthread_getspecific (obj_store->batch_key);
+
+    if (!batch) {
+        batch = g_new0 (WriteBatch, 1);
+        batch->objs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, free_obj_id_list);
+        pthread_setspecific (obj_store->batch_key, batch);
+    }
+
+    ++batch->depth;
+}
+
+static int
+sync_write_batch (ObjBackend *bend, WriteBatch *batch)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    int version;
+    char *repo_id;
+    int ret = 0;
+
+    g_hash_table_iter_init (&iter, batch->objs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        version = atoi ((char *)key);
+        repo_id = strchr ((char *)key, '/') + 1;
+        if (bend->sync_objs (bend, repo_id, version, value) < 0) {
+            seaf_warning ("[Object store] Failed to sync objects of %s.\n",
+                          repo_id);
+            ret = -1;
+        }
+    }
+
+    g_hash_table_remove_all (batch->objs);
+    return ret;
+}
+
+int
+seaf_obj_store_flush_write_batch (struct SeafObjStore *obj_store)
+{
+    WriteBatch *batch = pthread_getspecific (obj_store->batch_key);
+
+    if (!batch || batch->depth == 0)
+        return 0;
+
+    return sync_write_batch (obj_store->bend, batch);
+}
+
+static int
+end_write_batch (struct SeafObjStore *obj_store, gboolean sync)
+{
+    WriteBatch *batch = pthread_getspecific (obj_store->batch_key);
+
+    if (!batch || batch->depth == 0) {
+        seaf_warning ("[Object store] No write batch to end.\n");
+        return -1;
+    }
+
+    if (--batch->depth > 0)
+        return 0;
+
+    if (!sync) {
+        g_hash_table_remove_all (batch->objs);
+        return 0;
+    }
+
+    return sync_write_batch (obj_store->bend, batch);
+}
+
+int
+seaf_obj_store_commit_write_batch (struct SeafObjStore *obj_store)
+{
+    return end_write_batch (obj_store, TRUE);
+}
+
+void
+seaf_obj_store_abort_write_batch (struct SeafObjStore *obj_store)
+{
+    end_write_batch (obj_store, FALSE);
+}
+
+int
+seaf_obj_store_sync_objs (struct SeafObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          GList *obj_ids)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->sync_objs)
+        return 0;
+
+    return bend->sync_objs (bend, repo_id, version, obj_ids);
+}
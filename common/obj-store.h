@@ -38,6 +38,16 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            int version,
                            const char *obj_id);
 
+/* Returns -1 if the object is not found, or if the backend doesn't know
+ * where objects are stored.
+ */
+int
+seaf_obj_store_get_obj_location (struct SeafObjStore *obj_store,
+                                 const char *repo_id,
+                                 int version,
+                                 const char *obj_id,
+                                 guint64 *location);
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -68,4 +78,42 @@ int
 seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
                              const char *store_id);
 
+/* Write batches.
+ *
+ * Objects written by the calling thread between begin and commit are not
+ * synced one by one. Committing the batch makes all of them durable in one
+ * pass, whether they were written with need_sync or not. Outside a batch,
+ * fs objects are written without need_sync and never synced, so a batch
+ * is how a commit makes its new tree durable before the commit object
+ * refers to it. Batches can be nested, only the outermost commit syncs.
+ */
+
+void
+seaf_obj_store_begin_write_batch (struct SeafObjStore *obj_store);
+
+/* Sync the objects written so far in the batch, and keep it open.
+ * Does nothing if the calling thread has no batch.
+ */
+int
+seaf_obj_store_flush_write_batch (struct SeafObjStore *obj_store);
+
+int
+seaf_obj_store_commit_write_batch (struct SeafObjStore *obj_store);
+
+/* End the batch without syncing, e.g. when the written objects are not
+ * going to be referenced.
+ */
+void
+seaf_obj_store_abort_write_batch (struct SeafObjStore *obj_store);
+
+/* Make objects written without need_sync durable in one pass, e.g. objects
+ * written by several threads for the same request. @obj_ids is a list of
+ * object ids in the repo.
+ */
+int
+seaf_obj_store_sync_objs (struct SeafObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          GList *obj_ids);
+
 #endif
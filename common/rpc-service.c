@@ -260,6 +260,19 @@ seafile_pop_event(const char *channel, GError **error)
     }
     return seaf_mq_manager_pop_event (seaf->mq_mgr, channel);
 }
+
+int
+seafile_invalidate_branch_cache (const char *repo_id, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    seaf_branch_manager_invalidate_cache (seaf->branch_mgr, repo_id);
+
+    return 0;
+}
 #endif
 
 GList*
@@ -4,6 +4,7 @@
 #include "log.h"
 
 #include "seaf-db.h"
+#include "metrics.h"
 
 #include <stdarg.h>
 #ifdef HAVE_MYSQL
@@ -55,6 +56,33 @@ typedef struct DBOperations {
 
 static DBOperations db_ops;
 
+static SeafMetric *conn_wait_metric;
+static SeafMetric *conn_fail_metric;
+
+static void
+init_db_metrics ()
+{
+    conn_wait_metric = seaf_metric_histogram_new ("seafile_db_conn_wait_seconds", NULL,
+                                                  "Time to get a database connection.");
+    conn_fail_metric = seaf_metric_counter_new ("seafile_db_conn_failures_total", NULL,
+                                                "Failures to get a database connection.");
+}
+
+static DBConnection *
+get_db_connection (SeafDB *db)
+{
+    gint64 start = g_get_monotonic_time ();
+    DBConnection *conn;
+
+    conn = db_ops.get_connection (db);
+
+    seaf_metric_observe (conn_wait_metric, g_get_monotonic_time () - start);
+    if (!conn)
+        seaf_metric_add (conn_fail_metric, 1);
+
+    return conn;
+}
+
 #ifdef HAVE_MYSQL
 
 /* MySQL Ops */
@@ -216,6 +244,7 @@ seaf_db_new_mysql (const char *host,
     db_ops.row_get_column_int64 = mysql_db_row_get_column_int64;
 
     db->pool = init_conn_pool_common (max_connections);
+    init_db_metrics ();
 
     pthread_t tid;
     int ret = pthread_create (&tid, NULL, mysql_conn_keepalive, db->pool);
@@ -274,6 +303,8 @@ seaf_db_new_sqlite (const char *db_path, int max_connections)
     db_ops.row_get_column_int = sqlite_db_row_get_column_int;
     db_ops.row_get_column_int64 = sqlite_db_row_get_column_int64;
 
+    init_db_metrics ();
+
     return db;
 }
 
@@ -286,7 +317,7 @@ seaf_db_type (SeafDB *db)
 int
 seaf_db_query (SeafDB *db, const char *sql)
 {
-    DBConnection *conn = db_ops.get_connection (db);
+    DBConnection *conn = get_db_connection (db);
     if (!conn)
         return -1;
 
@@ -358,7 +389,7 @@ seaf_db_statement_query (SeafDB *db, const char *sql, int n, ...)
     int ret;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
+    conn = get_db_connection (db);
     if (!conn)
         return -1;
 
@@ -378,7 +409,7 @@ seaf_db_statement_exists (SeafDB *db, const char *sql, gboolean *db_err, int n,
     int n_rows;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection(db);
+    conn = get_db_connection (db);
     if (!conn) {
         *db_err = TRUE;
         return FALSE;
@@ -408,7 +439,7 @@ seaf_db_statement_foreach_row (SeafDB *db, const char *sql,
     int ret;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
+    conn = get_db_connection (db);
     if (!conn)
         return -1;
 
@@ -439,7 +470,7 @@ seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...)
     int rc;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
+    conn = get_db_connection (db);
     if (!conn)
         return -1;
 
@@ -473,7 +504,7 @@ seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...)
     int rc;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
+    conn = get_db_connection (db);
     if (!conn)
         return -1;
 
@@ -507,7 +538,7 @@ seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...)
     int rc;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
+    conn = get_db_connection (db);
     if (!conn)
         return NULL;
 
@@ -530,7 +561,7 @@ SeafDBTrans *
 seaf_db_begin_transaction (SeafDB *db)
 {
     SeafDBTrans *trans = NULL;
-    DBConnection *conn = db_ops.get_connection(db);
+    DBConnection *conn = get_db_connection (db);
     if (!conn) {
         return trans;
     }
@@ -1308,7 +1308,7 @@ func genDirRecursive(repo *repomgr.Repo, toPath []string) (string, error) {
 		mode := (syscall.S_IFDIR | 0644)
 		mtime := time.Now().Unix()
 		dent := fsmgr.NewDirent("", uniqueName, uint32(mode), mtime, "", 0)
-		newdir, err := fsmgr.NewSeafdir(1, []*fsmgr.SeafDirent{dent})
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), []*fsmgr.SeafDirent{dent})
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -1332,7 +1332,7 @@ func genDirRecursive(repo *repomgr.Repo, toPath []string) (string, error) {
 		mode := (syscall.S_IFDIR | 0644)
 		mtime := time.Now().Unix()
 		dent := fsmgr.NewDirent(ret, uniqueName, uint32(mode), mtime, "", 0)
-		newdir, err := fsmgr.NewSeafdir(1, []*fsmgr.SeafDirent{dent})
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), []*fsmgr.SeafDirent{dent})
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -1810,6 +1810,8 @@ func updateBranch(repoID, newCommitID, oldCommitID, secondParentID string) error
 
 	trans.Commit()
 
+	invalidateBranchCache(repoID)
+
 	if secondParentID != "" {
 		if err := onBranchUpdated(repoID, secondParentID, false); err != nil {
 			return err
@@ -1870,7 +1872,7 @@ func postMultiFilesRecursive(repo *repomgr.Repo, dirID, toPath, user string, den
 			err := fmt.Errorf("failed to add new entries: %v", err)
 			return "", err
 		}
-		newdir, err := fsmgr.NewSeafdir(1, olddir.Entries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), olddir.Entries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -1911,7 +1913,7 @@ func postMultiFilesRecursive(repo *repomgr.Repo, dirID, toPath, user string, den
 	}
 
 	if ret != "" {
-		newdir, err := fsmgr.NewSeafdir(1, entries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), entries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -2520,7 +2522,7 @@ func putFileRecursive(repo *repomgr.Repo, dirID, toPath string, newDent *fsmgr.S
 			}
 		}
 
-		newdir, err := fsmgr.NewSeafdir(1, newEntries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), newEntries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -2559,7 +2561,7 @@ func putFileRecursive(repo *repomgr.Repo, dirID, toPath string, newDent *fsmgr.S
 	}
 
 	if ret != "" {
-		newdir, err := fsmgr.NewSeafdir(1, entries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), entries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -68,7 +68,9 @@ type fileServerOptions struct {
 	windowsEncoding           string
 	// Timeout for fs-id-list requests.
 	fsIDListRequestTimeout uint32
-	defaultQuota           int64
+	// Size after which pack-fs stops adding objects to a response.
+	maxObjectPackSize int
+	defaultQuota      int64
 	// Profile password
 	profilePassword string
 	enableProfiling bool
@@ -354,6 +356,12 @@ func parseFileServerSection(section *ini.Section) {
 			options.fixedBlockSize = blkSize
 		}
 	}
+	if key, err := section.GetKey("max_object_pack_size"); err == nil {
+		size, err := key.Uint()
+		if err == nil && size > 0 {
+			options.maxObjectPackSize = int(size) * (1 << 20)
+		}
+	}
 	if key, err := section.GetKey("web_token_expire_time"); err == nil {
 		expire, err := key.Uint()
 		if err == nil {
@@ -386,6 +394,7 @@ func initDefaultOptions() {
 	options.port = 8082
 	options.maxDownloadDirSize = 100 * (1 << 20)
 	options.fixedBlockSize = 1 << 23
+	options.maxObjectPackSize = maxObjectPackSize
 	options.maxIndexingThreads = 1
 	options.webTokenExpireTime = 7200
 	options.clusterSharedTempFileMode = 0600
@@ -597,6 +606,8 @@ func newHTTPRouter() *mux.Router {
 		appHandler(headCommitsMultiCB))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/pack-fs{slash:\\/?}",
 		appHandler(packFSCB))
+	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/pack-blocks{slash:\\/?}",
+		appHandler(packBlocksCB))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/check-fs{slash:\\/?}",
 		appHandler(checkFSCB))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/check-blocks{slash:\\/?}",
@@ -624,7 +635,7 @@ func newHTTPRouter() *mux.Router {
 }
 
 func handleProtocolVersion(rsp http.ResponseWriter, r *http.Request) {
-	io.WriteString(rsp, "{\"version\": 2}")
+	io.WriteString(rsp, "{\"version\": 3}")
 }
 
 type appError struct {
@@ -0,0 +1,265 @@
+package fsmgr
+
+import (
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"sort"
+)
+
+// Fs objects with version >= BinaryObjVersion are stored in a binary format,
+// which can be read without decompressing and parsing JSON.
+//
+// Every object starts with a header. Integers are little-endian.
+//
+//	magic "SFO2" | type u8 | version u8 | flags u8 | compression u8 | count u32
+//
+// A file object is followed by the file size (u64) and count raw block ids.
+//
+// A dir object is followed by count fixed-size dirent records and a string
+// table. Each record holds the raw object id, mode, mtime, size, and the
+// offset and length of the dirent name in the string table, followed by the
+// modifier. When the dirents are sorted by name in descending order, as the
+// server always writes them, the sorted flag is set, so a name can be looked
+// up with a binary search over the records.
+//
+// The object id is the sha1 of the whole object. Objects are not compressed:
+// ids are stored as raw bytes, so there is little left to compress. The
+// compression byte is reserved for that.
+const (
+	BinaryObjVersion = 2
+
+	binaryMagic      = "SFO2"
+	binaryHdrSize    = 12
+	binaryDirentSize = 48
+
+	binaryFlagSorted = 1
+
+	compressionNone = 0
+)
+
+// DirVersionFromRepoVersion returns the version of dir objects created in a repo.
+func DirVersionFromRepoVersion(repoVersion int) int {
+	if repoVersion >= BinaryObjVersion {
+		return BinaryObjVersion
+	}
+	return 1
+}
+
+func isBinaryObject(p []byte) bool {
+	return len(p) >= binaryHdrSize && string(p[:4]) == binaryMagic
+}
+
+func putBinaryHdr(buf []byte, objType, version int, flags byte, count int) {
+	copy(buf, binaryMagic)
+	buf[4] = byte(objType)
+	buf[5] = byte(version)
+	buf[6] = flags
+	buf[7] = compressionNone
+	binary.LittleEndian.PutUint32(buf[8:], uint32(count))
+}
+
+func parseBinaryHdr(p []byte, objType int) (version int, flags byte, count int, err error) {
+	if !isBinaryObject(p) {
+		return 0, 0, 0, fmt.Errorf("not a binary fs object")
+	}
+	if int(p[4]) != objType {
+		return 0, 0, 0, fmt.Errorf("object type is %d, expected %d", p[4], objType)
+	}
+	if p[7] != compressionNone {
+		return 0, 0, 0, fmt.Errorf("unsupported compression %d", p[7])
+	}
+	return int(p[5]), p[6], int(binary.LittleEndian.Uint32(p[8:])), nil
+}
+
+func decodeObjID(id string) ([]byte, error) {
+	raw, err := hex.DecodeString(id)
+	if err != nil || len(raw) != 20 {
+		return nil, fmt.Errorf("invalid object id %s", id)
+	}
+	return raw, nil
+}
+
+func (file *Seafile) toBinary() ([]byte, error) {
+	buf := make([]byte, binaryHdrSize+8+len(file.BlkIDs)*20)
+	putBinaryHdr(buf, SeafMetadataTypeFile, file.Version, 0, len(file.BlkIDs))
+	binary.LittleEndian.PutUint64(buf[binaryHdrSize:], file.FileSize)
+
+	p := buf[binaryHdrSize+8:]
+	for i, blkID := range file.BlkIDs {
+		raw, err := decodeObjID(blkID)
+		if err != nil {
+			return nil, err
+		}
+		copy(p[i*20:], raw)
+	}
+
+	return buf, nil
+}
+
+func (file *Seafile) fromBinary(p []byte) error {
+	version, _, count, err := parseBinaryHdr(p, SeafMetadataTypeFile)
+	if err != nil {
+		return err
+	}
+	if len(p) != binaryHdrSize+8+count*20 {
+		return fmt.Errorf("bad length of file object %s", file.FileID)
+	}
+
+	file.Version = version
+	file.FileType = SeafMetadataTypeFile
+	file.FileSize = binary.LittleEndian.Uint64(p[binaryHdrSize:])
+	file.BlkIDs = make([]string, count)
+	ids := p[binaryHdrSize+8:]
+	for i := 0; i < count; i++ {
+		file.BlkIDs[i] = hex.EncodeToString(ids[i*20 : i*20+20])
+	}
+
+	return nil
+}
+
+func direntsSorted(entries []*SeafDirent) bool {
+	return sort.SliceIsSorted(entries, func(i, j int) bool {
+		return entries[i].Name > entries[j].Name
+	})
+}
+
+func (dir *SeafDir) toBinary() ([]byte, error) {
+	strLen := 0
+	for _, dent := range dir.Entries {
+		strLen += len(dent.Name)
+		if IsRegular(dent.Mode) {
+			strLen += len(dent.Modifier)
+		}
+	}
+
+	n := len(dir.Entries)
+	buf := make([]byte, binaryHdrSize+n*binaryDirentSize+strLen)
+	var flags byte
+	if direntsSorted(dir.Entries) {
+		flags |= binaryFlagSorted
+	}
+	putBinaryHdr(buf, SeafMetadataTypeDir, dir.Version, flags, n)
+
+	strs := buf[binaryHdrSize+n*binaryDirentSize:]
+	strOff := 0
+	for i, dent := range dir.Entries {
+		var modifier string
+		var size int64
+		if IsRegular(dent.Mode) {
+			modifier = dent.Modifier
+			size = dent.Size
+		}
+		if len(dent.Name) > 0xffff || len(modifier) > 0xffff {
+			return nil, fmt.Errorf("dirent name or modifier is too long")
+		}
+		raw, err := decodeObjID(dent.ID)
+		if err != nil {
+			return nil, err
+		}
+
+		rec := buf[binaryHdrSize+i*binaryDirentSize:]
+		copy(rec, raw)
+		binary.LittleEndian.PutUint32(rec[20:], dent.Mode)
+		binary.LittleEndian.PutUint64(rec[24:], uint64(dent.Mtime))
+		binary.LittleEndian.PutUint64(rec[32:], uint64(size))
+		binary.LittleEndian.PutUint32(rec[40:], uint32(strOff))
+		binary.LittleEndian.PutUint16(rec[44:], uint16(len(dent.Name)))
+		binary.LittleEndian.PutUint16(rec[46:], uint16(len(modifier)))
+
+		strOff += copy(strs[strOff:], dent.Name)
+		strOff += copy(strs[strOff:], modifier)
+	}
+
+	return buf, nil
+}
+
+func decodeDirent(p, strs []byte, i int) (*SeafDirent, error) {
+	rec := p[binaryHdrSize+i*binaryDirentSize:]
+	off := int(binary.LittleEndian.Uint32(rec[40:]))
+	nameLen := int(binary.LittleEndian.Uint16(rec[44:]))
+	modifierLen := int(binary.LittleEndian.Uint16(rec[46:]))
+	if off+nameLen+modifierLen > len(strs) {
+		return nil, fmt.Errorf("bad dirent %d", i)
+	}
+
+	dent := new(SeafDirent)
+	dent.ID = hex.EncodeToString(rec[:20])
+	dent.Mode = binary.LittleEndian.Uint32(rec[20:])
+	dent.Mtime = int64(binary.LittleEndian.Uint64(rec[24:]))
+	dent.Name = string(strs[off : off+nameLen])
+	if IsRegular(dent.Mode) {
+		dent.Size = int64(binary.LittleEndian.Uint64(rec[32:]))
+		dent.Modifier = string(strs[off+nameLen : off+nameLen+modifierLen])
+	}
+
+	return dent, nil
+}
+
+func direntName(p, strs []byte, i int) string {
+	rec := p[binaryHdrSize+i*binaryDirentSize:]
+	off := int(binary.LittleEndian.Uint32(rec[40:]))
+	nameLen := int(binary.LittleEndian.Uint16(rec[44:]))
+	if off+nameLen > len(strs) {
+		return ""
+	}
+	return string(strs[off : off+nameLen])
+}
+
+func (dir *SeafDir) fromBinary(p []byte) error {
+	version, _, count, err := parseBinaryHdr(p, SeafMetadataTypeDir)
+	if err != nil {
+		return err
+	}
+	strBase := binaryHdrSize + count*binaryDirentSize
+	if len(p) < strBase {
+		return fmt.Errorf("bad length of dir object %s", dir.DirID)
+	}
+	strs := p[strBase:]
+
+	dir.Version = version
+	dir.DirType = SeafMetadataTypeDir
+	dir.Entries = make([]*SeafDirent, count)
+	for i := 0; i < count; i++ {
+		dent, err := decodeDirent(p, strs, i)
+		if err != nil {
+			return fmt.Errorf("failed to decode dir object %s: %v", dir.DirID, err)
+		}
+		dir.Entries[i] = dent
+	}
+
+	return nil
+}
+
+// LookupDirent finds the dirent with the given name in a binary dir object,
+// without decoding the other dirents. It returns nil if there is no such
+// dirent.
+func LookupDirent(p []byte, name string) (*SeafDirent, error) {
+	_, flags, count, err := parseBinaryHdr(p, SeafMetadataTypeDir)
+	if err != nil {
+		return nil, err
+	}
+	strBase := binaryHdrSize + count*binaryDirentSize
+	if len(p) < strBase {
+		return nil, fmt.Errorf("bad length of dir object")
+	}
+	strs := p[strBase:]
+
+	if flags&binaryFlagSorted != 0 {
+		// Names are in descending order.
+		i := sort.Search(count, func(i int) bool {
+			return direntName(p, strs, i) <= name
+		})
+		if i < count && direntName(p, strs, i) == name {
+			return decodeDirent(p, strs, i)
+		}
+		return nil, nil
+	}
+
+	for i := 0; i < count; i++ {
+		if direntName(p, strs, i) == name {
+			return decodeDirent(p, strs, i)
+		}
+	}
+	return nil, nil
+}
@@ -0,0 +1,167 @@
+package fsmgr
+
+import (
+	"bytes"
+	"fmt"
+	"sort"
+	"testing"
+)
+
+func genDirents(n int) []*SeafDirent {
+	var entries []*SeafDirent
+	for i := 0; i < n; i++ {
+		name := fmt.Sprintf("file-%06d.txt", i)
+		entries = append(entries, NewDirent(blkID, name, 0x81a4, 1600000000+int64(i), "user@example.com", int64(i)*1024))
+	}
+	for i := 0; i < n/10; i++ {
+		name := fmt.Sprintf("dir-%06d", i)
+		entries = append(entries, NewDirent(subDirID, name, 0x4000, 1600000000, "", 0))
+	}
+	sort.Slice(entries, func(i, j int) bool {
+		return entries[i].Name > entries[j].Name
+	})
+	return entries
+}
+
+func TestBinarySeafdir(t *testing.T) {
+	entries := genDirents(100)
+	seafdir, err := NewSeafdir(BinaryObjVersion, entries)
+	if err != nil {
+		t.Fatalf("Failed to new seafdir : %v.\n", err)
+	}
+
+	err = SaveSeafdir(repoID, seafdir)
+	if err != nil {
+		t.Fatalf("Failed to save seafdir : %v.\n", err)
+	}
+
+	dir, err := GetSeafdir(repoID, seafdir.DirID)
+	if err != nil {
+		t.Fatalf("Failed to get seafdir : %v.\n", err)
+	}
+	if dir.Version != BinaryObjVersion || len(dir.Entries) != len(entries) {
+		t.Fatalf("Wrong dir content.\n")
+	}
+	for i, dent := range dir.Entries {
+		if *dent != *entries[i] {
+			t.Errorf("Wrong dirent %d: %+v.\n", i, dent)
+		}
+	}
+
+	dent, err := LookupDirent(seafdir.data, "file-000042.txt")
+	if err != nil || dent == nil || dent.Size != 42*1024 {
+		t.Errorf("Failed to look up dirent : %v.\n", err)
+	}
+	dent, err = LookupDirent(seafdir.data, "no-such-file")
+	if err != nil || dent != nil {
+		t.Errorf("Found a dirent that does not exist.\n")
+	}
+
+	subDir := NewDirent(seafdir.DirID, "sub", 0x4000, 1600000000, "", 0)
+	root, err := NewSeafdir(BinaryObjVersion, []*SeafDirent{subDir})
+	if err != nil {
+		t.Fatalf("Failed to new seafdir : %v.\n", err)
+	}
+	err = SaveSeafdir(repoID, root)
+	if err != nil {
+		t.Fatalf("Failed to save seafdir : %v.\n", err)
+	}
+
+	id, mode, err := GetObjIDByPath(repoID, root.DirID, "/sub/file-000042.txt")
+	if err != nil || id != blkID || !IsRegular(mode) {
+		t.Errorf("Failed to get obj id by path : %v.\n", err)
+	}
+	id, _, err = GetObjIDByPath(repoID, root.DirID, "/sub/no-such-file")
+	if err != nil || id != "" {
+		t.Errorf("Found a path that does not exist.\n")
+	}
+	_, _, err = GetObjIDByPath(repoID, root.DirID, "/sub/file-000042.txt/x")
+	if err != ErrPathNoExist {
+		t.Errorf("Looked up a path under a file.\n")
+	}
+}
+
+func TestBinarySeafile(t *testing.T) {
+	seafile, err := NewSeafile(BinaryObjVersion, 100, []string{blkID, subDirID})
+	if err != nil {
+		t.Fatalf("Failed to new seafile : %v.\n", err)
+	}
+
+	err = SaveSeafile(repoID, seafile)
+	if err != nil {
+		t.Fatalf("Failed to save seafile : %v.\n", err)
+	}
+
+	file, err := GetSeafile(repoID, seafile.FileID)
+	if err != nil {
+		t.Fatalf("Failed to get seafile : %v.\n", err)
+	}
+	if file.FileSize != 100 || len(file.BlkIDs) != 2 ||
+		file.BlkIDs[0] != blkID || file.BlkIDs[1] != subDirID {
+		t.Errorf("Wrong file content.\n")
+	}
+}
+
+func benchmarkEncodeDir(b *testing.B, version int) {
+	entries := genDirents(1000)
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		dir, err := NewSeafdir(version, entries)
+		if err != nil {
+			b.Fatal(err)
+		}
+		var buf bytes.Buffer
+		if err := dir.ToData(&buf); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func benchmarkDecodeDir(b *testing.B, version int) {
+	dir, err := NewSeafdir(version, genDirents(1000))
+	if err != nil {
+		b.Fatal(err)
+	}
+	var buf bytes.Buffer
+	if err := dir.ToData(&buf); err != nil {
+		b.Fatal(err)
+	}
+	data := buf.Bytes()
+	b.SetBytes(int64(len(data)))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		seafdir := new(SeafDir)
+		if err := seafdir.FromData(data); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkEncodeDirJSON(b *testing.B) {
+	benchmarkEncodeDir(b, 1)
+}
+
+func BenchmarkEncodeDirBinary(b *testing.B) {
+	benchmarkEncodeDir(b, BinaryObjVersion)
+}
+
+func BenchmarkDecodeDirJSON(b *testing.B) {
+	benchmarkDecodeDir(b, 1)
+}
+
+func BenchmarkDecodeDirBinary(b *testing.B) {
+	benchmarkDecodeDir(b, BinaryObjVersion)
+}
+
+func BenchmarkLookupDirentBinary(b *testing.B) {
+	dir, err := NewSeafdir(BinaryObjVersion, genDirents(1000))
+	if err != nil {
+		b.Fatal(err)
+	}
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := LookupDirent(dir.data, "file-000500.txt"); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
@@ -250,6 +250,17 @@ func NewSeafdir(version int, entries []*SeafDirent) (*SeafDir, error) {
 		dir.DirID = EmptySha1
 		return dir, nil
 	}
+	if version >= BinaryObjVersion {
+		data, err := dir.toBinary()
+		if err != nil {
+			err := fmt.Errorf("failed to convert seafdir to binary: %v", err)
+			return nil, err
+		}
+		dir.data = data
+		checksum := sha1.Sum(data)
+		dir.DirID = hex.EncodeToString(checksum[:])
+		return dir, nil
+	}
 	jsonstr, err := dir.toJSON()
 	if err != nil {
 		err := fmt.Errorf("failed to convert seafdir to json")
@@ -273,6 +284,18 @@ func NewSeafile(version int, fileSize int64, blkIDs []string) (*Seafile, error)
 		return seafile, nil
 	}
 
+	if version >= BinaryObjVersion {
+		data, err := seafile.toBinary()
+		if err != nil {
+			err := fmt.Errorf("failed to convert seafile to binary: %v", err)
+			return nil, err
+		}
+		seafile.data = data
+		checkSum := sha1.Sum(data)
+		seafile.FileID = hex.EncodeToString(checkSum[:])
+		return seafile, nil
+	}
+
 	jsonstr, err := seafile.toJSON()
 	if err != nil {
 		err := fmt.Errorf("failed to convert seafile to json")
@@ -319,15 +342,21 @@ func compress(p []byte) ([]byte, error) {
 	return out.Bytes(), nil
 }
 
-// FromData reads from p and converts JSON-encoded data to Seafile.
+// FromData reads from p and converts JSON-encoded or binary data to Seafile.
 func (seafile *Seafile) FromData(p []byte) error {
-	b, err := uncompress(p)
-	if err != nil {
-		return err
-	}
-	err = json.Unmarshal(b, seafile)
-	if err != nil {
-		return err
+	if isBinaryObject(p) {
+		if err := seafile.fromBinary(p); err != nil {
+			return err
+		}
+	} else {
+		b, err := uncompress(p)
+		if err != nil {
+			return err
+		}
+		err = json.Unmarshal(b, seafile)
+		if err != nil {
+			return err
+		}
 	}
 
 	if seafile.FileType != SeafMetadataTypeFile {
@@ -349,13 +378,18 @@ func (seafile *Seafile) FromData(p []byte) error {
 }
 
 // ToData converts seafile to JSON-encoded data and writes to w.
+// Binary objects are written as they are.
 func (seafile *Seafile) ToData(w io.Writer) error {
-	buf, err := compress(seafile.data)
-	if err != nil {
-		return err
+	buf := seafile.data
+	if !isBinaryObject(buf) {
+		var err error
+		buf, err = compress(seafile.data)
+		if err != nil {
+			return err
+		}
 	}
 
-	_, err = w.Write(buf)
+	_, err := w.Write(buf)
 	if err != nil {
 		return err
 	}
@@ -364,13 +398,18 @@ func (seafile *Seafile) ToData(w io.Writer) error {
 }
 
 // ToData converts seafdir to JSON-encoded data and writes to w.
+// Binary objects are written as they are.
 func (seafdir *SeafDir) ToData(w io.Writer) error {
-	buf, err := compress(seafdir.data)
-	if err != nil {
-		return err
+	buf := seafdir.data
+	if !isBinaryObject(buf) {
+		var err error
+		buf, err = compress(seafdir.data)
+		if err != nil {
+			return err
+		}
 	}
 
-	_, err = w.Write(buf)
+	_, err := w.Write(buf)
 	if err != nil {
 		return err
 	}
@@ -378,15 +417,21 @@ func (seafdir *SeafDir) ToData(w io.Writer) error {
 	return nil
 }
 
-// FromData reads from p and converts JSON-encoded data to SeafDir.
+// FromData reads from p and converts JSON-encoded or binary data to SeafDir.
 func (seafdir *SeafDir) FromData(p []byte) error {
-	b, err := uncompress(p)
-	if err != nil {
-		return err
-	}
-	err = json.Unmarshal(b, seafdir)
-	if err != nil {
-		return err
+	if isBinaryObject(p) {
+		if err := seafdir.fromBinary(p); err != nil {
+			return err
+		}
+	} else {
+		b, err := uncompress(p)
+		if err != nil {
+			return err
+		}
+		err = json.Unmarshal(b, seafdir)
+		if err != nil {
+			return err
+		}
 	}
 	if seafdir.DirType != SeafMetadataTypeDir {
 		return fmt.Errorf("object %s is not a dir", seafdir.DirID)
@@ -617,46 +662,81 @@ func GetSeafdirIDByPath(repoID, rootID, path string) (string, error) {
 	return dirID, nil
 }
 
+// lookupDirent finds the dirent with the given name in a dir. Dirs in the
+// binary format are searched without decoding the other dirents. It returns
+// nil if there is no such dirent.
+func lookupDirent(repoID, dirID, name string) (*SeafDirent, error) {
+	if dirID == EmptySha1 {
+		return nil, nil
+	}
+
+	var buf bytes.Buffer
+	err := ReadRaw(repoID, dirID, &buf)
+	if err != nil {
+		errors := fmt.Errorf("failed to read seafdir object from storage : %v", err)
+		return nil, errors
+	}
+
+	if isBinaryObject(buf.Bytes()) {
+		dent, err := LookupDirent(buf.Bytes(), name)
+		if err != nil {
+			errors := fmt.Errorf("failed to parse seafdir object %s/%s : %v", repoID, dirID, err)
+			return nil, errors
+		}
+		return dent, nil
+	}
+
+	seafdir := new(SeafDir)
+	seafdir.DirID = dirID
+	err = seafdir.FromData(buf.Bytes())
+	if err != nil {
+		errors := fmt.Errorf("failed to parse seafdir object %s/%s : %v", repoID, dirID, err)
+		return nil, errors
+	}
+	for _, dent := range seafdir.Entries {
+		if dent.Name == name {
+			return dent, nil
+		}
+	}
+
+	return nil, nil
+}
+
 // GetObjIDByPath gets the obj id by path
 func GetObjIDByPath(repoID, rootID, path string) (string, uint32, error) {
-	var name string
-	var baseDir *SeafDir
 	formatPath := filepath.Join(path)
 	if len(formatPath) == 0 || formatPath == "/" {
 		return rootID, syscall.S_IFDIR, nil
 	}
-	index := strings.Index(formatPath, "/")
-	if index < 0 {
-		dir, err := GetSeafdir(repoID, rootID)
-		if err != nil {
-			err := fmt.Errorf("failed to find root dir %s: %v", rootID, err)
-			return "", 0, err
-		}
-		name = formatPath
-		baseDir = dir
-	} else {
-		name = filepath.Base(formatPath)
-		dirName := filepath.Dir(formatPath)
-		dir, err := GetSeafdirByPath(repoID, rootID, dirName)
+
+	parts := strings.FieldsFunc(formatPath, comp)
+	dirID := rootID
+	for i, name := range parts {
+		dent, err := lookupDirent(repoID, dirID, name)
 		if err != nil {
-			if err == ErrPathNoExist {
-				return "", syscall.S_IFDIR, ErrPathNoExist
+			if i == 0 {
+				err := fmt.Errorf("failed to find root dir %s: %v", rootID, err)
+				return "", 0, err
 			}
+			dirName := filepath.Join(parts[:i]...)
 			err := fmt.Errorf("failed to find dir %s in repo %s: %v", dirName, repoID, err)
 			return "", syscall.S_IFDIR, err
 		}
-		baseDir = dir
-	}
 
-	entries := baseDir.Entries
-	for _, de := range entries {
-		if de.Name == name {
-			return de.ID, de.Mode, nil
+		if i == len(parts)-1 {
+			if dent == nil {
+				return "", 0, nil
+			}
+			return dent.ID, dent.Mode, nil
+		}
+
+		if dent == nil || !IsDir(dent.Mode) {
+			return "", syscall.S_IFDIR, ErrPathNoExist
 		}
+		dirID = dent.ID
 	}
 
 	return "", 0, nil
-
 }
 
 // GetFileCountInfoByPath gets the count info of file by path.
@@ -109,8 +109,17 @@ func mergeTreesRecursive(storeID string, trees []*fsmgr.SeafDir, baseDir string,
 		}
 	}
 
+	// Keep the dir version of the trees being merged, so that repos
+	// with binary fs objects stay binary.
+	version := 1
+	for i := 0; i < n; i++ {
+		if trees[i] != nil && trees[i].Version > version {
+			version = trees[i].Version
+		}
+	}
+
 	sort.Sort(Dirents(mergedDents))
-	mergedTree, err := fsmgr.NewSeafdir(1, mergedDents)
+	mergedTree, err := fsmgr.NewSeafdir(version, mergedDents)
 	if err != nil {
 		err := fmt.Errorf("failed to new seafdir: %v", err)
 		return err
@@ -44,7 +44,8 @@ const (
 	permExpireTime             = 7200
 	virtualRepoExpireTime      = 7200
 	syncAPICleaningIntervalSec = 300
-	maxObjectPackSize          = 1 << 20 // 1MB
+	maxObjectPackSize          = 1 << 20  // 1MB
+	maxBlockPackSize           = 64 << 20 // 64MB
 	fsIdWorkers                = 10
 )
 
@@ -603,14 +604,95 @@ func packFSCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		data.Write(tmp.Bytes())
 
 		totalSize += tmp.Len()
-		if totalSize >= maxObjectPackSize {
+		if totalSize >= options.maxObjectPackSize {
 			break
 		}
 	}
 
-	rsp.Header().Set("Content-Length", strconv.Itoa(data.Len()))
+	writeMaybeCompressed(rsp, r, data.Bytes())
+	return nil
+}
+
+// packBlocksCB sends the requested blocks in the pack-fs format, with the
+// block size instead of the object size. The response is streamed, so
+// blocks are not buffered in memory. The pack stops after about
+// maxBlockPackSize bytes, the client requests the rest again.
+func packBlocksCB(rsp http.ResponseWriter, r *http.Request) *appError {
+	vars := mux.Vars(r)
+	repoID := vars["repoid"]
+
+	user, appErr := validateToken(r, repoID, false)
+	if appErr != nil {
+		return appErr
+	}
+	appErr = checkPermission(repoID, user, "download", false)
+	if appErr != nil {
+		return appErr
+	}
+
+	storeID, err := getRepoStoreID(repoID)
+	if err != nil {
+		err := fmt.Errorf("Failed to get repo store id by repo id %s: %v", repoID, err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	var blockIDList []string
+	if err := json.NewDecoder(r.Body).Decode(&blockIDList); err != nil {
+		return &appError{nil, err.Error(), http.StatusBadRequest}
+	}
+	if len(blockIDList) == 0 {
+		return &appError{nil, "", http.StatusBadRequest}
+	}
+	for _, blockID := range blockIDList {
+		if !utils.IsObjectIDValid(blockID) {
+			msg := fmt.Sprintf("Invalid block id %s", blockID)
+			return &appError{nil, msg, http.StatusBadRequest}
+		}
+	}
+
+	// Stat the blocks to send before the response is started, so that a
+	// missing block is reported with an error status.
+	var blockSizes []int64
+	var totalSize int64
+	for _, blockID := range blockIDList {
+		blockSize, err := blockmgr.Stat(storeID, blockID)
+		if err != nil {
+			err := fmt.Errorf("failed to stat block %.8s:%s: %v", storeID, blockID, err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		blockSizes = append(blockSizes, blockSize)
+
+		totalSize += blockSize
+		if totalSize >= maxBlockPackSize {
+			break
+		}
+	}
+
+	flusher, _ := rsp.(http.Flusher)
 	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(data.Bytes())
+
+	for i, blockSize := range blockSizes {
+		blockID := blockIDList[i]
+		hdr := make([]byte, 44)
+		copy(hdr, blockID)
+		binary.BigEndian.PutUint32(hdr[40:], uint32(blockSize))
+		if _, err := rsp.Write(hdr); err != nil {
+			panic(http.ErrAbortHandler)
+		}
+		if err := blockmgr.Read(storeID, blockID, rsp); err != nil {
+			if !isNetworkErr(err) {
+				log.Printf("failed to read block %.8s:%s: %v", storeID, blockID, err)
+			}
+			// The status has been sent. Abort the connection so that the
+			// client sees a truncated response instead of a short pack.
+			panic(http.ErrAbortHandler)
+		}
+		if flusher != nil {
+			flusher.Flush()
+		}
+	}
+
+	sendStatisticMsg(storeID, user, "sync-file-download", uint64(totalSize))
 	return nil
 }
 
@@ -766,7 +848,13 @@ func putSendBlockCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
-	if err := blockmgr.Write(storeID, blockID, r.Body); err != nil {
+	body, err := requestBody(r, maxInflatedBlockSize)
+	if err != nil {
+		return &appError{nil, err.Error(), http.StatusBadRequest}
+	}
+	defer body.Close()
+
+	if err := blockmgr.Write(storeID, blockID, body); err != nil {
 		err := fmt.Errorf("Failed to close block %.8s:%s", storeID, blockID)
 		return &appError{err, "", http.StatusInternalServerError}
 	}
@@ -806,6 +894,30 @@ func getBlockInfo(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
+	rsp.Header().Set("Vary", "Accept-Encoding")
+
+	// Only blocks whose first bytes look compressible are read into memory.
+	if acceptsDeflate(r) {
+		w := newSampledWriter(rsp, r, blockSize)
+		err := blockmgr.Read(storeID, blockID, w)
+		if err == nil {
+			err = w.Close()
+		}
+		if err != nil {
+			if w.decided && !w.compress {
+				// The response has been started.
+				if !isNetworkErr(err) {
+					log.Printf("failed to read block %s: %v", blockID, err)
+				}
+				return nil
+			}
+			err := fmt.Errorf("failed to read block %s: %v", blockID, err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		sendStatisticMsg(storeID, user, "sync-file-download", uint64(blockSize))
+		return nil
+	}
+
 	blockLen := fmt.Sprintf("%d", blockSize)
 	rsp.Header().Set("Content-Length", blockLen)
 	if err := blockmgr.Read(storeID, blockID, rsp); err != nil {
@@ -1202,6 +1314,14 @@ func publishRepoEvent(rData *repoEventData) {
 	}
 }
 
+// invalidateBranchCache drops the heads of repoID cached by seaf-server,
+// after its branches are changed here.
+func invalidateBranchCache(repoID string) {
+	if _, err := rpcclient.Call("invalidate_branch_cache", repoID); err != nil {
+		log.Printf("Failed to invalidate branch cache of repo %s: %v", repoID, err)
+	}
+}
+
 func publishUpdateEvent(repoID string, commitID string) {
 	buf := fmt.Sprintf("repo-update\t%s\t%s", repoID, commitID)
 	if _, err := rpcclient.Call("publish_event", seafileServerChannelEvent, buf); err != nil {
@@ -0,0 +1,188 @@
+package main
+
+import (
+	"bytes"
+	"compress/zlib"
+	"errors"
+	"io"
+	"net/http"
+	"strconv"
+	"strings"
+)
+
+// Transport compression of the sync protocol (version 3). Clients send
+// "Accept-Encoding: deflate" when downloading blocks and fs object packs,
+// and may upload blocks with "Content-Encoding: deflate". Data is in the
+// zlib format. Responses are only compressed when samples of the content
+// look compressible, so encrypted and compressed content is sent as is.
+const (
+	minCompressSize    = 1024
+	compressSamples    = 4
+	compressSampleSize = 4096
+	// Blocks of clients are at most 8MB by default, this leaves room for
+	// clients configured with larger blocks.
+	maxBlockSize         = 16 << 20
+	maxInflatedBlockSize = maxBlockSize
+)
+
+var errUnsupportedEncoding = errors.New("unsupported content encoding")
+
+func acceptsDeflate(r *http.Request) bool {
+	for _, value := range strings.Split(r.Header.Get("Accept-Encoding"), ",") {
+		params := ""
+		if i := strings.Index(value, ";"); i >= 0 {
+			value, params = value[:i], strings.TrimSpace(value[i+1:])
+		}
+		if params == "q=0" || params == "q=0.0" {
+			continue
+		}
+		if strings.EqualFold(strings.TrimSpace(value), "deflate") {
+			return true
+		}
+	}
+	return false
+}
+
+// isCompressible samples a few pieces of data and estimates the collision
+// entropy of their bytes, -log2(sum(p^2)). Random, encrypted or compressed
+// data is close to 8 bits per byte. Data above 7.5 bits, i.e. when
+// sum(p^2) < 2^-7.5 ~= 1/181, is not compressed.
+func isCompressible(data []byte) bool {
+	var counts [256]int64
+	var nSampled, sum int64
+
+	for i := 0; i < compressSamples; i++ {
+		start := len(data) / compressSamples * i
+		end := start + compressSampleSize
+		if end > len(data) {
+			end = len(data)
+		}
+		for _, b := range data[start:end] {
+			counts[b]++
+		}
+		nSampled += int64(end - start)
+	}
+
+	for _, n := range counts {
+		sum += n * n
+	}
+
+	return sum*181 >= nSampled*nSampled
+}
+
+// writeMaybeCompressed writes data as the response body, deflate encoded
+// if the client accepts it and it saves at least 1/10 of the size.
+func writeMaybeCompressed(rsp http.ResponseWriter, r *http.Request, data []byte) {
+	rsp.Header().Set("Vary", "Accept-Encoding")
+	if len(data) >= minCompressSize && acceptsDeflate(r) && isCompressible(data) {
+		var buf bytes.Buffer
+		w, _ := zlib.NewWriterLevel(&buf, zlib.BestSpeed)
+		w.Write(data)
+		w.Close()
+		if buf.Len() < len(data)-len(data)/10 {
+			rsp.Header().Set("Content-Encoding", "deflate")
+			data = buf.Bytes()
+		}
+	}
+
+	rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
+	rsp.WriteHeader(http.StatusOK)
+	rsp.Write(data)
+}
+
+// sampledWriter writes a block of a known size as the response body. The
+// first bytes are held back to decide whether the block is worth
+// compressing. Blocks that are not, e.g. blocks of encrypted repos or of
+// compressed files, are streamed as is. The others are buffered and
+// compressed when the writer is closed.
+type sampledWriter struct {
+	rsp      http.ResponseWriter
+	r        *http.Request
+	size     int64
+	buf      bytes.Buffer
+	decided  bool
+	compress bool
+}
+
+func newSampledWriter(rsp http.ResponseWriter, r *http.Request, size int64) *sampledWriter {
+	return &sampledWriter{rsp: rsp, r: r, size: size}
+}
+
+func (w *sampledWriter) decide() error {
+	w.decided = true
+	w.compress = w.size >= minCompressSize && isCompressible(w.buf.Bytes())
+	if w.compress {
+		return nil
+	}
+
+	w.rsp.Header().Set("Content-Length", strconv.FormatInt(w.size, 10))
+	w.rsp.WriteHeader(http.StatusOK)
+	_, err := w.rsp.Write(w.buf.Bytes())
+	w.buf.Reset()
+	return err
+}
+
+func (w *sampledWriter) Write(p []byte) (int, error) {
+	if w.decided && !w.compress {
+		return w.rsp.Write(p)
+	}
+
+	w.buf.Write(p)
+	if !w.decided && (w.buf.Len() >= compressSamples*compressSampleSize ||
+		int64(w.buf.Len()) >= w.size) {
+		if err := w.decide(); err != nil {
+			return 0, err
+		}
+	}
+	return len(p), nil
+}
+
+// Close sends the buffered block if it's compressed.
+func (w *sampledWriter) Close() error {
+	if !w.decided {
+		if err := w.decide(); err != nil {
+			return err
+		}
+	}
+	if w.compress {
+		writeMaybeCompressed(w.rsp, w.r, w.buf.Bytes())
+	}
+	return nil
+}
+
+// requestBody returns a reader of the decoded request body.
+func requestBody(r *http.Request, maxSize int64) (io.ReadCloser, error) {
+	encoding := r.Header.Get("Content-Encoding")
+	if encoding == "" || strings.EqualFold(encoding, "identity") {
+		return r.Body, nil
+	}
+	if !strings.EqualFold(encoding, "deflate") {
+		return nil, errUnsupportedEncoding
+	}
+
+	zr, err := zlib.NewReader(r.Body)
+	if err != nil {
+		return nil, err
+	}
+	return &limitedReadCloser{zr, maxSize}, nil
+}
+
+// limitedReadCloser fails instead of returning EOF when more than n bytes
+// are read.
+type limitedReadCloser struct {
+	rc io.ReadCloser
+	n  int64
+}
+
+func (l *limitedReadCloser) Read(p []byte) (int, error) {
+	n, err := l.rc.Read(p)
+	l.n -= int64(n)
+	if l.n < 0 {
+		return n, errors.New("inflated body is too large")
+	}
+	return n, err
+}
+
+func (l *limitedReadCloser) Close() error {
+	return l.rc.Close()
+}
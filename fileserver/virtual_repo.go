@@ -255,6 +255,7 @@ func handleMissingVirtualRepo(repo *repomgr.Repo, head *commitmgr.Commit, vInfo
 
 			if err == fsmgr.ErrPathNoExist {
 				repomgr.DelVirtualRepo(vInfo.RepoID, cloudMode)
+				invalidateBranchCache(vInfo.RepoID)
 			}
 			err := fmt.Errorf("failed to find %s under commit %s in repo %s", parPath, parent.CommitID, repo.StoreID)
 			return "", err
@@ -297,6 +298,7 @@ func handleMissingVirtualRepo(repo *repomgr.Repo, head *commitmgr.Commit, vInfo
 
 	if !isRenamed {
 		repomgr.DelVirtualRepo(vInfo.RepoID, cloudMode)
+		invalidateBranchCache(vInfo.RepoID)
 	}
 
 	return returnPath, nil
@@ -1138,6 +1138,9 @@ seafile_publish_event(const char *channel, const char *content, GError **error);
 json_t *
 seafile_pop_event(const char *channel, GError **error);
 
+int
+seafile_invalidate_branch_cache (const char *repo_id, GError **error);
+
 GList *
 seafile_search_files (const char *repo_id, const char *str, GError **error);
 
@@ -25,11 +25,18 @@
 #include "seafile-session.h"
 #include "access-file.h"
 #include "zip-download-mgr.h"
+#include "pack-dir.h"
 #include "http-server.h"
+#include "http-metrics.h"
+#include "http-conn-mgr.h"
+#include "async-block-reader.h"
 
 #define FILE_TYPE_MAP_DEFAULT_LEN 1
 #define BUFFER_SIZE 1024 * 64
+/* Ranges accepted in a Range header. */
+#define MAX_BYTE_RANGES 64
 #define MULTI_DOWNLOAD_FILE_PREFIX "documents-export-"
+#define ZIP_STREAM_CHUNK_SIZE 1024 * 64
 
 struct file_type_map {
     char *suffix;
@@ -39,9 +46,16 @@ struct file_type_map {
 typedef struct SendBlockData {
     evhtp_request_t *req;
     char *block_id;
-    BlockHandle *handle;
     uint32_t bsize;
-    uint32_t remain;
+
+    /* The next piece is read while the current one is being sent. */
+    AsyncBlockReader *reader;
+    char *piece;
+    int piece_len;
+    gboolean piece_eof;
+    gboolean piece_ready;
+    /* The connection is waiting for the next piece. */
+    gboolean waiting;
 
     char store_id[37];
     int repo_version;
@@ -57,12 +71,15 @@ typedef struct SendBlockData {
 typedef struct SendfileData {
     evhtp_request_t *req;
     Seafile *file;
-    SeafileCrypt *crypt;
-    gboolean enc_init;
-    EVP_CIPHER_CTX *ctx;
-    BlockHandle *handle;
-    size_t remain;
-    int idx;
+
+    /* The next piece is read while the current one is being sent. */
+    AsyncBlockReader *reader;
+    char *piece;
+    int piece_len;
+    gboolean piece_eof;
+    gboolean piece_ready;
+    /* The connection is waiting for the next piece. */
+    gboolean waiting;
 
     char store_id[37];
     int repo_version;
@@ -76,13 +93,24 @@ typedef struct SendfileData {
     void *saved_cb_arg;
 } SendfileData;
 
+typedef struct ByteRange {
+    guint64 start;
+    guint64 end;
+} ByteRange;
+
 typedef struct SendFileRangeData {
     evhtp_request_t *req;
     Seafile *file;
     BlockHandle *handle;
     int blk_idx;
-    guint64 start_off;
+
+    ByteRange *ranges;
+    int n_ranges;
+    int range_idx;
     guint64 range_remain;
+    /* Set when the ranges are sent as multipart/byteranges. */
+    char *boundary;
+    char *content_type;
 
     char store_id[37];
     int repo_version;
@@ -114,6 +142,24 @@ typedef struct SendDirData {
     void *saved_cb_arg;
 } SendDirData;
 
+typedef struct SendZipStreamData {
+    evhtp_request_t *req;
+    ZipStream *stream;
+    guint64 total_size;
+
+    char *token;
+    char *user;
+    char *token_type;
+    char repo_id[37];
+
+    /* The stream is waiting for file data being read. */
+    gboolean waiting;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendZipStreamData;
 
 
 extern SeafileSession *seaf;
@@ -147,11 +193,9 @@ static struct file_type_map ftmap[] = {
 static void
 free_sendblock_data (SendBlockData *data)
 {
-    if (data->handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, data->handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, data->handle);
-    }
+    async_block_reader_free (data->reader);
 
+    g_free (data->piece);
     g_free (data->block_id);
     g_free (data->user);
     g_free (data);
@@ -160,18 +204,12 @@ free_sendblock_data (SendBlockData *data)
 static void
 free_sendfile_data (SendfileData *data)
 {
-    if (data->handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, data->handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, data->handle);
-    }
-
-    if (data->enc_init)
-        EVP_CIPHER_CTX_free (data->ctx);
+    async_block_reader_free (data->reader);
 
+    g_free (data->piece);
     seafile_unref (data->file);
     g_free (data->user);
     g_free (data->token_type);
-    g_free (data->crypt);
     g_free (data);
 }
 
@@ -184,6 +222,9 @@ free_send_file_range_data (SendFileRangeData *data)
     }
 
     seafile_unref (data->file);
+    g_free (data->ranges);
+    g_free (data->boundary);
+    g_free (data->content_type);
     g_free (data->user);
     g_free (data->token_type);
     g_free (data);
@@ -203,216 +244,197 @@ free_senddir_data (SendDirData *data)
 }
 
 static void
-write_block_data_cb (struct bufferevent *bev, void *ctx)
+free_send_zip_stream_data (SendZipStreamData *data)
 {
-    SendBlockData *data = ctx;
-    char *blk_id;
-    BlockHandle *handle;
-    char buf[1024 * 64];
-    int n;
+    zip_stream_free (data->stream);
 
-    blk_id = data->block_id;
+    zip_download_mgr_del_zip_progress (seaf->zip_download_mgr, data->token);
 
-    if (!data->handle) {
-        data->handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                                     data->store_id,
-                                                     data->repo_version,
-                                                     blk_id, BLOCK_READ);
-        if (!data->handle) {
-            seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
-            goto err;
-        }
+    g_free (data->user);
+    g_free (data->token_type);
+    g_free (data->token);
+    g_free (data);
+}
 
-        data->remain = data->bsize;
-    }
-    handle = data->handle;
+static void
+free_piece (const void *data, size_t datalen, void *extra)
+{
+    g_free ((void *)data);
+}
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
-    data->remain -= n;
-    if (n < 0) {
-        seaf_warning ("Error when reading from block %s:%s.\n",
-                      data->store_id, blk_id);
-        goto err;
-    } else if (n == 0) {
-        /* We've read up the data of this block, finish. */
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        data->handle = NULL;
+/* The piece is added to the output buffer by reference, it's freed when
+ * it's sent.
+ */
+static void
+add_piece (struct bufferevent *bev, char *piece, int len)
+{
+    if (len == 0) {
+        g_free (piece);
+        return;
+    }
 
-        /* Recover evhtp's callbacks */
-        bev->readcb = data->saved_read_cb;
-        bev->writecb = data->saved_write_cb;
-        bev->errorcb = data->saved_event_cb;
-        bev->cbarg = data->saved_cb_arg;
+    evbuffer_add_reference (bufferevent_get_output (bev), piece, len,
+                            free_piece, NULL);
+}
 
-        /* Resume reading incomming requests. */
-        evhtp_request_resume (data->req);
+static void
+send_block_piece (SendBlockData *data, char *piece, int len, gboolean eof)
+{
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    if (!eof) {
+        async_block_reader_read (data->reader);
+        if (len == 0)
+            data->waiting = TRUE;
+        /* This may call write_block_data_cb() recursively (by
+         * libevent_openssl), which only marks the connection as waiting.
+         */
+        add_piece (bev, piece, len);
+        return;
+    }
 
-        evhtp_send_reply_end (data->req);
+    add_piece (bev, piece, len);
 
-        send_statistic_msg (data->store_id, data->user, "web-file-download", (guint64)data->bsize);
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+    http_conn_stream_end (bev);
 
-        free_sendblock_data (data);
-        return;
-    }
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
 
-    /* OK, we've got some data to send. */
-    bufferevent_write (bev, buf, n);
+    evhtp_send_reply_end (data->req);
 
-    return;
+    send_statistic_msg (data->store_id, data->user, "web-file-download", (guint64)data->bsize);
 
-err:
-    evhtp_connection_free (evhtp_request_get_connection (data->req));
     free_sendblock_data (data);
-    return;
 }
 
 static void
-write_data_cb (struct bufferevent *bev, void *ctx)
+block_piece_read_cb (char *piece, int len, gboolean eof, void *arg)
 {
-    SendfileData *data = ctx;
-    char *blk_id;
-    BlockHandle *handle;
-    char buf[1024 * 64];
-    int n;
+    SendBlockData *data = arg;
 
-next:
-    blk_id = data->file->blk_sha1s[data->idx];
+    if (!piece) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_sendblock_data (data);
+        return;
+    }
 
-    if (!data->handle) {
-        data->handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                                     data->store_id,
-                                                     data->repo_version,
-                                                     blk_id, BLOCK_READ);
-        if (!data->handle) {
-            seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
-            goto err;
-        }
+    if (!data->waiting) {
+        data->piece = piece;
+        data->piece_len = len;
+        data->piece_eof = eof;
+        data->piece_ready = TRUE;
+        return;
+    }
 
-        BlockMetadata *bmd;
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       data->handle);
-        if (!bmd)
-            goto err;
-        data->remain = bmd->size;
-        g_free (bmd);
-
-        if (data->crypt) {
-            if (seafile_decrypt_init (&data->ctx,
-                                      data->crypt->version,
-                                      (unsigned char *)data->crypt->key,
-                                      (unsigned char *)data->crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                goto err;
-            }
-            data->enc_init = TRUE;
-        }
+    data->waiting = FALSE;
+    send_block_piece (data, piece, len, eof);
+}
+
+static void
+write_block_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendBlockData *data = ctx;
+    char *piece;
+
+    if (!data->piece_ready) {
+        data->waiting = TRUE;
+        return;
     }
-    handle = data->handle;
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
-    data->remain -= n;
-    if (n < 0) {
-        seaf_warning ("Error when reading from block %s.\n", blk_id);
-        goto err;
-    } else if (n == 0) {
-        /* We've read up the data of this block, finish or try next block. */
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        data->handle = NULL;
-        if (data->crypt != NULL) {
-            EVP_CIPHER_CTX_free (data->ctx);
-            data->enc_init = FALSE;
-        }
+    piece = data->piece;
+    data->piece = NULL;
+    data->piece_ready = FALSE;
+    send_block_piece (data, piece, data->piece_len, data->piece_eof);
+}
 
-        if (data->idx == data->file->n_blocks - 1) {
-            /* Recover evhtp's callbacks */
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+static void
+send_file_piece (SendfileData *data, char *piece, int len, gboolean eof)
+{
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    if (!eof) {
+        async_block_reader_read (data->reader);
+        if (len == 0)
+            data->waiting = TRUE;
+        /* This may call write_data_cb() recursively (by libevent_openssl),
+         * which only marks the connection as waiting.
+         */
+        add_piece (bev, piece, len);
+        return;
+    }
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+    add_piece (bev, piece, len);
 
-            evhtp_send_reply_end (data->req);
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+    http_conn_stream_end (bev);
 
-            if (g_strcmp0(data->token_type, "view") != 0) {
-                char *oper = "web-file-download";
-                if (g_strcmp0(data->token_type, "download-link") == 0)
-                    oper = "link-file-download";
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
 
-                send_statistic_msg(data->store_id, data->user, oper,
-                                   (guint64)data->file->file_size);
-            }
+    evhtp_send_reply_end (data->req);
 
-            free_sendfile_data (data);
-            return;
-        }
+    if (g_strcmp0(data->token_type, "view") != 0) {
+        char *oper = "web-file-download";
+        if (g_strcmp0(data->token_type, "download-link") == 0)
+            oper = "link-file-download";
 
-        ++(data->idx);
-        goto next;
+        send_statistic_msg(data->store_id, data->user, oper,
+                           (guint64)data->file->file_size);
     }
 
-    /* OK, we've got some data to send. */
-    if (data->crypt != NULL) {
-        char *dec_out;
-        int dec_out_len = -1;
-        struct evbuffer *tmp_buf;
+    free_sendfile_data (data);
+}
 
-        dec_out = g_new (char, n + 16);
-        if (!dec_out) {
-            seaf_warning ("Failed to alloc memory.\n");
-            goto err;
-        }
+static void
+file_piece_read_cb (char *piece, int len, gboolean eof, void *arg)
+{
+    SendfileData *data = arg;
 
-        int ret = EVP_DecryptUpdate (data->ctx,
-                                     (unsigned char *)dec_out,
-                                     &dec_out_len,
-                                     (unsigned char *)buf,
-                                     n);
-        if (ret == 0) {
-            seaf_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
-            g_free (dec_out);
-            goto err;
-        }
+    if (!piece) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_sendfile_data (data);
+        return;
+    }
 
-        tmp_buf = evbuffer_new ();
+    if (!data->waiting) {
+        data->piece = piece;
+        data->piece_len = len;
+        data->piece_eof = eof;
+        data->piece_ready = TRUE;
+        return;
+    }
 
-        evbuffer_add (tmp_buf, dec_out, dec_out_len);
+    data->waiting = FALSE;
+    send_file_piece (data, piece, len, eof);
+}
 
-        /* If it's the last piece of a block, call decrypt_final()
-         * to decrypt the possible partial block. */
-        if (data->remain == 0) {
-            ret = EVP_DecryptFinal_ex (data->ctx,
-                                       (unsigned char *)dec_out,
-                                       &dec_out_len);
-            if (ret == 0) {
-                seaf_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
-                evbuffer_free (tmp_buf);
-                g_free (dec_out);
-                goto err;
-            }
-            evbuffer_add (tmp_buf, dec_out, dec_out_len);
-        }
-        /* This may call write_data_cb() recursively (by libevent_openssl).
-         * SendfileData struct may be free'd in the recursive calls.
-         * So don't use "data" variable after here.
-         */
-        bufferevent_write_buffer (bev, tmp_buf);
+/* Block content is read on the reader threads, so a slow block read
+ * doesn't hold up the other connections of this event loop.
+ */
+static void
+write_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendfileData *data = ctx;
+    char *piece;
 
-        evbuffer_free (tmp_buf);
-        g_free (dec_out);
-    } else {
-        bufferevent_write (bev, buf, n);
+    if (!data->piece_ready) {
+        data->waiting = TRUE;
+        return;
     }
 
-    return;
-
-err:
-    evhtp_connection_free (evhtp_request_get_connection (data->req));
-    free_sendfile_data (data);
-    return;
+    piece = data->piece;
+    data->piece = NULL;
+    data->piece_ready = FALSE;
+    send_file_piece (data, piece, data->piece_len, data->piece_eof);
 }
 
 static void
@@ -437,6 +459,7 @@ write_dir_data_cb (struct bufferevent *bev, void *ctx)
             bev->writecb = data->saved_write_cb;
             bev->errorcb = data->saved_event_cb;
             bev->cbarg = data->saved_cb_arg;
+            http_conn_stream_end (bev);
 
             /* Resume reading incomming requests. */
             evhtp_request_resume (data->req);
@@ -456,6 +479,87 @@ write_dir_data_cb (struct bufferevent *bev, void *ctx)
     }
 }
 
+static void
+send_zip_stream_data (SendZipStreamData *data)
+{
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+    struct evbuffer *buf;
+    int ret;
+
+    buf = evbuffer_new ();
+    ret = zip_stream_read (data->stream, buf, ZIP_STREAM_CHUNK_SIZE);
+    if (ret < 0) {
+        seaf_warning ("Failed to generate zip archive for repo %.8s.\n",
+                      data->repo_id);
+        evbuffer_free (buf);
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_send_zip_stream_data (data);
+        return;
+    }
+
+    data->total_size += evbuffer_get_length (buf);
+
+    if (ret > 0) {
+        if (ret == ZIP_STREAM_WAIT)
+            data->waiting = TRUE;
+        /* This may call write_zip_stream_cb() recursively (by
+         * libevent_openssl), so don't use data after here. An empty chunk
+         * would end the reply.
+         */
+        if (evbuffer_get_length (buf) > 0)
+            evhtp_send_reply_chunk (data->req, buf);
+        evbuffer_free (buf);
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+    http_conn_stream_end (bev);
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    if (evbuffer_get_length (buf) > 0)
+        evhtp_send_reply_chunk (data->req, buf);
+    evbuffer_free (buf);
+    evhtp_send_reply_chunk_end (data->req);
+
+    char *oper = "web-file-download";
+    if (g_strcmp0(data->token_type, "download-dir-link") == 0 ||
+        g_strcmp0(data->token_type, "download-multi-link") == 0)
+        oper = "link-file-download";
+
+    send_statistic_msg(data->repo_id, data->user, oper, data->total_size);
+
+    free_send_zip_stream_data (data);
+}
+
+/* File data of the archive is read on the async block reader threads, so
+ * that block reads don't hold up the other connections of this event loop.
+ */
+static void
+write_zip_stream_cb (struct bufferevent *bev, void *ctx)
+{
+    SendZipStreamData *data = ctx;
+
+    if (data->waiting)
+        return;
+
+    send_zip_stream_data (data);
+}
+
+static void
+zip_stream_ready_cb (void *arg)
+{
+    SendZipStreamData *data = arg;
+
+    data->waiting = FALSE;
+    send_zip_stream_data (data);
+}
+
 static void
 my_block_event_cb (struct bufferevent *bev, short events, void *ctx)
 {
@@ -500,6 +604,17 @@ my_dir_event_cb (struct bufferevent *bev, short events, void *ctx)
     free_senddir_data (data);
 }
 
+static void
+zip_stream_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendZipStreamData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. */
+    free_send_zip_stream_data (data);
+}
+
 static char *
 parse_content_type(const char *filename)
 {
@@ -601,6 +716,17 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new("Content-Length", file_size, 1, 1));
 
+    /* Ranges of encrypted files are not supported. */
+    if (!crypt) {
+        char *etag = g_strdup_printf ("\"%s\"", file_id);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("ETag", etag, 0, 1));
+        g_free (etag);
+
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Accept-Ranges", "bytes", 0, 0));
+    }
+
     if (strcmp(operation, "download") == 0 ||
         strcmp(operation, "download-link") == 0) {
         /* Safari doesn't support 'utf8', 'utf-8' is compatible with most of browsers. */
@@ -643,13 +769,24 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data = g_new0 (SendfileData, 1);
     data->req = req;
     data->file = file;
-    data->crypt = crypt;
     data->user = g_strdup(user);
     data->token_type = g_strdup (operation);
 
     memcpy (data->store_id, repo->store_id, 36);
     data->repo_version = repo->version;
 
+    data->reader = async_block_reader_new (evhtp_request_get_connection(req)->evbase,
+                                           repo->store_id, repo->version,
+                                           file->blk_sha1s, file->n_blocks,
+                                           crypt, file_piece_read_cb, data);
+    g_free (crypt);
+    if (!data->reader) {
+        free_sendfile_data (data);
+        return -1;
+    }
+    /* Read the first piece while the headers are being sent. */
+    async_block_reader_read (data->reader);
+
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
@@ -663,6 +800,7 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                        write_data_cb,
                        my_event_cb,
                        data);
+    http_conn_stream_begin (bev);
     /* Block any new request from this connection before finish
      * handling this request.
      */
@@ -680,30 +818,19 @@ get_start_block_handle (const char *store_id, int version, Seafile *file,
                         guint64 start, int *blk_idx)
 {
     BlockHandle *handle = NULL;
-    BlockMetadata *bmd;
     char *blkid;
-    guint64 tolsize = 0;
-    int i = 0;
-
-    for (; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
-
-        bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id,
-                                            version, blkid);
-        if (!bmd)
-            return NULL;
-
-        if (start < tolsize + bmd->size) {
-            g_free (bmd);
-            break;
-        }
-        tolsize += bmd->size;
-        g_free (bmd);
-    }
+    guint64 blk_start;
+    guint64 skip;
+    int i;
 
-    /* beyond the file size */
-    if (i == file->n_blocks)
+    /* Only the blocks up to the range start are stat'ed, and only the
+     * first time the file is requested.
+     */
+    i = seaf_fs_manager_find_block (seaf->fs_mgr, store_id, version,
+                                    file, start, &blk_start);
+    if (i < 0)
         return NULL;
+    blkid = file->blk_sha1s[i];
 
     handle = seaf_block_manager_open_block(seaf->block_mgr,
                                            store_id, version,
@@ -714,14 +841,17 @@ get_start_block_handle (const char *store_id, int version, Seafile *file,
     }
 
     /* trim the offset in a block */
-    if (start > tolsize) {
-        char *tmp = (char *)malloc(sizeof(*tmp) * (start - tolsize));
+    skip = start - blk_start;
+    if (skip > 0 &&
+        seaf_block_manager_seek_block (seaf->block_mgr, handle, (gint64)skip) < 0) {
+        /* The backend can't seek, read up to the offset. */
+        char *tmp = (char *)malloc(sizeof(*tmp) * skip);
         if (!tmp)
             goto err;
 
         int n = seaf_block_manager_read_block(seaf->block_mgr, handle,
-                                              tmp, start-tolsize);
-        if (n != start-tolsize) {
+                                              tmp, skip);
+        if (n != skip) {
             seaf_warning ("Failed to read block %s:%s.\n", store_id, blkid);
             free (tmp);
             goto err;
@@ -738,6 +868,23 @@ err:
     return NULL;
 }
 
+static char *
+format_range_part_header (SendFileRangeData *data, ByteRange *range)
+{
+    return g_strdup_printf ("\r\n--%s\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Range: bytes %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                            "/%"G_GUINT64_FORMAT"\r\n\r\n",
+                            data->boundary, data->content_type,
+                            range->start, range->end, data->file->file_size);
+}
+
+static char *
+format_range_trailer (SendFileRangeData *data)
+{
+    return g_strdup_printf ("\r\n--%s--\r\n", data->boundary);
+}
+
 static void
 finish_file_range_request (struct bufferevent *bev, SendFileRangeData *data)
 {
@@ -746,6 +893,7 @@ finish_file_range_request (struct bufferevent *bev, SendFileRangeData *data)
     bev->writecb = data->saved_write_cb;
     bev->errorcb = data->saved_event_cb;
     bev->cbarg = data->saved_cb_arg;
+    http_conn_stream_end (bev);
 
     /* Resume reading incomming requests. */
     evhtp_request_resume (data->req);
@@ -759,18 +907,43 @@ static void
 write_file_range_cb (struct bufferevent *bev, void *ctx)
 {
     SendFileRangeData *data = ctx;
+    ByteRange *range;
+    struct evbuffer *tmp_buf;
     char *blk_id;
     char buf[BUFFER_SIZE];
     int bsize;
     int n;
 
+    if (data->range_idx == data->n_ranges) {
+        if (data->ranges[data->n_ranges - 1].end == data->file->file_size - 1) {
+            char *oper = "web-file-download";
+            if (g_strcmp0(data->token_type, "download-link") == 0)
+                oper = "link-file-download";
+
+            send_statistic_msg (data->store_id, data->user, oper,
+                                (guint64)data->file->file_size);
+        }
+        finish_file_range_request (bev, data);
+        return;
+    }
+
+    range = &data->ranges[data->range_idx];
+    tmp_buf = evbuffer_new ();
+
     if (data->blk_idx == -1) {
-        // start to send block
+        // start to send a range
         data->handle = get_start_block_handle (data->store_id, data->repo_version,
-                                               data->file, data->start_off,
+                                               data->file, range->start,
                                                &data->blk_idx);
         if (!data->handle)
             goto err;
+        data->range_remain = range->end - range->start + 1;
+
+        if (data->boundary) {
+            char *part_header = format_range_part_header (data, range);
+            evbuffer_add (tmp_buf, part_header, strlen(part_header));
+            g_free (part_header);
+        }
     }
 
 next:
@@ -799,96 +972,187 @@ next:
         seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
         data->handle = NULL;
         ++data->blk_idx;
+        if (data->blk_idx == data->file->n_blocks) {
+            seaf_warning ("File %s is shorter than its size.\n",
+                          data->file->file_id);
+            goto err;
+        }
         goto next;
     }
+    evbuffer_add (tmp_buf, buf, n);
 
-    bufferevent_write (bev, buf, n);
     if (data->range_remain == 0) {
-        if (data->start_off + n >= data->file->file_size) {
-            char *oper = "web-file-download";
-            if (g_strcmp0(data->token_type, "download-link") == 0)
-                oper = "link-file-download";
+        /* The next range starts from its own block. */
+        seaf_block_manager_close_block (seaf->block_mgr, data->handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+        data->handle = NULL;
+        data->blk_idx = -1;
+        ++data->range_idx;
 
-            send_statistic_msg (data->store_id, data->user, oper,
-                                (guint64)data->file->file_size);
+        if (data->range_idx == data->n_ranges && data->boundary) {
+            char *trailer = format_range_trailer (data);
+            evbuffer_add (tmp_buf, trailer, strlen(trailer));
+            g_free (trailer);
         }
-        finish_file_range_request (bev, data);
     }
 
+    /* This may call write_file_range_cb() recursively (by libevent_openssl).
+     * SendFileRangeData struct may be free'd in the recursive calls.
+     * So don't use "data" variable after here.
+     */
+    bufferevent_write_buffer (bev, tmp_buf);
+    evbuffer_free (tmp_buf);
+
     return;
 
 err:
+    evbuffer_free (tmp_buf);
     evhtp_connection_free (evhtp_request_get_connection (data->req));
     free_send_file_range_data (data);
 }
 
-// parse range offset, only support single range (-num, num-num, num-)
-static gboolean
-parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
-                 guint64 fsize)
+/* Parse a byte range spec (-num, num-num, num-). Returns -1 if it's
+ * invalid, 0 if it's not satisfiable for @fsize bytes.
+ */
+static int
+parse_range_spec (const char *spec, guint64 fsize,
+                  guint64 *pstart, guint64 *pend)
 {
-    char *minus;
+    const char *minus;
     char *end_ptr;
-    gboolean error = FALSE;
-    char *ranges_dup = g_strdup (strchr(byte_ranges, '=') + 1);
-    char *tmp = ranges_dup;
     guint64 start;
     guint64 end;
+    guint64 len;
 
-    minus = strchr(tmp, '-');
+    minus = strchr(spec, '-');
     if (!minus)
-        return FALSE;
+        return -1;
 
-    if (minus == tmp) {
+    if (minus == spec) {
         // -num mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (start == 0) {
-            // range format is invalid
-            error = TRUE;
-        } else if (*end_ptr == '\0') {
-            end = fsize - 1;
-            start += fsize;
-        } else {
-            error = TRUE;
-        }
-    } else if (*(minus + 1) == '\0') {
-        // num- mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (end_ptr == minus) {
-            end = fsize - 1;
-        } else {
-            error = TRUE;
-        }
+        if (!g_ascii_isdigit (minus[1]))
+            return -1;
+        len = g_ascii_strtoull (minus + 1, &end_ptr, 10);
+        if (*end_ptr != '\0')
+            return -1;
+        if (len == 0 || fsize == 0)
+            return 0;
+        start = len < fsize ? fsize - len : 0;
+        end = fsize - 1;
     } else {
-        // num-num mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (end_ptr == minus) {
-            end = strtoll(minus + 1, &end_ptr, 10);
-            if (*end_ptr != '\0') {
-                error = TRUE;
-            }
+        if (!g_ascii_isdigit (spec[0]))
+            return -1;
+        start = g_ascii_strtoull (spec, &end_ptr, 10);
+        if (end_ptr != minus)
+            return -1;
+
+        if (*(minus + 1) == '\0') {
+            // num- mode
+            end = G_MAXUINT64;
         } else {
-            error = TRUE;
+            // num-num mode
+            if (!g_ascii_isdigit (minus[1]))
+                return -1;
+            end = g_ascii_strtoull (minus + 1, &end_ptr, 10);
+            if (*end_ptr != '\0' || start > end)
+                return -1;
         }
+
+        if (start >= fsize)
+            return 0;
+        if (end > fsize - 1)
+            end = fsize - 1;
     }
 
-    g_free (ranges_dup);
+    *pstart = start;
+    *pend = end;
+
+    return 1;
+}
+
+// parse range offset, only support single range (-num, num-num, num-)
+gboolean
+parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
+                 guint64 fsize)
+{
+    char *spec;
+    int ret;
 
-    if (error)
+    if (!strchr(byte_ranges, '='))
         return FALSE;
+    spec = g_strstrip (g_strdup (strchr(byte_ranges, '=') + 1));
 
-    if (end > fsize - 1) {
-        end = fsize - 1;
+    ret = parse_range_spec (spec, fsize, pstart, pend);
+
+    g_free (spec);
+    return ret == 1;
+}
+
+static int
+compare_byte_ranges (const void *a, const void *b)
+{
+    const ByteRange *ra = a, *rb = b;
+
+    if (ra->start != rb->start)
+        return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+/* Parse all ranges of a Range header. Ranges that are not satisfiable
+ * are skipped. Overlapping and adjacent ranges are merged, so a request
+ * can't make the server send more than the file. Returns NULL if the
+ * header is invalid, has more than MAX_BYTE_RANGES ranges, or no range
+ * is satisfiable.
+ */
+static ByteRange *
+parse_byte_ranges (const char *byte_ranges, guint64 fsize, int *n_ranges)
+{
+    const char *eq = strchr(byte_ranges, '=');
+    char **specs = NULL;
+    ByteRange *ranges = NULL;
+    guint64 start, end;
+    int i, m, n = 0, ret;
+
+    if (!eq || eq - byte_ranges != 5 ||
+        g_ascii_strncasecmp (byte_ranges, "bytes", 5) != 0)
+        return NULL;
+
+    specs = g_strsplit (eq + 1, ",", 0);
+    if (g_strv_length (specs) > MAX_BYTE_RANGES)
+        goto error;
+
+    ranges = g_new (ByteRange, g_strv_length (specs));
+    for (i = 0; specs[i]; ++i) {
+        ret = parse_range_spec (g_strstrip (specs[i]), fsize, &start, &end);
+        if (ret < 0)
+            goto error;
+        if (ret == 0)
+            continue;
+        ranges[n].start = start;
+        ranges[n].end = end;
+        ++n;
     }
-    if (start > end) {
-        // Range format is valid, but range number is invalid
-        return FALSE;
+    if (n == 0)
+        goto error;
+
+    qsort (ranges, n, sizeof(ByteRange), compare_byte_ranges);
+    for (i = 1, m = 0; i < n; ++i) {
+        if (ranges[i].start <= ranges[m].end + 1) {
+            if (ranges[i].end > ranges[m].end)
+                ranges[m].end = ranges[i].end;
+        } else {
+            ranges[++m] = ranges[i];
+        }
     }
 
-    *pstart = start;
-    *pend = end;
+    g_strfreev (specs);
+    *n_ranges = m + 1;
+    return ranges;
 
-    return TRUE;
+error:
+    g_strfreev (specs);
+    g_free (ranges);
+    return NULL;
 }
 
 static void
@@ -927,9 +1191,11 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
 {
     Seafile *file;
     SendFileRangeData *data = NULL;
-    guint64 start;
-    guint64 end;
+    ByteRange *ranges;
+    int n_ranges;
+    guint64 con_len;
     char *policy = "sandbox";
+    int i;
 
     file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
                                        repo->store_id, repo->version, file_id);
@@ -943,13 +1209,14 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         return 0;
     }
 
-    if (!parse_range_val (byte_ranges, &start, &end, file->file_size)) {
-        seafile_unref (file);
+    ranges = parse_byte_ranges (byte_ranges, file->file_size, &n_ranges);
+    if (!ranges) {
         char *con_range = g_strdup_printf ("bytes */%"G_GUINT64_FORMAT, file->file_size);
         evhtp_headers_add_header (req->headers_out,
                                   evhtp_header_new("Content-Range", con_range,
                                                    0, 1));
         g_free (con_range);
+        seafile_unref (file);
         evhtp_send_reply (req, EVHTP_RES_RANGENOTSC);
         return 0;
     }
@@ -961,6 +1228,11 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                              evhtp_header_new("Content-Security-Policy",
                                               policy, 1, 1));
 
+    char *etag = g_strdup_printf ("\"%s\"", file_id);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("ETag", etag, 0, 1));
+    g_free (etag);
+
     char *content_type = NULL;
     char *type = parse_content_type (filename);
     if (type != NULL) {
@@ -973,21 +1245,61 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         content_type = g_strdup ("application/octet-stream");
     }
 
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Type", content_type, 0, 1));
-    g_free (content_type);
+    data = g_new0 (SendFileRangeData, 1);
+    data->req = req;
+    data->file = file;
+    data->blk_idx = -1;
+    data->ranges = ranges;
+    data->n_ranges = n_ranges;
+    data->user = g_strdup(user);
+    data->token_type = g_strdup (operation);
 
-    char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, end-start+1);
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new("Content-Length", con_len, 0, 1));
-    g_free (con_len);
+    memcpy (data->store_id, repo->store_id, 36);
+    data->repo_version = repo->version;
+
+    if (n_ranges == 1) {
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type", content_type, 0, 1));
+        g_free (content_type);
 
-    char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
-                                       "/%"G_GUINT64_FORMAT, "bytes",
-                                       start, end, file->file_size);
+        con_len = ranges[0].end - ranges[0].start + 1;
+
+        char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                                           "/%"G_GUINT64_FORMAT, "bytes",
+                                           ranges[0].start, ranges[0].end,
+                                           file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Range", con_range, 0, 1));
+        g_free (con_range);
+    } else {
+        /* Send the ranges as multipart/byteranges, each part with its own
+         * Content-Type and Content-Range headers.
+         */
+        data->content_type = content_type;
+        data->boundary = g_strdup_printf ("%08x%08x", g_random_int (), g_random_int ());
+
+        char *multi_type = g_strdup_printf ("multipart/byteranges; boundary=%s",
+                                            data->boundary);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type", multi_type, 0, 1));
+        g_free (multi_type);
+
+        char *part;
+        con_len = 0;
+        for (i = 0; i < n_ranges; ++i) {
+            part = format_range_part_header (data, &ranges[i]);
+            con_len += strlen(part) + ranges[i].end - ranges[i].start + 1;
+            g_free (part);
+        }
+        part = format_range_trailer (data);
+        con_len += strlen(part);
+        g_free (part);
+    }
+
+    char *con_len_str = g_strdup_printf ("%"G_GUINT64_FORMAT, con_len);
     evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Range", con_range, 0, 1));
-    g_free (con_range);
+                              evhtp_header_new("Content-Length", con_len_str, 0, 1));
+    g_free (con_len_str);
 
     set_resp_disposition (req, operation, filename);
 
@@ -997,22 +1309,6 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                                                   1, 1));
     }
 
-    data = g_new0 (SendFileRangeData, 1);
-    if (!data) {
-        seafile_unref (file);
-        return -1;
-    }
-    data->req = req;
-    data->file = file;
-    data->blk_idx = -1;
-    data->start_off = start;
-    data->range_remain = end-start+1;
-    data->user = g_strdup(user);
-    data->token_type = g_strdup (operation);
-
-    memcpy (data->store_id, repo->store_id, 36);
-    data->repo_version = repo->version;
-
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
@@ -1026,6 +1322,7 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                        write_file_range_cb,
                        file_range_event_cb,
                        data);
+    http_conn_stream_begin (bev);
 
 
     /* Block any new request from this connection before finish
@@ -1098,6 +1395,7 @@ start_download_zip_file (evhtp_request_t *req, const char *token,
                        write_dir_data_cb,
                        my_dir_event_cb,
                        data);
+    http_conn_stream_begin (bev);
     /* Block any new request from this connection before finish
      * handling this request.
      */
@@ -1109,6 +1407,57 @@ start_download_zip_file (evhtp_request_t *req, const char *token,
     return 0;
 }
 
+/* The size of the archive is not known in advance, so it's sent with
+ * chunked encoding.
+ */
+static void
+start_stream_zip_file (evhtp_request_t *req, const char *token,
+                       const char *zipname, ZipStream *stream,
+                       const char *repo_id, const char *user, const char *token_type)
+{
+    char cont_filename[SEAF_PATH_MAX];
+
+    evhtp_headers_add_header(req->headers_out,
+                             evhtp_header_new("Content-Type", "application/zip", 1, 1));
+
+    snprintf(cont_filename, SEAF_PATH_MAX,
+             "attachment;filename=\"%s.zip\"", zipname);
+
+    evhtp_headers_add_header(req->headers_out,
+            evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
+
+    SendZipStreamData *data;
+    data = g_new0 (SendZipStreamData, 1);
+    data->req = req;
+    data->stream = stream;
+    data->token = g_strdup (token);
+    data->user = g_strdup (user);
+    data->token_type = g_strdup (token_type);
+    snprintf(data->repo_id, sizeof(data->repo_id), "%s", repo_id);
+
+    zip_stream_set_reader (stream, evhtp_request_get_connection (req)->evbase,
+                           zip_stream_ready_cb, data);
+
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_zip_stream_cb,
+                       zip_stream_event_cb,
+                       data);
+    http_conn_stream_begin (bev);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start(req, EVHTP_RES_OK);
+}
+
 static gboolean
 can_use_cached_content (evhtp_request_t *req)
 {
@@ -1153,7 +1502,8 @@ access_zip_cb (evhtp_request_t *req, void *arg)
     char *filename = NULL;
     char *repo_id = NULL;
     char *user = NULL;
-    char *zip_file_path;
+    char *zip_file_path = NULL;
+    ZipStream *stream = NULL;
     char *token_type = NULL;
     const char *error = NULL;
     int error_code;
@@ -1204,8 +1554,10 @@ access_zip_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    zip_file_path = zip_download_mgr_get_zip_file_path (seaf->zip_download_mgr, token);
-    if (!zip_file_path) {
+    stream = zip_download_mgr_take_zip_stream (seaf->zip_download_mgr, token);
+    if (!stream)
+        zip_file_path = zip_download_mgr_get_zip_file_path (seaf->zip_download_mgr, token);
+    if (!stream && !zip_file_path) {
         g_object_get (info, "repo_id", &repo_id, NULL);
         seaf_warning ("Failed to get zip file path for %s in repo %.8s, token:[%s].\n",
                       filename, repo_id, token);
@@ -1222,6 +1574,12 @@ access_zip_cb (evhtp_request_t *req, void *arg)
     g_object_get (info, "username", &user, NULL);
     g_object_get (info, "repo_id", &repo_id, NULL);
     g_object_get (info, "op", &token_type, NULL);
+    if (stream) {
+        start_stream_zip_file (req, token, filename, stream, repo_id, user, token_type);
+        stream = NULL;
+        goto out;
+    }
+
     int ret = start_download_zip_file (req, token, filename, zip_file_path, repo_id, user, token_type);
     if (ret < 0) {
         seaf_warning ("Failed to start download zip file: %s for token: %s", filename, token);
@@ -1230,6 +1588,7 @@ access_zip_cb (evhtp_request_t *req, void *arg)
 
 out:
     g_strfreev (parts);
+    zip_stream_free (stream);
     if (info)
         g_object_unref (info);
     if (info_str)
@@ -1251,6 +1610,31 @@ out:
     }
 }
 
+/* A Range request with If-Range only gets the ranges if the validator
+ * still matches, otherwise the whole file. The ETag of a file is its id.
+ * The file behind an access token never changes, so a date always matches.
+ */
+static gboolean
+if_range_matches (evhtp_request_t *req, const char *file_id)
+{
+    const char *if_range = evhtp_kv_find (req->headers_in, "If-Range");
+    char *etag;
+    gboolean ret;
+
+    if (!if_range)
+        return TRUE;
+
+    if (if_range[0] != '"' && strncmp (if_range, "W/", 2) != 0)
+        return TRUE;
+
+    /* Weak entity tags never match. */
+    etag = g_strdup_printf ("\"%s\"", file_id);
+    ret = (strcmp (if_range, etag) == 0);
+    g_free (etag);
+
+    return ret;
+}
+
 static void
 access_cb(evhtp_request_t *req, void *arg)
 {
@@ -1304,6 +1688,8 @@ access_cb(evhtp_request_t *req, void *arg)
     }
 
     byte_ranges = evhtp_kv_find (req->headers_in, "Range");
+    if (byte_ranges && !if_range_matches (req, data))
+        byte_ranges = NULL;
 
     repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -1428,6 +1814,17 @@ do_block(evhtp_request_t *req, SeafRepo *repo, const char *user, const char *fil
     memcpy (data->store_id, repo->store_id, 36);
     data->repo_version = repo->version;
 
+    data->reader = async_block_reader_new (evhtp_request_get_connection(req)->evbase,
+                                           repo->store_id, repo->version,
+                                           &data->block_id, 1,
+                                           NULL, block_piece_read_cb, data);
+    if (!data->reader) {
+        free_sendblock_data (data);
+        return -1;
+    }
+    /* Read the first piece while the headers are being sent. */
+    async_block_reader_read (data->reader);
+
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
@@ -1442,6 +1839,7 @@ do_block(evhtp_request_t *req, SeafRepo *repo, const char *user, const char *fil
                        write_block_data_cb,
                        my_block_event_cb,
                        data);
+    http_conn_stream_begin (bev);
     /* Block any new request from this connection before finish
      * handling this request.
      */
@@ -1540,9 +1938,14 @@ on_error:
 int
 access_file_init (evhtp_t *htp)
 {
-    evhtp_set_regex_cb (htp, "^/files/.*", access_cb, NULL);
-    evhtp_set_regex_cb (htp, "^/blks/.*", access_blks_cb, NULL);
-    evhtp_set_regex_cb (htp, "^/zip/.*", access_zip_cb, NULL);
+    evhtp_callback_t *cb;
+
+    cb = evhtp_set_regex_cb (htp, "^/files/.*", access_cb, NULL);
+    http_metrics_track_route (cb, "files");
+    cb = evhtp_set_regex_cb (htp, "^/blks/.*", access_blks_cb, NULL);
+    http_metrics_track_route (cb, "blks");
+    cb = evhtp_set_regex_cb (htp, "^/zip/.*", access_zip_cb, NULL);
+    http_metrics_track_route (cb, "zip");
 
     return 0;
 }
@@ -4,4 +4,11 @@
 int
 access_file_init (evhtp_t *htp);
 
+/* Parse a single byte range of a Range header (-num, num-num, num-).
+ * Returns FALSE if it's invalid or not satisfiable for @fsize bytes.
+ */
+gboolean
+parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
+                 guint64 fsize);
+
 #endif
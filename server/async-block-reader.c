@@ -0,0 +1,275 @@
+#include "common.h"
+
+#include "seafile-session.h"
+#include "seafile-crypt.h"
+#include "utils.h"
+#include "log.h"
+#include "loop-task.h"
+#include "async-block-reader.h"
+
+#define READ_PIECE_SIZE (1 << 20)
+
+struct AsyncBlockReader {
+    /* Finished reads are passed to the event loop that started them. */
+    LoopTaskQueue *loop;
+    char store_id[37];
+    int repo_version;
+    char **block_ids;
+    int n_blocks;
+    gboolean encrypted;
+    SeafileCrypt crypt;
+    AsyncBlockReadFunc func;
+    void *arg;
+
+    /* Read state, used by one thread at a time. */
+    int idx;
+    BlockHandle *handle;
+    guint32 remain;
+    EVP_CIPHER_CTX *ctx;
+    gboolean enc_init;
+
+    /* Result of the last read. */
+    char *data;
+    int len;
+    int result;
+
+    gboolean busy;
+    gboolean freed;
+};
+
+static GThreadPool *read_pool;
+
+static void
+read_piece (gpointer job, gpointer user_data);
+
+void
+async_block_reader_init (int n_threads)
+{
+    read_pool = g_thread_pool_new (read_piece, NULL, n_threads, FALSE, NULL);
+}
+
+static void
+reader_free (AsyncBlockReader *reader)
+{
+    if (reader->handle) {
+        seaf_block_manager_close_block (seaf->block_mgr, reader->handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, reader->handle);
+    }
+    if (reader->enc_init)
+        EVP_CIPHER_CTX_free (reader->ctx);
+    g_strfreev (reader->block_ids);
+    g_free (reader->data);
+    g_free (reader);
+}
+
+/* Called in the event loop thread. */
+static void
+on_read_done (void *arg)
+{
+    AsyncBlockReader *reader = arg;
+    char *data;
+
+    reader->busy = FALSE;
+    if (reader->freed) {
+        reader_free (reader);
+        return;
+    }
+
+    /* The callback may free the reader. */
+    data = reader->data;
+    reader->data = NULL;
+    if (reader->result < 0)
+        reader->func (NULL, 0, FALSE, reader->arg);
+    else
+        reader->func (data, reader->len,
+                      reader->idx == reader->n_blocks, reader->arg);
+}
+
+AsyncBlockReader *
+async_block_reader_new (struct event_base *base,
+                        const char *store_id,
+                        int repo_version,
+                        char **block_ids,
+                        int n_blocks,
+                        SeafileCrypt *crypt,
+                        AsyncBlockReadFunc func,
+                        void *arg)
+{
+    LoopTaskQueue *loop = loop_task_queue_get (base);
+    AsyncBlockReader *reader;
+    int i;
+
+    if (!loop)
+        return NULL;
+
+    reader = g_new0 (AsyncBlockReader, 1);
+    reader->loop = loop;
+    memcpy (reader->store_id, store_id, 36);
+    reader->repo_version = repo_version;
+    reader->block_ids = g_new0 (char *, n_blocks + 1);
+    for (i = 0; i < n_blocks; ++i)
+        reader->block_ids[i] = g_strdup (block_ids[i]);
+    reader->n_blocks = n_blocks;
+    /* Copied, the reader may outlive the request. */
+    if (crypt) {
+        reader->encrypted = TRUE;
+        reader->crypt = *crypt;
+    }
+    reader->func = func;
+    reader->arg = arg;
+
+    return reader;
+}
+
+static int
+open_next_block (AsyncBlockReader *reader)
+{
+    char *blk_id = reader->block_ids[reader->idx];
+    BlockMetadata *bmd;
+
+    reader->handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                                    reader->store_id,
+                                                    reader->repo_version,
+                                                    blk_id, BLOCK_READ);
+    if (!reader->handle) {
+        seaf_warning ("Failed to open block %s:%s\n", reader->store_id, blk_id);
+        return -1;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
+                                                   reader->handle);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s:%s\n", reader->store_id, blk_id);
+        return -1;
+    }
+    reader->remain = bmd->size;
+    g_free (bmd);
+
+    if (reader->encrypted) {
+        if (seafile_decrypt_init (&reader->ctx,
+                                  reader->crypt.version,
+                                  reader->crypt.key,
+                                  reader->crypt.iv) < 0) {
+            seaf_warning ("Failed to init decrypt.\n");
+            return -1;
+        }
+        reader->enc_init = TRUE;
+    }
+
+    return 0;
+}
+
+/* Read up to READ_PIECE_SIZE bytes of block content, across blocks. The
+ * decrypted data is at most one cipher block longer than the content
+ * read, plus the partial cipher block left from the last piece.
+ */
+static int
+read_piece_data (AsyncBlockReader *reader)
+{
+    char *in = NULL, *out;
+    char *blk_id;
+    int in_len = 0, out_len = 0;
+    int n, dec_len;
+
+    out = g_malloc (READ_PIECE_SIZE + 2 * BLK_SIZE);
+    if (reader->encrypted)
+        in = g_malloc (READ_PIECE_SIZE);
+
+    while (in_len < READ_PIECE_SIZE && reader->idx < reader->n_blocks) {
+        blk_id = reader->block_ids[reader->idx];
+
+        if (!reader->handle && open_next_block (reader) < 0)
+            goto error;
+
+        if (reader->remain > 0) {
+            n = MIN (READ_PIECE_SIZE - in_len, reader->remain);
+            n = seaf_block_manager_read_block (seaf->block_mgr, reader->handle,
+                                               reader->encrypted ? in : out + out_len,
+                                               n);
+            if (n <= 0) {
+                seaf_warning ("Error when reading from block %s:%s.\n",
+                              reader->store_id, blk_id);
+                goto error;
+            }
+            reader->remain -= n;
+            in_len += n;
+
+            if (!reader->encrypted) {
+                out_len += n;
+            } else {
+                if (EVP_DecryptUpdate (reader->ctx,
+                                       (unsigned char *)out + out_len, &dec_len,
+                                       (unsigned char *)in, n) != 1) {
+                    seaf_warning ("Decrypt block %s:%s failed.\n",
+                                  reader->store_id, blk_id);
+                    goto error;
+                }
+                out_len += dec_len;
+            }
+        }
+
+        if (reader->remain == 0) {
+            if (reader->encrypted) {
+                if (EVP_DecryptFinal_ex (reader->ctx,
+                                         (unsigned char *)out + out_len,
+                                         &dec_len) != 1) {
+                    seaf_warning ("Decrypt block %s:%s failed.\n",
+                                  reader->store_id, blk_id);
+                    goto error;
+                }
+                out_len += dec_len;
+                EVP_CIPHER_CTX_free (reader->ctx);
+                reader->enc_init = FALSE;
+            }
+
+            seaf_block_manager_close_block (seaf->block_mgr, reader->handle);
+            seaf_block_manager_block_handle_free (seaf->block_mgr, reader->handle);
+            reader->handle = NULL;
+            ++(reader->idx);
+        }
+    }
+
+    g_free (in);
+    reader->data = out;
+    reader->len = out_len;
+    return 0;
+
+error:
+    g_free (in);
+    g_free (out);
+    return -1;
+}
+
+static void
+read_piece (gpointer job, gpointer user_data)
+{
+    AsyncBlockReader *reader = job;
+
+    reader->result = read_piece_data (reader);
+
+    loop_task_push (reader->loop, on_read_done, reader);
+}
+
+int
+async_block_reader_read (AsyncBlockReader *reader)
+{
+    if (reader->busy || reader->idx == reader->n_blocks)
+        return -1;
+
+    reader->busy = TRUE;
+    g_thread_pool_push (read_pool, reader, NULL);
+
+    return 0;
+}
+
+void
+async_block_reader_free (AsyncBlockReader *reader)
+{
+    if (!reader)
+        return;
+
+    if (reader->busy)
+        reader->freed = TRUE;
+    else
+        reader_free (reader);
+}
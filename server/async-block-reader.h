@@ -0,0 +1,52 @@
+#ifndef ASYNC_BLOCK_READER_H
+#define ASYNC_BLOCK_READER_H
+
+#include <glib.h>
+
+#include "seafile-crypt.h"
+
+/*
+ * Block reads for responses streamed from the event loop threads.
+ *
+ * Blocks are read and decrypted on a thread pool, so that a slow block
+ * read doesn't stall the other connections served by the same event loop.
+ * A reader reads a list of blocks piece by piece, one piece at a time.
+ * The callback is called in the event loop thread of @base.
+ */
+
+struct event_base;
+
+typedef struct AsyncBlockReader AsyncBlockReader;
+
+/* Called with the next piece of data, which the callback owns and frees
+ * with g_free(). @data is NULL on error. @len may be 0 before the end if
+ * a block is empty. @eof is set for the last piece.
+ */
+typedef void (*AsyncBlockReadFunc) (char *data, int len, gboolean eof, void *arg);
+
+void
+async_block_reader_init (int n_threads);
+
+AsyncBlockReader *
+async_block_reader_new (struct event_base *base,
+                        const char *store_id,
+                        int repo_version,
+                        char **block_ids,
+                        int n_blocks,
+                        SeafileCrypt *crypt,
+                        AsyncBlockReadFunc func,
+                        void *arg);
+
+/* Start reading the next piece. Returns -1 if a piece is being read, or
+ * all blocks have been read.
+ */
+int
+async_block_reader_read (AsyncBlockReader *reader);
+
+/* A reader with a read in progress is freed when the read finishes, and
+ * the callback is not called.
+ */
+void
+async_block_reader_free (AsyncBlockReader *reader);
+
+#endif
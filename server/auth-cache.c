@@ -0,0 +1,202 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "log.h"
+#include "auth-cache.h"
+
+#define N_SHARDS 64
+
+typedef struct CacheEntry {
+    char *key;
+    gpointer value;
+    gint64 expire_time;
+    GQueue *queue;              /* the queue of the entry's ttl class */
+    GList link;                 /* node in that queue */
+} CacheEntry;
+
+/* Entries of the same class are inserted with the same ttl, so each queue
+ * is ordered by expire time too.
+ */
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    GHashTable *entries;        /* key -> CacheEntry */
+    GQueue positive;            /* oldest entry first */
+    GQueue negative;            /* oldest entry first */
+} CacheShard;
+
+struct AuthCache {
+    CacheShard shards[N_SHARDS];
+    int shard_size;
+    int negative_size;
+    GDestroyNotify value_free;
+};
+
+AuthCache *
+auth_cache_new (int max_entries, GDestroyNotify value_free)
+{
+    AuthCache *cache = g_new0 (AuthCache, 1);
+    int i;
+
+    cache->shard_size = MAX (max_entries / N_SHARDS, 1);
+    cache->negative_size = MAX (cache->shard_size / 4, 1);
+    cache->value_free = value_free;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_init (&cache->shards[i].lock, NULL);
+        cache->shards[i].entries = g_hash_table_new (g_str_hash, g_str_equal);
+        g_queue_init (&cache->shards[i].positive);
+        g_queue_init (&cache->shards[i].negative);
+    }
+
+    return cache;
+}
+
+static CacheShard *
+get_shard (AuthCache *cache, const char *key)
+{
+    return &cache->shards[g_str_hash (key) % N_SHARDS];
+}
+
+/* Called with the shard locked. */
+static void
+remove_entry (AuthCache *cache, CacheShard *shard, CacheEntry *entry)
+{
+    g_hash_table_remove (shard->entries, entry->key);
+    g_queue_unlink (entry->queue, &entry->link);
+
+    if (cache->value_free && entry->value)
+        cache->value_free (entry->value);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+static void
+remove_expired_in_queue (AuthCache *cache, CacheShard *shard,
+                         GQueue *queue, gint64 now)
+{
+    CacheEntry *entry;
+
+    while (queue->head) {
+        entry = queue->head->data;
+        if (entry->expire_time > now)
+            break;
+        remove_entry (cache, shard, entry);
+    }
+}
+
+static void
+remove_expired_entries (AuthCache *cache, CacheShard *shard, gint64 now)
+{
+    remove_expired_in_queue (cache, shard, &shard->positive, now);
+    remove_expired_in_queue (cache, shard, &shard->negative, now);
+}
+
+gboolean
+auth_cache_lookup (AuthCache *cache, const char *key,
+                   AuthCacheFunc func, void *data)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        if (entry->expire_time > (gint64)time(NULL)) {
+            func (entry->value, data);
+            ret = TRUE;
+        } else {
+            remove_entry (cache, shard, entry);
+        }
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    return ret;
+}
+
+void
+auth_cache_insert (AuthCache *cache, const char *key, gpointer value,
+                   int ttl, gboolean negative)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+    gint64 now = (gint64)time(NULL);
+
+    entry = g_new0 (CacheEntry, 1);
+    entry->key = g_strdup (key);
+    entry->value = value;
+    entry->expire_time = now + ttl;
+    entry->queue = negative ? &shard->negative : &shard->positive;
+    entry->link.data = entry;
+
+    pthread_mutex_lock (&shard->lock);
+
+    CacheEntry *old = g_hash_table_lookup (shard->entries, key);
+    if (old)
+        remove_entry (cache, shard, old);
+
+    remove_expired_entries (cache, shard, now);
+
+    if (negative) {
+        while (shard->negative.length >= cache->negative_size)
+            remove_entry (cache, shard, shard->negative.head->data);
+    }
+
+    /* Negative entries go first. They never evict positive ones, so a
+     * negative entry is not cached if the shard is full of positive ones.
+     */
+    while (g_hash_table_size (shard->entries) >= cache->shard_size) {
+        if (shard->negative.head)
+            remove_entry (cache, shard, shard->negative.head->data);
+        else if (!negative)
+            remove_entry (cache, shard, shard->positive.head->data);
+        else
+            break;
+    }
+
+    if (g_hash_table_size (shard->entries) >= cache->shard_size) {
+        pthread_mutex_unlock (&shard->lock);
+        if (cache->value_free && value)
+            cache->value_free (value);
+        g_free (entry->key);
+        g_free (entry);
+        return;
+    }
+
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    g_queue_push_tail_link (entry->queue, &entry->link);
+
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+auth_cache_remove (AuthCache *cache, const char *key)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry)
+        remove_entry (cache, shard, entry);
+
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+auth_cache_remove_expired (AuthCache *cache)
+{
+    gint64 now = (gint64)time(NULL);
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_lock (&cache->shards[i].lock);
+        remove_expired_entries (cache, &cache->shards[i], now);
+        pthread_mutex_unlock (&cache->shards[i].lock);
+    }
+}
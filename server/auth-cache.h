@@ -0,0 +1,47 @@
+#ifndef AUTH_CACHE_H
+#define AUTH_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Cache of the results of token and permission checks.
+ *
+ * The cache is split into shards with a lock each, so that concurrent
+ * requests rarely wait for each other. Every entry has its own ttl.
+ * Positive and negative results are kept in separate queues, because they
+ * have different ttls. Expired entries are dropped when they are looked
+ * up, on insertion, and by auth_cache_remove_expired(), which only locks
+ * one shard at a time.
+ *
+ * Negative entries are limited to a quarter of each shard. When a shard is
+ * full the oldest negative entries are dropped first; negative entries
+ * never push out positive ones.
+ */
+
+typedef struct AuthCache AuthCache;
+
+/* Called with the shard locked; copy what's needed out of @value. */
+typedef void (*AuthCacheFunc) (gpointer value, void *data);
+
+AuthCache *
+auth_cache_new (int max_entries, GDestroyNotify value_free);
+
+/* Returns FALSE if @key is not cached or expired. */
+gboolean
+auth_cache_lookup (AuthCache *cache, const char *key,
+                   AuthCacheFunc func, void *data);
+
+/* Replaces any entry of @key. The cache takes @value. @negative is set for
+ * failed checks; all entries of a class should use the same @ttl.
+ */
+void
+auth_cache_insert (AuthCache *cache, const char *key, gpointer value,
+                   int ttl, gboolean negative);
+
+void
+auth_cache_remove (AuthCache *cache, const char *key);
+
+void
+auth_cache_remove_expired (AuthCache *cache);
+
+#endif
@@ -0,0 +1,174 @@
+#include "common.h"
+
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <openssl/sha.h>
+
+#include "seafile-session.h"
+#include "utils.h"
+#include "log.h"
+#include "block-staging.h"
+
+#define STAGING_READ_SIZE (1 << 20)
+
+static char *
+get_staging_path (const char *staging_dir,
+                  const char *store_id,
+                  const char *block_id)
+{
+    char *name = g_strconcat (store_id, "-", block_id, NULL);
+    char *path = g_build_filename (staging_dir, name, NULL);
+
+    g_free (name);
+    return path;
+}
+
+gint64
+block_staging_get_offset (const char *staging_dir,
+                          const char *store_id,
+                          const char *block_id)
+{
+    char *path = get_staging_path (staging_dir, store_id, block_id);
+    SeafStat st;
+    gint64 offset = 0;
+
+    if (seaf_stat (path, &st) == 0)
+        offset = (gint64)st.st_size;
+
+    g_free (path);
+    return offset;
+}
+
+int
+block_staging_open (const char *staging_dir,
+                    const char *store_id,
+                    const char *block_id,
+                    gint64 offset)
+{
+    char *path = get_staging_path (staging_dir, store_id, block_id);
+    SeafStat st;
+    int fd;
+
+    fd = g_open (path, O_WRONLY | O_CREAT, 0600);
+    if (fd < 0) {
+        seaf_warning ("Failed to open staging file %s: %s.\n",
+                      path, strerror(errno));
+        goto error;
+    }
+
+    if (seaf_fstat (fd, &st) < 0 || (gint64)st.st_size < offset) {
+        close (fd);
+        goto error;
+    }
+
+    if ((gint64)st.st_size > offset && ftruncate (fd, (off_t)offset) < 0) {
+        seaf_warning ("Failed to truncate staging file %s: %s.\n",
+                      path, strerror(errno));
+        close (fd);
+        goto error;
+    }
+
+    if (lseek (fd, (off_t)offset, SEEK_SET) < 0) {
+        close (fd);
+        goto error;
+    }
+
+    g_free (path);
+    return fd;
+
+error:
+    g_free (path);
+    return -1;
+}
+
+int
+block_staging_commit (const char *staging_dir,
+                      const char *store_id,
+                      const char *block_id,
+                      gboolean *mismatch)
+{
+    char *path = get_staging_path (staging_dir, store_id, block_id);
+    BlockHandle *handle = NULL;
+    SHA_CTX ctx;
+    unsigned char sha1[20];
+    char check_id[41];
+    char *buf = NULL;
+    gboolean closed = FALSE;
+    int fd, n;
+    int ret = -1;
+
+    *mismatch = FALSE;
+
+    fd = g_open (path, O_RDONLY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open staging file %s: %s.\n",
+                      path, strerror(errno));
+        goto out;
+    }
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr, store_id, 1,
+                                            block_id, BLOCK_WRITE);
+    if (!handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
+        goto out;
+    }
+
+    SHA1_Init (&ctx);
+    buf = g_malloc (STAGING_READ_SIZE);
+    while ((n = readn (fd, buf, STAGING_READ_SIZE)) > 0) {
+        if (seaf_block_manager_write_block (seaf->block_mgr, handle, buf, n) != n) {
+            seaf_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
+            goto out;
+        }
+        SHA1_Update (&ctx, buf, n);
+    }
+    if (n < 0) {
+        seaf_warning ("Failed to read staging file %s: %s.\n",
+                      path, strerror(errno));
+        goto out;
+    }
+
+    SHA1_Final (sha1, &ctx);
+    rawdata_to_hex (sha1, check_id, 20);
+    if (strcmp (check_id, block_id) != 0) {
+        seaf_warning ("Content of staged block %.8s:%s doesn't match its id.\n",
+                      store_id, block_id);
+        *mismatch = TRUE;
+        g_unlink (path);
+        goto out;
+    }
+
+    closed = TRUE;
+    if (seaf_block_manager_close_block (seaf->block_mgr, handle) < 0 ||
+        seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0) {
+        seaf_warning ("Failed to commit block %.8s:%s.\n", store_id, block_id);
+        goto out;
+    }
+
+    g_unlink (path);
+    ret = 0;
+
+out:
+    if (handle) {
+        if (!closed)
+            seaf_block_manager_close_block (seaf->block_mgr, handle);
+        /* Removes the temp file if the block is not committed. */
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    }
+    if (fd >= 0)
+        close (fd);
+    g_free (buf);
+    g_free (path);
+    return ret;
+}
+
+void
+block_staging_remove (const char *staging_dir,
+                      const char *store_id,
+                      const char *block_id)
+{
+    char *path = get_staging_path (staging_dir, store_id, block_id);
+
+    g_unlink (path);
+    g_free (path);
+}
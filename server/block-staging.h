@@ -0,0 +1,50 @@
+#ifndef BLOCK_STAGING_H
+#define BLOCK_STAGING_H
+
+#include <glib.h>
+
+/*
+ * Staging files of blocks uploaded in several ranges.
+ *
+ * Ranges are appended to a staging file in @staging_dir, so the length of
+ * the file is the offset to resume the upload from. When the whole block
+ * is staged, it's verified against its id and written to the block store.
+ *
+ * Blocks are content addressed, so concurrent uploads of the same block
+ * write the same content. Staged content that doesn't match the block id
+ * is dropped when the block is committed. Staging files that are not
+ * finished are removed with other expired http temp files.
+ */
+
+/* Returns the length staged for a block, 0 if nothing is staged. */
+gint64
+block_staging_get_offset (const char *staging_dir,
+                          const char *store_id,
+                          const char *block_id);
+
+/* Open the staging file of a block for writing at @offset. Staged content
+ * after @offset is dropped. Returns -1 if @offset is after the staged
+ * content, or on error.
+ */
+int
+block_staging_open (const char *staging_dir,
+                    const char *store_id,
+                    const char *block_id,
+                    gint64 offset);
+
+/* Write the staged block to the block store and remove the staging file.
+ * Returns -1 on error; @mismatch is set if the content doesn't match the
+ * block id, in which case the staged content is removed.
+ */
+int
+block_staging_commit (const char *staging_dir,
+                      const char *store_id,
+                      const char *block_id,
+                      gboolean *mismatch);
+
+void
+block_staging_remove (const char *staging_dir,
+                      const char *store_id,
+                      const char *block_id);
+
+#endif
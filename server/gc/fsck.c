@@ -723,6 +723,162 @@ seaf_fsck (GList *repo_id_list, gboolean repair, int max_thread_num)
     return 0;
 }
 
+/* Convert repos to binary fs objects. */
+
+static char *
+convert_dir_recursive (SeafRepo *repo, int version, const char *dir_id,
+                       GHashTable *converted)
+{
+    SeafDir *dir, *new_dir;
+    SeafDirent *dent, *new_dent;
+    GList *ptr, *entries = NULL;
+    char *new_id = NULL, *sub_id;
+    char file_id[41];
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
+        return g_strdup (EMPTY_SHA1);
+
+    new_id = g_hash_table_lookup (converted, dir_id);
+    if (new_id)
+        return g_strdup (new_id);
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, repo->store_id,
+                                       version, dir_id);
+    if (!dir) {
+        seaf_warning ("Failed to get dir %s of repo %.8s.\n", dir_id, repo->id);
+        return NULL;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        new_dent = seaf_dirent_dup (dent);
+        new_dent->version = SEAF_BINARY_OBJ_VERSION;
+        entries = g_list_prepend (entries, new_dent);
+
+        if (S_ISDIR(dent->mode)) {
+            sub_id = convert_dir_recursive (repo, version, dent->id, converted);
+            if (!sub_id)
+                goto out;
+            memcpy (new_dent->id, sub_id, 41);
+            g_free (sub_id);
+        } else if (S_ISREG(dent->mode)) {
+            if (seaf_fs_manager_convert_seafile_to_binary (seaf->fs_mgr,
+                                                           repo->store_id,
+                                                           version, dent->id,
+                                                           file_id) < 0) {
+                seaf_warning ("Failed to convert file %s of repo %.8s.\n",
+                              dent->id, repo->id);
+                goto out;
+            }
+            memcpy (new_dent->id, file_id, 41);
+        }
+    }
+    entries = g_list_reverse (entries);
+
+    new_dir = seaf_dir_new (NULL, entries, SEAF_BINARY_OBJ_VERSION);
+    entries = NULL;
+    if (seaf_dir_save (seaf->fs_mgr, repo->store_id,
+                       SEAF_BINARY_OBJ_VERSION, new_dir) < 0) {
+        seaf_warning ("Failed to save dir %s of repo %.8s.\n",
+                      new_dir->dir_id, repo->id);
+        seaf_dir_free (new_dir);
+        goto out;
+    }
+    new_id = g_strdup (new_dir->dir_id);
+    g_hash_table_insert (converted, g_strdup (dir_id), g_strdup (new_id));
+    seaf_dir_free (new_dir);
+
+out:
+    g_list_free_full (entries, (GDestroyNotify)seaf_dirent_free);
+    seaf_dir_free (dir);
+    return new_id;
+}
+
+static void
+convert_repo (const char *repo_id)
+{
+    SeafRepo *repo;
+    SeafCommit *head = NULL, *new_commit = NULL;
+    GHashTable *converted = NULL;
+    char *new_root = NULL;
+    int version;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to get repo %.8s.\n", repo_id);
+        return;
+    }
+
+    version = repo->version;
+    if (version >= SEAF_BINARY_OBJ_VERSION) {
+        seaf_message ("Repo %.8s already uses binary fs objects.\n", repo_id);
+        goto out;
+    }
+    if (version == 0) {
+        seaf_warning ("Repo %.8s is of version 0, can't convert it.\n", repo_id);
+        goto out;
+    }
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr, repo->id,
+                                           version, repo->head->commit_id);
+    if (!head) {
+        seaf_warning ("Failed to get head commit %s of repo %.8s.\n",
+                      repo->head->commit_id, repo_id);
+        goto out;
+    }
+
+    converted = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    new_root = convert_dir_recursive (repo, version, head->root_id, converted);
+    if (!new_root)
+        goto out;
+
+    new_commit = seaf_commit_new (NULL, repo->id, new_root,
+                                  head->creator_name, head->creator_id,
+                                  "Converted to binary fs objects.", 0);
+    new_commit->parent_id = g_strdup (head->commit_id);
+    repo->version = SEAF_BINARY_OBJ_VERSION;
+    seaf_repo_to_commit (repo, new_commit);
+
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, new_commit) < 0) {
+        seaf_warning ("Failed to add commit for repo %.8s.\n", repo_id);
+        goto out;
+    }
+
+    seaf_branch_set_commit (repo->head, new_commit->commit_id);
+    if (seaf_branch_manager_add_branch (seaf->branch_mgr, repo->head) < 0) {
+        seaf_warning ("Update head of repo %.8s to commit %.8s failed.\n",
+                      repo_id, new_commit->commit_id);
+        goto out;
+    }
+
+    seaf_message ("Converted repo %.8s, %u dirs, new root %s.\n",
+                  repo_id, g_hash_table_size (converted), new_root);
+
+out:
+    if (converted)
+        g_hash_table_destroy (converted);
+    g_free (new_root);
+    seaf_commit_unref (head);
+    seaf_commit_unref (new_commit);
+    seaf_repo_unref (repo);
+}
+
+int
+seaf_convert_repos_to_binary_fs (GList *repo_id_list)
+{
+    GList *ptr;
+
+    for (ptr = repo_id_list; ptr; ptr = ptr->next)
+        convert_repo (ptr->data);
+
+    while (repo_id_list) {
+        g_free (repo_id_list->data);
+        repo_id_list = g_list_delete_link (repo_id_list, repo_id_list);
+    }
+
+    return 0;
+}
+
 /* Export files. */
 
 /*static gboolean
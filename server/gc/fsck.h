@@ -4,6 +4,12 @@
 int
 seaf_fsck (GList *repo_id_list, gboolean repair, int max_thread_num);
 
+/* Rewrite the head tree of the repos with binary fs objects and bump the
+ * repos to SEAF_BINARY_OBJ_VERSION. History is kept in the old format.
+ */
+int
+seaf_convert_repos_to_binary_fs (GList *repo_id_list);
+
 void export_file (GList *repo_id_list, const char *seafile_dir, char *export_path);
 
 #endif
@@ -448,6 +448,12 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs)
     removed_blocks = data.removed_blocks;
     ret = removed_blocks;
 
+    if (!dry_run && removed_blocks > 0) {
+        if (seaf_block_manager_compact_store (seaf->block_mgr, repo->store_id) < 0)
+            seaf_warning ("GC: Failed to compact block store for repo %.8s.\n",
+                          repo->id);
+    }
+
     if (rm_fs && total_fs > 0) {
         removed_fs = check_existing_fs(repo->store_id, repo->version, exist_fs,
                                        fs_index, dry_run);
@@ -14,7 +14,7 @@ static char *central_config_dir = NULL;
 
 SeafileSession *seaf;
 
-static const char *short_opts = "hvft:c:d:rE:F:";
+static const char *short_opts = "hvft:c:d:rE:F:B";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
@@ -22,6 +22,7 @@ static const struct option long_opts[] = {
     { "repair", no_argument, NULL, 'r', },
     { "threads", required_argument, NULL, 't', },
     { "export", required_argument, NULL, 'E', },
+    { "convert-binary-fs", no_argument, NULL, 'B', },
     { "config-file", required_argument, NULL, 'c', },
     { "central-config-dir", required_argument, NULL, 'F' },
     { "seafdir", required_argument, NULL, 'd', },
@@ -31,8 +32,10 @@ static const struct option long_opts[] = {
 static void usage ()
 {
     fprintf (stderr,
-             "usage: seaf-fsck [-r] [-E exported_path] [-c config_dir] [-d seafile_dir] "
-             "[repo_id_1 [repo_id_2 ...]]\n");
+             "usage: seaf-fsck [-r] [-E exported_path] [-B] [-c config_dir] [-d seafile_dir] "
+             "[repo_id_1 [repo_id_2 ...]]\n"
+             "  -B, --convert-binary-fs: convert the repos to binary fs objects.\n"
+             "      Stop the server first. Only the listed repos are converted.\n");
 }
 
 #ifdef WIN32
@@ -93,6 +96,7 @@ main(int argc, char *argv[])
     gboolean repair = FALSE;
     gboolean force = FALSE;
     char *export_path = NULL;
+    gboolean convert_binary_fs = FALSE;
     int max_thread_num = 0;
 
 #ifdef WIN32
@@ -122,6 +126,9 @@ main(int argc, char *argv[])
         case 'E':
             export_path = strdup(optarg);
             break;
+        case 'B':
+            convert_binary_fs = TRUE;
+            break;
         case 'c':
             ccnet_dir = strdup(optarg);
             break;
@@ -173,6 +180,12 @@ main(int argc, char *argv[])
 
     if (export_path) {
         export_file (repo_id_list, seafile_dir, export_path);
+    } else if (convert_binary_fs) {
+        if (!repo_id_list) {
+            usage ();
+            exit (1);
+        }
+        seaf_convert_repos_to_binary_fs (repo_id_list);
     } else {
         seaf_fsck (repo_id_list, repair, max_thread_num);
     }
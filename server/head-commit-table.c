@@ -0,0 +1,195 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "head-commit-table.h"
+#include "utils.h"
+#include "log.h"
+
+#define REPO_UPDATE_EVENT "repo-update\t"
+
+typedef struct HeadEntry {
+    char commit_id[41];
+    /* Entries loaded from the database are reloaded after this time. */
+    gint64 expire_time;
+} HeadEntry;
+
+struct HeadCommitTable {
+    GHashTable *heads;          /* repo_id -> HeadEntry */
+    pthread_mutex_t lock;
+    int seq;
+    int ttl;
+    int max_entries;
+};
+
+HeadCommitTable *
+head_commit_table_new (int ttl, int max_entries)
+{
+    HeadCommitTable *table = g_new0 (HeadCommitTable, 1);
+
+    table->heads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    pthread_mutex_init (&table->lock, NULL);
+    table->ttl = ttl;
+    table->max_entries = max_entries;
+
+    return table;
+}
+
+static gboolean
+is_head_entry_expire (gpointer key, gpointer value, gpointer arg)
+{
+    HeadEntry *entry = value;
+    gint64 *now = arg;
+
+    return entry->expire_time <= *now;
+}
+
+/* Called with the lock held. */
+static void
+set_head_entry (HeadCommitTable *table, const char *repo_id,
+                const char *commit_id, gint64 expire_time)
+{
+    HeadEntry *entry;
+    gint64 now;
+
+    entry = g_hash_table_lookup (table->heads, repo_id);
+    if (!entry) {
+        if (g_hash_table_size (table->heads) >= table->max_entries) {
+            now = (gint64)time(NULL);
+            g_hash_table_foreach_remove (table->heads, is_head_entry_expire, &now);
+            if (g_hash_table_size (table->heads) >= table->max_entries)
+                g_hash_table_remove_all (table->heads);
+        }
+        entry = g_new0 (HeadEntry, 1);
+        g_hash_table_insert (table->heads, g_strdup(repo_id), entry);
+    }
+
+    if (strcmp (entry->commit_id, commit_id) != 0) {
+        memcpy (entry->commit_id, commit_id, 40);
+        g_atomic_int_inc (&table->seq);
+    }
+    entry->expire_time = expire_time;
+}
+
+void
+head_commit_table_update (HeadCommitTable *table,
+                          const char *repo_id,
+                          const char *commit_id)
+{
+    pthread_mutex_lock (&table->lock);
+    set_head_entry (table, repo_id, commit_id, (gint64)time(NULL) + table->ttl);
+    pthread_mutex_unlock (&table->lock);
+}
+
+void
+head_commit_table_on_event (const char *channel, const char *content, void *data)
+{
+    HeadCommitTable *table = data;
+    char repo_id[37], commit_id[41];
+    const char *p;
+
+    /* "repo-update\t<repo_id>\t<commit_id>" */
+    if (strncmp (content, REPO_UPDATE_EVENT, strlen(REPO_UPDATE_EVENT)) != 0)
+        return;
+    p = content + strlen(REPO_UPDATE_EVENT);
+    if (strlen (p) != 36 + 1 + 40 || p[36] != '\t')
+        return;
+
+    memcpy (repo_id, p, 36);
+    repo_id[36] = 0;
+    memcpy (commit_id, p + 37, 40);
+    commit_id[40] = 0;
+
+    head_commit_table_update (table, repo_id, commit_id);
+}
+
+typedef struct LoadHeadsData {
+    HeadCommitTable *table;
+    json_t *map;
+    gint64 expire_time;
+} LoadHeadsData;
+
+static gboolean
+collect_loaded_head (SeafDBRow *row, void *data)
+{
+    LoadHeadsData *load = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+
+    if (!repo_id || !commit_id || strlen(commit_id) != 40)
+        return TRUE;
+
+    json_object_set_new (load->map, repo_id, json_string(commit_id));
+
+    pthread_mutex_lock (&load->table->lock);
+    set_head_entry (load->table, repo_id, commit_id, load->expire_time);
+    pthread_mutex_unlock (&load->table->lock);
+
+    return TRUE;
+}
+
+static int
+load_heads (HeadCommitTable *table, GString *id_list_str, json_t *map)
+{
+    LoadHeadsData load;
+    char *sql;
+    int ret = 0;
+
+    if (seaf_db_type (seaf->db) == SEAF_DB_TYPE_MYSQL)
+        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s) LOCK IN SHARE MODE",
+                               id_list_str->str);
+    else
+        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s)",
+                               id_list_str->str);
+
+    load.table = table;
+    load.map = map;
+    load.expire_time = (gint64)time(NULL) + table->ttl;
+    if (seaf_db_statement_foreach_row (seaf->db, sql,
+                                       collect_loaded_head, &load, 0) < 0)
+        ret = -1;
+
+    g_free (sql);
+    return ret;
+}
+
+int
+head_commit_table_lookup (HeadCommitTable *table,
+                          char **repo_ids,
+                          int n_repos,
+                          json_t *map)
+{
+    GString *id_list_str = g_string_new ("");
+    HeadEntry *entry;
+    gint64 now = (gint64)time(NULL);
+    int i, n_missing = 0;
+    int ret = 0;
+
+    pthread_mutex_lock (&table->lock);
+    for (i = 0; i < n_repos; ++i) {
+        entry = g_hash_table_lookup (table->heads, repo_ids[i]);
+        if (entry && entry->expire_time > now) {
+            json_object_set_new (map, repo_ids[i], json_string(entry->commit_id));
+            continue;
+        }
+        /* Ids are validated by the caller. */
+        g_string_append_printf (id_list_str, n_missing == 0 ? "'%s'" : ",'%s'",
+                                repo_ids[i]);
+        ++n_missing;
+    }
+    pthread_mutex_unlock (&table->lock);
+
+    if (n_missing > 0)
+        ret = load_heads (table, id_list_str, map);
+
+    g_string_free (id_list_str, TRUE);
+    return ret;
+}
+
+guint
+head_commit_table_get_seq (HeadCommitTable *table)
+{
+    return (guint)g_atomic_int_get (&table->seq);
+}
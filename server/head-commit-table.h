@@ -0,0 +1,52 @@
+#ifndef HEAD_COMMIT_TABLE_H
+#define HEAD_COMMIT_TABLE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * In-memory table of the master head commit of repos, for clients that
+ * watch many repos for changes.
+ *
+ * Entries are updated from the repo-update events of branches updated in
+ * this process, including virtual repos, whose events are only passed to
+ * in-process listeners. The Go fileserver publishes its repo-update events
+ * with the publish_event RPC, which also passes them to the listeners, so
+ * its head updates are seen right away too. Repos not in the table are
+ * loaded from the Branch table. Entries loaded from the database expire
+ * after ttl seconds, so that heads updated by processes that don't publish
+ * events to this one (e.g. other nodes of a cluster) are seen eventually,
+ * but only after up to ttl seconds.
+ *
+ * The table is only used by the http server of seaf-server. The Go
+ * fileserver doesn't serve head-commits-watch.
+ */
+
+typedef struct HeadCommitTable HeadCommitTable;
+
+HeadCommitTable *
+head_commit_table_new (int ttl, int max_entries);
+
+/* Listener for seaf_mq_manager_add_listener(). */
+void
+head_commit_table_on_event (const char *channel, const char *content, void *data);
+
+void
+head_commit_table_update (HeadCommitTable *table,
+                          const char *repo_id,
+                          const char *commit_id);
+
+/* Set repo_id -> head commit id in @map for the repos in @repo_ids.
+ * Repos that don't exist are not set. Returns -1 on database error.
+ */
+int
+head_commit_table_lookup (HeadCommitTable *table,
+                          char **repo_ids,
+                          int n_repos,
+                          json_t *map);
+
+/* Changes when a head in the table is updated. */
+guint
+head_commit_table_get_seq (HeadCommitTable *table);
+
+#endif
@@ -0,0 +1,198 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+#include <evhtp.h>
+
+#include "utils.h"
+#include "log.h"
+#include "metrics.h"
+#include "http-conn-mgr.h"
+
+struct HttpConnManager {
+    int max_connections;
+    int max_connections_per_ip;
+    struct timeval idle_timeout;
+    struct timeval send_timeout;
+
+    int n_connections;
+    GHashTable *ip_connections;     /* ip -> number of connections */
+    pthread_mutex_t lock;
+
+    SeafMetric *active;
+    SeafMetric *rejected_total;
+    SeafMetric *rejected_per_ip;
+};
+
+typedef struct ConnInfo {
+    HttpConnManager *mgr;
+    /* NULL if the connection is not counted per ip. */
+    char *ip;
+} ConnInfo;
+
+static int stream_watermark;
+
+HttpConnManager *
+http_conn_manager_new (int max_connections,
+                       int max_connections_per_ip,
+                       int idle_timeout,
+                       int send_timeout,
+                       int watermark)
+{
+    HttpConnManager *mgr = g_new0 (HttpConnManager, 1);
+
+    mgr->max_connections = max_connections;
+    mgr->max_connections_per_ip = max_connections_per_ip;
+    mgr->idle_timeout.tv_sec = idle_timeout;
+    mgr->send_timeout.tv_sec = send_timeout;
+
+    mgr->ip_connections = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+    pthread_mutex_init (&mgr->lock, NULL);
+
+    mgr->active = seaf_metric_gauge_new ("seafile_http_connections", NULL,
+                                         "Open http connections.");
+    mgr->rejected_total = seaf_metric_counter_new ("seafile_http_rejected_connections_total",
+                                                   "reason=\"max_connections\"",
+                                                   "Connections closed because of connection limits.");
+    mgr->rejected_per_ip = seaf_metric_counter_new ("seafile_http_rejected_connections_total",
+                                                    "reason=\"max_connections_per_ip\"",
+                                                    "Connections closed because of connection limits.");
+
+    stream_watermark = watermark;
+
+    seaf_message ("fileserver: max_connections = %d, max_connections_per_ip = %d, "
+                  "idle_timeout = %d, send_timeout = %d\n",
+                  max_connections, max_connections_per_ip,
+                  idle_timeout, send_timeout);
+
+    return mgr;
+}
+
+static char *
+get_conn_ip (evhtp_connection_t *conn)
+{
+    char ip[INET6_ADDRSTRLEN];
+    struct sockaddr *sa = conn->saddr;
+
+    if (!sa)
+        return NULL;
+
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+        if (ntohl (sin->sin_addr.s_addr) >> 24 == 127)
+            return NULL;
+        if (!inet_ntop (AF_INET, &sin->sin_addr, ip, sizeof(ip)))
+            return NULL;
+    } else if (sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+        if (IN6_IS_ADDR_LOOPBACK (&sin6->sin6_addr))
+            return NULL;
+        if (!inet_ntop (AF_INET6, &sin6->sin6_addr, ip, sizeof(ip)))
+            return NULL;
+    } else {
+        return NULL;
+    }
+
+    return g_strdup (ip);
+}
+
+static evhtp_res
+conn_fini_cb (evhtp_connection_t *conn, void *arg)
+{
+    ConnInfo *info = arg;
+    HttpConnManager *mgr = info->mgr;
+    int n;
+
+    pthread_mutex_lock (&mgr->lock);
+    --(mgr->n_connections);
+    if (info->ip) {
+        n = GPOINTER_TO_INT (g_hash_table_lookup (mgr->ip_connections, info->ip));
+        if (n <= 1)
+            g_hash_table_remove (mgr->ip_connections, info->ip);
+        else
+            g_hash_table_insert (mgr->ip_connections, g_strdup(info->ip),
+                                 GINT_TO_POINTER(n - 1));
+    }
+    pthread_mutex_unlock (&mgr->lock);
+
+    seaf_metric_add (mgr->active, -1);
+
+    g_free (info->ip);
+    g_free (info);
+
+    return EVHTP_RES_OK;
+}
+
+/* Runs in the worker thread of the connection. Rejected connections are
+ * freed by evhtp without running the connection hooks.
+ */
+static evhtp_res
+post_accept_cb (evhtp_connection_t *conn, void *arg)
+{
+    HttpConnManager *mgr = arg;
+    ConnInfo *info;
+    char *ip = NULL;
+    int n = 0;
+
+    if (mgr->max_connections_per_ip > 0)
+        ip = get_conn_ip (conn);
+
+    pthread_mutex_lock (&mgr->lock);
+
+    if (mgr->max_connections > 0 && mgr->n_connections >= mgr->max_connections) {
+        pthread_mutex_unlock (&mgr->lock);
+        seaf_metric_add (mgr->rejected_total, 1);
+        g_free (ip);
+        return EVHTP_RES_SERVUNAVAIL;
+    }
+
+    if (ip) {
+        n = GPOINTER_TO_INT (g_hash_table_lookup (mgr->ip_connections, ip));
+        if (n >= mgr->max_connections_per_ip) {
+            pthread_mutex_unlock (&mgr->lock);
+            seaf_metric_add (mgr->rejected_per_ip, 1);
+            g_free (ip);
+            return EVHTP_RES_SERVUNAVAIL;
+        }
+        g_hash_table_insert (mgr->ip_connections, g_strdup(ip),
+                             GINT_TO_POINTER(n + 1));
+    }
+    ++(mgr->n_connections);
+
+    pthread_mutex_unlock (&mgr->lock);
+
+    seaf_metric_add (mgr->active, 1);
+
+    info = g_new0 (ConnInfo, 1);
+    info->mgr = mgr;
+    info->ip = ip;
+    evhtp_set_hook (&conn->hooks, evhtp_hook_on_connection_fini,
+                    (evhtp_hook)conn_fini_cb, info);
+
+    return EVHTP_RES_OK;
+}
+
+void
+http_conn_manager_attach (HttpConnManager *mgr, evhtp_t *htp)
+{
+    evhtp_set_post_accept_cb (htp, post_accept_cb, mgr);
+    evhtp_set_timeouts (htp,
+                        mgr->idle_timeout.tv_sec > 0 ? &mgr->idle_timeout : NULL,
+                        mgr->send_timeout.tv_sec > 0 ? &mgr->send_timeout : NULL);
+}
+
+void
+http_conn_stream_begin (struct bufferevent *bev)
+{
+    bufferevent_setwatermark (bev, EV_WRITE, stream_watermark, 0);
+}
+
+void
+http_conn_stream_end (struct bufferevent *bev)
+{
+    bufferevent_setwatermark (bev, EV_WRITE, 0, 0);
+}
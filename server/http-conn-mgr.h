@@ -0,0 +1,46 @@
+#ifndef HTTP_CONN_MGR_H
+#define HTTP_CONN_MGR_H
+
+#include <event2/bufferevent.h>
+
+/*
+ * Connection limits of the http server.
+ *
+ * Connections over the limits are closed right after they're accepted.
+ * Connections from the local host are not limited per ip, since they
+ * usually come from a reverse proxy.
+ *
+ * Connections that don't send anything for idle_timeout seconds, or
+ * don't read any of the pending output for send_timeout seconds, are
+ * closed by evhtp.
+ */
+
+typedef struct HttpConnManager HttpConnManager;
+
+/* A limit of 0 means no limit. */
+HttpConnManager *
+http_conn_manager_new (int max_connections,
+                       int max_connections_per_ip,
+                       int idle_timeout,
+                       int send_timeout,
+                       int watermark);
+
+void
+http_conn_manager_attach (HttpConnManager *mgr, evhtp_t *htp);
+
+/*
+ * Responses that are streamed from a bufferevent write callback read the
+ * next chunk when the output drains to the stream watermark, instead of
+ * when it's empty. So the socket always has data to send, and no more
+ * than the watermark plus one chunk is queued per connection.
+ *
+ * Call http_conn_stream_begin() when replacing the callbacks of @bev, and
+ * http_conn_stream_end() when restoring evhtp's callbacks.
+ */
+void
+http_conn_stream_begin (struct bufferevent *bev);
+
+void
+http_conn_stream_end (struct bufferevent *bev);
+
+#endif
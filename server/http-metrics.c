@@ -0,0 +1,232 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#include <event2/event.h>
+#include <evhtp.h>
+
+#include "utils.h"
+#include "log.h"
+#include "seafile-session.h"
+#include "metrics.h"
+#include "http-metrics.h"
+
+enum {
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_PUT,
+    METHOD_POST,
+    METHOD_OTHER,
+    N_METHODS,
+};
+
+static const char *method_names[] = { "GET", "HEAD", "PUT", "POST", "OTHER" };
+
+typedef struct RouteMetrics {
+    char *route;
+    /* Created for the methods that are used. */
+    SeafMetric *duration[N_METHODS];
+    SeafMetric *in_flight;
+} RouteMetrics;
+
+typedef struct RequestTiming {
+    SeafMetric *duration;
+    SeafMetric *in_flight;
+    gint64 start;
+    evhtp_hook_request_fini_cb fini;
+    void *fini_arg;
+} RequestTiming;
+
+static int
+method_index (evhtp_request_t *req)
+{
+    switch (evhtp_request_get_method (req)) {
+    case htp_method_GET:
+        return METHOD_GET;
+    case htp_method_HEAD:
+        return METHOD_HEAD;
+    case htp_method_PUT:
+        return METHOD_PUT;
+    case htp_method_POST:
+        return METHOD_POST;
+    default:
+        return METHOD_OTHER;
+    }
+}
+
+static SeafMetric *
+get_duration_metric (RouteMetrics *route, int method)
+{
+    SeafMetric *metric;
+    char *labels;
+
+    metric = __atomic_load_n (&route->duration[method], __ATOMIC_ACQUIRE);
+    if (metric)
+        return metric;
+
+    /* Registering again returns the same metric, so racing threads agree. */
+    labels = g_strdup_printf ("route=\"%s\",method=\"%s\"",
+                              route->route, method_names[method]);
+    metric = seaf_metric_histogram_new ("seafile_http_request_duration_seconds",
+                                        labels,
+                                        "Latency of http requests.");
+    g_free (labels);
+
+    __atomic_store_n (&route->duration[method], metric, __ATOMIC_RELEASE);
+    return metric;
+}
+
+static evhtp_res
+request_timing_fini_cb (evhtp_request_t *req, void *arg)
+{
+    RequestTiming *timing = arg;
+
+    if (timing->fini)
+        timing->fini (req, timing->fini_arg);
+
+    seaf_metric_observe (timing->duration, g_get_monotonic_time () - timing->start);
+    seaf_metric_add (timing->in_flight, -1);
+
+    g_free (timing);
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+route_path_cb (evhtp_request_t *req, evhtp_path_t *path, void *arg)
+{
+    RouteMetrics *route = arg;
+    RequestTiming *timing = g_new0 (RequestTiming, 1);
+
+    timing->duration = get_duration_metric (route, method_index (req));
+    timing->in_flight = route->in_flight;
+    timing->start = g_get_monotonic_time ();
+
+    seaf_metric_add (timing->in_flight, 1);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini,
+                    request_timing_fini_cb, timing);
+
+    return EVHTP_RES_OK;
+}
+
+void
+http_metrics_track_route (evhtp_callback_t *cb, const char *route)
+{
+    RouteMetrics *metrics = g_new0 (RouteMetrics, 1);
+    char *labels;
+
+    metrics->route = g_strdup (route);
+
+    labels = g_strdup_printf ("route=\"%s\"", route);
+    metrics->in_flight = seaf_metric_gauge_new ("seafile_http_requests_in_flight",
+                                                labels,
+                                                "Http requests being processed.");
+    g_free (labels);
+
+    /* Hooks of a callback are copied to its requests when the path matches. */
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_path, route_path_cb, metrics);
+}
+
+void
+http_metrics_set_fini_hook (evhtp_request_t *req,
+                            evhtp_hook_request_fini_cb hook,
+                            void *arg)
+{
+    RequestTiming *timing;
+
+    if (req->hooks &&
+        req->hooks->on_request_fini == request_timing_fini_cb) {
+        timing = req->hooks->on_request_fini_arg;
+        timing->fini = hook;
+        timing->fini_arg = arg;
+        return;
+    }
+
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, hook, arg);
+}
+
+static gboolean
+is_local_request (evhtp_request_t *req)
+{
+    evhtp_connection_t *conn = evhtp_request_get_connection (req);
+
+    /* Requests forwarded by a reverse proxy come from the local host too. */
+    if (evhtp_kv_find (req->headers_in, "X-Forwarded-For"))
+        return FALSE;
+
+    if (conn->saddr->sa_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)conn->saddr;
+        return (ntohl (addr_in->sin_addr.s_addr) >> 24) == 127;
+    }
+
+    if (conn->saddr->sa_family == AF_INET6) {
+        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)conn->saddr;
+        return IN6_IS_ADDR_LOOPBACK (&addr_in6->sin6_addr);
+    }
+
+    return FALSE;
+}
+
+static void
+format_stat (GString *buf, const char *name, const char *type,
+             const char *help, gint64 value)
+{
+    g_string_append_printf (buf, "# HELP %s %s\n", name, help);
+    g_string_append_printf (buf, "# TYPE %s %s\n", name, type);
+    g_string_append_printf (buf, "%s %"G_GINT64_FORMAT"\n", name, value);
+}
+
+/* The caches keep their own counters, which are read at scrape time. */
+static void
+format_cache_stats (GString *buf)
+{
+    FsCacheStats fs;
+    CommitCacheStats commits;
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &fs);
+    format_stat (buf, "seafile_fs_cache_hits_total", "counter",
+                 "Lookups of parsed fs objects found in the cache.", fs.hits);
+    format_stat (buf, "seafile_fs_cache_misses_total", "counter",
+                 "Lookups of parsed fs objects not found in the cache.", fs.misses);
+    format_stat (buf, "seafile_fs_cache_evictions_total", "counter",
+                 "Fs objects evicted from the cache.", fs.evictions);
+    format_stat (buf, "seafile_fs_cache_objects", "gauge",
+                 "Fs objects in the cache.", fs.n_cached);
+    format_stat (buf, "seafile_fs_cache_bytes", "gauge",
+                 "Estimated memory used by the fs object cache.", fs.size);
+
+    seaf_commit_manager_get_cache_stats (seaf->commit_mgr, &commits);
+    format_stat (buf, "seafile_commit_cache_hits_total", "counter",
+                 "Lookups of commits found in the cache.", commits.hits);
+    format_stat (buf, "seafile_commit_cache_misses_total", "counter",
+                 "Lookups of commits not found in the cache.", commits.misses);
+    format_stat (buf, "seafile_commit_cache_evictions_total", "counter",
+                 "Commits evicted from the cache.", commits.evictions);
+    format_stat (buf, "seafile_commit_cache_commits", "gauge",
+                 "Commits in the cache.", commits.n_cached);
+    format_stat (buf, "seafile_commit_cache_borrowed_refs", "gauge",
+                 "References to cached commits held outside the cache.",
+                 commits.borrowed);
+}
+
+void
+http_metrics_cb (evhtp_request_t *req, void *arg)
+{
+    GString *buf;
+
+    if (!is_local_request (req)) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        return;
+    }
+
+    buf = g_string_sized_new (65536);
+    seaf_metrics_format (buf);
+    format_cache_stats (buf);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Type",
+                                                "text/plain; version=0.0.4", 1, 1));
+    evbuffer_add (req->buffer_out, buf->str, buf->len);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    g_string_free (buf, TRUE);
+}
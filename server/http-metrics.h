@@ -0,0 +1,30 @@
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+/*
+ * Latency and in-flight metrics of http routes.
+ *
+ * A request is timed from the time its path is parsed to the time it's
+ * freed, i.e. including the upload of the request body and the sending
+ * of the response.
+ */
+
+/* Record the requests of @cb, labelled with @route and the method. */
+void
+http_metrics_track_route (evhtp_callback_t *cb, const char *route);
+
+/* Use this instead of evhtp_set_hook() to set the request fini hook of a
+ * tracked route. It's run before the request is recorded.
+ */
+void
+http_metrics_set_fini_hook (evhtp_request_t *req,
+                            evhtp_hook_request_fini_cb hook,
+                            void *arg);
+
+/* Handler of the metrics endpoint. Only serves requests from the local
+ * host that are not proxied.
+ */
+void
+http_metrics_cb (evhtp_request_t *req, void *arg);
+
+#endif
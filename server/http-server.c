@@ -5,6 +5,7 @@
 #include <jansson.h>
 #include <locale.h>
 #include <sys/types.h>
+#include <openssl/sha.h>
 
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 #include <event2/event.h>
@@ -13,6 +14,8 @@
 #endif
 
 #include <evhtp.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_struct.h>
 
 #include "mq-mgr.h"
 #include "utils.h"
@@ -26,6 +29,14 @@
 #include "access-file.h"
 #include "upload-file.h"
 #include "fileserver-config.h"
+#include "head-commit-table.h"
+#include "http-metrics.h"
+#include "http-conn-mgr.h"
+#include "transfer-compress.h"
+#include "block-staging.h"
+#include "loop-task.h"
+#include "async-block-reader.h"
+#include "auth-cache.h"
 
 #include "http-status-codes.h"
 
@@ -47,26 +58,91 @@
 #define HTTP_SCAN_INTERVAL "http_temp_scan_interval"
 
 #define INIT_INFO "If you see this page, Seafile HTTP syncing component works."
-#define PROTO_VERSION "{\"version\": 2}"
+#define PROTO_VERSION "{\"version\": 3}"
 
 #define CLEANING_INTERVAL_SEC 300	/* 5 minutes */
 #define TOKEN_EXPIRE_TIME 7200	    /* 2 hours */
 #define PERM_EXPIRE_TIME 7200       /* 2 hours */
+/* Failed token and permission checks are cached for a short time, so that
+ * floods of invalid tokens don't reach the database.
+ */
+#define DEFAULT_AUTH_NEGATIVE_EXPIRE_TIME 30
+#define DEFAULT_AUTH_CACHE_MAX_ENTRIES 1000000
 #define VIRINFO_EXPIRE_TIME 7200       /* 2 hours */
 
 #define FS_ID_LIST_MAX_WORKERS 3
 #define FS_ID_LIST_TOKEN_LEN 36
+#define FS_ID_LIST_EXPIRE_TIME 1800     /* 30 minutes since last access */
+#define DEFAULT_FS_ID_LIST_MAX_QUEUE 100
+#define DEFAULT_FS_ID_LIST_MAX_IDS 5000000
+#define DEFAULT_FS_ID_LIST_MEMORY_LIMIT 512 /* MB */
+/* Ids are charged to the memory limit in batches of this size. */
+#define FS_ID_LIST_CHARGE_IDS 4096
+/* Number of ids formatted in one write when a list is retrieved. */
+#define FS_ID_LIST_WRITE_IDS 10000
+
+#define DEFAULT_HEAD_COMMIT_TTL 60
+#define DEFAULT_HEAD_COMMIT_TABLE_SIZE 1000000
+#define DEFAULT_HEAD_COMMITS_WATCH_TIMEOUT 60
+#define HEAD_WATCH_CHECK_INTERVAL 1
+#define HEAD_WATCH_HEARTBEAT_INTERVAL 30
+
+#define DEFAULT_PACK_FS_READ_THREADS 8
+/* Objects read in parallel for a pack-fs request. */
+#define PACK_FS_READ_WINDOW 64
+
+#define DEFAULT_RECV_FS_WRITE_THREADS 4
+
+/* Connection limits, 0 means no limit. */
+#define DEFAULT_MAX_CONNECTIONS 0
+#define DEFAULT_MAX_CONNECTIONS_PER_IP 0
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_SEND_TIMEOUT 300
+#define DEFAULT_STREAM_WATERMARK 256 /* KB */
+
+/* Blocks read ahead by each zip task. */
+#define DEFAULT_ZIP_PREFETCH_BLOCKS 4
+
+/* Threads reading blocks for web file downloads. */
+#define DEFAULT_WEB_DOWNLOAD_READ_THREADS 8
+
+/* A recv-fs batch is written when it has this many objects or bytes. */
+#define RECV_FS_BATCH_OBJS 256
+#define RECV_FS_BATCH_SIZE (1 << 20)
+/* Max bytes of received objects not yet written, per upload. */
+#define RECV_FS_WINDOW_SIZE (8 << 20)
+/* Larger fs objects are rejected. Even a dir with a million entries is
+ * smaller once compressed.
+ */
+#define RECV_FS_MAX_OBJ_SIZE (64 << 20)
+
+/* Blocks of clients are at most 8MB by default, this leaves room for
+ * clients configured with larger blocks.
+ */
+#define MAX_BLOCK_SIZE ((gint64)16 << 20)
+
+/* Limit of the inflated size of a deflate encoded block upload. */
+#define MAX_INFLATED_BLOCK_SIZE MAX_BLOCK_SIZE
+
+/* Blocks uploaded in ranges are staged on disk, up to this size. */
+#define MAX_STAGED_BLOCK_SIZE MAX_BLOCK_SIZE
+#define BLOCK_OFFSET_HEADER "Seafile-Block-Offset"
+
+enum {
+    FS_ID_LIST_PENDING,
+    FS_ID_LIST_RUNNING,
+    FS_ID_LIST_DONE,
+    FS_ID_LIST_ERROR,
+};
 
 struct _HttpServer {
     evbase_t *evbase;
     evhtp_t *evhtp;
     pthread_t thread_id;
 
-    GHashTable *token_cache;
-    pthread_mutex_t token_cache_lock; /* token -> username */
-
-    GHashTable *perm_cache;
-    pthread_mutex_t perm_cache_lock; /* repo_id:username -> permission */
+    AuthCache *token_cache;     /* token -> TokenInfo */
+    AuthCache *perm_cache;      /* repo_id:username:op -> EVHTP_RES_* */
+    int auth_negative_expire_time;
 
     GHashTable *vir_repo_info_cache;
     pthread_mutex_t vir_repo_info_cache_lock;
@@ -75,8 +151,29 @@ struct _HttpServer {
 
     GThreadPool *compute_fs_obj_id_pool;
 
-    GHashTable *fs_obj_ids;
+    GHashTable *fs_obj_ids;         /* token -> FsIdListToken */
+    GHashTable *fs_id_list_jobs;    /* repo_id:server_head:client_head:dir_only -> FsIdListJob */
     pthread_mutex_t fs_obj_ids_lock;
+    int fs_id_list_mem_kb;          /* memory used by results, atomic */
+
+    int fs_id_list_workers;
+    int fs_id_list_max_queue;
+    int fs_id_list_max_ids;
+    int fs_id_list_memory_limit_kb;
+
+    GThreadPool *recv_fs_pool;
+
+    GThreadPool *pack_fs_pool;
+    gint64 max_object_pack_size;
+
+    HeadCommitTable *head_table;
+    int head_commit_ttl;
+    int head_commits_watch_timeout;
+    gboolean enable_metrics;
+
+    HttpConnManager *conn_mgr;
+
+    char *block_staging_dir;
 };
 typedef struct _HttpServer HttpServer;
 
@@ -89,20 +186,12 @@ struct _StatsEventData {
 };
 typedef struct _StatsEventData StatsEventData;
 
+// email is NULL if the token is invalid for repo_id.
 typedef struct TokenInfo {
     char *repo_id;
     char *email;
-    gint64 expire_time;
 } TokenInfo;
 
-// PermInfo caches the results from the last permission check for accessing a repo.
-// They're cached in a hash table having "repo_Id:username:op" as key.
-// The cached result is updated on the next call to get_check_permission_cb function, or when the cache expires.
-// The result is only cached if the permission check passed.
-typedef struct PermInfo {
-    gint64 expire_time;
-} PermInfo;
-
 typedef struct VirRepoInfo {
     char *store_id;
     gint64 expire_time;
@@ -119,21 +208,25 @@ typedef enum CheckExistType {
 } CheckExistType;
 
 const char *GET_PROTO_PATH = "/protocol-version";
+const char *METRICS_PATH = "/metrics";
 const char *OP_PERM_CHECK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/permission-check/.*";
 const char *GET_CHECK_QUOTA_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/quota-check/.*";
 const char *HEAD_COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/HEAD";
 const char *GET_HEAD_COMMITS_MULTI_REGEX = "^/repo/head-commits-multi";
+const char *HEAD_COMMITS_WATCH_REGEX = "^/repo/head-commits-watch";
 const char *COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/[\\da-z]{40}";
 const char *PUT_COMMIT_INFO_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/[\\da-z]{40}";
 const char *GET_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/fs-id-list/.*";
 const char *START_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/start-fs-id-list/.*";
 const char *QUERY_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/query-fs-id-list/.*";
 const char *RETRIEVE_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/retrieve-fs-id-list/.*";
+const char *CANCEL_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/cancel-fs-id-list/.*";
 const char *BLOCK_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/block/[\\da-z]{40}";
 const char *POST_CHECK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/check-fs";
 const char *POST_CHECK_BLOCK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/check-blocks";
 const char *POST_RECV_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/recv-fs";
 const char *POST_PACK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-fs";
+const char *POST_PACK_BLOCKS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-blocks";
 const char *GET_BLOCK_MAP_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/block-map/[\\da-z]{40}";
 
 //accessible repos
@@ -288,6 +381,70 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     }
 }
 
+static int
+get_positive_config_integer (GKeyFile *config, char *key, int default_value)
+{
+    GError *error = NULL;
+    int value;
+
+    value = fileserver_config_get_integer (config, key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return default_value;
+    }
+
+    return value > 0 ? value : default_value;
+}
+
+static void
+load_fs_id_list_config (HttpServer *priv, GKeyFile *config)
+{
+    priv->fs_id_list_workers = get_positive_config_integer (config,
+                                                            "fs_id_list_max_workers",
+                                                            FS_ID_LIST_MAX_WORKERS);
+    priv->fs_id_list_max_queue = get_positive_config_integer (config,
+                                                              "fs_id_list_max_queue",
+                                                              DEFAULT_FS_ID_LIST_MAX_QUEUE);
+    priv->fs_id_list_max_ids = get_positive_config_integer (config,
+                                                            "fs_id_list_max_ids",
+                                                            DEFAULT_FS_ID_LIST_MAX_IDS);
+    priv->fs_id_list_memory_limit_kb = get_positive_config_integer (config,
+                                                                    "fs_id_list_memory_limit",
+                                                                    DEFAULT_FS_ID_LIST_MEMORY_LIMIT) * 1024;
+
+    seaf_message ("fileserver: fs_id_list_max_workers = %d, fs_id_list_max_queue = %d, "
+                  "fs_id_list_max_ids = %d, fs_id_list_memory_limit = %dMB\n",
+                  priv->fs_id_list_workers, priv->fs_id_list_max_queue,
+                  priv->fs_id_list_max_ids, priv->fs_id_list_memory_limit_kb / 1024);
+}
+
+typedef struct TokenCheck {
+    const char *repo_id;
+    int status;
+    char *email;
+} TokenCheck;
+
+static void
+check_cached_token (gpointer value, void *data)
+{
+    TokenInfo *token_info = value;
+    TokenCheck *check = data;
+
+    if (strcmp (token_info->repo_id, check->repo_id) != 0) {
+        /* An invalid token may still be valid for another repo. */
+        check->status = token_info->email ? EVHTP_RES_FORBIDDEN : -1;
+        return;
+    }
+
+    if (!token_info->email) {
+        check->status = EVHTP_RES_FORBIDDEN;
+        return;
+    }
+
+    check->status = EVHTP_RES_OK;
+    check->email = g_strdup (token_info->email);
+}
+
 static int
 validate_token (HttpServer *htp_server, evhtp_request_t *req,
                 const char *repo_id, char **username,
@@ -295,6 +452,7 @@ validate_token (HttpServer *htp_server, evhtp_request_t *req,
 {
     char *email = NULL;
     TokenInfo *token_info;
+    TokenCheck check;
 
     const char *token = evhtp_kv_find (req->headers_in, "Seafile-Repo-Token");
     if (token == NULL) {
@@ -303,135 +461,84 @@ validate_token (HttpServer *htp_server, evhtp_request_t *req,
     }
 
     if (!skip_cache) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-
-        token_info = g_hash_table_lookup (htp_server->token_cache, token);
-        if (token_info) {
-            if (strcmp (token_info->repo_id, repo_id) != 0) {
-                pthread_mutex_unlock (&htp_server->token_cache_lock);
-                return EVHTP_RES_FORBIDDEN;
-            }
-
+        memset (&check, 0, sizeof(check));
+        check.repo_id = repo_id;
+        if (auth_cache_lookup (htp_server->token_cache, token,
+                               check_cached_token, &check) &&
+            check.status != -1) {
             if (username)
-                *username = g_strdup(token_info->email);
-            pthread_mutex_unlock (&htp_server->token_cache_lock);
-            return EVHTP_RES_OK;
+                *username = check.email;
+            else
+                g_free (check.email);
+            return check.status;
         }
-
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
     }
 
     email = seaf_repo_manager_get_email_by_token (seaf->repo_mgr,
                                                   repo_id, token);
-    if (email == NULL) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-        g_hash_table_remove (htp_server->token_cache, token);
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
-        return EVHTP_RES_FORBIDDEN;
-    }
 
     token_info = g_new0 (TokenInfo, 1);
     token_info->repo_id = g_strdup (repo_id);
-    token_info->expire_time = (gint64)time(NULL) + TOKEN_EXPIRE_TIME;
     token_info->email = email;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_insert (htp_server->token_cache, g_strdup (token), token_info);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    if (email == NULL) {
+        auth_cache_insert (htp_server->token_cache, token, token_info,
+                           htp_server->auth_negative_expire_time, TRUE);
+        return EVHTP_RES_FORBIDDEN;
+    }
 
     if (username)
         *username = g_strdup(email);
-    return EVHTP_RES_OK;
-}
-
-static PermInfo *
-lookup_perm_cache (HttpServer *htp_server, const char *repo_id, const char *username, const char *op)
-{
-    PermInfo *ret = NULL;
-    PermInfo *perm = NULL;
-    char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
-
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    ret = g_hash_table_lookup (htp_server->perm_cache, key);
-    if (ret) {
-        perm = g_new0 (PermInfo, 1);
-        perm->expire_time = ret->expire_time;
-    }
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
-    g_free (key);
 
-    return perm;
-}
-
-static void
-insert_perm_cache (HttpServer *htp_server,
-                   const char *repo_id, const char *username,
-                   const char *op,
-                   PermInfo *perm)
-{
-    char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
-
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_insert (htp_server->perm_cache, key, perm);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    auth_cache_insert (htp_server->token_cache, token, token_info,
+                       TOKEN_EXPIRE_TIME, FALSE);
+    return EVHTP_RES_OK;
 }
 
 static void
-remove_perm_cache (HttpServer *htp_server,
-                   const char *repo_id, const char *username,
-                   const char *op)
+get_cached_perm (gpointer value, void *data)
 {
-    char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
+    int *status = data;
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_remove (htp_server->perm_cache, key);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
-
-    g_free (key);
+    *status = GPOINTER_TO_INT (value);
 }
 
-static void perm_cache_value_free (gpointer data);
-
 static int
 check_permission (HttpServer *htp_server, const char *repo_id, const char *username,
                   const char *op, gboolean skip_cache)
 {
-    PermInfo *perm_info = NULL;
-
-    if (!skip_cache)
-        perm_info = lookup_perm_cache (htp_server, repo_id, username, op);
-
-    if (perm_info) {
-        perm_cache_value_free (perm_info);
-        return EVHTP_RES_OK;
-    }
+    char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
+    int status = EVHTP_RES_FORBIDDEN;
+    char *perm;
 
-    remove_perm_cache (htp_server, repo_id, username, op);
+    if (!skip_cache &&
+        auth_cache_lookup (htp_server->perm_cache, key, get_cached_perm, &status))
+        goto out;
 
     if (strcmp(op, "upload") == 0) {
-        int status = seaf_repo_manager_get_repo_status(seaf->repo_mgr, repo_id);
-        if (status != REPO_STATUS_NORMAL && status != -1)
-            return EVHTP_RES_FORBIDDEN;
+        int repo_status = seaf_repo_manager_get_repo_status(seaf->repo_mgr, repo_id);
+        if (repo_status != REPO_STATUS_NORMAL && repo_status != -1)
+            goto cache;
     }
 
-    char *perm = seaf_repo_manager_check_permission (seaf->repo_mgr,
-                                                     repo_id, username, NULL);
+    perm = seaf_repo_manager_check_permission (seaf->repo_mgr,
+                                               repo_id, username, NULL);
     if (perm) {
-        if ((strcmp (perm, "r") == 0 && strcmp (op, "upload") == 0)) {
-            g_free (perm);
-            return EVHTP_RES_FORBIDDEN;
-        }
-
+        if (!(strcmp (perm, "r") == 0 && strcmp (op, "upload") == 0))
+            status = EVHTP_RES_OK;
         g_free (perm);
-        perm_info = g_new0 (PermInfo, 1);
-        /* Take the reference of perm. */
-        perm_info->expire_time = (gint64)time(NULL) + PERM_EXPIRE_TIME;
-        insert_perm_cache (htp_server, repo_id, username, op, perm_info);
-        return EVHTP_RES_OK;
     }
 
-    /* Invalidate cache if perm not found in db. */
-    return EVHTP_RES_FORBIDDEN;
+cache:
+    if (status == EVHTP_RES_OK)
+        auth_cache_insert (htp_server->perm_cache, key, GINT_TO_POINTER(status),
+                           PERM_EXPIRE_TIME, FALSE);
+    else
+        auth_cache_insert (htp_server->perm_cache, key, GINT_TO_POINTER(status),
+                           htp_server->auth_negative_expire_time, TRUE);
+out:
+    g_free (key);
+    return status;
 }
 
 static gboolean
@@ -914,6 +1021,19 @@ get_head_commit_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    /* Usually answered from the branch head cache. */
+    SeafBranch *master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                                         repo_id, "master");
+    if (master) {
+        evbuffer_add_printf (req->buffer_out,
+                             "{\"is_corrupted\": 0, \"head_commit_id\": \"%s\"}",
+                             master->commit_id);
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        seaf_branch_unref (master);
+        goto out;
+    }
+
+    /* Tell a db error from a missing branch. */
     commit_id[0] = 0;
 
     sql = "SELECT commit_id FROM Branch WHERE name='master' AND repo_id=?";
@@ -1288,6 +1408,290 @@ out:
         free (data);
 }
 
+/* A client waiting for head commits of repos to change. */
+typedef struct HeadWatchData {
+    HttpServer *htp_server;
+    evhtp_request_t *req;
+    /* repo_id -> head commit id known by the client. */
+    json_t *known;
+    char **repo_ids;
+    int n_repos;
+    gboolean sse;
+    guint seq;
+    gint64 deadline;
+    gint64 next_reload;
+    gint64 next_heartbeat;
+    struct event *timer;
+} HeadWatchData;
+
+static void
+free_head_watch_data (HeadWatchData *data)
+{
+    if (data->timer)
+        event_free (data->timer);
+    json_decref (data->known);
+    g_strfreev (data->repo_ids);
+    g_free (data);
+}
+
+/* Returns the repos whose head is not the one the client knows, and
+ * remembers the new heads. Returns NULL on error.
+ */
+static json_t *
+collect_head_changes (HeadWatchData *data)
+{
+    HttpServer *htp_server = data->htp_server;
+    json_t *heads, *changes;
+    const char *repo_id, *known;
+    json_t *head;
+    void *iter;
+
+    data->seq = head_commit_table_get_seq (htp_server->head_table);
+    data->next_reload = (gint64)time(NULL) + htp_server->head_commit_ttl;
+
+    heads = json_object ();
+    if (head_commit_table_lookup (htp_server->head_table, data->repo_ids,
+                                  data->n_repos, heads) < 0) {
+        json_decref (heads);
+        return NULL;
+    }
+
+    changes = json_object ();
+    for (iter = json_object_iter (heads); iter;
+         iter = json_object_iter_next (heads, iter)) {
+        repo_id = json_object_iter_key (iter);
+        head = json_object_iter_value (iter);
+        known = json_string_value (json_object_get (data->known, repo_id));
+        if (g_strcmp0 (known, json_string_value (head)) != 0) {
+            json_object_set (changes, repo_id, head);
+            json_object_set (data->known, repo_id, head);
+        }
+    }
+
+    json_decref (heads);
+    return changes;
+}
+
+static void
+send_head_changes_event (HeadWatchData *data, json_t *changes)
+{
+    struct evbuffer *buf = evbuffer_new ();
+    char *json_str = json_dumps (changes, JSON_COMPACT);
+
+    evbuffer_add_printf (buf, "data: %s\n\n", json_str);
+    evhtp_send_reply_chunk (data->req, buf);
+
+    evbuffer_free (buf);
+    free (json_str);
+}
+
+/* End a long-poll request. data is freed when the request is finished. */
+static void
+finish_head_watch (HeadWatchData *data, json_t *changes, int status)
+{
+    evhtp_request_t *req = data->req;
+    char *json_str;
+
+    event_free (data->timer);
+    data->timer = NULL;
+
+    evhtp_request_resume (req);
+
+    if (status == EVHTP_RES_OK) {
+        json_str = json_dumps (changes, JSON_COMPACT);
+        evbuffer_add (req->buffer_out, json_str, strlen(json_str));
+        free (json_str);
+    }
+    evhtp_send_reply (req, status);
+}
+
+static void
+head_watch_timer_cb (evutil_socket_t sock, short type, void *arg)
+{
+    HeadWatchData *data = arg;
+    HttpServer *htp_server = data->htp_server;
+    gint64 now = (gint64)time(NULL);
+    json_t *changes;
+
+    /* The table is only looked up when a head has changed, or when entries
+     * loaded from the database may have expired.
+     */
+    if (data->seq != head_commit_table_get_seq (htp_server->head_table) ||
+        now >= data->next_reload) {
+        changes = collect_head_changes (data);
+        if (!changes) {
+            if (!data->sse)
+                finish_head_watch (data, NULL, EVHTP_RES_SERVERR);
+            return;
+        }
+
+        if (json_object_size (changes) > 0) {
+            if (data->sse) {
+                send_head_changes_event (data, changes);
+                data->next_heartbeat = now + HEAD_WATCH_HEARTBEAT_INTERVAL;
+            } else {
+                finish_head_watch (data, changes, EVHTP_RES_OK);
+            }
+            json_decref (changes);
+            return;
+        }
+        json_decref (changes);
+    }
+
+    if (!data->sse && now >= data->deadline) {
+        changes = json_object ();
+        finish_head_watch (data, changes, EVHTP_RES_OK);
+        json_decref (changes);
+        return;
+    }
+
+    if (data->sse && now >= data->next_heartbeat) {
+        /* Comment lines keep proxies from closing an idle stream. */
+        struct evbuffer *buf = evbuffer_new ();
+        evbuffer_add_printf (buf, ": keepalive\n\n");
+        evhtp_send_reply_chunk (data->req, buf);
+        evbuffer_free (buf);
+        data->next_heartbeat = now + HEAD_WATCH_HEARTBEAT_INTERVAL;
+    }
+}
+
+static evhtp_res
+head_watch_finish_cb (evhtp_request_t *req, void *arg)
+{
+    HeadWatchData *data = arg;
+
+    free_head_watch_data (data);
+
+    return EVHTP_RES_OK;
+}
+
+/*
+ * Wait for the head commits of a set of repos to change, instead of
+ * polling head-commits-multi.
+ *
+ * The body is a json object of repo_id -> the head commit id the client
+ * has. The reply is a json object of the repos whose head is different,
+ * with their current head. It's sent as soon as a head differs, or as an
+ * empty object after the timeout (the "timeout" argument in seconds,
+ * capped by head_commits_watch_timeout).
+ *
+ * With "Accept: text/event-stream", the response is a stream of server
+ * sent events, one for each set of changes, until the client disconnects.
+ */
+static void
+head_commits_watch_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    size_t list_len;
+    json_t *known = NULL;
+    json_t *changes = NULL;
+    HeadWatchData *data = NULL;
+    const char *repo_id, *accept, *timeout_arg;
+    json_t *commit;
+    void *iter;
+    int i, timeout;
+    char *json_str;
+
+    list_len = evbuffer_get_length (req->buffer_in);
+    if (list_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    char *body = g_new0 (char, list_len);
+    json_error_t jerror;
+    evbuffer_remove (req->buffer_in, body, list_len);
+    known = json_loadb (body, list_len, 0, &jerror);
+    g_free (body);
+
+    if (!known || !json_is_object (known) || json_object_size (known) == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    data = g_new0 (HeadWatchData, 1);
+    data->htp_server = htp_server;
+    data->req = req;
+    data->n_repos = json_object_size (known);
+    data->repo_ids = g_new0 (char *, data->n_repos + 1);
+    i = 0;
+    for (iter = json_object_iter (known); iter;
+         iter = json_object_iter_next (known, iter)) {
+        repo_id = json_object_iter_key (iter);
+        commit = json_object_iter_value (iter);
+        /* Make sure ids are in UUID format. */
+        if (!is_uuid_valid (repo_id) ||
+            !(json_is_null (commit) || json_is_string (commit))) {
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            goto out;
+        }
+        data->repo_ids[i++] = g_strdup (repo_id);
+    }
+    data->known = known;
+    known = NULL;
+
+    changes = collect_head_changes (data);
+    if (!changes) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    accept = evhtp_kv_find (req->headers_in, "Accept");
+    data->sse = (accept && strstr (accept, "text/event-stream") != NULL);
+
+    if (!data->sse && json_object_size (changes) > 0) {
+        json_str = json_dumps (changes, JSON_COMPACT);
+        evbuffer_add (req->buffer_out, json_str, strlen(json_str));
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        free (json_str);
+        goto out;
+    }
+
+    timeout = htp_server->head_commits_watch_timeout;
+    timeout_arg = evhtp_kv_find (req->uri->query, "timeout");
+    if (timeout_arg && atoi (timeout_arg) > 0 && atoi (timeout_arg) < timeout)
+        timeout = atoi (timeout_arg);
+    data->deadline = (gint64)time(NULL) + timeout;
+    data->next_heartbeat = (gint64)time(NULL) + HEAD_WATCH_HEARTBEAT_INTERVAL;
+
+    struct timeval tv;
+    tv.tv_sec = HEAD_WATCH_CHECK_INTERVAL;
+    tv.tv_usec = 0;
+    data->timer = event_new (evhtp_request_get_connection(req)->evbase, -1,
+                             EV_PERSIST, head_watch_timer_cb, data);
+    evtimer_add (data->timer, &tv);
+
+    /* data is freed when the request is finished or the connection is closed. */
+    http_metrics_set_fini_hook (req, head_watch_finish_cb, data);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    if (data->sse) {
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type",
+                                                    "text/event-stream", 1, 1));
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Cache-Control",
+                                                    "no-cache", 1, 1));
+        evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+        /* The first event has the heads the client doesn't know yet. */
+        if (json_object_size (changes) > 0)
+            send_head_changes_event (data, changes);
+    }
+    data = NULL;
+
+out:
+    if (data)
+        free_head_watch_data (data);
+    if (known)
+        json_decref (known);
+    if (changes)
+        json_decref (changes);
+}
+
 static void
 get_commit_info_cb (evhtp_request_t *req, void *arg)
 {
@@ -1403,16 +1807,26 @@ commit_oper_cb (evhtp_request_t *req, void *arg)
     }
 }
 
+/* Called for each object that the client doesn't have. Returning -1
+ * stops the diff.
+ */
+typedef int (*CollectObjIDFunc) (const char *obj_id, void *data);
+
+typedef struct CollectObjIDs {
+    CollectObjIDFunc collect;
+    void *data;
+} CollectObjIDs;
+
 static int
 collect_file_ids (int n, const char *basedir, SeafDirent *files[], void *data)
 {
     SeafDirent *file1 = files[0];
     SeafDirent *file2 = files[1];
-    GList **pret = data;
+    CollectObjIDs *collector = data;
 
     if (file1 && (!file2 || strcmp(file1->id, file2->id) != 0) &&
         strcmp (file1->id, EMPTY_SHA1) != 0)
-        *pret = g_list_prepend (*pret, g_strdup(file1->id));
+        return collector->collect (file1->id, collector->data);
 
     return 0;
 }
@@ -1429,27 +1843,30 @@ collect_dir_ids (int n, const char *basedir, SeafDirent *dirs[], void *data,
 {
     SeafDirent *dir1 = dirs[0];
     SeafDirent *dir2 = dirs[1];
-    GList **pret = data;
+    CollectObjIDs *collector = data;
 
     if (dir1 && (!dir2 || strcmp(dir1->id, dir2->id) != 0) &&
         strcmp (dir1->id, EMPTY_SHA1) != 0)
-        *pret = g_list_prepend (*pret, g_strdup(dir1->id));
+        return collector->collect (dir1->id, collector->data);
 
     return 0;
 }
 
 static int
-calculate_send_object_list (SeafRepo *repo,
-                            const char *server_head,
-                            const char *client_head,
-                            gboolean dir_only,
-                            GList **results)
+diff_send_object_list (SeafRepo *repo,
+                       const char *server_head,
+                       const char *client_head,
+                       gboolean dir_only,
+                       CollectObjIDFunc collect,
+                       void *data)
 {
     SeafCommit *remote_head = NULL, *master_head = NULL;
     char *remote_head_root;
+    CollectObjIDs collector;
     int ret = 0;
 
-    *results = NULL;
+    collector.collect = collect;
+    collector.data = data;
 
     master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
                                                   repo->id, repo->version,
@@ -1473,8 +1890,11 @@ calculate_send_object_list (SeafRepo *repo,
 
     /* Diff won't traverse the root object itself. */
     if (strcmp (remote_head_root, master_head->root_id) != 0 &&
-        strcmp (master_head->root_id, EMPTY_SHA1) != 0)
-        *results = g_list_prepend (*results, g_strdup(master_head->root_id));
+        strcmp (master_head->root_id, EMPTY_SHA1) != 0 &&
+        collect (master_head->root_id, data) < 0) {
+        ret = -1;
+        goto out;
+    }
 
     DiffOptions opts;
     memset (&opts, 0, sizeof(opts));
@@ -1485,7 +1905,7 @@ calculate_send_object_list (SeafRepo *repo,
     else
         opts.file_cb = collect_file_ids_nop;
     opts.dir_cb = collect_dir_ids;
-    opts.data = results;
+    opts.data = &collector;
 
     const char *trees[2];
     trees[0] = master_head->root_id;
@@ -1493,7 +1913,6 @@ calculate_send_object_list (SeafRepo *repo,
     if (diff_trees (2, trees, &opts) < 0) {
         seaf_warning ("Failed to diff remote and master head for repo %.8s.\n",
                       repo->id);
-        string_list_free (*results);
         ret = -1;
     }
 
@@ -1503,6 +1922,34 @@ out:
     return ret;
 }
 
+static int
+collect_obj_id_to_list (const char *obj_id, void *data)
+{
+    GList **pret = data;
+
+    *pret = g_list_prepend (*pret, g_strdup(obj_id));
+    return 0;
+}
+
+static int
+calculate_send_object_list (SeafRepo *repo,
+                            const char *server_head,
+                            const char *client_head,
+                            gboolean dir_only,
+                            GList **results)
+{
+    *results = NULL;
+
+    if (diff_send_object_list (repo, server_head, client_head, dir_only,
+                               collect_obj_id_to_list, results) < 0) {
+        string_list_free (*results);
+        *results = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
 static void
 get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 {
@@ -1586,95 +2033,232 @@ out:
     seaf_repo_unref (repo);
 }
 
-typedef struct ComputeObjTask {
+/*
+ * Asynchronous fs id list computation.
+ *
+ * For a large library the diff between the server head and the client head
+ * can take longer than the client waits for a reply. The client starts the
+ * computation with start-fs-id-list, polls query-fs-id-list for progress,
+ * then reads the ids with retrieve-fs-id-list, page by page if it passes
+ * "offset" and "limit".
+ *
+ * A computation (FsIdListJob) is shared by the tokens started for the same
+ * repo, heads and dir-only flag. It's canceled when its last token is
+ * released: fully retrieved, canceled by the client or expired.
+ */
+
+typedef struct FsIdListJob {
     HttpServer *htp_server;
-    char *token;
-    char *repo_id;
+    char *key;
+    char repo_id[37];
+    char server_head[41];
     char *client_head;
-    char *server_head;
     gboolean dir_only;
-} ComputeObjTask;
 
-typedef struct CalObjResult {
-    GList *list;
-    gboolean done;
-} CalObjResult;
+    int ref;
+    /* Protected by fs_obj_ids_lock. */
+    int n_tokens;
+
+    /* Written by the worker thread, read with atomic operations. */
+    int status;
+    int n_ids;
+    int canceled;
+    /* Set before status becomes FS_ID_LIST_ERROR. */
+    int error_status;
+    char *error;
+
+    /* Raw 20-byte ids, only read after status becomes FS_ID_LIST_DONE. */
+    GByteArray *ids;
+    int charged_kb;
+} FsIdListJob;
+
+typedef struct FsIdListToken {
+    FsIdListJob *job;
+    gint64 expire_time;
+} FsIdListToken;
 
-static void
-free_compute_obj_task(ComputeObjTask *task)
+static FsIdListJob *
+fs_id_list_job_ref (FsIdListJob *job)
 {
-    if (!task)
-        return;
+    g_atomic_int_inc (&job->ref);
+    return job;
+}
 
-    if (task->token)
-        g_free(task->token);
-    if (task->repo_id)
-        g_free(task->repo_id);
-    if (task->client_head)
-        g_free(task->client_head);
-    if (task->server_head)
-        g_free(task->server_head);
-    g_free(task);
+static void
+fs_id_list_job_free_ids (FsIdListJob *job)
+{
+    g_atomic_int_add (&job->htp_server->fs_id_list_mem_kb, -job->charged_kb);
+    job->charged_kb = 0;
+    if (job->ids)
+        g_byte_array_free (job->ids, TRUE);
+    job->ids = NULL;
 }
 
 static void
-free_obj_cal_result (gpointer data)
+fs_id_list_job_unref (FsIdListJob *job)
 {
-    CalObjResult *result = (CalObjResult *)data;
-    if (!result)
+    if (!job || !g_atomic_int_dec_and_test (&job->ref))
         return;
 
-    if (result->list)
-        g_list_free (result->list);
-
-    g_free(result);
+    fs_id_list_job_free_ids (job);
+    g_free (job->key);
+    g_free (job->client_head);
+    g_free (job->error);
+    g_free (job);
 }
 
+/* Called with fs_obj_ids_lock held, when a token is removed. */
 static void
-compute_fs_obj_id (gpointer ptask, gpointer ppara)
+free_fs_id_list_token (gpointer data)
 {
-    SeafRepo *repo = NULL;
-    ComputeObjTask *task = ptask;
-    const char *client_head = task->client_head;
-    const char *server_head = task->server_head;
-    char *repo_id = task->repo_id;
-    gboolean dir_only = task->dir_only;
-    HttpServer *htp_server = task->htp_server;
-    CalObjResult *result = NULL;
+    FsIdListToken *token = data;
+    FsIdListJob *job = token->job;
+    HttpServer *htp_server = job->htp_server;
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
-    result = g_hash_table_lookup (htp_server->fs_obj_ids, task->token);
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
-    if (!result) {
-        goto out;
+    if (--(job->n_tokens) == 0) {
+        /* Nobody waits for the result any more. */
+        g_atomic_int_set (&job->canceled, 1);
+        if (g_hash_table_lookup (htp_server->fs_id_list_jobs, job->key) == job)
+            g_hash_table_remove (htp_server->fs_id_list_jobs, job->key);
     }
 
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to find repo %.8s.\n", repo_id);
-        goto out;
-    }
+    fs_id_list_job_unref (job);
+    g_free (token);
+}
 
-    if (calculate_send_object_list (repo, server_head, client_head, dir_only, &result->list) < 0) {
-        pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
-        g_hash_table_remove (htp_server->fs_obj_ids, task->token);
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
-        goto out;
+static gboolean
+is_fs_id_list_token_expire (gpointer key, gpointer value, gpointer arg)
+{
+    FsIdListToken *token = value;
+
+    return token->expire_time <= (gint64)time(NULL);
+}
+
+/* Returns a new reference to the job of @token, or NULL if the token
+ * doesn't exist or belongs to another repo.
+ */
+static FsIdListJob *
+lookup_fs_id_list_job (HttpServer *htp_server, const char *repo_id,
+                       const char *token)
+{
+    FsIdListToken *info;
+    FsIdListJob *job = NULL;
+
+    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    info = g_hash_table_lookup (htp_server->fs_obj_ids, token);
+    if (info && strcmp (info->job->repo_id, repo_id) == 0) {
+        info->expire_time = (gint64)time(NULL) + FS_ID_LIST_EXPIRE_TIME;
+        job = fs_id_list_job_ref (info->job);
     }
+    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
 
-    result->done = TRUE;
-out:
-    seaf_repo_unref (repo);
-    free_compute_obj_task(task);
+    return job;
 }
 
 static void
-start_fs_obj_id_cb (evhtp_request_t *req, void *arg)
+release_fs_id_list_token (HttpServer *htp_server, const char *token)
 {
-    HttpServer *htp_server = arg;
-    char **parts;
-    char *repo_id;
+    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    g_hash_table_remove (htp_server->fs_obj_ids, token);
+    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+}
+
+static int
+collect_obj_id_to_job (const char *obj_id, void *data)
+{
+    FsIdListJob *job = data;
+    HttpServer *htp_server = job->htp_server;
+    unsigned char raw[20];
+
+    if (g_atomic_int_get (&job->canceled))
+        return -1;
+
+    if (job->n_ids >= htp_server->fs_id_list_max_ids) {
+        seaf_warning ("Too many fs objects to send for repo %.8s.\n",
+                      job->repo_id);
+        job->error_status = EVHTP_RES_SERVERR;
+        job->error = g_strdup ("Too many objects to send.\n");
+        return -1;
+    }
+
+    /* Charge the memory limit for a batch of ids at once. */
+    if (job->n_ids % FS_ID_LIST_CHARGE_IDS == 0) {
+        int kb = FS_ID_LIST_CHARGE_IDS * 20 / 1024;
+        if (g_atomic_int_add (&htp_server->fs_id_list_mem_kb, kb) + kb >
+            htp_server->fs_id_list_memory_limit_kb) {
+            g_atomic_int_add (&htp_server->fs_id_list_mem_kb, -kb);
+            seaf_warning ("Memory limit of fs id lists is reached.\n");
+            job->error_status = EVHTP_RES_SERVUNAVAIL;
+            job->error = g_strdup ("Server is busy, please try again later.\n");
+            return -1;
+        }
+        job->charged_kb += kb;
+    }
+
+    hex_to_rawdata (obj_id, raw, 20);
+    g_byte_array_append (job->ids, raw, 20);
+    g_atomic_int_inc (&job->n_ids);
+
+    return 0;
+}
+
+static void
+compute_fs_obj_id (gpointer ptask, gpointer ppara)
+{
+    FsIdListJob *job = ptask;
+    HttpServer *htp_server = job->htp_server;
+    SeafRepo *repo = NULL;
+
+    if (g_atomic_int_get (&job->canceled))
+        goto error;
+
+    g_atomic_int_set (&job->status, FS_ID_LIST_RUNNING);
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, job->repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to find repo %.8s.\n", job->repo_id);
+        goto error;
+    }
+
+    if (diff_send_object_list (repo, job->server_head, job->client_head,
+                               job->dir_only, collect_obj_id_to_job, job) < 0)
+        goto error;
+
+    g_atomic_int_set (&job->status, FS_ID_LIST_DONE);
+    goto out;
+
+error:
+    /* Don't give a failed job to new requests. */
+    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    if (g_hash_table_lookup (htp_server->fs_id_list_jobs, job->key) == job)
+        g_hash_table_remove (htp_server->fs_id_list_jobs, job->key);
+    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+
+    fs_id_list_job_free_ids (job);
+    if (!job->error) {
+        job->error_status = EVHTP_RES_SERVERR;
+        job->error = g_strdup ("Failed to calculate fs id list.\n");
+    }
+    g_atomic_int_set (&job->status, FS_ID_LIST_ERROR);
+
+out:
+    seaf_repo_unref (repo);
+    fs_id_list_job_unref (job);
+}
+
+static void
+start_fs_obj_id_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts;
+    char *repo_id;
     gboolean dir_only = FALSE;
+    char *username = NULL;
+    char *key = NULL;
+    FsIdListJob *job;
+    FsIdListToken *token;
+    gboolean new_job = FALSE;
+    char uuid[37];
     json_t *obj;
 
     const char *server_head = evhtp_kv_find (req->uri->query, "server-head");
@@ -1700,43 +2284,66 @@ start_fs_obj_id_cb (evhtp_request_t *req, void *arg)
     parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
 
-    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
         evhtp_send_reply (req, token_status);
         goto out;
     }
 
-    char uuid[37];
-    char *new_token;
-    gen_uuid_inplace (uuid);
-    new_token = g_strndup(uuid, FS_ID_LIST_TOKEN_LEN);
-
-    CalObjResult *result = g_new0(CalObjResult, 1);
-    if (!result) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-    result->done = FALSE;
-
-    ComputeObjTask *task = g_new0 (ComputeObjTask, 1);
-    if (!task) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "download", FALSE);
+    if (perm_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
         goto out;
     }
 
-    task->token = new_token;
-    task->dir_only = dir_only;
-    task->htp_server = htp_server;
-    task->repo_id = g_strdup(repo_id);
-    task->client_head = g_strdup(client_head);
-    task->server_head = g_strdup(server_head);
+    key = g_strdup_printf ("%s:%s:%s:%d", repo_id, server_head,
+                           client_head ? client_head : EMPTY_SHA1, dir_only);
 
     pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
-    g_hash_table_insert (htp_server->fs_obj_ids, g_strdup(task->token), result);
+
+    job = g_hash_table_lookup (htp_server->fs_id_list_jobs, key);
+    if (!job) {
+        if (g_thread_pool_unprocessed (htp_server->compute_fs_obj_id_pool) >=
+            htp_server->fs_id_list_max_queue) {
+            pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+            char *error = "Too many fs id lists are being calculated.\n";
+            evbuffer_add (req->buffer_out, error, strlen (error));
+            evhtp_send_reply (req, EVHTP_RES_SERVUNAVAIL);
+            goto out;
+        }
+
+        job = g_new0 (FsIdListJob, 1);
+        job->htp_server = htp_server;
+        job->key = key;
+        key = NULL;
+        memcpy (job->repo_id, repo_id, 36);
+        memcpy (job->server_head, server_head, 40);
+        job->client_head = g_strdup (client_head);
+        job->dir_only = dir_only;
+        job->status = FS_ID_LIST_PENDING;
+        job->ids = g_byte_array_new ();
+        /* The reference of the worker. */
+        job->ref = 1;
+        g_hash_table_insert (htp_server->fs_id_list_jobs, job->key, job);
+        new_job = TRUE;
+    }
+
+    token = g_new0 (FsIdListToken, 1);
+    token->job = fs_id_list_job_ref (job);
+    token->expire_time = (gint64)time(NULL) + FS_ID_LIST_EXPIRE_TIME;
+    ++(job->n_tokens);
+
+    gen_uuid_inplace (uuid);
+    g_hash_table_insert (htp_server->fs_obj_ids, g_strdup(uuid), token);
+
+    if (new_job)
+        g_thread_pool_push (htp_server->compute_fs_obj_id_pool, job, NULL);
+
     pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
-    g_thread_pool_push (htp_server->compute_fs_obj_id_pool, task, NULL);
+
     obj = json_object ();
-    json_object_set_new (obj, "token", json_string (new_token));
+    json_object_set_new (obj, "token", json_string (uuid));
 
     char *json_str = json_dumps (obj, JSON_COMPACT);
     evbuffer_add (req->buffer_out, json_str, strlen(json_str));
@@ -1745,18 +2352,48 @@ start_fs_obj_id_cb (evhtp_request_t *req, void *arg)
     g_free (json_str);
     json_decref (obj);
 out:
+    g_free (key);
+    g_free (username);
     g_strfreev (parts);
 }
 
+static const char *
+fs_id_list_status_str (int status)
+{
+    switch (status) {
+    case FS_ID_LIST_PENDING:
+        return "pending";
+    case FS_ID_LIST_RUNNING:
+        return "running";
+    case FS_ID_LIST_DONE:
+        return "done";
+    default:
+        return "error";
+    }
+}
+
+/* Reply the error of a failed job, and release the token. The client has
+ * to start again.
+ */
+static void
+reply_fs_id_list_error (HttpServer *htp_server, evhtp_request_t *req,
+                        FsIdListJob *job, const char *token)
+{
+    release_fs_id_list_token (htp_server, token);
+    evbuffer_add (req->buffer_out, job->error, strlen(job->error));
+    evhtp_send_reply (req, job->error_status);
+}
+
 static void
 query_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 {
-    json_t *obj;
+    json_t *obj = NULL;
     const char *token = NULL;
-    CalObjResult *result = NULL;
+    FsIdListJob *job = NULL;
     char **parts;
     char *repo_id = NULL;
     HttpServer *htp_server = (HttpServer *)arg;
+    int status;
 
     parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
@@ -1773,24 +2410,27 @@ query_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    obj = json_object ();
-
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
-    result = g_hash_table_lookup (htp_server->fs_obj_ids, token);
-    if (!result) {
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+    job = lookup_fs_id_list_job (htp_server, repo_id, token);
+    if (!job) {
         evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
         goto out;
-    } else {
-        if (!result->done) {
-            json_object_set_new (obj, "success", json_false());
-        } else {
-            json_object_set_new (obj, "success", json_true());
-        }
     }
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
 
+    status = g_atomic_int_get (&job->status);
+    if (status == FS_ID_LIST_ERROR) {
+        reply_fs_id_list_error (htp_server, req, job, token);
+        goto out;
+    }
+
+    obj = json_object ();
+    json_object_set_new (obj, "success",
+                         status == FS_ID_LIST_DONE ? json_true() : json_false());
     json_object_set_new (obj, "token", json_string (token));
+    json_object_set_new (obj, "status",
+                         json_string (fs_id_list_status_str (status)));
+    /* Number of ids found so far, the total when done. */
+    json_object_set_new (obj, "count",
+                         json_integer (g_atomic_int_get (&job->n_ids)));
 
     char *json_str = json_dumps (obj, JSON_COMPACT);
     evbuffer_add (req->buffer_out, json_str, strlen(json_str));
@@ -1801,19 +2441,106 @@ query_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 out:
     if (obj)
         json_decref (obj);
+    fs_id_list_job_unref (job);
     g_strfreev (parts);
     return;
 }
 
+typedef struct SendFsIdListData {
+    evhtp_request_t *req;
+    FsIdListJob *job;
+    int start;
+    int pos;
+    int end;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendFsIdListData;
+
+static void
+free_send_fs_id_list_data (SendFsIdListData *data)
+{
+    fs_id_list_job_unref (data->job);
+    g_free (data);
+}
+
+/* The ids are formatted into the json array batch by batch, instead of
+ * building the whole list in memory.
+ */
+static void
+write_fs_id_list_cb (struct bufferevent *bev, void *ctx)
+{
+    SendFsIdListData *data = ctx;
+    struct evbuffer *buf;
+    char hex[41];
+    int n = 0;
+
+    buf = evbuffer_new ();
+    if (data->pos == data->start)
+        evbuffer_add (buf, "[", 1);
+
+    while (data->pos < data->end && n < FS_ID_LIST_WRITE_IDS) {
+        rawdata_to_hex (data->job->ids->data + (gsize)data->pos * 20, hex, 20);
+        if (data->pos != data->start)
+            evbuffer_add (buf, ",", 1);
+        evbuffer_add_printf (buf, "\"%s\"", hex);
+        ++(data->pos);
+        ++n;
+    }
+
+    if (data->pos < data->end) {
+        /* This may call write_fs_id_list_cb() recursively (by
+         * libevent_openssl), so don't use data after here.
+         */
+        evhtp_send_reply_chunk (data->req, buf);
+        evbuffer_free (buf);
+        return;
+    }
+
+    evbuffer_add (buf, "]", 1);
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+    http_conn_stream_end (bev);
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_chunk (data->req, buf);
+    evbuffer_free (buf);
+    evhtp_send_reply_chunk_end (data->req);
+
+    free_send_fs_id_list_data (data);
+}
+
+static void
+fs_id_list_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendFsIdListData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. */
+    free_send_fs_id_list_data (data);
+}
+
 static void
 retrieve_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 {
     char **parts;
     const char *token = NULL;
     char *repo_id = NULL;
-    GList *list = NULL;
-    CalObjResult *result = NULL;
+    FsIdListJob *job = NULL;
     HttpServer *htp_server = (HttpServer *)arg;
+    const char *offset_arg, *limit_arg;
+    int offset = 0, limit = -1;
+    int status, n_ids, start, end;
+    SendFsIdListData *data;
 
     parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
@@ -1830,49 +2557,200 @@ retrieve_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
-    result = g_hash_table_lookup (htp_server->fs_obj_ids, token);
-    if (!result) {
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
-        evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
+    offset_arg = evhtp_kv_find (req->uri->query, "offset");
+    if (offset_arg)
+        offset = atoi (offset_arg);
+    limit_arg = evhtp_kv_find (req->uri->query, "limit");
+    if (limit_arg)
+        limit = atoi (limit_arg);
+    if (offset < 0 || (limit_arg && limit <= 0)) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
 
-        return;
+    job = lookup_fs_id_list_job (htp_server, repo_id, token);
+    if (!job) {
+        evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
+        goto out;
     }
-    if (!result->done) {
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
 
-        char *error = "The cauculation task is not completed.\n";
+    status = g_atomic_int_get (&job->status);
+    if (status == FS_ID_LIST_ERROR) {
+        reply_fs_id_list_error (htp_server, req, job, token);
+        goto out;
+    }
+    if (status != FS_ID_LIST_DONE) {
+        char *error = "The calculation task is not completed.\n";
         evbuffer_add (req->buffer_out, error, strlen(error));
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        return;
+        goto out;
     }
-    list = result->list;
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
 
-    GList *ptr;
-    json_t *obj_array = json_array ();
+    n_ids = g_atomic_int_get (&job->n_ids);
+    start = MIN (offset, n_ids);
+    if (limit < 0 || limit > n_ids - start)
+        end = n_ids;
+    else
+        end = start + limit;
 
-    for (ptr = list; ptr; ptr = ptr->next) {
-        json_array_append_new (obj_array, json_string (ptr->data));
-        g_free (ptr->data);
+    /* The last page is being sent, the job is kept alive by our reference. */
+    if (end == n_ids)
+        release_fs_id_list_token (htp_server, token);
+
+    if (start == end) {
+        evbuffer_add (req->buffer_out, "[]", 2);
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        goto out;
     }
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
-    g_hash_table_remove (htp_server->fs_obj_ids, token);
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+    data = g_new0 (SendFsIdListData, 1);
+    data->req = req;
+    data->job = job;
+    job = NULL;
+    data->start = start;
+    data->pos = start;
+    data->end = end;
 
-    char *obj_list = json_dumps (obj_array, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, obj_list, strlen (obj_list));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    /* We need to overwrite evhtp's callback functions to
+     * write the list piece by piece.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_fs_id_list_cb,
+                       fs_id_list_event_cb,
+                       data);
+    http_conn_stream_begin (bev);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
 
-    g_free (obj_list);
-    json_decref (obj_array);
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
 
 out:
+    fs_id_list_job_unref (job);
     g_strfreev (parts);
     return;
 }
 
+static void
+cancel_fs_obj_id_cb (evhtp_request_t *req, void *arg)
+{
+    char **parts;
+    const char *token = NULL;
+    char *repo_id = NULL;
+    FsIdListJob *job = NULL;
+    HttpServer *htp_server = (HttpServer *)arg;
+
+    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    repo_id = parts[1];
+
+    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    token = evhtp_kv_find (req->uri->query, "token");
+    if (!token || strlen(token)!=FS_ID_LIST_TOKEN_LEN) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    job = lookup_fs_id_list_job (htp_server, repo_id, token);
+    if (!job) {
+        evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
+        goto out;
+    }
+
+    /* The computation stops if no other client waits for it. */
+    release_fs_id_list_token (htp_server, token);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+out:
+    fs_id_list_job_unref (job);
+    g_strfreev (parts);
+}
+
+/* Send the bytes of a block in the Range header. Content before the
+ * range is not read.
+ */
+static void
+send_block_range (evhtp_request_t *req, const char *store_id,
+                  const char *block_id, BlockHandle *handle,
+                  const char *byte_ranges, char *username)
+{
+    BlockMetadata *blk_meta;
+    guint64 start, end, len;
+    char *con_range;
+    int blk_fd;
+    gint64 blk_offset, blk_len;
+    char *buf;
+
+    blk_meta = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (blk_meta == NULL || blk_meta->size <= 0) {
+        g_free (blk_meta);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    if (!parse_range_val (byte_ranges, &start, &end, blk_meta->size)) {
+        con_range = g_strdup_printf ("bytes */%u", blk_meta->size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Range", con_range, 0, 1));
+        g_free (con_range);
+        g_free (blk_meta);
+        evhtp_send_reply (req, EVHTP_RES_RANGENOTSC);
+        return;
+    }
+    len = end - start + 1;
+
+    con_range = g_strdup_printf ("bytes %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT"/%u",
+                                 start, end, blk_meta->size);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Range", con_range, 0, 1));
+    g_free (con_range);
+    g_free (blk_meta);
+
+    if (seaf_block_manager_get_block_segment (seaf->block_mgr, handle,
+                                              &blk_fd, &blk_offset, &blk_len) == 0) {
+        /* evbuffer takes the ownership of blk_fd. */
+        if (evbuffer_add_file (req->buffer_out, blk_fd,
+                               blk_offset + start, len) < 0) {
+            seaf_warning ("Failed to add block %.8s:%s to output buffer.\n",
+                          store_id, block_id);
+            close (blk_fd);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            return;
+        }
+    } else {
+        if (seaf_block_manager_seek_block (seaf->block_mgr, handle, start) < 0) {
+            seaf_warning ("Failed to seek block %.8s:%s.\n", store_id, block_id);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            return;
+        }
+        buf = g_malloc (len);
+        if (seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           buf, len) != (int)len) {
+            seaf_warning ("Failed to read block %.8s:%s.\n", store_id, block_id);
+            g_free (buf);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            return;
+        }
+        evbuffer_add (req->buffer_out, buf, len);
+        g_free (buf);
+    }
+
+    evhtp_send_reply (req, EVHTP_RES_PARTIAL);
+    send_statistic_msg (store_id, username, "sync-file-download", len);
+}
+
 static void
 get_block_cb (evhtp_request_t *req, void *arg)
 {
@@ -1906,13 +2784,6 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    blk_meta = seaf_block_manager_stat_block (seaf->block_mgr,
-                                              store_id, 1, block_id);
-    if (blk_meta == NULL || blk_meta->size <= 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-
     BlockHandle *blk_handle = NULL;
     blk_handle = seaf_block_manager_open_block(seaf->block_mgr,
                                                store_id, 1, block_id, BLOCK_READ);
@@ -1922,6 +2793,60 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Accept-Ranges", "bytes", 0, 0));
+
+    const char *byte_ranges = evhtp_kv_find (req->headers_in, "Range");
+    if (byte_ranges) {
+        send_block_range (req, store_id, block_id, blk_handle,
+                          byte_ranges, username);
+        goto free_handle;
+    }
+
+    transfer_compress_set_vary (req);
+
+    /* Let libevent send the block file directly to the socket when the
+     * backend supports it, instead of copying the content into memory.
+     * Only blocks whose first bytes look compressible are read into memory
+     * to be compressed. Blocks of encrypted repos and of already compressed
+     * files are still sent with sendfile.
+     */
+    int blk_fd;
+    gint64 blk_offset, blk_len;
+    gboolean use_sendfile = FALSE;
+    if (seaf_block_manager_get_block_segment (seaf->block_mgr, blk_handle,
+                                              &blk_fd, &blk_offset, &blk_len) == 0) {
+        use_sendfile = !(transfer_compress_accepted (req) &&
+                         transfer_compress_file_compressible (blk_fd, blk_offset,
+                                                              blk_len));
+        if (!use_sendfile)
+            close (blk_fd);
+    }
+    if (use_sendfile) {
+        if (blk_len <= 0) {
+            close (blk_fd);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            goto free_handle;
+        }
+        /* evbuffer takes the ownership of blk_fd. */
+        if (evbuffer_add_file (req->buffer_out, blk_fd, blk_offset, blk_len) < 0) {
+            seaf_warning ("Failed to add block %.8s:%s to output buffer.\n",
+                          store_id, block_id);
+            close (blk_fd);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            goto free_handle;
+        }
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        send_statistic_msg (store_id, username, "sync-file-download", (guint64)blk_len);
+        goto free_handle;
+    }
+
+    blk_meta = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, blk_handle);
+    if (blk_meta == NULL || blk_meta->size <= 0) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto free_handle;
+    }
+
     void *block_con = g_new0 (char, blk_meta->size);
     if (!block_con) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
@@ -1937,6 +2862,7 @@ get_block_cb (evhtp_request_t *req, void *arg)
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
     } else {
         evbuffer_add (req->buffer_out, block_con, blk_meta->size);
+        transfer_compress_reply (req);
         evhtp_send_reply (req, EVHTP_RES_OK);
     }
     g_free (block_con);
@@ -1953,119 +2879,1059 @@ out:
     g_strfreev (parts);
 }
 
+/* State of a block being uploaded by PUT. The body is written to the block
+ * store piece by piece as it arrives, instead of being buffered in memory.
+ */
+typedef struct RecvBlockData {
+    HttpServer *htp_server;
+    char *store_id;
+    char *username;
+    char block_id[41];
+    BlockHandle *handle;
+    /* Set if the body is deflate encoded. */
+    TransferInflater *inflater;
+    SHA_CTX ctx;
+    gint64 recv_len;
+    /* Reply status if the request has failed, 0 otherwise. */
+    int error_code;
+
+    /* Set for uploads with a Content-Range. The body is appended to the
+     * staging file of the block. range_start is -1 if the range is "*",
+     * i.e. the request only asks for the staged offset.
+     */
+    gboolean partial;
+    gint64 range_start;
+    gint64 range_end;
+    gint64 range_total;
+    int staging_fd;
+} RecvBlockData;
+
 static void
-put_send_block_cb (evhtp_request_t *req, void *arg)
+free_recv_block_data (RecvBlockData *data)
 {
-    const char *repo_id = NULL;
-    char *block_id = NULL;
-    char *store_id = NULL;
-    char *username = NULL;
-    HttpServer *htp_server = arg;
-    char **parts = NULL;
-    void *blk_con = NULL;
+    if (data->handle) {
+        seaf_block_manager_close_block (seaf->block_mgr, data->handle);
+        /* Removes the temp file if the block is not committed. */
+        seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+    }
+    if (data->staging_fd >= 0)
+        close (data->staging_fd);
+    transfer_inflater_free (data->inflater);
+    g_free (data->store_id);
+    g_free (data->username);
+    g_free (data);
+}
 
-    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    repo_id = parts[1];
-    block_id = parts[3];
+static int
+write_recv_block_data (const void *buf, size_t len, void *arg)
+{
+    RecvBlockData *data = arg;
 
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
+    if (data->partial) {
+        /* A "*" range only queries the staged offset. */
+        if (data->staging_fd < 0) {
+            data->error_code = EVHTP_RES_BADREQ;
+            return -1;
+        }
+        if (data->recv_len + (gint64)len > data->range_end - data->range_start + 1) {
+            data->error_code = EVHTP_RES_BADREQ;
+            return -1;
+        }
+        if (writen (data->staging_fd, buf, len) != (ssize_t)len) {
+            seaf_warning ("Failed to write staging file of block %.8s:%s: %s.\n",
+                          data->store_id, data->block_id, strerror(errno));
+            data->error_code = EVHTP_RES_SERVERR;
+            return -1;
+        }
+        data->recv_len += len;
+        return 0;
+    }
+
+    if (seaf_block_manager_write_block (seaf->block_mgr, data->handle,
+                                        buf, len) != (int)len) {
+        seaf_warning ("Failed to write block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        data->error_code = EVHTP_RES_SERVERR;
+        return -1;
+    }
+    SHA1_Update (&data->ctx, buf, len);
+    data->recv_len += len;
+
+    return 0;
+}
+
+static evhtp_res
+recv_block_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    RecvBlockData *data = arg;
+    struct evbuffer_iovec *vec = NULL;
+    int n_vec, i;
+
+    if (data->error_code != 0)
+        goto out;
+
+    n_vec = evbuffer_peek (buf, -1, NULL, NULL, 0);
+    if (n_vec <= 0)
         goto out;
+    vec = g_new0 (struct evbuffer_iovec, n_vec);
+    evbuffer_peek (buf, -1, NULL, vec, n_vec);
+
+    for (i = 0; i < n_vec; ++i) {
+        if (!data->inflater) {
+            if (write_recv_block_data (vec[i].iov_base, vec[i].iov_len, data) < 0)
+                break;
+            continue;
+        }
+        if (transfer_inflater_feed (data->inflater, vec[i].iov_base, vec[i].iov_len,
+                                    write_recv_block_data, data) < 0) {
+            if (data->error_code == 0) {
+                seaf_warning ("Failed to inflate uploaded block %.8s:%s.\n",
+                              data->store_id, data->block_id);
+                data->error_code = EVHTP_RES_BADREQ;
+            }
+            break;
+        }
     }
 
-    int perm_status = check_permission (htp_server, repo_id, username,
+    g_free (vec);
+
+out:
+    /* Drain the buffer so that evhtp don't copy it to req->buffer_in
+     * after this callback returns.
+     */
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+recv_block_finish_cb (evhtp_request_t *req, void *arg)
+{
+    RecvBlockData *data = arg;
+
+    if (data)
+        free_recv_block_data (data);
+
+    return EVHTP_RES_OK;
+}
+
+/* Parse "bytes <start>-<end>/<total>", or "bytes *" followed by
+ * "/<total>".
+ */
+static int
+parse_content_range (const char *value, RecvBlockData *data)
+{
+    char *end_ptr;
+
+    if (strncmp (value, "bytes ", 6) != 0)
+        return -1;
+    value += 6;
+
+    if (*value == '*') {
+        data->range_start = -1;
+        data->range_end = -1;
+        end_ptr = (char *)value + 1;
+    } else {
+        data->range_start = g_ascii_strtoll (value, &end_ptr, 10);
+        if (end_ptr == value || *end_ptr != '-')
+            return -1;
+        value = end_ptr + 1;
+        data->range_end = g_ascii_strtoll (value, &end_ptr, 10);
+        if (end_ptr == value)
+            return -1;
+    }
+
+    if (*end_ptr != '/')
+        return -1;
+    value = end_ptr + 1;
+    data->range_total = g_ascii_strtoll (value, &end_ptr, 10);
+    if (end_ptr == value || *end_ptr != 0)
+        return -1;
+
+    if (data->range_total <= 0 || data->range_total > MAX_STAGED_BLOCK_SIZE)
+        return -1;
+    if (data->range_start >= 0 &&
+        (data->range_start > data->range_end ||
+         data->range_end >= data->range_total))
+        return -1;
+
+    return 0;
+}
+
+static gboolean
+has_request_body (evhtp_headers_t *hdr)
+{
+    const char *con_len = evhtp_kv_find (hdr, "Content-Length");
+
+    if (evhtp_kv_find (hdr, "Transfer-Encoding"))
+        return TRUE;
+    return con_len && g_ascii_strtoll (con_len, NULL, 10) != 0;
+}
+
+static evhtp_res
+block_oper_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
+{
+    HttpServer *htp_server = arg;
+    RecvBlockData *data;
+    char **parts = NULL;
+    const char *repo_id;
+
+    if (evhtp_request_get_method (req) != htp_method_PUT)
+        return EVHTP_RES_OK;
+
+    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    repo_id = parts[1];
+
+    data = g_new0 (RecvBlockData, 1);
+    data->htp_server = htp_server;
+    memcpy (data->block_id, parts[3], 40);
+    data->staging_fd = -1;
+
+    /* Errors are replied in put_send_block_cb(), after the body is received. */
+    if (!evhtp_kv_find (hdr, "Seafile-Repo-Token")) {
+        data->error_code = EVHTP_RES_BADREQ;
+        goto out;
+    }
+
+    int encoding = transfer_request_encoding (hdr);
+    if (encoding < 0) {
+        data->error_code = EVHTP_RES_BADREQ;
+        goto out;
+    }
+
+    int token_status = validate_token (htp_server, req, repo_id,
+                                       &data->username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        data->error_code = token_status;
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, data->username,
                                         "upload", FALSE);
     if (perm_status == EVHTP_RES_FORBIDDEN) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        data->error_code = EVHTP_RES_FORBIDDEN;
         goto out;
     }
 
-    store_id = get_repo_store_id (htp_server, repo_id);
-    if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    data->store_id = get_repo_store_id (htp_server, repo_id);
+    if (!data->store_id) {
+        data->error_code = EVHTP_RES_SERVERR;
         goto out;
     }
 
-    int blk_len = evbuffer_get_length (req->buffer_in);
-    if (blk_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    const char *content_range = evhtp_kv_find (hdr, "Content-Range");
+    if (content_range) {
+        data->partial = TRUE;
+        if (encoding > 0 || parse_content_range (content_range, data) < 0) {
+            data->error_code = EVHTP_RES_BADREQ;
+            goto out;
+        }
+        if (data->range_start < 0) {
+            if (has_request_body (hdr))
+                data->error_code = EVHTP_RES_BADREQ;
+            goto out;
+        }
+        data->staging_fd = block_staging_open (htp_server->block_staging_dir,
+                                               data->store_id, data->block_id,
+                                               data->range_start);
+        if (data->staging_fd < 0)
+            data->error_code = EVHTP_RES_RANGENOTSC;
         goto out;
     }
 
-    blk_con = g_new0 (char, blk_len);
-    if (!blk_con) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_warning ("Failed to allocate %d bytes memory.\n", blk_len);
+    data->handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                                  data->store_id, 1,
+                                                  data->block_id, BLOCK_WRITE);
+    if (!data->handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        data->error_code = EVHTP_RES_SERVERR;
         goto out;
     }
 
-    evbuffer_remove (req->buffer_in, blk_con, blk_len);
+    if (encoding > 0) {
+        data->inflater = transfer_inflater_new (MAX_INFLATED_BLOCK_SIZE);
+        if (!data->inflater) {
+            data->error_code = EVHTP_RES_SERVERR;
+            goto out;
+        }
+    }
+
+    SHA1_Init (&data->ctx);
 
-    BlockHandle *blk_handle = NULL;
-    blk_handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                store_id, 1, block_id, BLOCK_WRITE);
-    if (blk_handle == NULL) {
-        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
+out:
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, recv_block_read_cb, data);
+    http_metrics_set_fini_hook (req, recv_block_finish_cb, data);
+    /* Set arg for put_send_block_cb. */
+    req->cbarg = data;
+
+    g_strfreev (parts);
+    return EVHTP_RES_OK;
+}
+
+static void
+add_block_offset_header (evhtp_request_t *req, RecvBlockData *data)
+{
+    gint64 offset = block_staging_get_offset (data->htp_server->block_staging_dir,
+                                              data->store_id, data->block_id);
+    char *value = g_strdup_printf ("%"G_GINT64_FORMAT, offset);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new (BLOCK_OFFSET_HEADER, value, 0, 1));
+    g_free (value);
+}
+
+/*
+ * Reply to an upload with a Content-Range. The staged offset is returned
+ * in the Seafile-Block-Offset header, with 202 while the block is not
+ * complete. The block is committed when all of it is staged, and 200 is
+ * returned.
+ */
+static void
+put_block_range (evhtp_request_t *req, RecvBlockData *data)
+{
+    HttpServer *htp_server = data->htp_server;
+    gint64 offset;
+    gboolean mismatch;
+
+    if (data->staging_fd >= 0) {
+        close (data->staging_fd);
+        data->staging_fd = -1;
+    }
+
+    if (data->error_code != 0) {
+        add_block_offset_header (req, data);
+        evhtp_send_reply (req, data->error_code);
+        return;
+    }
+
+    if (data->range_start >= 0 &&
+        data->recv_len != data->range_end - data->range_start + 1) {
+        add_block_offset_header (req, data);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    offset = block_staging_get_offset (htp_server->block_staging_dir,
+                                       data->store_id, data->block_id);
+    if (offset > data->range_total) {
+        block_staging_remove (htp_server->block_staging_dir,
+                              data->store_id, data->block_id);
+        add_block_offset_header (req, data);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    if (offset < data->range_total) {
+        add_block_offset_header (req, data);
+        evhtp_send_reply (req, EVHTP_RES_ACCEPTED);
+        return;
+    }
+
+    if (block_staging_commit (htp_server->block_staging_dir,
+                              data->store_id, data->block_id, &mismatch) < 0) {
+        add_block_offset_header (req, data);
+        evhtp_send_reply (req, mismatch ? EVHTP_RES_BADREQ : EVHTP_RES_SERVERR);
+        return;
+    }
+
+    add_block_offset_header (req, data);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    send_statistic_msg (data->store_id, data->username,
+                        "sync-file-upload", (guint64)data->recv_len);
+}
+
+static void
+put_send_block_cb (evhtp_request_t *req, void *arg)
+{
+    RecvBlockData *data = arg;
+    unsigned char sha1[20];
+    char check_id[41];
+
+    if (data->partial) {
+        put_block_range (req, data);
+        return;
+    }
+
+    if (data->error_code != 0) {
+        evhtp_send_reply (req, data->error_code);
+        return;
+    }
+
+    if (data->recv_len == 0 ||
+        (data->inflater && !transfer_inflater_finished (data->inflater))) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    SHA1_Final (sha1, &data->ctx);
+    rawdata_to_hex (sha1, check_id, 20);
+    if (strcmp (check_id, data->block_id) != 0) {
+        seaf_warning ("Content of uploaded block %.8s:%s doesn't match its id.\n",
+                      data->store_id, data->block_id);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    if (seaf_block_manager_close_block (seaf->block_mgr, data->handle) < 0) {
+        seaf_warning ("Failed to close block %.8s:%s.\n",
+                      data->store_id, data->block_id);
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
+        seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+        data->handle = NULL;
+        return;
     }
 
-    if (seaf_block_manager_write_block (seaf->block_mgr, blk_handle,
-                                        blk_con, blk_len) != blk_len) {
-        seaf_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
+    if (seaf_block_manager_commit_block (seaf->block_mgr, data->handle) < 0) {
+        seaf_warning ("Failed to commit block %.8s:%s.\n",
+                      data->store_id, data->block_id);
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_block_manager_close_block (seaf->block_mgr, blk_handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+        data->handle = NULL;
+        return;
+    }
+
+    seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+    data->handle = NULL;
+
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    send_statistic_msg (data->store_id, data->username,
+                        "sync-file-upload", (guint64)data->recv_len);
+}
+
+static void
+block_oper_cb (evhtp_request_t *req, void *arg)
+{
+    htp_method req_method = evhtp_request_get_method (req);
+
+    if (req_method == htp_method_GET) {
+        get_block_cb (req, arg);
+    } else if (req_method == htp_method_PUT) {
+        /* arg is set to RecvBlockData by block_oper_headers_cb(). */
+        put_send_block_cb (req, arg);
+    }
+}
+
+static void
+post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char *repo_id = parts[1];
+    char *store_id = NULL;
+    char *username = NULL;
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
         goto out;
     }
 
-    if (seaf_block_manager_close_block (seaf->block_mgr, blk_handle) < 0) {
-        seaf_warning ("Failed to close block %.8s:%s.\n", store_id, block_id);
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "download", FALSE);
+    if (perm_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
         goto out;
     }
 
-    if (seaf_block_manager_commit_block (seaf->block_mgr,
-                                         blk_handle) < 0) {
-        seaf_warning ("Failed to commit block %.8s:%s.\n", store_id, block_id);
+    size_t list_len = evbuffer_get_length (req->buffer_in);
+    if (list_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    char *obj_list_con = g_new0 (char, list_len);
+    if (!obj_list_con) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+        seaf_warning ("Failed to allocate %zu bytes memory.\n", list_len);
         goto out;
     }
 
-    seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+    json_error_t jerror;
+    evbuffer_remove (req->buffer_in, obj_list_con, list_len);
+    json_t *obj_array = json_loadb (obj_list_con, list_len, 0, &jerror);
+    g_free (obj_list_con);
 
+    if (!obj_array) {
+        seaf_warning ("dump obj_id to json failed, error: %s\n", jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    json_t *obj = NULL;
+    gboolean ret = TRUE;
+    const char *obj_id = NULL;
+    int index = 0;
+
+    int array_size = json_array_size (obj_array);
+    json_t *needed_objs = json_array();
+
+    for (; index < array_size; ++index) {
+        obj = json_array_get (obj_array, index);
+        obj_id = json_string_value (obj);
+        if (!is_object_id_valid (obj_id))
+            continue;
+
+        if (type == CHECK_FS_EXIST) {
+            ret = seaf_fs_manager_object_exists (seaf->fs_mgr, store_id, 1,
+                                                 obj_id);
+        } else if (type == CHECK_BLOCK_EXIST) {
+            ret = seaf_block_manager_block_exists_indexed (seaf->block_mgr,
+                                                           store_id, 1, obj_id);
+        }
+
+        if (!ret) {
+            json_array_append (needed_objs, obj);
+        }
+    }
+
+    char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
+    evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
     evhtp_send_reply (req, EVHTP_RES_OK);
 
-    send_statistic_msg (store_id, username, "sync-file-upload", (guint64)blk_len);
+    g_free (ret_array);
+    json_decref (needed_objs);
+    json_decref (obj_array);
 
 out:
     g_free (username);
     g_free (store_id);
     g_strfreev (parts);
-    g_free (blk_con);
 }
 
 static void
-block_oper_cb (evhtp_request_t *req, void *arg)
+post_check_fs_cb (evhtp_request_t *req, void *arg)
+{
+   post_check_exist_cb (req, arg, CHECK_FS_EXIST);
+}
+
+static void
+post_check_block_cb (evhtp_request_t *req, void *arg)
+{
+   post_check_exist_cb (req, arg, CHECK_BLOCK_EXIST);
+}
+
+/* An object received by recv-fs, waiting to be written. */
+typedef struct RecvFsObj {
+    char obj_id[41];
+    void *data;
+    int len;
+} RecvFsObj;
+
+/* State of a recv-fs upload. Objects are parsed as the body arrives and
+ * handed to the recv-fs thread pool in batches. The objects are not synced
+ * by the writing threads. All objects of the upload are synced in one pass
+ * on the pool after the last batch is written, and then the reply is sent.
+ *
+ * Finished jobs are passed back to the event loop thread, so the event
+ * loop never waits for the pool. Reading the body is paused while the
+ * window of batches being written is full.
+ */
+typedef struct RecvFsData {
+    HttpServer *htp_server;
+    /* NULL once the request is freed. */
+    evhtp_request_t *req;
+    LoopTaskQueue *loop;
+    /* Held by the request and by each job in the pool. */
+    int ref;
+
+    char *store_id;
+    char *username;
+    /* Reply status if the request has failed, 0 otherwise. */
+    int error_code;
+
+    /* Received bytes not parsed yet. */
+    struct evbuffer *pending;
+    GPtrArray *batch;
+    gint64 batch_size;
+    gint64 recv_len;
+
+    int n_writing;              /* batches in the thread pool */
+    gint64 writing_size;        /* bytes of these batches */
+    gboolean write_failed;
+    GList *written;             /* ids of the written objects */
+
+    gboolean paused;            /* a full batch waits for the window */
+    gboolean body_done;         /* post_recv_fs_cb() was called */
+    gboolean syncing;
+    gboolean replied;
+} RecvFsData;
+
+/* A batch of objects to write, or the final sync if objs is NULL. */
+typedef struct RecvFsJob {
+    RecvFsData *data;
+    GPtrArray *objs;
+    gint64 size;
+    GList *written;
+    gboolean failed;
+} RecvFsJob;
+
+static void
+free_recv_fs_obj (gpointer p)
+{
+    RecvFsObj *obj = p;
+
+    g_free (obj->data);
+    g_free (obj);
+}
+
+static void
+recv_fs_data_unref (RecvFsData *data)
+{
+    if (--(data->ref) > 0)
+        return;
+
+    if (data->pending)
+        evbuffer_free (data->pending);
+    if (data->batch)
+        g_ptr_array_free (data->batch, TRUE);
+    g_list_free_full (data->written, g_free);
+    g_free (data->store_id);
+    g_free (data->username);
+    g_free (data);
+}
+
+static void
+recv_fs_job_done (void *arg);
+
+/* Runs on the recv-fs thread pool. data->written is not changed while the
+ * final sync runs, since all batches have been written.
+ */
+static void
+run_recv_fs_job (gpointer p, gpointer user_data)
+{
+    RecvFsJob *job = p;
+    RecvFsData *data = job->data;
+    struct SeafObjStore *obj_store = seaf->fs_mgr->obj_store;
+    RecvFsObj *obj;
+    guint i;
+
+    if (!job->objs) {
+        if (seaf_obj_store_sync_objs (obj_store, data->store_id, 1,
+                                      data->written) < 0) {
+            seaf_warning ("Failed to sync fs objects of %.8s.\n",
+                          data->store_id);
+            job->failed = TRUE;
+        }
+        goto out;
+    }
+
+    for (i = 0; i < job->objs->len; ++i) {
+        obj = g_ptr_array_index (job->objs, i);
+        if (seaf_obj_store_write_obj (obj_store, data->store_id, 1, obj->obj_id,
+                                      obj->data, obj->len, FALSE) < 0) {
+            seaf_warning ("Failed to write fs object %.8s to disk.\n",
+                          obj->obj_id);
+            job->failed = TRUE;
+            break;
+        }
+        job->written = g_list_prepend (job->written, g_strdup (obj->obj_id));
+    }
+
+out:
+    loop_task_push (data->loop, recv_fs_job_done, job);
+}
+
+static void
+push_recv_fs_job (RecvFsData *data, GPtrArray *objs, gint64 size)
+{
+    RecvFsJob *job = g_new0 (RecvFsJob, 1);
+
+    job->data = data;
+    job->objs = objs;
+    job->size = size;
+    ++(data->ref);
+
+    g_thread_pool_push (data->htp_server->recv_fs_pool, job, NULL);
+}
+
+/* The memory used by an upload is bounded by the window. */
+static gboolean
+recv_fs_window_full (RecvFsData *data)
+{
+    return data->writing_size > 0 &&
+           data->writing_size + data->batch_size > RECV_FS_WINDOW_SIZE;
+}
+
+static void
+submit_recv_fs_batch (RecvFsData *data)
+{
+    ++(data->n_writing);
+    data->writing_size += data->batch_size;
+    push_recv_fs_job (data, data->batch, data->batch_size);
+
+    data->batch = g_ptr_array_new_with_free_func (free_recv_fs_obj);
+    data->batch_size = 0;
+}
+
+/* Parse the received objects into batches. Returns FALSE if a full batch
+ * has to wait for room in the window.
+ */
+static gboolean
+parse_recv_fs_objs (RecvFsData *data)
+{
+    RecvFsObj *obj;
+    FsHdr hdr;
+    gint64 con_len;
+
+    while (1) {
+        if (data->batch->len >= RECV_FS_BATCH_OBJS ||
+            data->batch_size >= RECV_FS_BATCH_SIZE) {
+            if (recv_fs_window_full (data))
+                return FALSE;
+            submit_recv_fs_batch (data);
+        }
+
+        if (evbuffer_get_length (data->pending) < sizeof(FsHdr))
+            return TRUE;
+
+        evbuffer_copyout (data->pending, &hdr, sizeof(FsHdr));
+        con_len = ntohl (hdr.obj_size);
+        if (con_len > RECV_FS_MAX_OBJ_SIZE) {
+            seaf_warning ("Fs object of %"G_GINT64_FORMAT" bytes from %.8s "
+                          "is too large.\n", con_len, data->store_id);
+            data->error_code = EVHTP_RES_BADREQ;
+            evbuffer_drain (data->pending, evbuffer_get_length (data->pending));
+            return TRUE;
+        }
+        if (evbuffer_get_length (data->pending) < sizeof(FsHdr) + con_len)
+            return TRUE;
+
+        obj = g_new0 (RecvFsObj, 1);
+        memcpy (obj->obj_id, hdr.obj_id, 40);
+        if (!is_object_id_valid (obj->obj_id)) {
+            g_free (obj);
+            data->error_code = EVHTP_RES_BADREQ;
+            evbuffer_drain (data->pending, evbuffer_get_length (data->pending));
+            return TRUE;
+        }
+
+        evbuffer_drain (data->pending, sizeof(FsHdr));
+        obj->len = (int)con_len;
+        obj->data = g_malloc (con_len);
+        evbuffer_remove (data->pending, obj->data, con_len);
+
+        g_ptr_array_add (data->batch, obj);
+        data->batch_size += con_len;
+    }
+}
+
+static void
+recv_fs_reply (RecvFsData *data, int status)
+{
+    data->replied = TRUE;
+
+    /* The request was paused in post_recv_fs_cb(). */
+    evhtp_request_resume (data->req);
+    evhtp_send_reply (data->req, status);
+}
+
+/* Move the upload forward after a job has finished, or the body has been
+ * received.
+ */
+static void
+recv_fs_continue (RecvFsData *data)
+{
+    if (!data->req || data->replied)
+        return;
+
+    if (data->paused) {
+        if (!parse_recv_fs_objs (data))
+            return;
+        data->paused = FALSE;
+        if (!data->body_done) {
+            /* Read the rest of the body. */
+            evhtp_request_resume (data->req);
+            return;
+        }
+    }
+
+    if (!data->body_done)
+        return;
+
+    if (data->error_code != 0) {
+        recv_fs_reply (data, data->error_code);
+        return;
+    }
+
+    if (evbuffer_get_length (data->pending) > 0) {
+        seaf_warning ("Bad fs object content format from %.8s:%s.\n",
+                      data->store_id, data->username);
+        recv_fs_reply (data, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    if (data->batch->len > 0) {
+        if (recv_fs_window_full (data))
+            return;
+        submit_recv_fs_batch (data);
+    }
+
+    if (data->n_writing > 0 || data->syncing)
+        return;
+
+    if (data->write_failed) {
+        recv_fs_reply (data, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    /* Only reply after all objects are durable. */
+    data->syncing = TRUE;
+    push_recv_fs_job (data, NULL, 0);
+}
+
+static void
+recv_fs_job_done (void *arg)
+{
+    RecvFsJob *job = arg;
+    RecvFsData *data = job->data;
+
+    if (!job->objs) {
+        data->syncing = FALSE;
+        if (data->req && !data->replied)
+            recv_fs_reply (data, job->failed ? EVHTP_RES_SERVERR : EVHTP_RES_OK);
+    } else {
+        --(data->n_writing);
+        data->writing_size -= job->size;
+        data->written = g_list_concat (job->written, data->written);
+        if (job->failed)
+            data->write_failed = TRUE;
+        g_ptr_array_free (job->objs, TRUE);
+        recv_fs_continue (data);
+    }
+
+    g_free (job);
+    recv_fs_data_unref (data);
+}
+
+static evhtp_res
+recv_fs_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    RecvFsData *data = arg;
+
+    if (data->error_code != 0) {
+        evbuffer_drain (buf, evbuffer_get_length (buf));
+        return EVHTP_RES_OK;
+    }
+
+    data->recv_len += evbuffer_get_length (buf);
+    /* Moves the data so that evhtp doesn't copy it to req->buffer_in. */
+    evbuffer_add_buffer (data->pending, buf);
+
+    /* Data read before the pause took effect is kept in pending. */
+    if (data->paused)
+        return EVHTP_RES_OK;
+
+    if (!parse_recv_fs_objs (data)) {
+        data->paused = TRUE;
+        evhtp_request_pause (req);
+    }
+
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+recv_fs_finish_cb (evhtp_request_t *req, void *arg)
+{
+    RecvFsData *data = arg;
+
+    /* Jobs still in the pool drop their reference when they finish. */
+    if (data) {
+        data->req = NULL;
+        recv_fs_data_unref (data);
+    }
+
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+recv_fs_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
+{
+    HttpServer *htp_server = arg;
+    RecvFsData *data;
+    char **parts = NULL;
+    const char *repo_id;
+
+    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    repo_id = parts[1];
+
+    data = g_new0 (RecvFsData, 1);
+    data->htp_server = htp_server;
+    data->req = req;
+    data->ref = 1;
+    data->pending = evbuffer_new ();
+    data->batch = g_ptr_array_new_with_free_func (free_recv_fs_obj);
+
+    /* Errors are replied in post_recv_fs_cb(), after the body is received. */
+    data->loop = loop_task_queue_get (evhtp_request_get_connection(req)->evbase);
+    if (!data->loop) {
+        data->error_code = EVHTP_RES_SERVERR;
+        goto out;
+    }
+
+    if (!evhtp_kv_find (hdr, "Seafile-Repo-Token")) {
+        data->error_code = EVHTP_RES_BADREQ;
+        goto out;
+    }
+
+    int token_status = validate_token (htp_server, req, repo_id,
+                                       &data->username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        data->error_code = token_status;
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, data->username,
+                                        "upload", FALSE);
+    if (perm_status != EVHTP_RES_OK) {
+        data->error_code = EVHTP_RES_FORBIDDEN;
+        goto out;
+    }
+
+    data->store_id = get_repo_store_id (htp_server, repo_id);
+    if (!data->store_id) {
+        data->error_code = EVHTP_RES_SERVERR;
+        goto out;
+    }
+
+out:
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, recv_fs_read_cb, data);
+    http_metrics_set_fini_hook (req, recv_fs_finish_cb, data);
+    /* Set arg for post_recv_fs_cb. */
+    req->cbarg = data;
+
+    g_strfreev (parts);
+    return EVHTP_RES_OK;
+}
+
+static void
+post_recv_fs_cb (evhtp_request_t *req, void *arg)
+{
+    /* arg is set to RecvFsData by recv_fs_headers_cb(). */
+    RecvFsData *data = arg;
+
+    data->body_done = TRUE;
+
+    if (data->error_code != 0) {
+        data->replied = TRUE;
+        evhtp_send_reply (req, data->error_code);
+        return;
+    }
+
+    if (data->recv_len < sizeof(FsHdr)) {
+        seaf_warning ("Bad fs object content format from %.8s:%s.\n",
+                      data->store_id, data->username);
+        data->replied = TRUE;
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    /* Replied when the objects are written and synced. Block any new
+     * request from this connection until then.
+     */
+    evhtp_request_pause (req);
+    recv_fs_continue (data);
+}
+
+#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+
+/* An object read for a pack-fs request. */
+typedef struct PackFsObj {
+    struct PackFsReads *reads;
+    const char *obj_id;
+    guint64 location;
+    void *data;
+    int len;
+    int result;
+} PackFsObj;
+
+/* Reads of a pack-fs request that are in the reader pool. */
+typedef struct PackFsReads {
+    const char *store_id;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_pending;
+} PackFsReads;
+
+static void
+read_pack_fs_obj (gpointer job, gpointer user_data)
+{
+    PackFsObj *obj = job;
+    PackFsReads *reads = obj->reads;
+
+    obj->result = seaf_obj_store_read_obj (seaf->fs_mgr->obj_store,
+                                           reads->store_id, 1, obj->obj_id,
+                                           &obj->data, &obj->len);
+
+    pthread_mutex_lock (&reads->lock);
+    if (--(reads->n_pending) == 0)
+        pthread_cond_signal (&reads->cond);
+    pthread_mutex_unlock (&reads->lock);
+}
+
+static gint
+compare_pack_fs_obj_location (gconstpointer a, gconstpointer b)
+{
+    const PackFsObj *obj_a = *(PackFsObj **)a;
+    const PackFsObj *obj_b = *(PackFsObj **)b;
+
+    if (obj_a->location < obj_b->location)
+        return -1;
+    return obj_a->location > obj_b->location;
+}
+
+/* Read @n objects with the reader pool and wait for all of them. When the
+ * backend knows where objects are stored, they are queued in that order.
+ */
+static void
+read_pack_fs_objs (HttpServer *htp_server, PackFsReads *reads,
+                   PackFsObj *objs, int n, gboolean *use_location)
 {
-    htp_method req_method = evhtp_request_get_method (req);
+    PackFsObj **queue = g_new (PackFsObj *, n);
+    int i;
 
-    if (req_method == htp_method_GET) {
-        get_block_cb (req, arg);
-    } else if (req_method == htp_method_PUT) {
-        put_send_block_cb (req, arg);
+    for (i = 0; i < n; ++i) {
+        objs[i].reads = reads;
+        queue[i] = &objs[i];
+        /* Backends without location support fail for every object. */
+        if (*use_location &&
+            seaf_obj_store_get_obj_location (seaf->fs_mgr->obj_store,
+                                             reads->store_id, 1, objs[i].obj_id,
+                                             &objs[i].location) < 0)
+            *use_location = (i > 0);
     }
+
+    if (*use_location)
+        qsort (queue, n, sizeof(PackFsObj *), compare_pack_fs_obj_location);
+
+    pthread_mutex_lock (&reads->lock);
+    reads->n_pending += n;
+    pthread_mutex_unlock (&reads->lock);
+
+    for (i = 0; i < n; ++i)
+        g_thread_pool_push (htp_server->pack_fs_pool, queue[i], NULL);
+
+    pthread_mutex_lock (&reads->lock);
+    while (reads->n_pending > 0)
+        pthread_cond_wait (&reads->cond, &reads->lock);
+    pthread_mutex_unlock (&reads->lock);
+
+    g_free (queue);
 }
 
 static void
-post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
+post_pack_fs_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    char *repo_id = parts[1];
+    const char *repo_id = parts[1];
     char *store_id = NULL;
     char *username = NULL;
 
@@ -2081,195 +3947,301 @@ post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
         evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
         goto out;
     }
-
     store_id = get_repo_store_id (htp_server, repo_id);
     if (!store_id) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
 
-    size_t list_len = evbuffer_get_length (req->buffer_in);
-    if (list_len == 0) {
+    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
+    if (fs_id_list_len == 0) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    char *obj_list_con = g_new0 (char, list_len);
-    if (!obj_list_con) {
+    char *fs_id_list = g_new0 (char, fs_id_list_len);
+    if (!fs_id_list) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_warning ("Failed to allocate %zu bytes memory.\n", list_len);
+        seaf_warning ("Failed to allocate %d bytes memory.\n", fs_id_list_len);
         goto out;
     }
 
     json_error_t jerror;
-    evbuffer_remove (req->buffer_in, obj_list_con, list_len);
-    json_t *obj_array = json_loadb (obj_list_con, list_len, 0, &jerror);
-    g_free (obj_list_con);
+    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
+    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
 
-    if (!obj_array) {
-        seaf_warning ("dump obj_id to json failed, error: %s\n", jerror.text);
+    g_free (fs_id_list);
+
+    if (!fs_id_array) {
+        seaf_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        return;
+        goto out;
     }
 
-    json_t *obj = NULL;
-    gboolean ret = TRUE;
     const char *obj_id = NULL;
-    int index = 0;
-
-    int array_size = json_array_size (obj_array);
-    json_t *needed_objs = json_array();
+    int index, start, n, i;
+    int data_len_net;
+    gint64 total_size = 0;
+    gboolean use_location = TRUE;
+    gboolean failed = FALSE;
+    PackFsObj *objs;
+    PackFsReads reads;
 
-    for (; index < array_size; ++index) {
-        obj = json_array_get (obj_array, index);
-        obj_id = json_string_value (obj);
-        if (!is_object_id_valid (obj_id))
-            continue;
+    int array_size = json_array_size (fs_id_array);
 
-        if (type == CHECK_FS_EXIST) {
-            ret = seaf_fs_manager_object_exists (seaf->fs_mgr, store_id, 1,
-                                                 obj_id);
-        } else if (type == CHECK_BLOCK_EXIST) {
-            ret = seaf_block_manager_block_exists (seaf->block_mgr, store_id, 1,
-                                                   obj_id);
+    for (index = 0; index < array_size; ++index) {
+        obj_id = json_string_value (json_array_get (fs_id_array, index));
+        if (!is_object_id_valid (obj_id)) {
+            seaf_warning ("Invalid fs id %s.\n", obj_id);
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            json_decref (fs_id_array);
+            goto out;
         }
+    }
 
-        if (!ret) {
-            json_array_append (needed_objs, obj);
+    memset (&reads, 0, sizeof(reads));
+    reads.store_id = store_id;
+    pthread_mutex_init (&reads.lock, NULL);
+    pthread_cond_init (&reads.cond, NULL);
+    objs = g_new0 (PackFsObj, PACK_FS_READ_WINDOW);
+
+    /* Objects are read a window at a time, and added to the response in
+     * the requested order. Reading stops after the window that fills the
+     * pack.
+     */
+    for (start = 0; start < array_size && !failed &&
+             total_size < htp_server->max_object_pack_size; start += n) {
+        n = MIN (PACK_FS_READ_WINDOW, array_size - start);
+        memset (objs, 0, sizeof(PackFsObj) * n);
+        for (i = 0; i < n; ++i)
+            objs[i].obj_id = json_string_value (json_array_get (fs_id_array,
+                                                                start + i));
+
+        read_pack_fs_objs (htp_server, &reads, objs, n, &use_location);
+
+        for (i = 0; i < n; ++i) {
+            if (failed || total_size >= htp_server->max_object_pack_size) {
+                g_free (objs[i].data);
+                continue;
+            }
+
+            if (objs[i].result < 0) {
+                seaf_warning ("Failed to read seafile object %s:%s.\n",
+                              store_id, objs[i].obj_id);
+                failed = TRUE;
+                continue;
+            }
+
+            evbuffer_add (req->buffer_out, objs[i].obj_id, 40);
+            data_len_net = htonl (objs[i].len);
+            evbuffer_add (req->buffer_out, &data_len_net, 4);
+            evbuffer_add (req->buffer_out, objs[i].data, objs[i].len);
+
+            total_size += objs[i].len;
+            g_free (objs[i].data);
         }
     }
 
-    char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    g_free (objs);
+    pthread_mutex_destroy (&reads.lock);
+    pthread_cond_destroy (&reads.cond);
 
-    g_free (ret_array);
-    json_decref (needed_objs);
-    json_decref (obj_array);
+    if (failed) {
+        evbuffer_drain (req->buffer_out, evbuffer_get_length (req->buffer_out));
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    } else {
+        /* Fs objects are zlib compressed already, so packs are usually
+         * sent as is.
+         */
+        transfer_compress_reply (req);
+        evhtp_send_reply (req, EVHTP_RES_OK);
+    }
 
+    json_decref (fs_id_array);
 out:
     g_free (username);
     g_free (store_id);
     g_strfreev (parts);
 }
 
-static void
-post_check_fs_cb (evhtp_request_t *req, void *arg)
-{
-   post_check_exist_cb (req, arg, CHECK_FS_EXIST);
-}
+/* Stop adding blocks to a pack after this size. The client requests the
+ * remaining blocks again.
+ */
+#define MAX_BLOCK_PACK_SIZE (64 << 20) /* 64MB */
+/* Queue at most this much data on the connection in one write callback. */
+#define PACK_BLOCKS_WRITE_SIZE (256 << 10)
+
+/* State of a pack-blocks response. Blocks are written to the connection
+ * one batch at a time, when the output buffer of the connection has been
+ * drained, so a slow client doesn't make the server buffer the whole pack.
+ */
+typedef struct SendBlocksData {
+    evhtp_request_t *req;
+    char store_id[37];
+    char *username;
+    char **block_ids;
+    int n_blocks;
+    int idx;
+    guint64 total_size;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendBlocksData;
 
 static void
-post_check_block_cb (evhtp_request_t *req, void *arg)
+free_send_blocks_data (SendBlocksData *data)
 {
-   post_check_exist_cb (req, arg, CHECK_BLOCK_EXIST);
+    g_strfreev (data->block_ids);
+    g_free (data->username);
+    g_free (data);
 }
 
-static void
-post_recv_fs_cb (evhtp_request_t *req, void *arg)
+/* Add a block to @buf as: block id (40 bytes), size (4 bytes, network
+ * order), content.
+ */
+static int
+add_block_to_pack (SendBlocksData *data, const char *block_id,
+                   struct evbuffer *buf)
 {
-    HttpServer *htp_server = arg;
-    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    const char *repo_id = parts[1];
-    char *store_id = NULL;
-    char *username = NULL;
-    FsHdr *hdr = NULL;
+    BlockHandle *handle;
+    BlockMetadata *bmd = NULL;
+    int fd;
+    gint64 offset, len;
+    guint32 size_net;
+    void *content = NULL;
+    int ret = 0;
 
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
+    handle = seaf_block_manager_open_block (seaf->block_mgr, data->store_id, 1,
+                                            block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n", data->store_id, block_id);
+        return -1;
     }
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+    if (seaf_block_manager_get_block_segment (seaf->block_mgr, handle,
+                                              &fd, &offset, &len) == 0) {
+        evbuffer_add (buf, block_id, 40);
+        size_net = htonl ((guint32)len);
+        evbuffer_add (buf, &size_net, 4);
+        /* evbuffer takes the ownership of fd. */
+        if (len > 0 && evbuffer_add_file (buf, fd, offset, len) < 0) {
+            close (fd);
+            ret = -1;
+            goto out;
+        } else if (len == 0) {
+            close (fd);
+        }
+        data->total_size += len;
         goto out;
     }
 
-    store_id = get_repo_store_id (htp_server, repo_id);
-    if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd) {
+        ret = -1;
         goto out;
     }
 
-    int fs_con_len = evbuffer_get_length (req->buffer_in);
-    if (fs_con_len < sizeof(FsHdr)) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    content = g_malloc (bmd->size);
+    if (seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                       content, bmd->size) != bmd->size) {
+        seaf_warning ("Failed to read block %.8s:%s.\n", data->store_id, block_id);
+        ret = -1;
         goto out;
     }
 
-    hdr = g_new0 (FsHdr, 1);
-    if (!hdr) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
+    evbuffer_add (buf, block_id, 40);
+    size_net = htonl (bmd->size);
+    evbuffer_add (buf, &size_net, 4);
+    evbuffer_add (buf, content, bmd->size);
+    data->total_size += bmd->size;
 
-    char obj_id[41];
-    void *obj_con = NULL;
-    int con_len;
+out:
+    g_free (content);
+    g_free (bmd);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
 
-    while (fs_con_len > 0) {
-        if (fs_con_len < sizeof(FsHdr)) {
-            seaf_warning ("Bad fs object content format from %.8s:%s.\n",
-                          repo_id, username);
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
+static void
+write_pack_blocks_cb (struct bufferevent *bev, void *ctx)
+{
+    SendBlocksData *data = ctx;
+    struct evbuffer *buf;
+
+    buf = evbuffer_new ();
+    while (data->idx < data->n_blocks &&
+           data->total_size < MAX_BLOCK_PACK_SIZE &&
+           evbuffer_get_length (buf) < PACK_BLOCKS_WRITE_SIZE) {
+        if (add_block_to_pack (data, data->block_ids[data->idx], buf) < 0) {
+            evbuffer_free (buf);
+            evhtp_connection_free (evhtp_request_get_connection (data->req));
+            free_send_blocks_data (data);
+            return;
         }
+        ++(data->idx);
+    }
 
-        evbuffer_remove (req->buffer_in, hdr, sizeof(FsHdr));
-        con_len = ntohl (hdr->obj_size);
-        memcpy (obj_id, hdr->obj_id, 40);
-        obj_id[40] = 0;
+    if (data->idx < data->n_blocks && data->total_size < MAX_BLOCK_PACK_SIZE) {
+        /* This may call write_pack_blocks_cb() recursively (by
+         * libevent_openssl), so don't use data after here.
+         */
+        evhtp_send_reply_chunk (data->req, buf);
+        evbuffer_free (buf);
+        return;
+    }
 
-        if (!is_object_id_valid (obj_id)) {
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
-        }
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+    http_conn_stream_end (bev);
 
-        obj_con = g_new0 (char, con_len);
-        if (!obj_con) {
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
-        }
-        evbuffer_remove (req->buffer_in, obj_con, con_len);
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
 
-        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
-                                      store_id, 1, obj_id, obj_con,
-                                      con_len, FALSE) < 0) {
-            seaf_warning ("Failed to write fs object %.8s to disk.\n",
-                          obj_id);
-            g_free (obj_con);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
-        }
+    if (evbuffer_get_length (buf) > 0)
+        evhtp_send_reply_chunk (data->req, buf);
+    evbuffer_free (buf);
+    evhtp_send_reply_chunk_end (data->req);
 
-        fs_con_len -= (con_len + sizeof(FsHdr));
-        g_free (obj_con);
-    }
+    send_statistic_msg (data->store_id, data->username, "sync-file-download",
+                        data->total_size);
+    free_send_blocks_data (data);
+}
 
-    if (fs_con_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_OK);
-    }
+static void
+pack_blocks_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendBlocksData *data = ctx;
 
-out:
-    g_free (store_id);
-    g_free (hdr);
-    g_free (username);
-    g_strfreev (parts);
-}
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+    /* Free aux data. */
+    free_send_blocks_data (data);
+}
 
+/*
+ * Send the requested blocks in one response, in the same format as
+ * pack-fs, with the block size instead of the object size. Blocks are
+ * sent in the requested order. The pack stops after about
+ * MAX_BLOCK_PACK_SIZE bytes, the client should request the blocks
+ * it hasn't received again.
+ */
 static void
-post_pack_fs_cb (evhtp_request_t *req, void *arg)
+post_pack_blocks_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     const char *repo_id = parts[1];
     char *store_id = NULL;
     char *username = NULL;
+    json_t *id_array = NULL;
+    GPtrArray *block_ids = NULL;
+    SendBlocksData *data;
 
     int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
@@ -2289,75 +4261,82 @@ post_pack_fs_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
-    if (fs_id_list_len == 0) {
+    int id_list_len = evbuffer_get_length (req->buffer_in);
+    if (id_list_len == 0) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    char *fs_id_list = g_new0 (char, fs_id_list_len);
-    if (!fs_id_list) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_warning ("Failed to allocate %d bytes memory.\n", fs_id_list_len);
-        goto out;
-    }
-
+    char *id_list = g_new0 (char, id_list_len);
     json_error_t jerror;
-    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
-    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
-
-    g_free (fs_id_list);
+    evbuffer_remove (req->buffer_in, id_list, id_list_len);
+    id_array = json_loadb (id_list, id_list_len, 0, &jerror);
+    g_free (id_list);
 
-    if (!fs_id_array) {
-        seaf_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
+    if (!id_array || !json_is_array (id_array)) {
+        seaf_warning ("dump block ids from json failed, error: %s\n", jerror.text);
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    json_t *obj = NULL;
-    const char *obj_id = NULL;
-    int index = 0;
-    void *fs_data = NULL;
-    int data_len;
-    int data_len_net;
-    int total_size = 0;
-
-    int array_size = json_array_size (fs_id_array);
-
-    for (; index < array_size; ++index) {
-        obj = json_array_get (fs_id_array, index);
-        obj_id = json_string_value (obj);
+    int array_size = json_array_size (id_array);
+    int i;
+    const char *block_id;
 
-        if (!is_object_id_valid (obj_id)) {
-            seaf_warning ("Invalid fs id %s.\n", obj_id);
+    block_ids = g_ptr_array_new ();
+    for (i = 0; i < array_size; ++i) {
+        block_id = json_string_value (json_array_get (id_array, i));
+        if (!is_object_id_valid (block_id)) {
+            seaf_warning ("Invalid block id %s.\n", block_id);
             evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            json_decref (fs_id_array);
-            goto out;
-        }
-        if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, store_id, 1,
-                                     obj_id, &fs_data, &data_len) < 0) {
-            seaf_warning ("Failed to read seafile object %s:%s.\n", store_id, obj_id);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            json_decref (fs_id_array);
             goto out;
         }
+        g_ptr_array_add (block_ids, g_strdup (block_id));
+    }
+    if (block_ids->len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+    g_ptr_array_add (block_ids, NULL);
 
-        evbuffer_add (req->buffer_out, obj_id, 40);
-        data_len_net = htonl (data_len);
-        evbuffer_add (req->buffer_out, &data_len_net, 4);
-        evbuffer_add (req->buffer_out, fs_data, data_len);
-
-        total_size += data_len;
-        g_free (fs_data);
+    data = g_new0 (SendBlocksData, 1);
+    data->req = req;
+    memcpy (data->store_id, store_id, 36);
+    data->username = username;
+    username = NULL;
+    data->n_blocks = block_ids->len - 1;
+    data->block_ids = (char **)g_ptr_array_free (block_ids, FALSE);
+    block_ids = NULL;
 
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
-            break;
-    }
+    /* We need to overwrite evhtp's callback functions to
+     * write the blocks piece by piece.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_pack_blocks_cb,
+                       pack_blocks_event_cb,
+                       data);
+    http_conn_stream_begin (bev);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
 
-    json_decref (fs_id_array);
 out:
+    if (block_ids) {
+        g_ptr_array_foreach (block_ids, (GFunc)g_free, NULL);
+        g_ptr_array_free (block_ids, TRUE);
+    }
+    if (id_array)
+        json_decref (id_array);
     g_free (username);
     g_free (store_id);
     g_strfreev (parts);
@@ -2693,74 +4672,112 @@ static void
 http_request_init (HttpServerStruct *server)
 {
     HttpServer *priv = server->priv;
-
-    evhtp_set_cb (priv->evhtp,
-                  GET_PROTO_PATH, get_protocol_cb,
-                  NULL);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        OP_PERM_CHECK_REGEX, get_check_permission_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_HEAD_COMMITS_MULTI_REGEX, head_commits_multi_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        COMMIT_OPER_REGEX, commit_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
-                        priv);
-
-    // evhtp_set_regex_cb (priv->evhtp,
-    //                     START_FS_OBJ_ID_REGEX, start_fs_obj_id_cb,
-    //                     priv);
-
-    // evhtp_set_regex_cb (priv->evhtp,
-    //                     QUERY_FS_OBJ_ID_REGEX, query_fs_obj_id_cb,
-    //                     priv);
-
-    // evhtp_set_regex_cb (priv->evhtp,
-    //                     RETRIEVE_FS_OBJ_ID_REGEX, retrieve_fs_obj_id_cb,
-    //                     priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        BLOCK_OPER_REGEX, block_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_FS_REGEX, post_check_fs_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_BLOCK_REGEX, post_check_block_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_RECV_FS_REGEX, post_recv_fs_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_PACK_FS_REGEX, post_pack_fs_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_BLOCK_MAP_REGEX, get_block_map_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_ACCESSIBLE_REPO_LIST_REGEX, get_accessible_repo_list_cb,
-                        priv);
+    evhtp_callback_t *cb;
+
+    cb = evhtp_set_cb (priv->evhtp,
+                       GET_PROTO_PATH, get_protocol_cb,
+                       NULL);
+    http_metrics_track_route (cb, "protocol_version");
+
+    if (priv->enable_metrics)
+        evhtp_set_cb (priv->evhtp, METRICS_PATH, http_metrics_cb, NULL);
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
+                             priv);
+    http_metrics_track_route (cb, "check_quota");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             OP_PERM_CHECK_REGEX, get_check_permission_cb,
+                             priv);
+    http_metrics_track_route (cb, "check_permission");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
+                             priv);
+    http_metrics_track_route (cb, "head_commit");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             GET_HEAD_COMMITS_MULTI_REGEX, head_commits_multi_cb,
+                             priv);
+    http_metrics_track_route (cb, "head_commits_multi");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             HEAD_COMMITS_WATCH_REGEX, head_commits_watch_cb,
+                             priv);
+    http_metrics_track_route (cb, "head_commits_watch");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             COMMIT_OPER_REGEX, commit_oper_cb,
+                             priv);
+    http_metrics_track_route (cb, "commit");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
+                             priv);
+    http_metrics_track_route (cb, "fs_id_list");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             START_FS_OBJ_ID_REGEX, start_fs_obj_id_cb,
+                             priv);
+    http_metrics_track_route (cb, "start_fs_id_list");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             QUERY_FS_OBJ_ID_REGEX, query_fs_obj_id_cb,
+                             priv);
+    http_metrics_track_route (cb, "query_fs_id_list");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             RETRIEVE_FS_OBJ_ID_REGEX, retrieve_fs_obj_id_cb,
+                             priv);
+    http_metrics_track_route (cb, "retrieve_fs_id_list");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             CANCEL_FS_OBJ_ID_REGEX, cancel_fs_obj_id_cb,
+                             priv);
+    http_metrics_track_route (cb, "cancel_fs_id_list");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             BLOCK_OPER_REGEX, block_oper_cb,
+                             priv);
+    http_metrics_track_route (cb, "block");
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_headers, block_oper_headers_cb, priv);
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             POST_CHECK_FS_REGEX, post_check_fs_cb,
+                             priv);
+    http_metrics_track_route (cb, "check_fs");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             POST_CHECK_BLOCK_REGEX, post_check_block_cb,
+                             priv);
+    http_metrics_track_route (cb, "check_blocks");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             POST_RECV_FS_REGEX, post_recv_fs_cb,
+                             priv);
+    http_metrics_track_route (cb, "recv_fs");
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_headers, recv_fs_headers_cb, priv);
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             POST_PACK_FS_REGEX, post_pack_fs_cb,
+                             priv);
+    http_metrics_track_route (cb, "pack_fs");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             POST_PACK_BLOCKS_REGEX, post_pack_blocks_cb,
+                             priv);
+    http_metrics_track_route (cb, "pack_blocks");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             GET_BLOCK_MAP_REGEX, get_block_map_cb,
+                             priv);
+    http_metrics_track_route (cb, "block_map");
+
+    cb = evhtp_set_regex_cb (priv->evhtp,
+                             GET_ACCESSIBLE_REPO_LIST_REGEX, get_accessible_repo_list_cb,
+                             priv);
+    http_metrics_track_route (cb, "accessible_repos");
 
     /* Web access file */
     access_file_init (priv->evhtp);
@@ -2781,37 +4798,6 @@ token_cache_value_free (gpointer data)
     }
 }
 
-static gboolean
-is_token_expire (gpointer key, gpointer value, gpointer arg)
-{
-    TokenInfo *token_info = (TokenInfo *)value;
-
-    if(token_info && token_info->expire_time <= (gint64)time(NULL)) {
-        return TRUE;
-    }
-
-    return FALSE;
-}
-
-static void
-perm_cache_value_free (gpointer data)
-{
-    PermInfo *perm_info = data;
-    g_free (perm_info);
-}
-
-static gboolean
-is_perm_expire (gpointer key, gpointer value, gpointer arg)
-{
-    PermInfo *perm_info = (PermInfo *)value;
-
-    if(perm_info && perm_info->expire_time <= (gint64)time(NULL)) {
-        return TRUE;
-    }
-
-    return FALSE;
-}
-
 static gboolean
 is_vir_repo_info_expire (gpointer key, gpointer value, gpointer arg)
 {
@@ -2843,18 +4829,18 @@ remove_expire_cache_cb (evutil_socket_t sock, short type, void *data)
 {
     HttpServer *htp_server = data;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_foreach_remove (htp_server->token_cache, is_token_expire, NULL);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
-
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_foreach_remove (htp_server->perm_cache, is_perm_expire, NULL);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    auth_cache_remove_expired (htp_server->token_cache);
+    auth_cache_remove_expired (htp_server->perm_cache);
 
     pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
     g_hash_table_foreach_remove (htp_server->vir_repo_info_cache,
                                  is_vir_repo_info_expire, NULL);
     pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+
+    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    g_hash_table_foreach_remove (htp_server->fs_obj_ids,
+                                 is_fs_id_list_token_expire, NULL);
+    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
 }
 
 static void *
@@ -2875,6 +4861,8 @@ http_server_run (void *arg)
 
     http_request_init (server);
 
+    http_conn_manager_attach (priv->conn_mgr, priv->evhtp);
+
     evhtp_use_threads (priv->evhtp, NULL, server->worker_threads, NULL);
 
     struct timeval tv;
@@ -2903,13 +4891,14 @@ seaf_http_server_new (struct _SeafileSession *session)
 
     load_http_config (server, session);
 
-    priv->token_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, token_cache_value_free);
-    pthread_mutex_init (&priv->token_cache_lock, NULL);
-
-    priv->perm_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, perm_cache_value_free);
-    pthread_mutex_init (&priv->perm_cache_lock, NULL);
+    int auth_cache_size = get_positive_config_integer (session->config,
+                                                       "auth_cache_max_entries",
+                                                       DEFAULT_AUTH_CACHE_MAX_ENTRIES);
+    priv->token_cache = auth_cache_new (auth_cache_size, token_cache_value_free);
+    priv->perm_cache = auth_cache_new (auth_cache_size, NULL);
+    priv->auth_negative_expire_time = get_positive_config_integer (session->config,
+                                                                   "auth_negative_cache_ttl",
+                                                                   DEFAULT_AUTH_NEGATIVE_EXPIRE_TIME);
 
     priv->vir_repo_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                        g_free, free_vir_repo_info);
@@ -2917,12 +4906,85 @@ seaf_http_server_new (struct _SeafileSession *session)
 
     server->http_temp_dir = g_build_filename (session->seaf_dir, "httptemp", NULL);
 
-    // priv->compute_fs_obj_id_pool = g_thread_pool_new (compute_fs_obj_id, NULL,
-    //                                                   FS_ID_LIST_MAX_WORKERS, FALSE, NULL);
+    server->zip_prefetch_blocks = get_positive_config_integer (session->config,
+                                                               "zip_prefetch_blocks",
+                                                               DEFAULT_ZIP_PREFETCH_BLOCKS);
+
+    async_block_reader_init (get_positive_config_integer (session->config,
+                                                          "web_download_read_threads",
+                                                          DEFAULT_WEB_DOWNLOAD_READ_THREADS));
+
+    priv->block_staging_dir = g_build_filename (server->http_temp_dir, "blocks", NULL);
+    if (g_mkdir_with_parents (priv->block_staging_dir, 0700) < 0)
+        seaf_warning ("Failed to create %s: %s.\n",
+                      priv->block_staging_dir, strerror(errno));
+
+    load_fs_id_list_config (priv, session->config);
+
+    priv->compute_fs_obj_id_pool = g_thread_pool_new (compute_fs_obj_id, NULL,
+                                                      priv->fs_id_list_workers,
+                                                      FALSE, NULL);
+
+    priv->fs_obj_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, free_fs_id_list_token);
+    priv->fs_id_list_jobs = g_hash_table_new (g_str_hash, g_str_equal);
+    pthread_mutex_init (&priv->fs_obj_ids_lock, NULL);
+
+    int recv_fs_threads = get_positive_config_integer (session->config,
+                                                       "recv_fs_write_threads",
+                                                       DEFAULT_RECV_FS_WRITE_THREADS);
+    priv->recv_fs_pool = g_thread_pool_new (run_recv_fs_job, NULL,
+                                            recv_fs_threads, FALSE, NULL);
+
+    int pack_fs_threads = get_positive_config_integer (session->config,
+                                                       "pack_fs_read_threads",
+                                                       DEFAULT_PACK_FS_READ_THREADS);
+    priv->pack_fs_pool = g_thread_pool_new (read_pack_fs_obj, NULL,
+                                            pack_fs_threads, FALSE, NULL);
+    /* In MB. */
+    priv->max_object_pack_size = get_positive_config_integer (session->config,
+                                                              "max_object_pack_size",
+                                                              0) * ((gint64)1 << 20);
+    if (priv->max_object_pack_size == 0)
+        priv->max_object_pack_size = MAX_OBJECT_PACK_SIZE;
+
+    priv->head_commit_ttl = get_positive_config_integer (session->config,
+                                                         "head_commit_cache_ttl",
+                                                         DEFAULT_HEAD_COMMIT_TTL);
+    priv->head_commits_watch_timeout = get_positive_config_integer (session->config,
+                                                                    "head_commits_watch_timeout",
+                                                                    DEFAULT_HEAD_COMMITS_WATCH_TIMEOUT);
+    priv->head_table = head_commit_table_new (priv->head_commit_ttl,
+                                              DEFAULT_HEAD_COMMIT_TABLE_SIZE);
+    seaf_mq_manager_add_listener (session->mq_mgr, head_commit_table_on_event,
+                                  priv->head_table);
+
+    GError *error = NULL;
+    priv->enable_metrics = fileserver_config_get_boolean (session->config,
+                                                          "enable_metrics", &error);
+    if (error) {
+        priv->enable_metrics = TRUE;
+        g_clear_error (&error);
+    }
 
-    // priv->fs_obj_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
-    //                                           g_free, free_obj_cal_result);
-    // pthread_mutex_init (&priv->fs_obj_ids_lock, NULL);
+    int max_conns = get_positive_config_integer (session->config,
+                                                 "max_connections",
+                                                 DEFAULT_MAX_CONNECTIONS);
+    int max_conns_per_ip = get_positive_config_integer (session->config,
+                                                        "max_connections_per_ip",
+                                                        DEFAULT_MAX_CONNECTIONS_PER_IP);
+    int idle_timeout = get_positive_config_integer (session->config,
+                                                    "idle_timeout",
+                                                    DEFAULT_IDLE_TIMEOUT);
+    int send_timeout = get_positive_config_integer (session->config,
+                                                    "send_timeout",
+                                                    DEFAULT_SEND_TIMEOUT);
+    int watermark = get_positive_config_integer (session->config,
+                                                 "stream_output_watermark",
+                                                 DEFAULT_STREAM_WATERMARK);
+    priv->conn_mgr = http_conn_manager_new (max_conns, max_conns_per_ip,
+                                            idle_timeout, send_timeout,
+                                            watermark * 1024);
 
     server->seaf_session = session;
     server->priv = priv;
@@ -3043,11 +5105,9 @@ seaf_http_server_invalidate_tokens (HttpServerStruct *htp_server,
 {
     const GList *p;
 
-    pthread_mutex_lock (&htp_server->priv->token_cache_lock);
     for (p = tokens; p; p = p->next) {
         const char *token = (char *)p->data;
-        g_hash_table_remove (htp_server->priv->token_cache, token);
+        auth_cache_remove (htp_server->priv->token_cache, token);
     }
-    pthread_mutex_unlock (&htp_server->priv->token_cache_lock);
     return 0;
 }
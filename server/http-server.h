@@ -22,6 +22,7 @@ struct _HttpServerStruct {
     int worker_threads;
     int max_index_processing_threads;
     int cluster_shared_temp_file_mode;
+    int zip_prefetch_blocks;
 };
 
 typedef struct _HttpServerStruct HttpServerStruct;
@@ -0,0 +1,107 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#include "log.h"
+#include "loop-task.h"
+
+struct LoopTaskQueue {
+    int fds[2];
+    struct event *ev;
+    pthread_mutex_t lock;
+    GQueue *tasks;
+};
+
+typedef struct LoopTask {
+    LoopTaskFunc func;
+    void *arg;
+} LoopTask;
+
+/* struct event_base -> LoopTaskQueue, never freed. */
+static GHashTable *queues;
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+run_tasks (evutil_socket_t fd, short what, void *arg)
+{
+    LoopTaskQueue *queue = arg;
+    LoopTask *task;
+    GQueue *tasks;
+    char buf[256];
+
+    while (read (fd, buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock (&queue->lock);
+    tasks = queue->tasks;
+    queue->tasks = g_queue_new ();
+    pthread_mutex_unlock (&queue->lock);
+
+    while ((task = g_queue_pop_head (tasks)) != NULL) {
+        task->func (task->arg);
+        g_free (task);
+    }
+
+    g_queue_free (tasks);
+}
+
+LoopTaskQueue *
+loop_task_queue_get (struct event_base *base)
+{
+    LoopTaskQueue *queue;
+
+    pthread_mutex_lock (&queues_lock);
+
+    if (!queues)
+        queues = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    queue = g_hash_table_lookup (queues, base);
+    if (queue)
+        goto out;
+
+    queue = g_new0 (LoopTaskQueue, 1);
+    if (pipe (queue->fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        g_free (queue);
+        queue = NULL;
+        goto out;
+    }
+    fcntl (queue->fds[0], F_SETFL, O_NONBLOCK);
+    fcntl (queue->fds[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init (&queue->lock, NULL);
+    queue->tasks = g_queue_new ();
+    queue->ev = event_new (base, queue->fds[0], EV_READ | EV_PERSIST,
+                           run_tasks, queue);
+    event_add (queue->ev, NULL);
+
+    g_hash_table_insert (queues, base, queue);
+
+out:
+    pthread_mutex_unlock (&queues_lock);
+    return queue;
+}
+
+void
+loop_task_push (LoopTaskQueue *queue, LoopTaskFunc func, void *arg)
+{
+    LoopTask *task = g_new0 (LoopTask, 1);
+    char c = 0;
+
+    task->func = func;
+    task->arg = arg;
+
+    pthread_mutex_lock (&queue->lock);
+    g_queue_push_tail (queue->tasks, task);
+    pthread_mutex_unlock (&queue->lock);
+
+    /* If the pipe is full, the loop is going to drain it anyway. */
+    if (write (queue->fds[1], &c, 1) < 0 && errno != EAGAIN)
+        seaf_warning ("Failed to wake up event loop: %s.\n", strerror(errno));
+}
@@ -0,0 +1,30 @@
+#ifndef LOOP_TASK_H
+#define LOOP_TASK_H
+
+#include <glib.h>
+
+/*
+ * Run functions in the thread of an event loop, from worker threads.
+ *
+ * Libevent is not thread safe here, so worker threads never touch the
+ * event base. Tasks are queued for the event loop, which is woken up
+ * through a pipe and runs them in the order they were pushed.
+ */
+
+struct event_base;
+
+typedef struct LoopTaskQueue LoopTaskQueue;
+
+typedef void (*LoopTaskFunc) (void *arg);
+
+/* Called in the event loop thread of @base. The queue is never freed.
+ * Returns NULL on error.
+ */
+LoopTaskQueue *
+loop_task_queue_get (struct event_base *base);
+
+/* Can be called from any thread. */
+void
+loop_task_push (LoopTaskQueue *queue, LoopTaskFunc func, void *arg);
+
+#endif
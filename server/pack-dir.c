@@ -10,11 +10,15 @@
 #include "utils.h"
 
 #include "seafile-session.h"
+#include "async-block-reader.h"
 #include "pack-dir.h"
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <iconv.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <event2/buffer.h>
 
 #ifdef WIN32
 #define S_IFLNK    0120000 /* Symbolic link */
@@ -63,55 +67,248 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
+/*
+ * Blocks of the files to be archived are read and decrypted ahead by a
+ * pool of threads, in archive order. Files and empty dirs are listed
+ * before packing, so that blocks of the next files are read while the
+ * current one is written. At most zip_prefetch_blocks blocks are read
+ * ahead.
+ */
+
+typedef struct PackEntry {
+    char *pathname;
+    /* NULL for empty dirs. */
+    SeafDirent *dent;
+    Seafile *file;
+} PackEntry;
+
+typedef struct BlockPrefetch {
+    const char *block_id;
+    char *data;
+    int len;
+    int result;
+    gboolean done;
+} BlockPrefetch;
+
+typedef struct BlockPrefetcher {
+    PackDirData *data;
+    GThreadPool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Blocks being read, in archive order. */
+    GQueue *pending;
+    int max_pending;
+
+    /* The next block to read. */
+    GList *next_entry;
+    int next_block;
+} BlockPrefetcher;
+
+static void
+pack_entry_free (PackEntry *entry)
+{
+    g_free (entry->pathname);
+    if (entry->dent)
+        seaf_dirent_free (entry->dent);
+    if (entry->file)
+        seafile_unref (entry->file);
+    g_free (entry);
+}
+
+static void
+block_prefetch_free (BlockPrefetch *task)
+{
+    g_free (task->data);
+    g_free (task);
+}
+
 static int
-add_file_to_archive (PackDirData *data,
-                     const char *parent_dir,
-                     SeafDirent *dent)
+read_block_data (PackDirData *data, const char *blk_id,
+                 char **block_data, int *block_len)
 {
-    struct archive *a = data->a;
-    struct SeafileCrypt *crypt = data->crypt;
-    gboolean is_windows = data->is_windows;
-    const char *top_dir_name = data->top_dir_name;
-    
-    struct archive_entry *entry = NULL;
-    Seafile *file = NULL;
-    char *pathname = NULL;
-    char buf[64 * 1024];
-    int len = 0;
-    int n = 0;
-    int idx = 0;
     BlockHandle *handle = NULL;
     BlockMetadata *bmd = NULL;
-    char *blk_id = NULL;
-    uint32_t remain = 0;
-    EVP_CIPHER_CTX *ctx;
-    gboolean enc_init = FALSE;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
-    int ret = 0;
-
-    pathname = g_build_filename (top_dir_name, parent_dir, dent->name, NULL);
+    char *buf = NULL;
+    int size, n, pos = 0;
+    int ret = -1;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                            data->store_id,
+                                            data->repo_version,
+                                            blk_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
+        return -1;
+    }
 
-    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                        data->store_id, data->repo_version,
-                                        dent->id);
-    if (!file) {
-        ret = -1;
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s:%s\n", data->store_id, blk_id);
         goto out;
     }
+    size = bmd->size;
+    g_free (bmd);
+
+    buf = g_malloc (size > 0 ? size : 1);
+    while (pos < size) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           buf + pos, size - pos);
+        if (n <= 0) {
+            seaf_warning ("failed to read block %s\n", blk_id);
+            goto out;
+        }
+        pos += n;
+    }
 
-    entry = archive_entry_new ();
+    if (data->crypt) {
+        if (seafile_decrypt (block_data, block_len, buf, size, data->crypt) < 0) {
+            seaf_warning ("Decrypt block %s failed.\n", blk_id);
+            goto out;
+        }
+    } else {
+        *block_data = buf;
+        *block_len = size;
+        buf = NULL;
+    }
+
+    ret = 0;
+
+out:
+    g_free (buf);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+static void
+prefetch_block (gpointer data, gpointer user_data)
+{
+    BlockPrefetch *task = data;
+    BlockPrefetcher *pf = user_data;
+
+    task->result = read_block_data (pf->data, task->block_id,
+                                    &task->data, &task->len);
+
+    pthread_mutex_lock (&pf->lock);
+    task->done = TRUE;
+    pthread_cond_broadcast (&pf->cond);
+    pthread_mutex_unlock (&pf->lock);
+}
+
+static BlockPrefetcher *
+block_prefetcher_new (PackDirData *data, GList *entries, int max_pending)
+{
+    BlockPrefetcher *pf = g_new0 (BlockPrefetcher, 1);
+
+    pf->pool = g_thread_pool_new (prefetch_block, pf, max_pending, FALSE, NULL);
+    if (!pf->pool) {
+        seaf_warning ("Failed to create block prefetch thread pool.\n");
+        g_free (pf);
+        return NULL;
+    }
 
+    pf->data = data;
+    pthread_mutex_init (&pf->lock, NULL);
+    pthread_cond_init (&pf->cond, NULL);
+    pf->pending = g_queue_new ();
+    pf->max_pending = max_pending;
+    pf->next_entry = entries;
+
+    return pf;
+}
+
+static void
+block_prefetcher_free (BlockPrefetcher *pf)
+{
+    /* Drop blocks that are not read yet, and wait for running reads. */
+    g_thread_pool_free (pf->pool, TRUE, TRUE);
+    g_queue_free_full (pf->pending, (GDestroyNotify)block_prefetch_free);
+    pthread_mutex_destroy (&pf->lock);
+    pthread_cond_destroy (&pf->cond);
+    g_free (pf);
+}
+
+/* Queue reads of the next blocks, and load the files they belong to. */
+static void
+block_prefetcher_schedule (BlockPrefetcher *pf)
+{
+    PackDirData *data = pf->data;
+    PackEntry *entry;
+    BlockPrefetch *task;
+
+    while (pf->next_entry && pf->pending->length < pf->max_pending) {
+        entry = pf->next_entry->data;
+        if (!entry->dent) {
+            pf->next_entry = pf->next_entry->next;
+            continue;
+        }
+
+        if (!entry->file) {
+            entry->file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                                       data->store_id,
+                                                       data->repo_version,
+                                                       entry->dent->id);
+            /* The error is reported when the file is archived. */
+            if (!entry->file) {
+                pf->next_entry = NULL;
+                break;
+            }
+        }
+
+        if (pf->next_block < entry->file->n_blocks) {
+            task = g_new0 (BlockPrefetch, 1);
+            task->block_id = entry->file->blk_sha1s[pf->next_block++];
+            g_queue_push_tail (pf->pending, task);
+            g_thread_pool_push (pf->pool, task, NULL);
+        }
+
+        /* Move on as soon as all blocks are queued, the file may be
+         * released once it's archived.
+         */
+        if (pf->next_block == entry->file->n_blocks) {
+            pf->next_entry = pf->next_entry->next;
+            pf->next_block = 0;
+        }
+    }
+}
+
+/* Returns the next block in archive order, waiting for it to be read. */
+static BlockPrefetch *
+block_prefetcher_pop (BlockPrefetcher *pf)
+{
+    BlockPrefetch *task;
+
+    block_prefetcher_schedule (pf);
+
+    task = g_queue_pop_head (pf->pending);
+    if (!task)
+        return NULL;
+
+    pthread_mutex_lock (&pf->lock);
+    while (!task->done)
+        pthread_cond_wait (&pf->cond, &pf->lock);
+    pthread_mutex_unlock (&pf->lock);
+
+    /* Keep the pool busy while this block is written. */
+    block_prefetcher_schedule (pf);
+
+    return task;
+}
+
+static int
+set_entry_pathname (PackDirData *data,
+                    struct archive_entry *entry,
+                    const char *pathname)
+{
     /* File name fixup for WinRAR */
-    if (is_windows && seaf->http_server->windows_encoding) {
+    if (data->is_windows && seaf->http_server->windows_encoding) {
         char *win_file_name = do_iconv ("UTF-8",
                                         seaf->http_server->windows_encoding,
-                                        pathname);
+                                        (char *)pathname);
         if (!win_file_name) {
             seaf_warning ("Failed to convert file name to %s\n",
                           seaf->http_server->windows_encoding);
-            ret = -1;
-            goto out;
+            return -1;
         }
         archive_entry_copy_pathname (entry, win_file_name);
         g_free (win_file_name);
@@ -120,6 +317,38 @@ add_file_to_archive (PackDirData *data,
         archive_entry_set_pathname (entry, pathname);
     }
 
+    return 0;
+}
+
+static int
+add_file_to_archive (PackDirData *data,
+                     BlockPrefetcher *pf,
+                     PackEntry *pentry)
+{
+    struct archive *a = data->a;
+    SeafDirent *dent = pentry->dent;
+    struct archive_entry *entry = NULL;
+    Seafile *file;
+    BlockPrefetch *task = NULL;
+    int idx = 0;
+    int n;
+    int ret = 0;
+
+    /* Make sure the file is loaded by the prefetcher. */
+    block_prefetcher_schedule (pf);
+    file = pentry->file;
+    if (!file) {
+        seaf_warning ("Failed to get file %s:%s\n", data->store_id, dent->id);
+        return -1;
+    }
+
+    entry = archive_entry_new ();
+
+    if (set_entry_pathname (data, entry, pentry->pathname) < 0) {
+        ret = -1;
+        goto out;
+    }
+
     /* FIXME: 0644 should be set when upload files in repo-mgr.c */
     archive_entry_set_mode (entry, dent->mode | 0644);
     archive_entry_set_size (entry, file->file_size);
@@ -132,147 +361,94 @@ add_file_to_archive (PackDirData *data,
         goto out;
     }
 
-    /* Read data of this entry block by block */
+    /* Blocks of this entry are the next ones in the prefetch queue. */
     while (idx < file->n_blocks) {
-        blk_id = file->blk_sha1s[idx];
-        handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                data->store_id,
-                                                data->repo_version,
-                                                blk_id, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
+        task = block_prefetcher_pop (pf);
+        if (!task || task->block_id != file->blk_sha1s[idx]) {
+            seaf_warning ("Missing prefetched block %s:%s\n",
+                          data->store_id, file->blk_sha1s[idx]);
             ret = -1;
             goto out;
         }
-
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       handle);
-        if (!bmd) {
-            seaf_warning ("Failed to stat block %s:%s\n", data->store_id, blk_id);
+        if (task->result < 0) {
             ret = -1;
             goto out;
         }
-        remain = bmd->size;
-        g_free (bmd);
-
-        if (crypt) {
-            if (seafile_decrypt_init (&ctx, crypt->version,
-                                      crypt->key, crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                ret = -1;
-                goto out;
-            }
-            enc_init = TRUE;
-        }
 
-        while (remain != 0) {
-            n = seaf_block_manager_read_block (seaf->block_mgr, handle,
-                                               buf, sizeof(buf));
-            if (n <= 0) {
-                seaf_warning ("failed to read block %s\n", blk_id);
-                ret = -1;
-                goto out;
-            }
-            remain -= n;
-
-            /* OK, We're read some data of this block  */
-            if (crypt == NULL) {
-                /* not encrypted */
-                len = archive_write_data (a, buf, n);
-                if (len <= 0) {
-                    seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                    ret = -1;
-                    goto out;
-                }
-
-            } else {
-                /* an encrypted block */
-                dec_out = g_new (char, n + 16);
-                if (!dec_out) {
-                    seaf_warning ("Failed to alloc memory.\n");
-                    ret = -1;
-                    goto out;
-                }
-
-                int r = EVP_DecryptUpdate (ctx,
-                                           (unsigned char *)dec_out,
-                                           &dec_out_len,
-                                           (unsigned char *)buf,
-                                           n);
-
-                /* EVP_DecryptUpdate returns 1 on success, 0 on failure */
-                if (r != 1) {
-                    seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                    ret = -1;
-                    goto out;
-                }
-
-                if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
-                    if (len <= 0) {
-                        seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                        ret = -1;
-                        goto out;
-                    }
-                }
-
-                /* If it's the last piece of a block, call decrypt_final()
-                 * to decrypt the possible partial block. */
-                if (remain == 0) {
-                    r = EVP_DecryptFinal_ex (ctx,
-                                             (unsigned char *)dec_out,
-                                             &dec_out_len);
-                    if (r != 1) {
-                        seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                        ret = -1;
-                        goto out;
-                    }
-
-                    if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                            ret = -1;
-                            goto out;
-                        }
-                    }
-                }
-
-                g_free (dec_out);
-                dec_out = NULL;
-            }
+        if (task->len > 0 && archive_write_data (a, task->data, task->len) <= 0) {
+            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
+            ret = -1;
+            goto out;
         }
 
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        handle = NULL;
+        block_prefetch_free (task);
+        task = NULL;
 
         /* turn to next block */
         idx++;
     }
 
+    /* Drop the block list, it's not needed anymore. */
+    seafile_unref (pentry->file);
+    pentry->file = NULL;
+
 out:
-    g_free (pathname);
     if (entry)
         archive_entry_free (entry);
-    if (file)
-        seafile_unref (file);
-    if (handle) {
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, handle);
+    if (task)
+        block_prefetch_free (task);
+
+    return ret;
+}
+
+static int
+add_empty_dir_to_archive (PackDirData *data, PackEntry *pentry)
+{
+    struct archive_entry *entry = archive_entry_new ();
+    int ret = 0;
+
+    if (set_entry_pathname (data, entry, pentry->pathname) < 0) {
+        ret = -1;
+        goto out;
     }
-    if (crypt != NULL && enc_init)
-        EVP_CIPHER_CTX_free (ctx);
-    g_free (dec_out);
 
+    archive_entry_set_filetype (entry, AE_IFDIR);
+    archive_entry_set_mtime (entry, data->mtime, 0);
+    archive_entry_set_perm (entry, 0755);
+    int n = archive_write_header (data->a, entry);
+    if (n != ARCHIVE_OK) {
+        seaf_warning ("archive_write_header  error: %s\n", archive_error_string(data->a));
+        ret = -1;
+    }
+
+out:
+    archive_entry_free (entry);
     return ret;
 }
 
+static void
+add_pack_entry (PackDirData *data, GQueue *entries,
+                const char *parent_dir, SeafDirent *dent)
+{
+    PackEntry *entry = g_new0 (PackEntry, 1);
+
+    if (dent) {
+        entry->pathname = g_build_filename (data->top_dir_name, parent_dir,
+                                            dent->name, NULL);
+        entry->dent = seaf_dirent_dup (dent);
+    } else {
+        entry->pathname = g_build_filename (data->top_dir_name, parent_dir, NULL);
+    }
+
+    g_queue_push_tail (entries, entry);
+}
+
 static int
-archive_dir (PackDirData *data,
-             const char *root_id,
-             const char *dirpath,
-             Progress *progress)
+list_dir (PackDirData *data,
+          const char *root_id,
+          const char *dirpath,
+          GQueue *entries,
+          Progress *progress)
 {
     SeafDir *dir = NULL;
     SeafDirent *dent;
@@ -288,38 +464,7 @@ archive_dir (PackDirData *data,
         goto out;
     }
     if (!dir->entries) {
-        char *pathname = g_build_filename (data->top_dir_name, dirpath, NULL);
-        struct archive_entry *entry = archive_entry_new ();
-        gboolean is_windows = data->is_windows;
-
-        if (is_windows && seaf->http_server->windows_encoding) {
-            char *win_file_name = do_iconv ("UTF-8",
-                    seaf->http_server->windows_encoding,
-                    pathname);
-            if (!win_file_name) {
-                seaf_warning ("Failed to convert file name to %s\n",
-                              seaf->http_server->windows_encoding);
-                ret = -1;
-                goto out;
-            }
-            archive_entry_copy_pathname (entry, win_file_name);
-            g_free (win_file_name);
-
-        } else {
-            archive_entry_set_pathname (entry, pathname);
-        }
-
-        archive_entry_set_filetype (entry, AE_IFDIR);
-        archive_entry_set_mtime (entry, data->mtime, 0);
-        archive_entry_set_perm (entry, 0755);
-        int n = archive_write_header (data->a, entry);
-        if (n != ARCHIVE_OK) {
-            seaf_warning ("archive_write_header  error: %s\n", archive_error_string(data->a));
-            ret = -1;
-        }
-
-        archive_entry_free (entry);
-        g_free (pathname);
+        add_pack_entry (data, entries, dirpath, NULL);
         goto out;
     }
 
@@ -331,20 +476,17 @@ archive_dir (PackDirData *data,
 
         dent = ptr->data;
         if (S_ISREG(dent->mode)) {
-            ret = add_file_to_archive (data, dirpath, dent);
-            if (ret == 0) {
-                g_atomic_int_inc (&progress->zipped);
-            }
+            add_pack_entry (data, entries, dirpath, dent);
         } else if (S_ISLNK(dent->mode)) {
             if (archive_version_number() >= 3000001) {
                 /* Symlink in zip arhive is not supported in earlier version
                  * of libarchive */
-                ret = add_file_to_archive (data, dirpath, dent);
+                add_pack_entry (data, entries, dirpath, dent);
             }
 
         } else if (S_ISDIR(dent->mode)) {
             subpath = g_build_filename (dirpath, dent->name, NULL);
-            ret = archive_dir (data, dent->id, subpath, progress);
+            ret = list_dir (data, dent->id, subpath, entries, progress);
             g_free (subpath);
         }
 
@@ -401,8 +543,8 @@ pack_dir_data_new (const char *store_id,
 }
 
 static int
-archive_multi (PackDirData *data, GList *dirent_list,
-               Progress *progress)
+list_multi (PackDirData *data, GList *dirent_list,
+            GQueue *entries, Progress *progress)
 {
     GList *iter;
     SeafDirent *dirent;
@@ -412,13 +554,9 @@ archive_multi (PackDirData *data, GList *dirent_list,
             return -1;
         dirent = iter->data;
         if (S_ISREG(dirent->mode)) {
-            if (add_file_to_archive (data, "", dirent) < 0) {
-                seaf_warning ("Failed to archive file: %s.\n", dirent->name);
-                return -1;
-            }
-            g_atomic_int_inc (&progress->zipped);
+            add_pack_entry (data, entries, "", dirent);
         } else if (S_ISDIR(dirent->mode)) {
-            if (archive_dir (data, dirent->id, dirent->name, progress) < 0) {
+            if (list_dir (data, dirent->id, dirent->name, entries, progress) < 0) {
                 seaf_warning ("Failed to archive dir: %s.\n", dirent->name);
                 return -1;
             }
@@ -428,6 +566,45 @@ archive_multi (PackDirData *data, GList *dirent_list,
     return 0;
 }
 
+static int
+archive_entries (PackDirData *data, GQueue *entries, Progress *progress)
+{
+    BlockPrefetcher *pf;
+    PackEntry *entry;
+    GList *ptr;
+    int ret = 0;
+
+    pf = block_prefetcher_new (data, entries->head,
+                               seaf->http_server->zip_prefetch_blocks);
+    if (!pf)
+        return -1;
+
+    for (ptr = entries->head; ptr; ptr = ptr->next) {
+        if (progress->canceled) {
+            ret = -1;
+            break;
+        }
+
+        entry = ptr->data;
+        if (!entry->dent) {
+            ret = add_empty_dir_to_archive (data, entry);
+        } else {
+            ret = add_file_to_archive (data, pf, entry);
+            if (ret == 0 && S_ISREG(entry->dent->mode))
+                g_atomic_int_inc (&progress->zipped);
+            else if (ret < 0)
+                seaf_warning ("Failed to archive file: %s.\n", entry->pathname);
+        }
+
+        if (ret < 0)
+            break;
+    }
+
+    block_prefetcher_free (pf);
+
+    return ret;
+}
+
 int
 pack_files (const char *store_id,
             int repo_version,
@@ -439,6 +616,7 @@ pack_files (const char *store_id,
 {
     int ret = 0;
     PackDirData *data = NULL;
+    GQueue *entries;
 
     data = pack_dir_data_new (store_id, repo_version, dirname,
                               crypt, is_windows);
@@ -450,9 +628,12 @@ pack_files (const char *store_id,
 
     progress->zip_file_path = data->tmp_zip_file;
 
+    entries = g_queue_new ();
+
     if (strcmp (dirname, "") != 0) {
         // Pack dir
-        if (archive_dir (data, (char *)internal, "", progress) < 0) {
+        if (list_dir (data, (char *)internal, "", entries, progress) < 0 ||
+            archive_entries (data, entries, progress) < 0) {
             if (progress->canceled)
                 seaf_warning ("Zip task for dir %s in repo %.8s canceled.\n", dirname, store_id);
             else
@@ -461,7 +642,8 @@ pack_files (const char *store_id,
         }
     } else {
         // Pack multi
-        if (archive_multi (data, (GList *)internal, progress) < 0) {
+        if (list_multi (data, (GList *)internal, entries, progress) < 0 ||
+            archive_entries (data, entries, progress) < 0) {
             if (progress->canceled)
                 seaf_warning ("Archiving multi files in repo %.8s canceled.\n", store_id);
             else
@@ -470,6 +652,8 @@ pack_files (const char *store_id,
         }
     }
 
+    g_queue_free_full (entries, (GDestroyNotify)pack_entry_free);
+
     if (archive_write_free (data->a) < 0) {
         seaf_warning ("Failed to archive write finish for %s in repo %.8s.\n",
                       strcmp (dirname, "")==0 ? "multi files" : dirname, store_id);
@@ -481,3 +665,666 @@ pack_files (const char *store_id,
 
     return ret;
 }
+
+/*
+ * Streaming zip archive.
+ *
+ * Entries are stored without compression and their content is followed by
+ * a data descriptor, so every entry is written as soon as its blocks are
+ * read. ZIP64 records are only used for entries, offsets and counts that
+ * don't fit in the classic format.
+ */
+
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_DATA_DESC_SIG 0x08074b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP64_END_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP_END_SIG 0x06054b50
+
+#define ZIP_FLAG_DATA_DESC 0x0008
+#define ZIP_FLAG_UTF8 0x0800
+
+#define ZIP_VERSION 20
+#define ZIP64_VERSION 45
+/* Made by unix, so that external attributes hold the file mode. */
+#define ZIP_MADE_BY_UNIX (3 << 8)
+
+#define ZIP_MAX_32 0xffffffffULL
+#define ZIP_MAX_16 0xffff
+
+typedef struct ZipEntry {
+    char *name;
+    guint16 flags;
+    gboolean is_dir;
+    gboolean zip64;
+    guint32 crc;
+    guint64 size;
+    guint64 offset;
+} ZipEntry;
+
+typedef struct ZipStreamDir {
+    SeafDir *dir;
+    GList *next;
+    char *path;
+} ZipStreamDir;
+
+enum {
+    ZIP_STREAM_ENTRIES,
+    ZIP_STREAM_CENTRAL_DIR,
+    ZIP_STREAM_DONE,
+};
+
+struct ZipStream {
+    char store_id[37];
+    int repo_version;
+    char *top_dir_name;
+    /* download-dir: obj_id; download-multi: dirent list */
+    void *internal;
+    SeafileCrypt *crypt;
+    gboolean is_windows;
+    guint16 dos_time;
+    guint16 dos_date;
+
+    int state;
+    gboolean started;
+    GList *dir_stack;
+
+    /* Blocks are read and decrypted on the async block reader threads of
+     * the event loop, so that block reads don't stall the other
+     * connections. Set by zip_stream_set_reader().
+     */
+    struct event_base *evbase;
+    ZipStreamReadyFunc ready_func;
+    void *ready_arg;
+
+    /* The file being written. Its next piece is read while the current
+     * one is being sent.
+     */
+    ZipEntry *entry;
+    Seafile *file;
+    AsyncBlockReader *reader;
+    char *piece;
+    int piece_len;
+    gboolean piece_eof;
+    gboolean piece_ready;
+    /* zip_stream_read() returned ZIP_STREAM_WAIT. */
+    gboolean waiting;
+
+    guint64 offset;
+    GQueue *entries;
+    GList *central_pos;
+    guint64 central_offset;
+};
+
+typedef struct ZipWriter {
+    guint8 buf[64];
+    guint8 *p;
+} ZipWriter;
+
+static void
+put16 (ZipWriter *w, guint16 v)
+{
+    *w->p++ = v & 0xff;
+    *w->p++ = (v >> 8) & 0xff;
+}
+
+static void
+put32 (ZipWriter *w, guint32 v)
+{
+    put16 (w, v & 0xffff);
+    put16 (w, (v >> 16) & 0xffff);
+}
+
+static void
+put64 (ZipWriter *w, guint64 v)
+{
+    put32 (w, v & 0xffffffff);
+    put32 (w, (v >> 32) & 0xffffffff);
+}
+
+static void
+zip_stream_add (ZipStream *stream, struct evbuffer *buf,
+                const void *data, size_t len)
+{
+    evbuffer_add (buf, data, len);
+    stream->offset += len;
+}
+
+static void
+zip_stream_add_writer (ZipStream *stream, struct evbuffer *buf, ZipWriter *w)
+{
+    zip_stream_add (stream, buf, w->buf, w->p - w->buf);
+    w->p = w->buf;
+}
+
+static void
+zip_entry_free (ZipEntry *entry)
+{
+    if (!entry)
+        return;
+    g_free (entry->name);
+    g_free (entry);
+}
+
+static void
+zip_stream_dir_free (ZipStreamDir *sdir)
+{
+    if (sdir->dir)
+        seaf_dir_free (sdir->dir);
+    g_free (sdir->path);
+    g_free (sdir);
+}
+
+static void
+set_dos_time (ZipStream *stream)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r (&now, &tm);
+    stream->dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    stream->dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+ZipStream *
+zip_stream_new (const char *store_id,
+                int repo_version,
+                const char *dirname,
+                void *internal,
+                SeafileCrypt *crypt,
+                gboolean is_windows)
+{
+    ZipStream *stream = g_new0 (ZipStream, 1);
+
+    memcpy (stream->store_id, store_id, 36);
+    stream->repo_version = repo_version;
+    stream->top_dir_name = g_strdup (dirname);
+    stream->internal = internal;
+    stream->crypt = crypt;
+    stream->is_windows = is_windows;
+    stream->entries = g_queue_new ();
+    set_dos_time (stream);
+
+    return stream;
+}
+
+void
+zip_stream_set_reader (ZipStream *stream, struct event_base *base,
+                       ZipStreamReadyFunc ready, void *arg)
+{
+    stream->evbase = base;
+    stream->ready_func = ready;
+    stream->ready_arg = arg;
+}
+
+static void
+close_file_entry (ZipStream *stream)
+{
+    /* A read in progress is dropped, the callback is not called. */
+    async_block_reader_free (stream->reader);
+    stream->reader = NULL;
+    g_free (stream->piece);
+    stream->piece = NULL;
+    stream->piece_ready = FALSE;
+    stream->waiting = FALSE;
+
+    if (stream->file) {
+        seafile_unref (stream->file);
+        stream->file = NULL;
+    }
+}
+
+void
+zip_stream_free (ZipStream *stream)
+{
+    if (!stream)
+        return;
+
+    close_file_entry (stream);
+    zip_entry_free (stream->entry);
+    g_list_free_full (stream->dir_stack, (GDestroyNotify)zip_stream_dir_free);
+    g_queue_free_full (stream->entries, (GDestroyNotify)zip_entry_free);
+
+    if (strcmp (stream->top_dir_name, "") != 0)
+        g_free (stream->internal);
+    else
+        g_list_free_full ((GList *)stream->internal, (GDestroyNotify)seaf_dirent_free);
+
+    g_free (stream->top_dir_name);
+    g_free (stream->crypt);
+    g_free (stream);
+}
+
+static ZipEntry *
+zip_entry_new (ZipStream *stream, const char *pathname, gboolean is_dir)
+{
+    ZipEntry *entry;
+    char *name;
+    guint16 flags = 0;
+
+    /* File name fixup for WinRAR */
+    if (stream->is_windows && seaf->http_server->windows_encoding) {
+        name = do_iconv ("UTF-8", seaf->http_server->windows_encoding,
+                         (char *)pathname);
+        if (!name) {
+            seaf_warning ("Failed to convert file name to %s\n",
+                          seaf->http_server->windows_encoding);
+            return NULL;
+        }
+    } else {
+        name = g_strdup (pathname);
+        flags |= ZIP_FLAG_UTF8;
+    }
+
+    if (is_dir) {
+        char *tmp = name;
+        name = g_strconcat (tmp, "/", NULL);
+        g_free (tmp);
+    } else {
+        flags |= ZIP_FLAG_DATA_DESC;
+    }
+
+    entry = g_new0 (ZipEntry, 1);
+    entry->name = name;
+    entry->flags = flags;
+    entry->is_dir = is_dir;
+    entry->offset = stream->offset;
+
+    return entry;
+}
+
+static void
+write_local_header (ZipStream *stream, struct evbuffer *buf, ZipEntry *entry)
+{
+    ZipWriter w;
+    size_t name_len = strlen (entry->name);
+
+    w.p = w.buf;
+    put32 (&w, ZIP_LOCAL_HEADER_SIG);
+    put16 (&w, entry->zip64 ? ZIP64_VERSION : ZIP_VERSION);
+    put16 (&w, entry->flags);
+    put16 (&w, 0);              /* stored */
+    put16 (&w, stream->dos_time);
+    put16 (&w, stream->dos_date);
+    /* Crc and sizes are in the data descriptor. */
+    put32 (&w, 0);
+    put32 (&w, entry->zip64 ? ZIP_MAX_32 : 0);
+    put32 (&w, entry->zip64 ? ZIP_MAX_32 : 0);
+    put16 (&w, name_len);
+    put16 (&w, entry->zip64 ? 20 : 0);
+    zip_stream_add_writer (stream, buf, &w);
+
+    zip_stream_add (stream, buf, entry->name, name_len);
+
+    if (entry->zip64) {
+        put16 (&w, 0x0001);
+        put16 (&w, 16);
+        put64 (&w, 0);
+        put64 (&w, 0);
+        zip_stream_add_writer (stream, buf, &w);
+    }
+}
+
+static int
+add_dir_entry (ZipStream *stream, struct evbuffer *buf, const char *dirpath)
+{
+    char *pathname = g_build_filename (stream->top_dir_name, dirpath, NULL);
+    ZipEntry *entry;
+
+    entry = zip_entry_new (stream, pathname, TRUE);
+    g_free (pathname);
+    if (!entry)
+        return -1;
+
+    write_local_header (stream, buf, entry);
+    g_queue_push_tail (stream->entries, entry);
+
+    return 0;
+}
+
+static void
+file_piece_read_cb (char *piece, int len, gboolean eof, void *arg)
+{
+    ZipStream *stream = arg;
+
+    /* piece is NULL on error, which is reported by write_file_data(). */
+    stream->piece = piece;
+    stream->piece_len = len;
+    stream->piece_eof = eof;
+    stream->piece_ready = TRUE;
+
+    if (stream->waiting) {
+        stream->waiting = FALSE;
+        /* May free the stream. */
+        stream->ready_func (stream->ready_arg);
+    }
+}
+
+static int
+start_file_entry (ZipStream *stream, struct evbuffer *buf,
+                  const char *parent_dir, SeafDirent *dent)
+{
+    char *pathname;
+    Seafile *file;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                        stream->store_id, stream->repo_version,
+                                        dent->id);
+    if (!file) {
+        seaf_warning ("Failed to get file %s:%s\n", stream->store_id, dent->id);
+        return -1;
+    }
+
+    pathname = g_build_filename (stream->top_dir_name, parent_dir, dent->name, NULL);
+    stream->entry = zip_entry_new (stream, pathname, FALSE);
+    g_free (pathname);
+    if (!stream->entry) {
+        seafile_unref (file);
+        return -1;
+    }
+
+    stream->entry->zip64 = (file->file_size >= ZIP_MAX_32);
+    stream->file = file;
+
+    write_local_header (stream, buf, stream->entry);
+
+    if (file->n_blocks == 0)
+        return 0;
+
+    stream->reader = async_block_reader_new (stream->evbase,
+                                             stream->store_id,
+                                             stream->repo_version,
+                                             file->blk_sha1s, file->n_blocks,
+                                             stream->crypt,
+                                             file_piece_read_cb, stream);
+    if (!stream->reader)
+        return -1;
+    async_block_reader_read (stream->reader);
+
+    return 0;
+}
+
+static void
+finish_file_entry (ZipStream *stream, struct evbuffer *buf)
+{
+    ZipEntry *entry = stream->entry;
+    ZipWriter w;
+
+    /* Files are larger or smaller than recorded if the tree is corrupt. */
+    if (entry->size >= ZIP_MAX_32)
+        entry->zip64 = TRUE;
+
+    w.p = w.buf;
+    put32 (&w, ZIP_DATA_DESC_SIG);
+    put32 (&w, entry->crc);
+    if (entry->zip64) {
+        put64 (&w, entry->size);
+        put64 (&w, entry->size);
+    } else {
+        put32 (&w, entry->size);
+        put32 (&w, entry->size);
+    }
+    zip_stream_add_writer (stream, buf, &w);
+
+    g_queue_push_tail (stream->entries, entry);
+    stream->entry = NULL;
+    close_file_entry (stream);
+}
+
+static void
+free_piece (const void *data, size_t datalen, void *extra)
+{
+    g_free ((void *)data);
+}
+
+/* Write the next piece of the current file. Returns ZIP_STREAM_WAIT if it
+ * is still being read.
+ */
+static int
+write_file_data (ZipStream *stream, struct evbuffer *buf)
+{
+    ZipEntry *entry = stream->entry;
+    char *piece;
+
+    /* Empty file. */
+    if (!stream->reader) {
+        finish_file_entry (stream, buf);
+        return 0;
+    }
+
+    if (!stream->piece_ready) {
+        stream->waiting = TRUE;
+        return ZIP_STREAM_WAIT;
+    }
+
+    if (!stream->piece) {
+        seaf_warning ("Failed to read file %s in %s.\n",
+                      entry->name, stream->store_id);
+        return -1;
+    }
+
+    piece = stream->piece;
+    stream->piece = NULL;
+    stream->piece_ready = FALSE;
+
+    /* The piece is freed once it's sent. */
+    if (stream->piece_len > 0) {
+        entry->crc = crc32 (entry->crc, (unsigned char *)piece, stream->piece_len);
+        entry->size += stream->piece_len;
+        evbuffer_add_reference (buf, piece, stream->piece_len, free_piece, NULL);
+        stream->offset += stream->piece_len;
+    } else {
+        g_free (piece);
+    }
+
+    if (stream->piece_eof)
+        finish_file_entry (stream, buf);
+    else
+        async_block_reader_read (stream->reader);
+
+    return 0;
+}
+
+/* Returns -1 on error. Empty dirs are written as entries, not pushed. */
+static int
+push_dir (ZipStream *stream, struct evbuffer *buf,
+          const char *dir_id, const char *dirpath)
+{
+    SeafDir *dir;
+    ZipStreamDir *sdir;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       stream->store_id, stream->repo_version,
+                                       dir_id);
+    if (!dir) {
+        seaf_warning ("failed to get dir %s:%s\n", stream->store_id, dir_id);
+        return -1;
+    }
+
+    if (!dir->entries) {
+        seaf_dir_free (dir);
+        return add_dir_entry (stream, buf, dirpath);
+    }
+
+    sdir = g_new0 (ZipStreamDir, 1);
+    sdir->dir = dir;
+    sdir->next = dir->entries;
+    sdir->path = g_strdup (dirpath);
+    stream->dir_stack = g_list_prepend (stream->dir_stack, sdir);
+
+    return 0;
+}
+
+/* Start the next entry in the tree, or the central directory when all
+ * entries are written.
+ */
+static int
+next_entry (ZipStream *stream, struct evbuffer *buf)
+{
+    ZipStreamDir *sdir;
+    SeafDirent *dent;
+    char *subpath;
+    int ret = 0;
+
+    if (!stream->started) {
+        stream->started = TRUE;
+        if (strcmp (stream->top_dir_name, "") != 0)
+            return push_dir (stream, buf, (char *)stream->internal, "");
+
+        sdir = g_new0 (ZipStreamDir, 1);
+        sdir->next = (GList *)stream->internal;
+        sdir->path = g_strdup ("");
+        stream->dir_stack = g_list_prepend (stream->dir_stack, sdir);
+        return 0;
+    }
+
+    if (!stream->dir_stack) {
+        stream->state = ZIP_STREAM_CENTRAL_DIR;
+        stream->central_offset = stream->offset;
+        stream->central_pos = stream->entries->head;
+        return 0;
+    }
+
+    sdir = stream->dir_stack->data;
+    if (!sdir->next) {
+        stream->dir_stack = g_list_delete_link (stream->dir_stack,
+                                                stream->dir_stack);
+        zip_stream_dir_free (sdir);
+        return 0;
+    }
+
+    dent = sdir->next->data;
+    sdir->next = sdir->next->next;
+
+    if (S_ISREG(dent->mode) || S_ISLNK(dent->mode)) {
+        ret = start_file_entry (stream, buf, sdir->path, dent);
+    } else if (S_ISDIR(dent->mode)) {
+        subpath = g_build_filename (sdir->path, dent->name, NULL);
+        ret = push_dir (stream, buf, dent->id, subpath);
+        g_free (subpath);
+    }
+
+    return ret;
+}
+
+static void
+write_central_header (ZipStream *stream, struct evbuffer *buf, ZipEntry *entry)
+{
+    ZipWriter w;
+    size_t name_len = strlen (entry->name);
+    gboolean size64 = (entry->size >= ZIP_MAX_32);
+    gboolean offset64 = (entry->offset >= ZIP_MAX_32);
+    int extra_len = (size64 ? 16 : 0) + (offset64 ? 8 : 0);
+    guint32 mode;
+
+    if (entry->is_dir)
+        mode = ((guint32)(S_IFDIR | 0755) << 16) | 0x10;
+    else
+        mode = (guint32)(S_IFREG | 0644) << 16;
+
+    w.p = w.buf;
+    put32 (&w, ZIP_CENTRAL_HEADER_SIG);
+    put16 (&w, ZIP_MADE_BY_UNIX | (extra_len ? ZIP64_VERSION : ZIP_VERSION));
+    put16 (&w, (entry->zip64 || extra_len) ? ZIP64_VERSION : ZIP_VERSION);
+    put16 (&w, entry->flags);
+    put16 (&w, 0);
+    put16 (&w, stream->dos_time);
+    put16 (&w, stream->dos_date);
+    put32 (&w, entry->crc);
+    put32 (&w, size64 ? ZIP_MAX_32 : entry->size);
+    put32 (&w, size64 ? ZIP_MAX_32 : entry->size);
+    put16 (&w, name_len);
+    put16 (&w, extra_len ? extra_len + 4 : 0);
+    put16 (&w, 0);              /* comment */
+    put16 (&w, 0);              /* disk */
+    put16 (&w, 0);              /* internal attributes */
+    put32 (&w, mode);
+    put32 (&w, offset64 ? ZIP_MAX_32 : entry->offset);
+    zip_stream_add_writer (stream, buf, &w);
+
+    zip_stream_add (stream, buf, entry->name, name_len);
+
+    if (extra_len) {
+        put16 (&w, 0x0001);
+        put16 (&w, extra_len);
+        if (size64) {
+            put64 (&w, entry->size);
+            put64 (&w, entry->size);
+        }
+        if (offset64)
+            put64 (&w, entry->offset);
+        zip_stream_add_writer (stream, buf, &w);
+    }
+}
+
+static void
+write_end_records (ZipStream *stream, struct evbuffer *buf)
+{
+    ZipWriter w;
+    guint64 n_entries = stream->entries->length;
+    guint64 central_size = stream->offset - stream->central_offset;
+    guint64 zip64_end_offset = stream->offset;
+    gboolean zip64 = (n_entries >= ZIP_MAX_16 ||
+                      central_size >= ZIP_MAX_32 ||
+                      stream->central_offset >= ZIP_MAX_32);
+
+    w.p = w.buf;
+    if (zip64) {
+        put32 (&w, ZIP64_END_SIG);
+        put64 (&w, 44);
+        put16 (&w, ZIP_MADE_BY_UNIX | ZIP64_VERSION);
+        put16 (&w, ZIP64_VERSION);
+        put32 (&w, 0);
+        put32 (&w, 0);
+        put64 (&w, n_entries);
+        put64 (&w, n_entries);
+        put64 (&w, central_size);
+        put64 (&w, stream->central_offset);
+        zip_stream_add_writer (stream, buf, &w);
+
+        put32 (&w, ZIP64_LOCATOR_SIG);
+        put32 (&w, 0);
+        put64 (&w, zip64_end_offset);
+        put32 (&w, 1);
+        zip_stream_add_writer (stream, buf, &w);
+    }
+
+    put32 (&w, ZIP_END_SIG);
+    put16 (&w, 0);
+    put16 (&w, 0);
+    put16 (&w, MIN (n_entries, ZIP_MAX_16));
+    put16 (&w, MIN (n_entries, ZIP_MAX_16));
+    put32 (&w, MIN (central_size, ZIP_MAX_32));
+    put32 (&w, MIN (stream->central_offset, ZIP_MAX_32));
+    put16 (&w, 0);
+    zip_stream_add_writer (stream, buf, &w);
+}
+
+int
+zip_stream_read (ZipStream *stream, struct evbuffer *buf, size_t max_size)
+{
+    size_t start = evbuffer_get_length (buf);
+    int ret;
+
+    while (stream->state != ZIP_STREAM_DONE &&
+           evbuffer_get_length (buf) - start < max_size) {
+        if (stream->state == ZIP_STREAM_ENTRIES) {
+            if (stream->file) {
+                ret = write_file_data (stream, buf);
+                if (ret != 0)
+                    return ret;
+            } else if (next_entry (stream, buf) < 0) {
+                return -1;
+            }
+        } else if (stream->central_pos) {
+            write_central_header (stream, buf, stream->central_pos->data);
+            stream->central_pos = stream->central_pos->next;
+        } else {
+            write_end_records (stream, buf);
+            stream->state = ZIP_STREAM_DONE;
+        }
+    }
+
+    return stream->state == ZIP_STREAM_DONE ? 0 : 1;
+}
@@ -13,6 +13,11 @@ typedef struct Progress {
     gboolean canceled;
     gboolean size_too_large;
     gboolean internal_error;
+    /* Archive to be generated while it's downloaded, in streaming mode. */
+    void *stream_task;
+    /* Set if the archive is shared in the zip cache. */
+    char *cache_key;
+    int ref;
 } Progress;
 
 int
@@ -24,4 +29,47 @@ pack_files (const char *store_id,
             gboolean is_windows,
             Progress *progress);
 
+/*
+ * Zip archive generated while it's downloaded, without a temporary file.
+ * The stream takes ownership of @internal and @crypt.
+ */
+
+struct evbuffer;
+struct event_base;
+
+typedef struct ZipStream ZipStream;
+
+/* zip_stream_read() is waiting for file data being read. */
+#define ZIP_STREAM_WAIT 2
+
+typedef void (*ZipStreamReadyFunc) (void *arg);
+
+ZipStream *
+zip_stream_new (const char *store_id,
+                int repo_version,
+                const char *dirname,
+                void *internal,
+                SeafileCrypt *crypt,
+                gboolean is_windows);
+
+/* File data is read on the async block reader threads, and @ready is
+ * called in the event loop thread of @base when data that
+ * zip_stream_read() waited for is ready. Must be called before reading.
+ */
+void
+zip_stream_set_reader (ZipStream *stream, struct event_base *base,
+                       ZipStreamReadyFunc ready, void *arg);
+
+/* Append about @max_size bytes of the archive to @buf.
+ * Returns 1 if there is more to read, ZIP_STREAM_WAIT if the next data is
+ * being read, 0 at the end of the archive, -1 on error. After
+ * ZIP_STREAM_WAIT, @buf may have some data, and @ready is called once the
+ * stream can be read again.
+ */
+int
+zip_stream_read (ZipStream *stream, struct evbuffer *buf, size_t max_size);
+
+void
+zip_stream_free (ZipStream *stream);
+
 #endif
@@ -480,6 +480,14 @@ gen_new_commit (const char *repo_id,
     new_commit->parent_id = g_strdup (base->commit_id);
     seaf_repo_to_commit (repo, new_commit);
 
+    /* The new tree must be on disk before the commit referring to it. */
+    if (seaf_obj_store_flush_write_batch (seaf->fs_mgr->obj_store) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to add commit");
+        ret = -1;
+        goto out;
+    }
+
     if (seaf_commit_manager_add_commit (seaf->commit_mgr, new_commit) < 0) {
         seaf_warning ("Failed to add commit.\n");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
@@ -551,6 +559,13 @@ retry:
             merged_commit->conflict = TRUE;
         seaf_repo_to_commit (repo, merged_commit);
 
+        if (seaf_obj_store_flush_write_batch (seaf->fs_mgr->obj_store) < 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Failed to add commit");
+            ret = -1;
+            goto out;
+        }
+
         if (seaf_commit_manager_add_commit (seaf->commit_mgr, merged_commit) < 0) {
             seaf_warning ("Failed to add commit.\n");
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
@@ -1167,6 +1182,9 @@ post_files_and_gen_commit (GList *filenames,
     int ret = 0;
     int retry_cnt = 0;
 
+    /* Sync the new dir objects with one pass before committing. */
+    seaf_obj_store_begin_write_batch (seaf->fs_mgr->obj_store);
+
     GET_REPO_OR_FAIL(repo, repo_id);
     GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, repo->head->commit_id);
 
@@ -1222,6 +1240,7 @@ retry:
     update_repo_size(repo->id);
 
 out:
+    seaf_obj_store_commit_write_batch (seaf->fs_mgr->obj_store);
     if (repo)
         seaf_repo_unref (repo);
     if (head_commit)
@@ -1843,6 +1862,9 @@ put_dirent_and_commit (SeafRepo *repo,
     char buf[SEAF_PATH_MAX];
     int ret = 0, i = 0;
 
+    /* Sync the new dir objects with one pass before committing. */
+    seaf_obj_store_begin_write_batch (seaf->fs_mgr->obj_store);
+
     GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, repo->head->commit_id);
     
     root_id = head_commit->root_id;
@@ -1887,6 +1909,7 @@ put_dirent_and_commit (SeafRepo *repo,
         ret = -1;
 
 out:
+    seaf_obj_store_commit_write_batch (seaf->fs_mgr->obj_store);
     if (head_commit)
         seaf_commit_unref (head_commit);
     if (root_id)
@@ -670,6 +670,11 @@ static void start_rpc_service (const char *seafile_dir,
                                      "pop_event",
                                      searpc_signature_json__string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_invalidate_branch_cache,
+                                     "invalidate_branch_cache",
+                                     searpc_signature_int__string());
+
                                      
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_set_inner_pub_repo,
@@ -0,0 +1,316 @@
+#include "common.h"
+
+#include <zlib.h>
+
+#include <event2/buffer.h>
+#include <evhtp.h>
+
+#include "utils.h"
+#include "log.h"
+#include "transfer-compress.h"
+
+/* Smaller content is not worth compressing. */
+#define MIN_COMPRESS_SIZE 1024
+
+#define N_SAMPLES 4
+#define SAMPLE_SIZE 4096
+
+/* Compressed content must save at least 1/10 of the size. */
+#define MIN_SAVING_RATIO 10
+
+#define DEFLATE_OUT_SIZE (64 << 10)
+
+static gboolean
+token_list_contains (const char *list, const char *token)
+{
+    char **tokens = g_strsplit (list, ",", 0);
+    char **ptr;
+    char *value, *params;
+    gboolean found = FALSE;
+
+    for (ptr = tokens; *ptr && !found; ++ptr) {
+        value = g_strstrip (*ptr);
+        params = strchr (value, ';');
+        if (params) {
+            *params++ = 0;
+            g_strchomp (value);
+            /* "deflate;q=0" means not acceptable. */
+            params = g_strstrip (params);
+            if (strcmp (params, "q=0") == 0 || strcmp (params, "q=0.0") == 0)
+                continue;
+        }
+        found = (g_ascii_strcasecmp (value, token) == 0);
+    }
+
+    g_strfreev (tokens);
+    return found;
+}
+
+gboolean
+transfer_compress_accepted (evhtp_request_t *req)
+{
+    const char *accept = evhtp_kv_find (req->headers_in, "Accept-Encoding");
+
+    return accept && token_list_contains (accept, "deflate");
+}
+
+int
+transfer_request_encoding (evhtp_headers_t *headers)
+{
+    const char *encoding = evhtp_kv_find (headers, "Content-Encoding");
+
+    if (!encoding || g_ascii_strcasecmp (encoding, "identity") == 0)
+        return 0;
+    if (g_ascii_strcasecmp (encoding, "deflate") == 0)
+        return 1;
+    return -1;
+}
+
+static void
+count_bytes (const guint8 *data, size_t len, guint32 *counts)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        ++counts[data[i]];
+}
+
+/*
+ * Estimate the collision entropy of the sampled bytes: -log2(sum(p^2)).
+ * Random, encrypted or compressed data is close to 8 bits per byte.
+ * Content above 7.5 bits is not compressed, i.e. when
+ * sum(p^2) < 2^-7.5 ~= 1/181.
+ */
+static gboolean
+counts_compressible (const guint32 *counts, gint64 n_sampled)
+{
+    gint64 sum = 0;
+    int i;
+
+    for (i = 0; i < 256; ++i)
+        sum += (gint64)counts[i] * counts[i];
+
+    return n_sampled > 0 && sum * 181 >= n_sampled * n_sampled;
+}
+
+/* Sample a few pieces spread over the buffer. */
+static gboolean
+is_compressible (struct evbuffer *buf, size_t len)
+{
+    struct evbuffer_iovec *vec;
+    guint32 counts[256] = { 0 };
+    size_t offset, skipped, n;
+    gint64 n_sampled = 0;
+    int n_vec, i, j;
+
+    n_vec = evbuffer_peek (buf, -1, NULL, NULL, 0);
+    if (n_vec <= 0)
+        return FALSE;
+    vec = g_new0 (struct evbuffer_iovec, n_vec);
+    evbuffer_peek (buf, -1, NULL, vec, n_vec);
+
+    for (i = 0; i < N_SAMPLES; ++i) {
+        offset = len / N_SAMPLES * i;
+        skipped = 0;
+        for (j = 0; j < n_vec; ++j) {
+            if (offset < skipped + vec[j].iov_len)
+                break;
+            skipped += vec[j].iov_len;
+        }
+        if (j == n_vec)
+            break;
+        offset -= skipped;
+        n = MIN (SAMPLE_SIZE, vec[j].iov_len - offset);
+        count_bytes ((guint8 *)vec[j].iov_base + offset, n, counts);
+        n_sampled += n;
+    }
+
+    g_free (vec);
+
+    return counts_compressible (counts, n_sampled);
+}
+
+gboolean
+transfer_compress_file_compressible (int fd, gint64 offset, gint64 len)
+{
+    guint8 buf[N_SAMPLES * SAMPLE_SIZE];
+    guint32 counts[256] = { 0 };
+    ssize_t n;
+
+    if (len < MIN_COMPRESS_SIZE)
+        return FALSE;
+
+    n = pread (fd, buf, MIN (len, (gint64)sizeof(buf)), offset);
+    if (n <= 0)
+        return FALSE;
+
+    count_bytes (buf, n, counts);
+    return counts_compressible (counts, n);
+}
+
+void
+transfer_compress_set_vary (evhtp_request_t *req)
+{
+    if (!evhtp_kv_find (req->headers_out, "Vary"))
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Vary", "Accept-Encoding", 0, 0));
+}
+
+/* Returns NULL if the content doesn't compress well enough. */
+static struct evbuffer *
+deflate_buffer (struct evbuffer *buf, size_t len)
+{
+    struct evbuffer *out = NULL;
+    struct evbuffer_iovec *vec = NULL;
+    guint8 *out_buf = NULL;
+    z_stream strm;
+    int n_vec, i, flush, ret = Z_OK;
+    size_t max_out = len - len / MIN_SAVING_RATIO;
+
+    memset (&strm, 0, sizeof(strm));
+    if (deflateInit (&strm, Z_BEST_SPEED) != Z_OK) {
+        seaf_warning ("deflateInit failed.\n");
+        return NULL;
+    }
+
+    n_vec = evbuffer_peek (buf, -1, NULL, NULL, 0);
+    vec = g_new0 (struct evbuffer_iovec, n_vec);
+    evbuffer_peek (buf, -1, NULL, vec, n_vec);
+
+    out = evbuffer_new ();
+    out_buf = g_malloc (DEFLATE_OUT_SIZE);
+
+    for (i = 0; i < n_vec; ++i) {
+        strm.next_in = vec[i].iov_base;
+        strm.avail_in = vec[i].iov_len;
+        flush = (i == n_vec - 1) ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            strm.next_out = out_buf;
+            strm.avail_out = DEFLATE_OUT_SIZE;
+            ret = deflate (&strm, flush);
+            if (ret == Z_STREAM_ERROR) {
+                seaf_warning ("Failed to deflate response.\n");
+                goto error;
+            }
+            evbuffer_add (out, out_buf, DEFLATE_OUT_SIZE - strm.avail_out);
+            if (evbuffer_get_length (out) >= max_out)
+                goto error;
+        } while (strm.avail_out == 0);
+    }
+
+    if (ret != Z_STREAM_END)
+        goto error;
+
+    deflateEnd (&strm);
+    g_free (vec);
+    g_free (out_buf);
+    return out;
+
+error:
+    deflateEnd (&strm);
+    g_free (vec);
+    g_free (out_buf);
+    evbuffer_free (out);
+    return NULL;
+}
+
+void
+transfer_compress_reply (evhtp_request_t *req)
+{
+    struct evbuffer *out;
+    size_t len = evbuffer_get_length (req->buffer_out);
+
+    transfer_compress_set_vary (req);
+
+    if (len < MIN_COMPRESS_SIZE || !transfer_compress_accepted (req))
+        return;
+
+    if (!is_compressible (req->buffer_out, len))
+        return;
+
+    out = deflate_buffer (req->buffer_out, len);
+    if (!out)
+        return;
+
+    evbuffer_drain (req->buffer_out, len);
+    evbuffer_add_buffer (req->buffer_out, out);
+    evbuffer_free (out);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Encoding", "deflate", 1, 1));
+}
+
+struct TransferInflater {
+    z_stream strm;
+    gint64 max_size;
+    gint64 total_out;
+    gboolean finished;
+    guint8 out[DEFLATE_OUT_SIZE];
+};
+
+TransferInflater *
+transfer_inflater_new (gint64 max_size)
+{
+    TransferInflater *inf = g_new0 (TransferInflater, 1);
+
+    if (inflateInit (&inf->strm) != Z_OK) {
+        seaf_warning ("inflateInit failed.\n");
+        g_free (inf);
+        return NULL;
+    }
+    inf->max_size = max_size;
+
+    return inf;
+}
+
+int
+transfer_inflater_feed (TransferInflater *inf, const void *data, size_t len,
+                        TransferOutputFunc func, void *arg)
+{
+    size_t n;
+    int ret;
+
+    inf->strm.next_in = (Bytef *)data;
+    inf->strm.avail_in = len;
+
+    /* Inflate until the input is used up and zlib has no pending output. */
+    do {
+        /* Data after the end of the stream. */
+        if (inf->finished)
+            return inf->strm.avail_in > 0 ? -1 : 0;
+
+        inf->strm.next_out = inf->out;
+        inf->strm.avail_out = DEFLATE_OUT_SIZE;
+        ret = inflate (&inf->strm, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR)
+            break;
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return -1;
+        if (ret == Z_STREAM_END)
+            inf->finished = TRUE;
+
+        n = DEFLATE_OUT_SIZE - inf->strm.avail_out;
+        inf->total_out += n;
+        if (inf->total_out > inf->max_size)
+            return -1;
+        if (n > 0 && func (inf->out, n, arg) < 0)
+            return -1;
+    } while (inf->strm.avail_in > 0 || inf->strm.avail_out == 0);
+
+    return 0;
+}
+
+gboolean
+transfer_inflater_finished (TransferInflater *inf)
+{
+    return inf->finished;
+}
+
+void
+transfer_inflater_free (TransferInflater *inf)
+{
+    if (!inf)
+        return;
+    inflateEnd (&inf->strm);
+    g_free (inf);
+}
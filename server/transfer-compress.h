@@ -0,0 +1,69 @@
+#ifndef TRANSFER_COMPRESS_H
+#define TRANSFER_COMPRESS_H
+
+#include <glib.h>
+
+/*
+ * Transport compression of the sync protocol (version 3).
+ *
+ * Clients that speak version 3 send "Accept-Encoding: deflate" when
+ * downloading blocks and fs object packs, and may upload blocks with
+ * "Content-Encoding: deflate". Data is in the zlib format.
+ *
+ * Responses are only compressed when a few samples of the content look
+ * compressible, so that encrypted and already compressed content is sent
+ * as is.
+ */
+
+/* TRUE if the client accepts deflate encoded responses. */
+gboolean
+transfer_compress_accepted (evhtp_request_t *req);
+
+/* Compress req->buffer_out and set Content-Encoding, if the client
+ * accepts it and the content compresses. Otherwise the buffer is left
+ * as is.
+ */
+void
+transfer_compress_reply (evhtp_request_t *req);
+
+/* TRUE if the first bytes of @len bytes at @offset of @fd look
+ * compressible, to decide whether a file can be sent as is without
+ * reading all of it.
+ */
+gboolean
+transfer_compress_file_compressible (int fd, gint64 offset, gint64 len);
+
+/* Add "Vary: Accept-Encoding" to a response that may be compressed
+ * depending on the request. transfer_compress_reply() adds it too.
+ */
+void
+transfer_compress_set_vary (evhtp_request_t *req);
+
+/* Returns 1 if the body of the request is deflate encoded, 0 if it's not
+ * encoded, and -1 for encodings that are not supported.
+ */
+int
+transfer_request_encoding (evhtp_headers_t *headers);
+
+typedef struct TransferInflater TransferInflater;
+
+/* Called with every piece of inflated data. Returns -1 to stop. */
+typedef int (*TransferOutputFunc) (const void *data, size_t len, void *arg);
+
+/* Inflating more than @max_size bytes is an error. */
+TransferInflater *
+transfer_inflater_new (gint64 max_size);
+
+/* Returns -1 if the data is corrupt, too large, or @func fails. */
+int
+transfer_inflater_feed (TransferInflater *inf, const void *data, size_t len,
+                        TransferOutputFunc func, void *arg);
+
+/* TRUE if the end of the compressed stream was reached. */
+gboolean
+transfer_inflater_finished (TransferInflater *inf);
+
+void
+transfer_inflater_free (TransferInflater *inf);
+
+#endif
@@ -26,6 +26,7 @@
 #include "upload-file.h"
 #include "http-status-codes.h"
 #include "http-server.h"
+#include "http-metrics.h"
 
 #include "seafile-error.h"
 
@@ -2538,7 +2539,7 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 
     /* Set up per-request hooks, so that we can read file data piece by piece. */
     evhtp_set_hook (&req->hooks, evhtp_hook_on_read, upload_read_cb, fsm);
-    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, upload_finish_cb, fsm);
+    http_metrics_set_fini_hook (req, upload_finish_cb, fsm);
     /* Set arg for upload_cb or update_cb. */
     req->cbarg = fsm;
 
@@ -2655,35 +2656,44 @@ upload_file_init (evhtp_t *htp, const char *http_temp_dir)
 
     cb = evhtp_set_regex_cb (htp, "^/upload-api/.*", upload_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "upload_api");
 
     cb = evhtp_set_regex_cb (htp, "^/upload-raw-blks-api/.*",
                              upload_raw_blks_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "upload_raw_blks_api");
 
     cb = evhtp_set_regex_cb (htp, "^/upload-blks-api/.*", upload_blks_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "upload_blks_api");
 
     /* cb = evhtp_set_regex_cb (htp, "^/upload-blks-aj/.*", upload_blks_ajax_cb, NULL); */
     /* evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL); */
 
     cb = evhtp_set_regex_cb (htp, "^/upload-aj/.*", upload_ajax_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "upload_aj");
 
     cb = evhtp_set_regex_cb (htp, "^/update-api/.*", update_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "update_api");
 
     cb = evhtp_set_regex_cb (htp, "^/update-blks-api/.*", update_blks_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "update_blks_api");
 
     /* cb = evhtp_set_regex_cb (htp, "^/update-blks-aj/.*", update_blks_ajax_cb, NULL); */
     /* evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL); */
 
     cb = evhtp_set_regex_cb (htp, "^/update-aj/.*", update_ajax_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_track_route (cb, "update_aj");
 
-    evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
+    cb = evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
+    http_metrics_track_route (cb, "upload_progress");
 
-    evhtp_set_regex_cb (htp, "^/idx_progress.*", idx_progress_cb, NULL);
+    cb = evhtp_set_regex_cb (htp, "^/idx_progress.*", idx_progress_cb, NULL);
+    http_metrics_track_route (cb, "idx_progress");
 
     upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
                                              g_free, g_free);
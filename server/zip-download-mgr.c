@@ -15,6 +15,15 @@
 #define SCAN_PROGRESS_INTERVAL 24 * 3600 // 1 day
 #define PROGRESS_TTL 5 * 3600 // 5 hours
 #define DEFAULT_MAX_DOWNLOAD_DIR_SIZE 100 * ((gint64)1 << 20) /* 100MB */
+/* Packed archives are cached on disk only if zip_cache_size is set. */
+#define DEFAULT_ZIP_CACHE_SIZE 0 /* MB */
+#define DEFAULT_ZIP_CACHE_TTL 3600
+#define EVICT_ZIP_CACHE_INTERVAL 300 /* 5 minutes */
+
+typedef struct DownloadObj DownloadObj;
+
+static void
+free_download_obj (DownloadObj *obj);
 
 typedef struct ZipDownloadMgrPriv {
     pthread_mutex_t progress_lock;
@@ -24,27 +33,72 @@ typedef struct ZipDownloadMgrPriv {
     // so related progress will not be removed,
     // this timer is used to scan progress and remove invalid progress.
     CcnetTimer *scan_progress_timer;
+    /* Removes expired archives from the zip cache. */
+    CcnetTimer *evict_zip_cache_timer;
+
+    /* Archives of the same content are shared by download tokens. Cache
+     * key -> ZipCacheEntry, protected by progress_lock.
+     */
+    GHashTable *zip_cache;
+    gint64 zip_cache_used;
 } ZipDownloadMgrPriv;
 
-void
+/*
+ * A progress is referenced by download tokens, the zip task packing it and
+ * the zip cache. The archive is removed with the last reference.
+ * References are changed with progress_lock held.
+ */
+
+static void
 free_progress (Progress *progress)
 {
     if (!progress)
         return;
 
-    if (g_file_test (progress->zip_file_path, G_FILE_TEST_EXISTS)) {
+    if (progress->zip_file_path &&
+        g_file_test (progress->zip_file_path, G_FILE_TEST_EXISTS)) {
         g_unlink (progress->zip_file_path);
     }
     g_free (progress->zip_file_path);
+    free_download_obj (progress->stream_task);
+    g_free (progress->cache_key);
     g_free (progress);
 }
 
+static Progress *
+progress_ref (Progress *progress)
+{
+    ++progress->ref;
+    return progress;
+}
+
+static void
+progress_unref (Progress *progress)
+{
+    if (progress && --progress->ref == 0)
+        free_progress (progress);
+}
+
+typedef struct ZipCacheEntry {
+    Progress *progress;
+    /* 0 until the archive is packed. */
+    gint64 size;
+    gint64 last_access;
+} ZipCacheEntry;
+
+static void
+free_zip_cache_entry (ZipCacheEntry *entry)
+{
+    progress_unref (entry->progress);
+    g_free (entry);
+}
+
 typedef enum DownloadType {
     DOWNLOAD_DIR,
     DOWNLOAD_MULTI
 } DownloadType;
 
-typedef struct DownloadObj {
+struct DownloadObj {
     char *token;
     DownloadType type;
     SeafRepo *repo;
@@ -55,7 +109,7 @@ typedef struct DownloadObj {
     // download-dir: obj_id; download-multi: dirent list
     void *internal;
     Progress *progress;
-} DownloadObj;
+};
 
 static void
 free_download_obj (DownloadObj *obj)
@@ -81,12 +135,35 @@ start_zip_task (gpointer data, gpointer user_data);
 static int
 scan_progress (void *data);
 
+static int
+evict_zip_cache_pulse (void *data);
+
 static int
 get_download_file_count (DownloadObj *obj, GError **error);
 
 static gboolean
 validate_download_size (DownloadObj *obj, GError **error);
 
+/*
+ * In streaming mode the archive is not packed in advance. It's generated
+ * when it's downloaded, so no temporary space is used and the download
+ * starts immediately. The download size is only limited if
+ * max_download_dir_size is set explicitly.
+ */
+static gboolean
+streaming_enabled ()
+{
+    /* Not read with seaf_cfg_manager_get_config_boolean(), which warns on
+     * every download when the option is not set.
+     */
+    char *value = seaf_cfg_manager_get_config_string (seaf->cfg_mgr, "fileserver",
+                                                      "streaming_zip_download");
+    gboolean ret = (g_strcmp0 (value, "true") == 0 || g_strcmp0 (value, "1") == 0);
+
+    g_free (value);
+    return ret;
+}
+
 ZipDownloadMgr *
 zip_download_mgr_new ()
 {
@@ -109,9 +186,13 @@ zip_download_mgr_new ()
 
     pthread_mutex_init (&priv->progress_lock, NULL);
     priv->progress_store = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-                                                  (GDestroyNotify)free_progress);
+                                                  (GDestroyNotify)progress_unref);
+    priv->zip_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)free_zip_cache_entry);
     priv->scan_progress_timer = ccnet_timer_new (scan_progress, priv,
                                                  SCAN_PROGRESS_INTERVAL * 1000);
+    priv->evict_zip_cache_timer = ccnet_timer_new (evict_zip_cache_pulse, priv,
+                                                   EVICT_ZIP_CACHE_INTERVAL * 1000);
     mgr->priv = priv;
 
     return mgr;
@@ -125,6 +206,76 @@ remove_progress_by_token (ZipDownloadMgrPriv *priv, const char *token)
     pthread_mutex_unlock (&priv->progress_lock);
 }
 
+static gint64
+get_zip_cache_config (const char *key, gint64 default_value)
+{
+    gint64 value = seaf_cfg_manager_get_config_int64 (seaf->cfg_mgr, "fileserver", key);
+
+    return value >= 0 ? value : default_value;
+}
+
+static void
+remove_zip_cache_entry (ZipDownloadMgrPriv *priv, GHashTableIter *iter,
+                        ZipCacheEntry *entry)
+{
+    priv->zip_cache_used -= entry->size;
+    g_hash_table_iter_remove (iter);
+}
+
+/* Remove expired archives, then the least recently used ones until the
+ * cache fits in @max_size. Archives being packed are not counted.
+ */
+static void
+evict_zip_cache (ZipDownloadMgrPriv *priv, gint64 max_size, gint64 ttl)
+{
+    GHashTableIter iter;
+    gpointer key, value, lru_key;
+    ZipCacheEntry *entry, *lru;
+    gint64 now = (gint64)time(NULL);
+
+    g_hash_table_iter_init (&iter, priv->zip_cache);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = value;
+        if (now - entry->last_access >= ttl)
+            remove_zip_cache_entry (priv, &iter, entry);
+    }
+
+    while (priv->zip_cache_used > max_size) {
+        lru = NULL;
+        lru_key = NULL;
+        g_hash_table_iter_init (&iter, priv->zip_cache);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            entry = value;
+            if (entry->size > 0 && (!lru || entry->last_access < lru->last_access)) {
+                lru = entry;
+                lru_key = key;
+            }
+        }
+        if (!lru)
+            break;
+
+        priv->zip_cache_used -= lru->size;
+        g_hash_table_remove (priv->zip_cache, lru_key);
+    }
+}
+
+/* The cache is otherwise only evicted when an archive is packed, so
+ * archives would outlive zip_cache_ttl when there are no new downloads.
+ */
+static int
+evict_zip_cache_pulse (void *data)
+{
+    ZipDownloadMgrPriv *priv = data;
+    gint64 cache_size = get_zip_cache_config ("zip_cache_size", DEFAULT_ZIP_CACHE_SIZE);
+    gint64 cache_ttl = get_zip_cache_config ("zip_cache_ttl", DEFAULT_ZIP_CACHE_TTL);
+
+    pthread_mutex_lock (&priv->progress_lock);
+    evict_zip_cache (priv, cache_size << 20, cache_ttl);
+    pthread_mutex_unlock (&priv->progress_lock);
+
+    return TRUE;
+}
+
 static int
 scan_progress (void *data)
 {
@@ -178,6 +329,45 @@ get_seafile_crypt (SeafRepo *repo, const char *user)
     return crypt;
 }
 
+/* Account the packed archive in the cache, or drop it from the cache if
+ * packing failed, and release the reference of the zip task.
+ */
+static void
+finish_zip_task (ZipDownloadMgrPriv *priv, Progress *progress, int ret)
+{
+    ZipCacheEntry *entry;
+    SeafStat st;
+    gint64 size = 0, cache_size = 0, cache_ttl = 0;
+
+    if (progress->cache_key) {
+        cache_size = get_zip_cache_config ("zip_cache_size", DEFAULT_ZIP_CACHE_SIZE);
+        cache_ttl = get_zip_cache_config ("zip_cache_ttl", DEFAULT_ZIP_CACHE_TTL);
+        if (ret == 0 && seaf_stat (progress->zip_file_path, &st) < 0)
+            ret = -1;
+        else if (ret == 0)
+            size = (gint64)st.st_size;
+    }
+
+    pthread_mutex_lock (&priv->progress_lock);
+
+    entry = progress->cache_key ?
+        g_hash_table_lookup (priv->zip_cache, progress->cache_key) : NULL;
+    if (entry && entry->progress == progress) {
+        if (ret < 0) {
+            g_hash_table_remove (priv->zip_cache, progress->cache_key);
+        } else {
+            /* Packed archives have a non-zero size in the cache. */
+            entry->size = MAX (size, 1);
+            priv->zip_cache_used += entry->size;
+            evict_zip_cache (priv, cache_size << 20, cache_ttl);
+        }
+    }
+
+    progress_unref (progress);
+
+    pthread_mutex_unlock (&priv->progress_lock);
+}
+
 static void
 start_zip_task (gpointer data, gpointer user_data)
 {
@@ -219,6 +409,7 @@ out:
         !obj->progress->size_too_large) {
         obj->progress->internal_error = TRUE;
     }
+    finish_zip_task (priv, obj->progress, ret);
     free_download_obj (obj);
 }
 
@@ -433,22 +624,24 @@ validate_download_size (DownloadObj *obj, GError **error)
     gint64 download_size;
     gint64 max_download_dir_size;
 
-    if (obj->type == DOWNLOAD_DIR) {
-        download_size = seaf_fs_manager_get_fs_size (seaf->fs_mgr,
-                                                     repo->store_id, repo->version,
-                                                     (char *)obj->internal);
-    } else {
-        download_size = calcuate_download_multi_size (repo, (GList *)obj->internal);
-    }
-
     /* default is MB */
     max_download_dir_size = seaf_cfg_manager_get_config_int64 (seaf->cfg_mgr, "fileserver",
                                                                "max_download_dir_size");
     if (max_download_dir_size > 0)
         max_download_dir_size = max_download_dir_size * ((gint64)1 << 20);
+    else if (streaming_enabled ())
+        return TRUE;
     else
         max_download_dir_size = DEFAULT_MAX_DOWNLOAD_DIR_SIZE;
 
+    if (obj->type == DOWNLOAD_DIR) {
+        download_size = seaf_fs_manager_get_fs_size (seaf->fs_mgr,
+                                                     repo->store_id, repo->version,
+                                                     (char *)obj->internal);
+    } else {
+        download_size = calcuate_download_multi_size (repo, (GList *)obj->internal);
+    }
+
     if (download_size < 0) {
         seaf_warning ("Failed to get download size.\n");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
@@ -489,6 +682,74 @@ get_download_file_count (DownloadObj *obj, GError **error)
     return file_count;
 }
 
+static void
+checksum_update_string (GChecksum *checksum, const char *str)
+{
+    /* Include the terminating null as a separator. */
+    g_checksum_update (checksum, (const guchar *)str, strlen(str) + 1);
+}
+
+/* Archives are the same if they have the same content, names and name
+ * encoding. Fs objects are content addressed, so the content is identified
+ * by the ids of the dir or the selected dirents.
+ */
+static char *
+get_zip_cache_key (DownloadObj *obj)
+{
+    GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    SeafDirent *dent;
+    GList *ptr;
+    char mode[16];
+    char *key;
+
+    checksum_update_string (checksum, obj->repo->store_id);
+    checksum_update_string (checksum, obj->dir_name);
+    checksum_update_string (checksum, obj->is_windows ? "1" : "0");
+
+    if (obj->type == DOWNLOAD_DIR) {
+        checksum_update_string (checksum, (char *)obj->internal);
+    } else {
+        for (ptr = (GList *)obj->internal; ptr; ptr = ptr->next) {
+            dent = ptr->data;
+            snprintf (mode, sizeof(mode), "%o", dent->mode);
+            checksum_update_string (checksum, dent->id);
+            checksum_update_string (checksum, dent->name);
+            checksum_update_string (checksum, mode);
+        }
+    }
+
+    key = g_strdup (g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+
+    return key;
+}
+
+/* Returns the progress of a usable archive in the cache. Called with
+ * progress_lock held.
+ */
+static Progress *
+lookup_zip_cache (ZipDownloadMgrPriv *priv, const char *key, gint64 ttl)
+{
+    ZipCacheEntry *entry;
+    Progress *progress;
+    gint64 now = (gint64)time(NULL);
+
+    entry = g_hash_table_lookup (priv->zip_cache, key);
+    if (!entry)
+        return NULL;
+
+    progress = entry->progress;
+    if (progress->canceled || progress->size_too_large ||
+        progress->internal_error || now - entry->last_access >= ttl) {
+        priv->zip_cache_used -= entry->size;
+        g_hash_table_remove (priv->zip_cache, key);
+        return NULL;
+    }
+
+    entry->last_access = now;
+    return progress;
+}
+
 int
 zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
                                  const char *token,
@@ -501,6 +762,9 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
     SeafRepo *repo;
     DownloadObj *obj;
     Progress *progress;
+    gboolean streaming;
+    char *cache_key = NULL;
+    gint64 cache_ttl = 0;
     int ret = 0;
     ZipDownloadMgrPriv *priv = mgr->priv;
 
@@ -548,6 +812,37 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
         }
     }
 
+    streaming = streaming_enabled ();
+    if (streaming && !validate_download_size (obj, error)) {
+        ret = -1;
+        goto out;
+    }
+
+    /* Archives of encrypted libraries are not shared, the decrypt key is
+     * checked for every user in the zip task.
+     */
+    if (!streaming && !repo->encrypted &&
+        get_zip_cache_config ("zip_cache_size", DEFAULT_ZIP_CACHE_SIZE) > 0) {
+        cache_key = get_zip_cache_key (obj);
+        cache_ttl = get_zip_cache_config ("zip_cache_ttl", DEFAULT_ZIP_CACHE_TTL);
+    }
+
+    pthread_mutex_lock (&priv->progress_lock);
+
+    if (cache_key) {
+        progress = lookup_zip_cache (priv, cache_key, cache_ttl);
+        if (progress) {
+            /* Attach to the archive being packed or already packed. */
+            progress->expire_ts = time(NULL) + PROGRESS_TTL;
+            g_hash_table_replace (priv->progress_store, g_strdup (token),
+                                  progress_ref (progress));
+            pthread_mutex_unlock (&priv->progress_lock);
+            g_free (cache_key);
+            free_download_obj (obj);
+            return 0;
+        }
+    }
+
     progress = g_new0 (Progress, 1);
     /* Set to real total in worker thread. Here to just prevent the client from thinking
      * the zip has been finished too early.
@@ -556,11 +851,31 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
     progress->expire_ts = time(NULL) + PROGRESS_TTL;
     obj->progress = progress;
 
-    pthread_mutex_lock (&priv->progress_lock);
-    g_hash_table_replace (priv->progress_store, g_strdup (token), progress);
+    if (streaming) {
+        /* Nothing to pack, the archive is ready to be downloaded. */
+        progress->zipped = 1;
+        progress->stream_task = obj;
+    }
+
+    g_hash_table_replace (priv->progress_store, g_strdup (token),
+                          progress_ref (progress));
+
+    if (cache_key) {
+        ZipCacheEntry *entry = g_new0 (ZipCacheEntry, 1);
+        entry->progress = progress_ref (progress);
+        entry->last_access = (gint64)time(NULL);
+        progress->cache_key = g_strdup (cache_key);
+        g_hash_table_replace (priv->zip_cache, cache_key, entry);
+    }
+
+    /* Reference of the zip task. */
+    if (!streaming)
+        progress_ref (progress);
+
     pthread_mutex_unlock (&priv->progress_lock);
 
-    g_thread_pool_push (priv->zip_tpool, obj, NULL);
+    if (!streaming)
+        g_thread_pool_push (priv->zip_tpool, obj, NULL);
 
 out:
     if (ret < 0) {
@@ -634,6 +949,45 @@ zip_download_mgr_get_zip_file_path (struct ZipDownloadMgr *mgr,
     return progress->zip_file_path;
 }
 
+ZipStream *
+zip_download_mgr_take_zip_stream (ZipDownloadMgr *mgr,
+                                  const char *token)
+{
+    ZipDownloadMgrPriv *priv = mgr->priv;
+    Progress *progress;
+    DownloadObj *obj = NULL;
+    SeafRepo *repo;
+    SeafileCrypt *crypt = NULL;
+    ZipStream *stream;
+
+    pthread_mutex_lock (&priv->progress_lock);
+    progress = g_hash_table_lookup (priv->progress_store, token);
+    if (progress) {
+        obj = progress->stream_task;
+        progress->stream_task = NULL;
+    }
+    pthread_mutex_unlock (&priv->progress_lock);
+
+    if (!obj)
+        return NULL;
+
+    repo = obj->repo;
+    if (repo->encrypted) {
+        crypt = get_seafile_crypt (repo, obj->user);
+        if (!crypt) {
+            free_download_obj (obj);
+            return NULL;
+        }
+    }
+
+    stream = zip_stream_new (repo->store_id, repo->version, obj->dir_name,
+                             obj->internal, crypt, obj->is_windows);
+    obj->internal = NULL;
+    free_download_obj (obj);
+
+    return stream;
+}
+
 void
 zip_download_mgr_del_zip_progress (ZipDownloadMgr *mgr,
                                    const char *token)
@@ -645,9 +999,21 @@ int
 zip_download_mgr_cancel_zip_task (ZipDownloadMgr *mgr,
                                   const char *token)
 {
-    Progress *progress = get_progress_obj (mgr->priv, token);
-    if (progress)
-        progress->canceled = TRUE;
+    ZipDownloadMgrPriv *priv = mgr->priv;
+    Progress *progress;
+
+    pthread_mutex_lock (&priv->progress_lock);
+    progress = g_hash_table_lookup (priv->progress_store, token);
+    if (progress) {
+        /* Other downloads may wait for a cached archive, so only this
+         * download is dropped.
+         */
+        if (progress->cache_key)
+            g_hash_table_remove (priv->progress_store, token);
+        else
+            progress->canceled = TRUE;
+    }
+    pthread_mutex_unlock (&priv->progress_lock);
 
     return 0;
 }
@@ -26,6 +26,13 @@ char *
 zip_download_mgr_get_zip_file_path (ZipDownloadMgr *mgr,
                                     const char *token);
 
+/* Returns the archive to be generated while it's downloaded, if the task
+ * was started in streaming mode. A stream can only be taken once.
+ */
+struct ZipStream *
+zip_download_mgr_take_zip_stream (ZipDownloadMgr *mgr,
+                                  const char *token);
+
 void
 zip_download_mgr_del_zip_progress (ZipDownloadMgr *mgr,
                                    const char *token);
@@ -0,0 +1,171 @@
+#!/usr/bin/env python
+#coding: UTF-8
+
+"""Measure the throughput of the pack-fs sync API.
+
+Replays a recorded fs id list against a running file server, the way a
+syncing client downloads fs objects: ids are posted to pack-fs in batches,
+and the ids that didn't fit into a pack are requested again.
+
+Record the fs id list of a library once:
+
+    pack_fs_bench.py --url http://127.0.0.1:8082 --repo-id <repo_id> \\
+        --token <sync token> --record --server-head <commit_id> ids.json
+
+Then replay it, e.g. before and after changing the server:
+
+    pack_fs_bench.py --url http://127.0.0.1:8082 --repo-id <repo_id> \\
+        --token <sync token> ids.json
+
+A sync token can be created with seafile_api.generate_repo_token().
+"""
+
+import argparse
+import json
+import struct
+import sys
+import threading
+import time
+
+import requests
+
+OBJ_HDR_LEN = 44
+
+
+def record_fs_id_list(args):
+    url = '%s/repo/%s/fs-id-list/' % (args.url, args.repo_id)
+    resp = requests.get(url, params={'server-head': args.server_head},
+                        headers={'Seafile-Repo-Token': args.token})
+    resp.raise_for_status()
+    ids = resp.json()
+    with open(args.fs_id_list, 'w') as f:
+        json.dump(ids, f)
+    print('Recorded %d fs ids to %s' % (len(ids), args.fs_id_list))
+
+
+def parse_pack(content):
+    """Returns the list of (obj_id, size) in a pack-fs response."""
+    objs = []
+    pos = 0
+    while pos < len(content):
+        if len(content) - pos < OBJ_HDR_LEN:
+            raise ValueError('truncated object header')
+        obj_id = content[pos:pos + 40].decode()
+        size = struct.unpack('!I', content[pos + 40:pos + 44])[0]
+        pos += OBJ_HDR_LEN + size
+        if pos > len(content):
+            raise ValueError('truncated object %s' % obj_id)
+        objs.append((obj_id, size))
+    return objs
+
+
+class Stats(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.n_objs = 0
+        self.n_bytes = 0
+        self.latencies = []
+
+    def add(self, n_objs, n_bytes, latency):
+        with self.lock:
+            self.n_objs += n_objs
+            self.n_bytes += n_bytes
+            self.latencies.append(latency)
+
+
+def replay_worker(args, batches, stats, errors):
+    session = requests.Session()
+    url = '%s/repo/%s/pack-fs/' % (args.url, args.repo_id)
+    headers = {'Seafile-Repo-Token': args.token}
+
+    while not errors:
+        try:
+            ids = batches.pop()
+        except IndexError:
+            return
+
+        while ids:
+            start = time.time()
+            resp = session.post(url, data=json.dumps(ids), headers=headers)
+            latency = time.time() - start
+            if resp.status_code != 200:
+                errors.append('pack-fs returned %d' % resp.status_code)
+                return
+            try:
+                objs = parse_pack(resp.content)
+            except ValueError as e:
+                errors.append(str(e))
+                return
+            if not objs:
+                errors.append('empty pack')
+                return
+
+            stats.add(len(objs), len(resp.content), latency)
+            # The server stops at its pack size limit, in request order.
+            ids = ids[len(objs):]
+
+
+def replay(args):
+    with open(args.fs_id_list) as f:
+        fs_ids = json.load(f)
+
+    for round_no in range(args.rounds):
+        batches = [fs_ids[i:i + args.batch_size]
+                   for i in range(0, len(fs_ids), args.batch_size)]
+        batches.reverse()
+        stats = Stats()
+        errors = []
+
+        start = time.time()
+        threads = [threading.Thread(target=replay_worker,
+                                    args=(args, batches, stats, errors))
+                   for _ in range(args.concurrency)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.time() - start
+
+        if errors:
+            print('Round %d failed: %s' % (round_no + 1, errors[0]))
+            return 1
+
+        latencies = sorted(stats.latencies)
+        print('Round %d: %d objects, %.1f MB, %d requests in %.2fs: '
+              '%.0f objects/s, %.2f MB/s, p50 %.1fms, p95 %.1fms' % (
+                  round_no + 1, stats.n_objs, stats.n_bytes / 1048576.0,
+                  len(latencies), elapsed, stats.n_objs / elapsed,
+                  stats.n_bytes / 1048576.0 / elapsed,
+                  latencies[len(latencies) // 2] * 1000,
+                  latencies[int(len(latencies) * 0.95)] * 1000))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='pack-fs benchmark')
+    parser.add_argument('--url', required=True,
+                        help='file server url, e.g. http://127.0.0.1:8082')
+    parser.add_argument('--repo-id', required=True)
+    parser.add_argument('--token', required=True, help='sync token of the repo')
+    parser.add_argument('--record', action='store_true',
+                        help='record the fs id list instead of replaying it')
+    parser.add_argument('--server-head', help='commit to record the list for')
+    parser.add_argument('--batch-size', type=int, default=10000,
+                        help='ids posted in one request')
+    parser.add_argument('--concurrency', type=int, default=1,
+                        help='number of parallel connections')
+    parser.add_argument('--rounds', type=int, default=3)
+    parser.add_argument('fs_id_list', help='json file of fs ids')
+    args = parser.parse_args()
+
+    if args.record:
+        if not args.server_head:
+            parser.error('--server-head is required with --record')
+        record_fs_id_list(args)
+        return 0
+
+    return replay(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
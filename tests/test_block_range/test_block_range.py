@@ -0,0 +1,112 @@
+import hashlib
+import os
+
+import pytest
+import requests
+from seaserv import seafile_api as api
+from tests.config import USER
+from tests.utils import create_and_get_repo, is_go_fileserver, randstring
+
+BASE_URL = 'http://127.0.0.1:8082'
+BLOCK_SIZE = 3000
+MAX_BLOCK_SIZE = 16 << 20
+
+
+@pytest.fixture
+def sync_repo():
+    if is_go_fileserver():
+        pytest.skip('ranged block uploads are not supported')
+    repo = create_and_get_repo('test_block_range_{}'.format(randstring(10)),
+                               '', USER, passwd=None)
+    token = api.generate_repo_token(repo.id, USER)
+    yield repo, token
+    api.remove_repo(repo.id)
+
+
+def block_url(repo, block_id):
+    return '%s/repo/%s/block/%s' % (BASE_URL, repo.id, block_id)
+
+
+def put_range(repo, token, block_id, content_range, data):
+    headers = {'Seafile-Repo-Token': token, 'Content-Range': content_range}
+    return requests.put(block_url(repo, block_id), data=data, headers=headers)
+
+
+def new_block():
+    data = os.urandom(BLOCK_SIZE)
+    return data, hashlib.sha1(data).hexdigest()
+
+
+def test_put_block_ranges_and_resume(sync_repo):
+    repo, token = sync_repo
+    data, block_id = new_block()
+
+    resp = put_range(repo, token, block_id, 'bytes 0-999/3000', data[:1000])
+    assert resp.status_code == 202
+    assert resp.headers['Seafile-Block-Offset'] == '1000'
+
+    # A client that lost the reply asks for the staged offset.
+    resp = put_range(repo, token, block_id, 'bytes */3000', b'')
+    assert resp.status_code == 202
+    assert resp.headers['Seafile-Block-Offset'] == '1000'
+
+    # Ranges must start at or before the staged offset.
+    resp = put_range(repo, token, block_id, 'bytes 2000-2999/3000', data[2000:])
+    assert resp.status_code == 416
+    assert resp.headers['Seafile-Block-Offset'] == '1000'
+
+    resp = put_range(repo, token, block_id, 'bytes 1000-2999/3000', data[1000:])
+    assert resp.status_code == 200
+    assert resp.headers['Seafile-Block-Offset'] == '3000'
+
+    resp = requests.get(block_url(repo, block_id),
+                        headers={'Seafile-Repo-Token': token})
+    assert resp.status_code == 200
+    assert resp.content == data
+
+
+def test_put_block_range_errors(sync_repo):
+    repo, token = sync_repo
+    data, block_id = new_block()
+
+    # A "*" range only queries the offset, it can't carry data.
+    resp = put_range(repo, token, block_id, 'bytes */3000', data)
+    assert resp.status_code == 400
+
+    resp = put_range(repo, token, block_id,
+                     'bytes 0-999/%d' % (MAX_BLOCK_SIZE + 1), data[:1000])
+    assert resp.status_code == 400
+
+    # The body must match the range.
+    resp = put_range(repo, token, block_id, 'bytes 0-999/3000', data[:500])
+    assert resp.status_code == 400
+
+    # The content must match the block id.
+    resp = put_range(repo, token, block_id, 'bytes 0-2999/3000', data[::-1])
+    assert resp.status_code == 400
+
+
+def test_get_block_range(sync_repo):
+    repo, token = sync_repo
+    data, block_id = new_block()
+
+    resp = put_range(repo, token, block_id, 'bytes 0-2999/3000', data)
+    assert resp.status_code == 200
+
+    resp = requests.get(block_url(repo, block_id),
+                        headers={'Seafile-Repo-Token': token,
+                                 'Range': 'bytes=100-199'})
+    assert resp.status_code == 206
+    assert resp.headers['Content-Range'] == 'bytes 100-199/3000'
+    assert resp.content == data[100:200]
+
+    resp = requests.get(block_url(repo, block_id),
+                        headers={'Seafile-Repo-Token': token,
+                                 'Range': 'bytes=2900-'})
+    assert resp.status_code == 206
+    assert resp.content == data[2900:]
+
+    resp = requests.get(block_url(repo, block_id),
+                        headers={'Seafile-Repo-Token': token,
+                                 'Range': 'bytes=5000-5999'})
+    assert resp.status_code == 416
@@ -0,0 +1,133 @@
+import threading
+import time
+
+import pytest
+import requests
+from seaserv import seafile_api as api
+from tests.config import USER
+from tests.utils import create_and_get_repo, randstring
+
+N_WRITERS = 4
+N_READERS = 8
+N_COMMITS_PER_WRITER = 20
+
+METRICS_URL = 'http://127.0.0.1:8082/metrics'
+
+
+def get_commit_cache_stats():
+    """Commit cache stats exported by seaf-server, or None if the file
+    server doesn't export them (e.g. the Go file server)."""
+    resp = requests.get(METRICS_URL)
+    if resp.status_code != 200:
+        return None
+    stats = {}
+    for line in resp.text.splitlines():
+        if line.startswith('seafile_commit_cache_'):
+            name, value = line.split()
+            stats[name[len('seafile_commit_cache_'):]] = int(value)
+    return stats or None
+
+
+def wait_borrowed_refs(expected):
+    """References may still be held by requests being finished."""
+    for _ in range(50):
+        stats = get_commit_cache_stats()
+        if stats['borrowed_refs'] == expected:
+            break
+        time.sleep(0.1)
+    return stats
+
+
+def check_history(repo_id, version, errors):
+    """Walk the history through get_commit, which goes through the commit
+    cache, and compare with the commit list."""
+    commits = api.get_commit_list(repo_id, 0, 100)
+    if not commits:
+        errors.append('empty commit list')
+        return
+
+    for c in commits:
+        commit = api.get_commit(repo_id, version, c.id)
+        if commit is None or commit.id != c.id:
+            errors.append('failed to get commit %s' % c.id)
+            return
+        if commit.root_id != c.root_id or commit.parent_id != c.parent_id:
+            errors.append('commit %s changed' % c.id)
+            return
+
+
+def run_concurrent_access(repo, errors):
+    stop = threading.Event()
+
+    def writer(n):
+        try:
+            for i in range(N_COMMITS_PER_WRITER):
+                api.post_dir(repo.id, '/', 'dir_%d_%d' % (n, i), USER)
+        except Exception as e:
+            errors.append(str(e))
+
+    def reader():
+        try:
+            while not stop.is_set() and not errors:
+                check_history(repo.id, repo.version, errors)
+                head = api.get_repo(repo.id).head_cmmt_id
+                commit = api.get_commit(repo.id, repo.version, head)
+                if commit is None or commit.id != head:
+                    errors.append('failed to get head commit %s' % head)
+        except Exception as e:
+            errors.append(str(e))
+
+    writers = [threading.Thread(target=writer, args=(n,))
+               for n in range(N_WRITERS)]
+    readers = [threading.Thread(target=reader) for _ in range(N_READERS)]
+    for t in writers + readers:
+        t.start()
+    for t in writers:
+        t.join()
+    stop.set()
+    for t in readers:
+        t.join()
+
+
+def test_commit_cache_concurrent_access():
+    repo = create_and_get_repo('test_commit_cache_{}'.format(randstring(10)),
+                               '', USER, passwd=None)
+    errors = []
+
+    try:
+        run_concurrent_access(repo, errors)
+        assert errors == []
+
+        dirs = api.list_dir_by_path(repo.id, '/')
+        assert len(dirs) == N_WRITERS * N_COMMITS_PER_WRITER
+
+        # The server must still return consistent commits after the
+        # concurrent accesses.
+        check_history(repo.id, repo.version, errors)
+        assert errors == []
+    finally:
+        api.remove_repo(repo.id)
+
+
+def test_commit_cache_refs_released():
+    """References to cached commits taken by the requests must all be
+    dropped once the requests are done. A leaked reference leaves the count
+    above its baseline, a double unref leaves it below."""
+    before = get_commit_cache_stats()
+    if before is None:
+        pytest.skip('commit cache stats are not exported')
+
+    repo = create_and_get_repo('test_commit_cache_{}'.format(randstring(10)),
+                               '', USER, passwd=None)
+    errors = []
+
+    try:
+        run_concurrent_access(repo, errors)
+        assert errors == []
+
+        after = wait_borrowed_refs(before['borrowed_refs'])
+        assert after['borrowed_refs'] == before['borrowed_refs']
+        assert after['hits'] > before['hits']
+        assert after['commits'] > 0
+    finally:
+        api.remove_repo(repo.id)
@@ -0,0 +1,125 @@
+import os
+
+import pytest
+import requests
+from seaserv import seafile_api as api
+from tests.config import USER
+from tests.utils import create_and_get_repo, is_go_fileserver, randstring
+
+BASE_URL = 'http://127.0.0.1:8082'
+FILE_NAME = 'range.bin'
+# More than one block, so that ranges start in different blocks.
+FILE_SIZE = (9 << 20) + 123
+
+
+@pytest.fixture(scope='module')
+def range_file(tmp_path_factory):
+    if is_go_fileserver():
+        pytest.skip('multiple ranges are not supported')
+    repo = create_and_get_repo('test_file_range_{}'.format(randstring(10)),
+                               '', USER, passwd=None)
+    content = os.urandom(FILE_SIZE)
+    path = str(tmp_path_factory.mktemp('range') / FILE_NAME)
+    with open(path, 'wb') as fp:
+        fp.write(content)
+    api.post_file(repo.id, path, '/', FILE_NAME, USER)
+    file_id = api.get_file_id_by_path(repo.id, '/' + FILE_NAME)
+    yield repo, file_id, content
+    api.remove_repo(repo.id)
+
+
+def get_range(range_file, byte_ranges, **headers):
+    repo, file_id, _ = range_file
+    token = api.get_fileserver_access_token(repo.id, file_id, 'download', USER)
+    headers['Range'] = byte_ranges
+    return requests.get('%s/files/%s/%s' % (BASE_URL, token, FILE_NAME),
+                        headers=headers)
+
+
+def parse_multipart(resp):
+    """Returns the Content-Range and content of each part."""
+    content_type = resp.headers['Content-Type']
+    assert content_type.startswith('multipart/byteranges; boundary=')
+    boundary = content_type.split('boundary=')[1].encode()
+    delim = b'\r\n--' + boundary
+
+    parts = resp.content.split(delim)
+    assert parts[0] == b''
+    assert parts[-1] == b'--\r\n'
+    ret = []
+    for part in parts[1:-1]:
+        headers, body = part.split(b'\r\n\r\n', 1)
+        headers = dict(line.split(b': ', 1) for line in headers.split(b'\r\n')[1:])
+        ret.append((headers[b'Content-Range'].decode(), body))
+    return ret
+
+
+def test_single_range(range_file):
+    content = range_file[2]
+
+    resp = get_range(range_file, 'bytes=100-199')
+    assert resp.status_code == 206
+    assert resp.headers['Content-Range'] == 'bytes 100-199/%d' % FILE_SIZE
+    assert resp.content == content[100:200]
+
+    # Starts in the second block.
+    resp = get_range(range_file, 'bytes=-1000')
+    assert resp.status_code == 206
+    assert resp.content == content[-1000:]
+
+    resp = get_range(range_file, 'bytes=%d-' % FILE_SIZE)
+    assert resp.status_code == 416
+    assert resp.headers['Content-Range'] == 'bytes */%d' % FILE_SIZE
+
+
+def test_multiple_ranges(range_file):
+    content = range_file[2]
+    start = FILE_SIZE - 1000
+
+    resp = get_range(range_file, 'bytes=%d-, 0-9, %d-' % (start, FILE_SIZE))
+    assert resp.status_code == 206
+    assert resp.headers['Content-Type'].startswith('multipart/byteranges')
+    assert int(resp.headers['Content-Length']) == len(resp.content)
+    # Ranges are sent sorted, unsatisfiable ones are skipped.
+    assert parse_multipart(resp) == [
+        ('bytes 0-9/%d' % FILE_SIZE, content[:10]),
+        ('bytes %d-%d/%d' % (start, FILE_SIZE - 1, FILE_SIZE), content[start:]),
+    ]
+
+
+def test_overlapping_ranges_are_merged(range_file):
+    content = range_file[2]
+
+    # Overlapping and adjacent ranges are sent once.
+    resp = get_range(range_file, 'bytes=0-99, 50-149, 150-199, 10-20')
+    assert resp.status_code == 206
+    assert resp.headers['Content-Range'] == 'bytes 0-199/%d' % FILE_SIZE
+    assert resp.content == content[:200]
+
+    resp = get_range(range_file, 'bytes=' + ', '.join(['0-'] * 64))
+    assert resp.status_code == 206
+    assert len(resp.content) == FILE_SIZE
+
+    resp = get_range(range_file, 'bytes=0-9, 5-14, 100-109')
+    assert parse_multipart(resp) == [
+        ('bytes 0-14/%d' % FILE_SIZE, content[:15]),
+        ('bytes 100-109/%d' % FILE_SIZE, content[100:110]),
+    ]
+
+
+def test_if_range(range_file):
+    file_id, content = range_file[1], range_file[2]
+
+    resp = get_range(range_file, 'bytes=0-9', **{'If-Range': '"%s"' % file_id})
+    assert resp.status_code == 206
+    assert resp.content == content[:10]
+    assert resp.headers['ETag'] == '"%s"' % file_id
+
+    # The whole file is sent if the validator doesn't match.
+    resp = get_range(range_file, 'bytes=0-9', **{'If-Range': '"%s"' % ('0' * 40)})
+    assert resp.status_code == 200
+    assert resp.content == content
+
+    resp = get_range(range_file, 'bytes=0-9', **{'If-Range': 'W/"%s"' % file_id})
+    assert resp.status_code == 200
+    assert resp.content == content
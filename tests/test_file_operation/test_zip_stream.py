@@ -0,0 +1,131 @@
+import io
+import json
+import os
+import zipfile
+
+import pytest
+import requests
+from seaserv import seafile_api as api
+from tests.config import USER
+from tests.utils import create_and_get_repo, is_go_fileserver, randstring
+
+BASE_URL = 'http://127.0.0.1:8082'
+WINDOWS_ENCODING = 'gbk'
+ZIP_FLAG_UTF8 = 0x800
+# The zip64 end records are written from this many entries.
+ZIP_MAX_16 = 0xffff
+
+
+@pytest.fixture
+def streaming():
+    if is_go_fileserver():
+        pytest.skip('streaming zip download is not supported')
+    old = api.get_server_config_string('fileserver', 'streaming_zip_download')
+    api.set_server_config_string('fileserver', 'streaming_zip_download', 'true')
+    yield
+    # There is no api to delete the key; an empty value reads as unset.
+    api.set_server_config_string('fileserver', 'streaming_zip_download',
+                                 old or '')
+
+
+@pytest.fixture(params=[None, 'test_zip_stream'])
+def repo(request):
+    passwd = request.param
+    repo = create_and_get_repo('test_zip_stream_{}'.format(randstring(10)),
+                               '', USER, passwd=passwd)
+    if passwd:
+        api.set_passwd(repo.id, USER, passwd)
+    yield repo
+    api.remove_repo(repo.id)
+
+
+def post_file(repo, tmp_path, parent_dir, name, content):
+    path = str(tmp_path / randstring(10))
+    with open(path, 'wb') as fp:
+        fp.write(content)
+    assert api.post_file(repo.id, path, parent_dir, name, USER) == 0
+
+
+def download_dir(repo, path, dir_name, is_windows=0):
+    dir_id = api.get_dir_id_by_path(repo.id, path)
+    obj_id = {'obj_id': dir_id, 'dir_name': dir_name, 'is_windows': is_windows}
+    token = api.get_fileserver_access_token(repo.id, json.dumps(obj_id),
+                                            'download-dir', USER)
+    resp = requests.get(BASE_URL + '/zip/' + token)
+    assert resp.status_code == 200
+    assert resp.headers['Content-Type'] == 'application/zip'
+
+    zf = zipfile.ZipFile(io.BytesIO(resp.content))
+    # Checks the crc of every file.
+    assert zf.testzip() is None
+    return zf
+
+
+def test_zip_stream_content(streaming, repo, tmp_path):
+    # Files of several blocks are read in pieces.
+    big = os.urandom((9 << 20) + 123)
+    small = b'small file'
+
+    api.post_dir(repo.id, '/', 'dir', USER)
+    api.post_dir(repo.id, '/dir', 'sub', USER)
+    api.post_dir(repo.id, '/dir', 'empty', USER)
+    post_file(repo, tmp_path, '/dir', 'big.bin', big)
+    post_file(repo, tmp_path, '/dir/sub', 'small.txt', small)
+    api.post_empty_file(repo.id, '/dir', 'empty.txt', USER)
+
+    zf = download_dir(repo, '/dir', 'dir')
+    assert sorted(zf.namelist()) == ['dir/big.bin', 'dir/empty.txt',
+                                     'dir/empty/', 'dir/sub/small.txt']
+    assert zf.read('dir/big.bin') == big
+    assert zf.read('dir/sub/small.txt') == small
+    assert zf.read('dir/empty.txt') == b''
+    assert zf.getinfo('dir/empty/').is_dir()
+
+
+def test_zip_stream_windows_encoding(streaming, repo, tmp_path):
+    name = u'文件.txt'
+    content = b'windows'
+
+    api.post_dir(repo.id, '/', 'dir', USER)
+    post_file(repo, tmp_path, '/dir', name, content)
+
+    zf = download_dir(repo, '/dir', 'dir', is_windows=1)
+    info, = zf.infolist()
+    if info.flag_bits & ZIP_FLAG_UTF8:
+        # windows_encoding is not set, names are kept in UTF-8.
+        assert info.filename == u'dir/' + name
+    else:
+        # zipfile decodes names without the UTF-8 flag as cp437.
+        raw = info.filename.encode('cp437')
+        assert raw.decode(WINDOWS_ENCODING) == u'dir/' + name
+    assert zf.read(info) == content
+
+    zf = download_dir(repo, '/dir', 'dir', is_windows=0)
+    info, = zf.infolist()
+    assert info.flag_bits & ZIP_FLAG_UTF8
+    assert info.filename == u'dir/' + name
+
+
+def test_zip_stream_many_entries(streaming, repo, tmp_path):
+    """Archives of 65535 entries or more need the zip64 end records."""
+    n = 256
+    content = b'entry'
+
+    # 256 dirs of 256 files, built by copying dirents.
+    api.post_dir(repo.id, '/', 'files', USER)
+    post_file(repo, tmp_path, '/files', 'f0', content)
+    names = ['f%d' % i for i in range(1, n)]
+    api.copy_file(repo.id, '/files', json.dumps(['f0'] * len(names)),
+                  repo.id, '/files', json.dumps(names), USER, 0, 1)
+
+    api.post_dir(repo.id, '/', 'top', USER)
+    names = ['d%d' % i for i in range(n)]
+    api.copy_file(repo.id, '/', json.dumps(['files'] * n),
+                  repo.id, '/top', json.dumps(names), USER, 0, 1)
+
+    zf = download_dir(repo, '/top', 'top')
+    infos = zf.infolist()
+    assert len(infos) == n * n
+    assert len(infos) >= ZIP_MAX_16
+    assert all(info.file_size == len(content) for info in infos)
+    assert zf.read('top/d255/f255') == content
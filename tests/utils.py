@@ -1,3 +1,4 @@
+import configparser
 import os
 import random
 import string
@@ -25,3 +26,13 @@ def assert_repo_with_permission(r1, r2, permission):
         r2 = r2[0]
     assert r2.id == r1.id
     assert r2.permission == permission
+
+def is_go_fileserver():
+    """Whether the server under test is configured to use the go fileserver
+    (see ci/serverctl.py) instead of the file server of seaf-server."""
+    conf_dir = os.environ.get('SEAFILE_CENTRAL_CONF_DIR')
+    if not conf_dir:
+        return False
+    config = configparser.ConfigParser(strict=False)
+    config.read(os.path.join(conf_dir, 'seafile.conf'))
+    return config.getboolean('fileserver', 'use_go_fileserver', fallback=False)